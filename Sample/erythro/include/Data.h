@@ -16,7 +16,8 @@
 #define SYMBOLS 1024
 
 extern_ struct SymbolTableEntry* Globals, *GlobalsEnd;
-extern_ struct SymbolTableEntry* Locals, *LocalsEnd;
+// Each thread generating code has its own function, so its own locals and output.
+extern_ _Thread_local struct SymbolTableEntry* Locals, *LocalsEnd;
 extern_ struct SymbolTableEntry* Params, *ParamsEnd;
 extern_ struct SymbolTableEntry* Structs, *StructsEnd;
 extern_ struct SymbolTableEntry* StructMembers, *StructMembersEnd;
@@ -29,6 +30,20 @@ extern_ bool OptKeepAssembly;
 extern_ bool OptAssembleFiles;
 extern_ bool OptLinkFiles;
 extern_ bool OptVerboseOutput;
+extern_ bool OptOptimise;
+extern_ bool OptWholeProgram;
+extern_ bool OptProfileGenerate;
+extern_ bool OptProfileUse;
+extern_ bool OptRun;
+extern_ bool OptVirtualMachine;
+extern_ bool OptCache;
+extern_ int  OptJobs;
+extern_ bool OptPipeline;
+extern_ bool OptTimeReport;
+extern_ bool OptTimeReportJSON;
+extern_ bool OptPerfCounters;
+extern_ char* OptStatsFile;
+extern_ bool OptFreestanding;
 
 extern_ char* OutputFileName;
 extern_ char* CurrentASMFile, *CurrentObjectFile;
@@ -38,15 +53,20 @@ extern_ int   TypeSizes[5];
 extern_ char* TokenNames[];
 
 extern_ int CurrentFunction;
-extern_ struct SymbolTableEntry* FunctionEntry;
-extern_ int Line;
-extern_ int Overread;
+extern_ _Thread_local struct SymbolTableEntry* FunctionEntry;
+// The lexer may run on a thread of its own, which counts its own lines.
+extern_ _Thread_local int Line;
+extern_ _Thread_local int Overread;
 
 extern_ FILE* SourceFile;
-extern_ FILE* OutputFile;
+extern_ _Thread_local FILE* OutputFile;
 
 extern_ struct Token CurrentToken;
 extern_ char CurrentIdentifier[TEXTLEN + 1];
 
+extern_ struct BytecodeFunction* BytecodeFunctions;
+extern_ struct BytecodeCallee* BytecodeCallees;
+extern_ int BytecodeCalleeCount;
+
 extern_ int CurrentGlobal;
 extern_ int CurrentLocal;
\ No newline at end of file
@@ -55,6 +55,7 @@ enum TokenTypes {
     AR_MINUS,       // Arithmetic -
     AR_STAR,        // Arithmetic *
     AR_SLASH,       // Arithmetic /
+    AR_PERCENT,     // Arithmetic %
 
     PPMM_PLUS,      // PPMM Increment (++)
     PPMM_MINUS,     // PPMM Decrement (--)
@@ -77,6 +78,7 @@ enum TokenTypes {
     LI_RPARE,       // )
 
     LI_COM,         // ,
+    LI_COLON,       // :
 
     TY_IDENTIFIER,  // Identifier name. Variable, function, etc.
     TY_NONE,        // No return type. Literal void.
@@ -84,6 +86,9 @@ enum TokenTypes {
     TY_INT,         // "int" type keyword
     TY_LONG,        // "long" type keyword
     TY_VOID,        // "void" type keyword
+    TY_I8X16,       // "i8x16" vector type keyword
+    TY_I32X4,       // "i32x4" vector type keyword
+    TY_I64X2,       // "i64x2" vector type keyword
 
     KW_FUNC,        // :: function name incoming
     
@@ -92,6 +97,9 @@ enum TokenTypes {
     KW_ELSE,
     KW_WHILE,
     KW_FOR,
+    KW_SWITCH,
+    KW_CASE,
+    KW_DEFAULT,
     KW_RETURN,
     KW_STRUCT
 };
@@ -132,6 +140,7 @@ enum SyntaxOps {
     OP_SUBTRACT,        // Subtract two numbers.
     OP_MULTIPLY,        // Multiply two numbers.
     OP_DIVIDE,          // Divide two numbers.
+    OP_MODULO,          // The remainder of dividing two numbers.
 
     OP_PREINC,          // Increment var before reference.
     OP_PREDEC,          // Decrement var before reference.
@@ -161,7 +170,12 @@ enum SyntaxOps {
     OP_COMP,            // Compound statements need a way to be "glued" together. This is one of those mechanisms
     OP_IF,              // If statement
     OP_LOOP,            // FOR, WHILE
+    OP_VECLOOP,         // A loop the Vectoriser has rewritten to run 16 bytes at a time
+    OP_SWITCH,          // Switch statement. Left is the value, Right the first case
+    OP_CASE,            // A case of a switch. IntValue is the value, Left the body, Middle the labels sharing it, Right the next case
+    OP_DEFAULT,         // The default case of a switch
     OP_PRINT,           // Print statement
+    OP_INTRINSIC,       // A builtin that maps to a few instructions. IntValue holds the Intrinsics entry
 
     OP_FUNC,            // Define a function
 };
@@ -244,6 +258,69 @@ enum DataTypes {
     
     DAT_STRUCT = 80,     // Struct Data
     DAT_UNION,           // Union Data
+
+    RET_I8X16 = 96,      // "i8x16" - 16 chars in an SSE register
+    RET_I32X4 = 112,     // "i32x4" - 4 ints in an SSE register
+    RET_I64X2 = 128,     // "i64x2" - 2 longs in an SSE register
+};
+
+/*
+ * The builtins that look like function calls, but are
+ *  assembled inline.
+ * Their names are in Intrinsics.c
+ */
+enum Intrinsics {
+    IN_POPCOUNT,    // popcount(x): number of set bits
+    IN_CLZ,         // clz(x): number of leading zero bits
+    IN_CTZ,         // ctz(x): number of trailing zero bits
+    IN_BSWAP,       // bswap(x): reverse the order of the bytes
+    IN_SPLAT,       // i32x4(x): copy a scalar into every lane
+    IN_VLOAD,       // vload(p): read a vector from memory
+    IN_VSTORE,      // vstore(p, v): write a vector to memory
+    IN_VSHUFFLE,    // vshuffle(v, imm): rearrange the 32-bit lanes of a vector
+    IN_VEXTRACT,    // vextract(v, lane): read a single lane
+    IN_VMOVEMASK,   // vmovemask(v): gather the top bit of each byte into an int
+};
+
+/*
+ * The phases of the compiler that -ftime-report times.
+ * Their names are in Report.c
+ */
+enum Phases {
+    PHASE_LEX,          // Scanning tokens
+    PHASE_PARSE,        // Building the tree, apart from what follows
+    PHASE_LOOKUP,       // Searching the symbol tables, in SearchList
+    PHASE_MUTATE,       // Checking and converting types, in MutateType
+    PHASE_OPTIMISE,     // The passes over the tree, under -O
+    PHASE_GENERATE,     // Writing instructions, in AssembleTree
+    PHASE_SCHEDULE,     // Reordering instructions, under -O
+    PHASE_EMIT,         // Writing out what's left
+    PHASE_ASSEMBLE,     // Running the assembler
+    PHASE_LINK,         // Running the linker
+    PHASES
+};
+
+// The things -ftime-report counts.
+enum Counters {
+    COUNT_TOKENS,
+    COUNT_NODES,
+    COUNT_SYMBOLS,
+    COUNT_LABELS,
+    COUNT_INSTRUCTIONS,
+    COUNT_LOOKUP_STEPS, // Symbols compared against a name being looked up
+    COUNTERS
+};
+
+// What --stats counts for each function. Their names are in Stats.c
+enum Statistics {
+    STAT_INSTRUCTIONS,
+    STAT_FRAME,         // In bytes
+    STAT_SPILLS,        // Parameters stored out of their registers
+    STAT_LOADS,         // Of locals
+    STAT_STORES,        // To locals
+    STAT_CALLS,
+    STAT_LABELS,
+    STATISTICS
 };
 
 /*
@@ -260,6 +337,134 @@ enum StructureType {
                     // This is a typedef
 };
 
+/*
+ * The instructions of the bytecode that the VM runs.
+ * Each names up to three operands, A, B and C, which are registers
+ *  unless noted otherwise. K is an index into the function's constants,
+ *  and I is an immediate held in the operand itself.
+ *
+ * The compares and conditional jumps are in the same order as OP_EQUAL onwards.
+ */
+enum Bytecodes {
+    BC_CONST,       // A = K[B]
+    BC_MOVE,        // A = B
+
+    BC_ADD,         // A = B + C
+    BC_SUB,         // A = B - C
+    BC_MUL,         // A = B * C
+    BC_DIV,         // A = B / C
+    BC_MOD,         // A = B % C
+    BC_AND,         // A = B & C
+    BC_OR,          // A = B | C
+    BC_XOR,         // A = B ^ C
+    BC_SHL,         // A = B << C
+    BC_SHR,         // A = B >> C, unsigned
+    BC_ADDI,        // A = B + I[C]
+    BC_MULI,        // A = B * I[C]
+
+    BC_NEG,         // A = -B
+    BC_NOT,         // A = ~B
+    BC_LNOT,        // A = !B
+    BC_BOOL,        // A = B != 0
+
+    BC_EQ,          // A = B =? C
+    BC_NE,          // A = B != C
+    BC_LT,          // A = B < C
+    BC_GT,          // A = B > C
+    BC_LE,          // A = B <= C
+    BC_GE,          // A = B >= C
+
+    BC_JEQ,         // Jump to A if B =? C
+    BC_JNE,         // Jump to A if B != C
+    BC_JLT,         // Jump to A if B < C
+    BC_JGT,         // Jump to A if B > C
+    BC_JLE,         // Jump to A if B <= C
+    BC_JGE,         // Jump to A if B >= C
+
+    BC_JEQI,        // Jump to A if B =? I[C]
+    BC_JNEI,        // Jump to A if B != I[C]
+    BC_JLTI,        // Jump to A if B < I[C]
+    BC_JGTI,        // Jump to A if B > I[C]
+    BC_JLEI,        // Jump to A if B <= I[C]
+    BC_JGEI,        // Jump to A if B >= I[C]
+
+    BC_JZ,          // Jump to A if B is zero
+    BC_JNZ,         // Jump to A if B is not zero
+    BC_JMP,         // Jump to A
+
+    BC_TRUNC8,      // A = B, as an unsigned char
+    BC_EXTEND32,    // A = B, as a signed int
+
+    BC_LOAD8,       // A = *(unsigned char*) B
+    BC_LOAD32,      // A = *(int*) B
+    BC_LOAD64,      // A = *(long*) B
+    BC_STORE8,      // *(char*) A = B
+    BC_STORE32,     // *(int*) A = B
+    BC_STORE64,     // *(long*) A = B
+
+    BC_LOADG8,      // A = *(unsigned char*) K[B]
+    BC_LOADG32,     // A = *(int*) K[B]
+    BC_LOADG64,     // A = *(long*) K[B]
+    BC_STOREG8,     // *(char*) K[A] = B
+    BC_STOREG32,    // *(int*) K[A] = B
+    BC_STOREG64,    // *(long*) K[A] = B
+
+    BC_POPCOUNT32,  // A = popcount(B), of the low 32 bits
+    BC_POPCOUNT64,  // A = popcount(B)
+    BC_CLZ32,       // A = clz(B), of the low 32 bits
+    BC_CLZ64,       // A = clz(B)
+    BC_CTZ32,       // A = ctz(B), of the low 32 bits
+    BC_CTZ64,       // A = ctz(B)
+    BC_BSWAP32,     // A = bswap(B), of the low 32 bits, sign extended
+    BC_BSWAP64,     // A = bswap(B)
+
+    BC_SWITCH,      // Jump through switch table C on the value of B
+    BC_CALL,        // A = callee B, with the C arguments starting at A
+    BC_RET          // Return A
+};
+
+struct BytecodeInstruction {
+    int Operation;
+    int A, B, C;
+};
+
+/*
+ * The cases of a switch statement.
+ * A dense switch has a target for every value from Low up, and no Values.
+ */
+struct BytecodeSwitch {
+    long Low;
+    int Count;
+    int Dense;
+    long* Values;
+    int* Targets;
+    int Default;
+};
+
+struct BytecodeFunction {
+    char* Name;
+    int Parameters;
+    int Registers;      // Parameters first, then locals, then temporaries
+
+    struct BytecodeInstruction* Code;
+    int Length;
+
+    long* Constants;
+    int ConstantCount;
+
+    struct BytecodeSwitch* Switches;
+    int SwitchCount;
+
+    struct BytecodeFunction* Next;
+};
+
+// A function called by name, which is bound when the VM starts.
+struct BytecodeCallee {
+    char* Name;
+    struct BytecodeFunction* Function;
+    void* Native;
+};
+
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * *
  * * * * * * *      A R G U M E N T S      * * * * * * *
@@ -267,8 +472,10 @@ enum StructureType {
 
 char* Suffixate(char* String, char Suffix);
 char* Compile(char* InputFile);
+char* CompileProgram(char* InputFiles[], int Count);
 char* Assemble(char* InputFile);
 void Link(char* Output, char* Objects[]);
+int Run(char* Arguments[], int Count);
 void DisplayUsage(char* ProgName);
 
 
@@ -278,6 +485,8 @@ void DisplayUsage(char* ProgName);
 
 
 void Tokenise();
+void StartLexer(void);
+void StopLexer(void);
 
 void VerifyToken(int Type, char* TokenExpected);
 void RejectToken(struct Token* Token);
@@ -293,6 +502,9 @@ struct ASTNode* MutateType(struct ASTNode* Tree, int RightType, int Operation);
 
 int TypeIsInt(int Type);
 int TypeIsPtr(int Type);
+int TypeIsVector(int Type);
+int VectorElementType(int Type);
+int VectorOf(int Type);
 
 char* TypeNames(int Type);
 int TypeSize(int Type, struct SymbolTableEntry* Composite);
@@ -331,6 +543,7 @@ void ParseGlobals();
 
 struct ASTNode* ParseFunction(int Type);
 struct ASTNode* ParseCompound();
+struct ASTNode* ParseStatements();
 
 struct SymbolTableEntry* BeginStructDeclaration();
 struct ASTNode* GetExpressionList();
@@ -343,6 +556,10 @@ int PointerTo(int Type);
 
 struct ASTNode* AccessArray();
 
+int FindIntrinsic(char* Name);
+struct ASTNode* ParseIntrinsic(int Intrinsic);
+struct ASTNode* ParseSplat(int Type);
+
 int ParseTokenToOperation(int Token);
 
 struct ASTNode* PrintStatement(void);
@@ -370,13 +587,14 @@ struct SymbolTableEntry* AddSymbol(char* Name, int Type, int Structure, int Stor
  * * * *    C O N T R O L       S T A T U S      * * * *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-void Die(char* Error);
+// These never return, which lets the compiler see that a value set on every other path is set.
+_Noreturn void Die(char* Error);
 
-void DieMessage(char* Error, char* Reason);
+_Noreturn void DieMessage(char* Error, char* Reason);
 
-void DieDecimal(char* Error, int Number);
+_Noreturn void DieDecimal(char* Error, int Number);
 
-void DieChar(char* Error, int Char);
+_Noreturn void DieChar(char* Error, int Char);
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * *
@@ -391,6 +609,10 @@ int RetrieveRegister();
 
 void DeallocateRegister(int Register);
 
+int RetrieveVectorRegister();
+
+void DeallocateVectorRegister(int Register);
+
 int PrimitiveSize(int Type);
 int AsAlignMemory(int Type, int Offset, int Direction);
 
@@ -399,6 +621,9 @@ int AsAdd(int Left, int Right);
 int AsMul(int Left, int Right);
 int AsSub(int Left, int Right);
 int AsDiv(int Left, int Right);
+int AsMod(int Left, int Right);
+int AsMulConstant(int Register, long Value);
+int AsArithmeticByConstant(struct ASTNode* Node);
 
 int AsLdGlobalVar(struct SymbolTableEntry* Entry, int Operation);
 int AsLdLocalVar(struct SymbolTableEntry* Entry, int Operation);
@@ -417,6 +642,7 @@ int  AsNewString(char* Value);
 
 
 int AsLoadString(int ID);
+void AsStringPool(void);
 
 int AsEqual(int Left, int Right);
 int AsIneq(int Left, int Right);
@@ -439,6 +665,10 @@ int AsCompareJmp(int Operation, int RegisterLeft, int RegisterRight, int Label);
 int AsCompare(int Operation, int RegisterLeft, int RegisterRight);
 int AsIf(struct ASTNode* Node);
 int NewLabel(void);
+int CountLabels(struct ASTNode* Node);
+int ReserveLabels(int Count);
+void UseLabels(int First, int Count);
+void EndLabels(void);
 
 void AsJmp(int Label);
 void AsLabel(int Label);
@@ -451,10 +681,27 @@ void AsCopyArgs(int Register, int Position);
 int AsCall(struct SymbolTableEntry* Entry, int Args);
 
 int AsWhile(struct ASTNode* Node);
+int AsSwitch(struct ASTNode* Node);
+
+int AsVectorLoop(struct ASTNode* Node);
+int AsVectorExpression(struct ASTNode* Node, struct SymbolTableEntry* Induction, int Index, int Size);
+int AsVectorBroadcast(int Register, int Size);
+int AsVectorLoad(struct SymbolTableEntry* Entry, int Index, int Size);
+void AsVectorStore(struct SymbolTableEntry* Entry, int Vector, int Index, int Size);
+int AsVectorBinary(int Operation, int Left, int Right, int Size);
+int AsVectorInvert(int Vector);
+int AsVectorOperation(struct ASTNode* Node, int Left, int Right, int ParentOp);
+int AsLdVectorVar(struct SymbolTableEntry* Entry);
+int AsStrVectorVar(struct SymbolTableEntry* Entry, int Vector);
+int AsIntrinsic(struct ASTNode* Node);
 
 void AssemblerPrint(int Register);
 
 void AssemblerPreamble();
+int AsFunction(struct ASTNode* Node);
+void AsFunctionSection(struct SymbolTableEntry* Entry);
+int AsColdSection(void);
+void AsLeaveColdSection(int Was);
 void AsFunctionPreamble(struct SymbolTableEntry* Entry);
 void AsFunctionEpilogue(struct SymbolTableEntry* Entry);
 
@@ -469,6 +716,88 @@ struct ASTNode* ParseIdentifier(void);
 struct ASTNode* IfStatement();
 struct ASTNode* WhileStatement();
 struct ASTNode* ForStatement();
-
-
-void DumpTree(struct ASTNode* node, int level);
\ No newline at end of file
+struct ASTNode* SwitchStatement();
+
+
+void DumpTree(struct ASTNode* node, int level);
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     O P T I M I S A T I O N     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct ASTNode* OptimiseFunction(struct ASTNode* Tree);
+void OptimiseLoops(struct ASTNode* Tree);
+void VectoriseLoops(struct ASTNode* Tree);
+void EliminateDeadCode(struct ASTNode* Tree);
+void ScheduleFunction(FILE* Buffer, FILE* Output, struct SymbolTableEntry* Function);
+
+void ProfileStart(char* InputFile);
+long ProfileCount(int Label);
+int ProfileIsCold(long Count, long Other);
+int ProfileIsHot(int Label);
+void AsProfileCounter(int Label);
+void AsProfileRuntime(void);
+
+void DeclareRuntime(void);
+void UseRuntime(char* Name);
+int AsRuntime(int All);
+
+int JitRun(FILE* Assembly, int Count, char* Arguments[]);
+void* JitLibrarySymbol(char* Name);
+
+int BcFunction(struct ASTNode* Node);
+char* AsStringValue(int ID);
+int VmRun(int Count, char* Arguments[]);
+
+char* CacheUnitKey(char* InputFile);
+char* CacheProgramKey(char* InputFiles[], int Count);
+char* CacheObjectKey(char* AssemblyFile);
+int CacheFetch(char* Key, char* OutputName);
+void CacheStore(char* Key, char* InputName);
+void CacheReport(void);
+
+void GenerateFunction(struct ASTNode* Tree);
+void FinishFunctions(void);
+void LockShared(void);
+void UnlockShared(void);
+
+void PhaseStart(int Phase);
+void PhaseEnd(int Phase);
+void Tally(int Counter, long Amount);
+void CountInstructions(FILE* Assembly);
+long InstructionsFrom(FILE* Assembly, long Start);
+void TimeReport(void);
+
+struct FunctionStats* NewFunctionStats(struct SymbolTableEntry* Function);
+void UseFunctionStats(struct FunctionStats* Record);
+void TallyFunction(int Statistic, long Amount);
+int CountingFunction(void);
+void StatsReport(void);
+
+void RememberFunction(struct ASTNode* Tree);
+void EvaluateCalls(struct ASTNode* Tree);
+void EvaluateInitialisers(struct ASTNode* Main);
+unsigned char* EvaluatedGlobal(struct SymbolTableEntry* Symbol);
+
+void AddProgramFunction(struct ASTNode* Tree);
+void AssembleProgram(void);
+int SymbolIsExported(struct SymbolTableEntry* Symbol);
+struct SymbolTableEntry* VectorArrayAccess(struct ASTNode* Node, struct SymbolTableEntry* Index);
+
+struct ASTNode* CopyTree(struct ASTNode* Node);
+int TreesEqual(struct ASTNode* Left, struct ASTNode* Right);
+int TreeSize(struct ASTNode* Node);
+int TreeContainsOperation(struct ASTNode* Node, int Operation);
+int TreeHasSideEffects(struct ASTNode* Node);
+int TreeWritesSymbol(struct ASTNode* Node, struct SymbolTableEntry* Symbol);
+int TreeTakesAddress(struct ASTNode* Node, struct SymbolTableEntry* Symbol);
+int ConstantValue(struct ASTNode* Node, long* Value);
+struct ASTNode* Unwiden(struct ASTNode* Node);
+int IsReferenceTo(struct ASTNode* Node, struct SymbolTableEntry* Symbol);
+int IsScalarInteger(struct SymbolTableEntry* Symbol);
+int MatchInductionStep(struct ASTNode* Step, struct SymbolTableEntry** Symbol, long* Stride);
+
+struct SymbolTableEntry* AddTemporary(int Type);
+struct ASTNode* ConstructReference(struct SymbolTableEntry* Symbol);
+struct ASTNode* ConstructLiteral(int Type, int Value);
+struct ASTNode* ConstructAssignment(struct SymbolTableEntry* Symbol, struct ASTNode* Value);
+struct ASTNode* ConstructSequence(struct ASTNode* First, struct ASTNode* Second);
@@ -18,7 +18,7 @@
  * 
  */
 
-static int UsedRegisters[4];
+static _Thread_local int UsedRegisters[4];
 
 /* The https://en.wikipedia.org/wiki/X86_calling_conventions#Microsoft_x64_calling_convention
  *  calling convention on Windows requires that
@@ -33,6 +33,14 @@ static char* Registers[8]       = { "%r10",  "%r11" , "%r12" , "%r13",  "%r9" ,
 static char* DoubleRegisters[8] = { "%r10d", "%r11d", "%r12d", "%r13d", "%r9d", "%r8d", "%edx", "%ecx" };
 static char* ByteRegisters[8]   = { "%r10b", "%r11b", "%r12b", "%r13b", "%r9b", "%r8b", "%dl" , "%cl"  };
 
+/*
+ * The vectorised loops use the SSE registers.
+ * Only the first 6 may be clobbered without saving them on Windows, so those are all we use.
+ * The Vectoriser makes sure no statement needs more than this.
+ */
+static _Thread_local int UsedVectorRegisters[6];
+static char* VectorRegisters[6] = { "%xmm0", "%xmm1", "%xmm2", "%xmm3", "%xmm4", "%xmm5" };
+
 /*
  * For ease of reading later code, we store the valid x86 comparison instructions,
  *  and the inverse jump instructions together, in a synchronized fashion.
@@ -40,18 +48,25 @@ static char* ByteRegisters[8]   = { "%r10b", "%r11b", "%r12b", "%r13b", "%r9b",
 
 static char* Comparisons[6]     = { "sete", "setne", "setl", "setg", "setle", "setge" };
 static char* InvComparisons[6]  = { "jne", "je",     "jge",  "jle",  "jg",    "jl"};
+static char* Jumps[6]           = { "je",  "jne",    "jl",   "jg",   "jle",   "jge"};
+
+/*
+ * Conditions normally jump away when they are false.
+ * When laying out for a profile, it can be better to jump when they are true instead.
+ */
+static _Thread_local int BranchOnTrue;
 
 // How far above the base pointer is the last local?
-static int LocalVarOffset;
+static _Thread_local int LocalVarOffset;
 // How far must we lower the base pointer to retrieve the parameters?
-static int StackFrameOffset;
+static _Thread_local int StackFrameOffset;
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * *
  * * * *   R O O T    O F    A S S E M B L E R   * * * *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 // Just a short "hack" to make sure we only dump the tree the first time this function is called
-static int Started = 0;
+static _Thread_local int Started = 0;
 
 /*
  * Walk the AST tree given, and generate the assembly code that represents
@@ -66,6 +81,9 @@ static int Started = 0;
  */
 int AssembleTree(struct ASTNode* Node, int Register, int ParentOp) {
     int LeftVal, RightVal;
+    if(Node == NULL)
+        return -1;
+
     if(!Started && OptDumpTree)
         DumpTree(Node, 0);
     Started = 1;
@@ -78,6 +96,12 @@ int AssembleTree(struct ASTNode* Node, int Register, int ParentOp) {
         case OP_LOOP:
             return AsWhile(Node);
 
+        case OP_VECLOOP:
+            return AsVectorLoop(Node);
+
+        case OP_SWITCH:
+            return AsSwitch(Node);
+
         case OP_COMP:
             AssembleTree(Node->Left, -1, Node->Operation);
             DeallocateAllRegisters();
@@ -88,11 +112,22 @@ int AssembleTree(struct ASTNode* Node, int Register, int ParentOp) {
         case OP_CALL:
             return (AsCallWrapper(Node));
 
+        case OP_INTRINSIC:
+            return AsIntrinsic(Node);
+
         case OP_FUNC:
-            AsFunctionPreamble(Node->Symbol);
-            AssembleTree(Node->Left, -1, Node->Operation);
-            AsFunctionEpilogue(Node->Symbol);
-            return -1;
+            // The VM has a backend of its own.
+            if(OptVirtualMachine)
+                return BcFunction(Node);
+            return AsFunction(Node);
+
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+            // Constants can usually avoid imul and idiv entirely.
+            if(!TypeIsVector(Node->ExprType) && (LeftVal = AsArithmeticByConstant(Node)) >= 0)
+                return LeftVal;
+            break;
     }
 
 
@@ -102,6 +137,10 @@ int AssembleTree(struct ASTNode* Node, int Register, int ParentOp) {
     if(Node->Right)
         RightVal = AssembleTree(Node->Right, LeftVal, Node->Operation);
 
+    // Vectors live in the SSE registers, and have their own instructions.
+    if(TypeIsVector(Node->ExprType))
+        return AsVectorOperation(Node, LeftVal, RightVal, ParentOp);
+
     switch(Node->Operation) {
         case OP_ADD:
             return AsAdd(LeftVal, RightVal);
@@ -114,6 +153,9 @@ int AssembleTree(struct ASTNode* Node, int Register, int ParentOp) {
             
         case OP_DIVIDE:
             return AsDiv(LeftVal, RightVal);
+
+        case OP_MODULO:
+            return AsMod(LeftVal, RightVal);
             
         case OP_SCALE:
             // We can (ab)use the powers of 2 to do
@@ -124,8 +166,7 @@ int AssembleTree(struct ASTNode* Node, int Register, int ParentOp) {
                 case 8: return AsShl(LeftVal, 3);
                 
                 default:
-                    RightVal = AsLoad(Node->Size);
-                    return AsMul(LeftVal, RightVal);
+                    return AsMulConstant(LeftVal, Node->Size);
             }
         case OP_ADDRESS:
             return AsAddr(Node->Symbol);
@@ -138,10 +179,11 @@ int AssembleTree(struct ASTNode* Node, int Register, int ParentOp) {
             if(Node->Right == NULL)
                 Die("Fault in assigning a null rvalue");
             
-            printf("\tCalculating assignment for target %s:\r\n", Node->Right->Symbol->Name);
+            if(Node->Right->Symbol)
+                printf("\tCalculating assignment for target %s:\r\n", Node->Right->Symbol->Name);
             switch(Node->Right->Operation) {
                 case REF_IDENT: 
-                    if(Node->Right->Symbol->Storage == SC_LOCAL)
+                    if(Node->Right->Symbol->Storage == SC_LOCAL || Node->Right->Symbol->Storage == SC_PARAM)
                         return AsStrLocalVar(Node->Right->Symbol, LeftVal);
                     else 
                         return AsStrGlobalVar(Node->Right->Symbol, LeftVal);
@@ -207,16 +249,21 @@ int AssembleTree(struct ASTNode* Node, int Register, int ParentOp) {
             return AsShiftRight(LeftVal, RightVal);
         
         case OP_POSTINC:
-            return AsLdGlobalVar(Node->Symbol, Node->Operation);
-        
         case OP_POSTDEC:
-            return AsLdGlobalVar(Node->Symbol, Node->Operation);
+            if(Node->Symbol->Storage == SC_LOCAL || Node->Symbol->Storage == SC_PARAM)
+                return AsLdLocalVar(Node->Symbol, Node->Operation);
+            else
+                return AsLdGlobalVar(Node->Symbol, Node->Operation);
         
         case OP_PREINC:
-            return AsLdGlobalVar(Node->Symbol, Node->Operation);
-        
         case OP_PREDEC:
-            return AsLdGlobalVar(Node->Symbol, Node->Operation);
+            // The variable is on the left, and may already have been loaded.
+            if(LeftVal >= 0)
+                DeallocateRegister(LeftVal);
+            if(Node->Left->Symbol->Storage == SC_LOCAL || Node->Left->Symbol->Storage == SC_PARAM)
+                return AsLdLocalVar(Node->Left->Symbol, Node->Operation);
+            else
+                return AsLdGlobalVar(Node->Left->Symbol, Node->Operation);
         
         case OP_BOOLNOT:
             return AsBooleanNOT(LeftVal);
@@ -242,6 +289,8 @@ int AssembleTree(struct ASTNode* Node, int Register, int ParentOp) {
 // Set all Registers to unused.
 void DeallocateAllRegisters() {
     UsedRegisters[0] = UsedRegisters[1] = UsedRegisters[2] = UsedRegisters[3] = 0;
+    for(int i = 0; i < 6; i++)
+        UsedVectorRegisters[i] = 0;
 }
 
 /*
@@ -273,6 +322,34 @@ void DeallocateRegister(int Register) {
     UsedRegisters[Register] = 0;
 }
 
+/*
+ * Search for an unused vector register, allocate it, and return it.
+ * If none available, cancel compilation.
+ */
+int RetrieveVectorRegister() {
+    for (size_t i = 0; i < 6; i++) {
+        if(UsedVectorRegisters[i] == 0) {
+            UsedVectorRegisters[i] = 1;
+            return i;
+        }
+    }
+    fprintf(stderr, "Out of vector registers!\n");
+    exit(1);
+}
+
+/*
+ * Set the given vector register to unused.
+ * @param Register: The VectorRegisters index to deallocate.
+ */
+void DeallocateVectorRegister(int Register) {
+    if(UsedVectorRegisters[Register] != 1) {
+        fprintf(stderr, "Error trying to free vector register %d\n", Register);
+        exit(1);
+    }
+
+    UsedVectorRegisters[Register] = 0;
+}
+
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
  * * * * * *    S T A C K     M A N A G E M E N T    * * * * * *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -305,16 +382,61 @@ int AsCalcOffset(int Type) {
  * * * *     C O D E     G E N E R A T I O N     * * * *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+// The next label that no one has been given.
+static int NextLabel = 1;
+
+// The labels set aside for the function being assembled on this thread.
+static _Thread_local int BlockNext, BlockEnd;
+
 /*
  * A way to keep track of the largest label number.
  * Call this function to increase the number SRG-like.
+ * While a function is assembled, its labels come from the block set aside for it.
  * 
  * @return the highest available label number
  * 
  */
 int NewLabel(void) {
-    static int id = 1;
-    return id++;
+    if(BlockEnd) {
+        if(BlockNext == BlockEnd)
+            DieDecimal("Function used more labels than were set aside for it", BlockEnd);
+        TallyFunction(STAT_LABELS, 1);
+        return BlockNext++;
+    }
+
+    Tally(COUNT_LABELS, 1);
+    return NextLabel++;
+}
+
+/*
+ * Set aside a run of labels, for a function to be assembled later.
+ *
+ * @param Count: How many labels
+ * @return the first of them
+ */
+int ReserveLabels(int Count) {
+    int First = NextLabel;
+
+    Tally(COUNT_LABELS, Count);
+    NextLabel += Count;
+    return First;
+}
+
+/*
+ * Give the labels set aside by ReserveLabels to this thread,
+ *  so the function it assembles is numbered as if it were alone.
+ */
+void UseLabels(int First, int Count) {
+    BlockNext = First;
+    BlockEnd = First + Count;
+}
+
+// Go back to the shared labels, checking the function used what it was given.
+void EndLabels(void) {
+    if(BlockNext != BlockEnd)
+        DieDecimal("Function used fewer labels than were set aside for it", BlockEnd);
+
+    BlockNext = BlockEnd = 0;
 }
 
 /*
@@ -340,23 +462,85 @@ int AsAlignMemory(int Type, int Offset, int Direction) {
     return (Offset);
 }
  
-// Assemble an If statement
+// Whether code is going into the cold section of the current function.
+static _Thread_local int InColdSection;
+
+/*
+ * Assemble an If statement.
+ * With a profile, a branch that is rarely taken is moved out of line,
+ *  so that the common path never has to jump.
+ */
 int AsIf(struct ASTNode* Node) {
-    int FalseLabel, EndLabel;
+    int FalseLabel, EndLabel, ThenLabel = 0;
+    long ThenCount, OtherCount;
+    int ColdThen = 0, ColdElse = 0, WasCold;
 
     FalseLabel = NewLabel();
     if(Node->Right)
         EndLabel = NewLabel();
 
+    // Profiling needs to count the true block separately.
+    if(OptProfileGenerate || OptProfileUse)
+        ThenLabel = NewLabel();
+
+    // Code that is already out of line stays where it is.
+    if(OptProfileUse && !InColdSection && (ThenCount = ProfileCount(ThenLabel)) >= 0) {
+        // Without an else, the false label is reached from both ways.
+        OtherCount = ProfileCount(FalseLabel) - (Node->Right ? 0 : ThenCount);
+        ColdThen = ProfileIsCold(ThenCount, OtherCount);
+        ColdElse = Node->Right && ProfileIsCold(OtherCount, ThenCount);
+    }
+
+    if(ColdThen) {
+        printf("\tProfile: true block of if at label %d is cold\n", ThenLabel);
+
+        BranchOnTrue = 1;
+        AssembleTree(Node->Left, ThenLabel, Node->Operation);
+        BranchOnTrue = 0;
+        DeallocateAllRegisters();
+
+        WasCold = AsColdSection();
+        AsLabel(ThenLabel);
+        AssembleTree(Node->Middle, -1, Node->Operation);
+        DeallocateAllRegisters();
+        AsJmp(Node->Right ? EndLabel : FalseLabel);
+        AsLeaveColdSection(WasCold);
+
+        AsLabel(FalseLabel);
+        if(Node->Right) {
+            AssembleTree(Node->Right, -1, Node->Operation);
+            DeallocateAllRegisters();
+            AsLabel(EndLabel);
+        }
+
+        return -1;
+    }
     
     // Left is the condition
     AssembleTree(Node->Left, FalseLabel, Node->Operation);
     DeallocateAllRegisters();
 
+    if(ThenLabel)
+        AsLabel(ThenLabel);
+
     // Middle is the true block
     AssembleTree(Node->Middle, -1, Node->Operation);
     DeallocateAllRegisters();
 
+    if(ColdElse) {
+        printf("\tProfile: else block of if at label %d is cold\n", FalseLabel);
+
+        WasCold = AsColdSection();
+        AsLabel(FalseLabel);
+        AssembleTree(Node->Right, -1, Node->Operation);
+        DeallocateAllRegisters();
+        AsJmp(EndLabel);
+        AsLeaveColdSection(WasCold);
+
+        AsLabel(EndLabel);
+        return -1;
+    }
+
     // Right is the optional else
     if(Node->Right)
         AsJmp(EndLabel);
@@ -394,7 +578,7 @@ int AsCompareJmp(int Operation, int RegisterLeft, int RegisterRight, int Label)
     printf("\tBranching on comparison of registers %d & %d, with operation %s\n\n", RegisterLeft, RegisterRight, Comparisons[Operation - OP_EQUAL]);
     
     fprintf(OutputFile, "\tcmpq\t%s, %s\n", Registers[RegisterRight], Registers[RegisterLeft]);
-    fprintf(OutputFile, "\t%s\tL%d\n", InvComparisons[Operation - OP_EQUAL], Label);
+    fprintf(OutputFile, "\t%s\tL%d\n", (BranchOnTrue ? Jumps : InvComparisons)[Operation - OP_EQUAL], Label);
     DeallocateAllRegisters();
 
     return -1;
@@ -412,51 +596,350 @@ void AsJmp(int Label) {
 void AsLabel(int Label) {
     printf("\tCreating label %d\n", Label);
     fprintf(OutputFile, "\nL%d:\n", Label);
+    AsProfileCounter(Label);
+}
+
+// Create a label on data, which must not be counted.
+static void AsDataLabel(int Label) {
+    fprintf(OutputFile, "\nL%d:\n", Label);
+}
+
+// Create a label that the profile says is hot, aligned to make the most of the fetch window.
+static void AsHotLabel(int Label) {
+    if(OptProfileUse && ProfileIsHot(Label))
+        fprintf(OutputFile, "\t.p2align\t4\n");
+    AsLabel(Label);
+}
+
+/*
+ * Move to the section for the cold code of the current function.
+ * @return whether it was there already, to give back to AsLeaveColdSection
+ */
+int AsColdSection(void) {
+    int Was = InColdSection;
+
+    InColdSection = 1;
+    fprintf(OutputFile, "\t.section\t.text.unlikely.%s,\"x\"\n", FunctionEntry->Name);
+    return Was;
+}
+
+// Go back to the section the code was in, after something put elsewhere.
+static void AsCurrentSection(void) {
+    if(InColdSection)
+        fprintf(OutputFile, "\t.section\t.text.unlikely.%s,\"x\"\n", FunctionEntry->Name);
+    else
+        AsFunctionSection(FunctionEntry);
+}
+
+// Leave the cold section, for the one that was current before AsColdSection.
+void AsLeaveColdSection(int Was) {
+    InColdSection = Was;
+    AsCurrentSection();
 }
 
 /*
- * Assemble a new global string into the data segment.
- * @param Value: The name of the string, as a string
+ * String literals are pooled for the whole translation unit, instead of
+ *  being written out as they are parsed.
+ * Identical strings share one label, and a string that is the end of
+ *  another ("world" in "hello world") is emitted as a label inside it.
+ * Only strings that some generated code loads are written, once,
+ *  at the end, into read-only data.
+ */
+struct PooledString {
+    char* Value;
+    int Length;
+    int Label;
+    int Used;
+    // Where it ends up; the string it is a suffix of, and how far into it.
+    struct PooledString* Owner;
+    int Offset;
+    // The next string in the same hash bucket, or -1.
+    int Next;
+};
+
+static struct PooledString* StringPool;
+static int PoolCount, PoolCapacity;
+
+// The first string in each bucket, by the hash of its contents, or -1.
+static int* PoolBuckets;
+static int BucketCount;
+
+// FNV-1a, which is plenty for telling string literals apart.
+static unsigned int AsHashString(char* Value) {
+    unsigned int Hash = 2166136261u;
+    for(; *Value != '\0'; Value++)
+        Hash = (Hash ^ (unsigned char) *Value) * 16777619u;
+    return Hash;
+}
+
+// Grow the buckets to twice as many as there are strings, and chain everything in again.
+static void AsGrowBuckets(void) {
+    BucketCount = BucketCount ? BucketCount * 2 : 64;
+    free(PoolBuckets);
+    if((PoolBuckets = malloc(BucketCount * sizeof(int))) == NULL)
+        Die("Unable to allocate string pool");
+
+    for(int i = 0; i < BucketCount; i++)
+        PoolBuckets[i] = -1;
+
+    for(int i = 0; i < PoolCount; i++) {
+        unsigned int Bucket = AsHashString(StringPool[i].Value) & (BucketCount - 1);
+        StringPool[i].Next = PoolBuckets[Bucket];
+        PoolBuckets[Bucket] = i;
+    }
+}
+
+/*
+ * Add a string to the pool.
+ * @param Value: The contents of the string
+ * @return the Label that will refer to it
  */
 int AsNewString(char* Value) {
-    int Label = NewLabel();
-    char* CharPtr;
+    int Label;
+    unsigned int Bucket;
+
+    // Functions being assembled on other threads may be looking through the pool.
+    LockShared();
+    if(PoolCount * 2 >= BucketCount)
+        AsGrowBuckets();
+
+    Bucket = AsHashString(Value) & (BucketCount - 1);
+    for(int i = PoolBuckets[Bucket]; i >= 0; i = StringPool[i].Next) {
+        if(!strcmp(StringPool[i].Value, Value)) {
+            Label = StringPool[i].Label;
+            UnlockShared();
+            return Label;
+        }
+    }
 
-    AsLabel(Label);
+    if(PoolCount == PoolCapacity) {
+        PoolCapacity = PoolCapacity ? PoolCapacity * 2 : 32;
+        StringPool = realloc(StringPool, PoolCapacity * sizeof(struct PooledString));
+        if(StringPool == NULL)
+            Die("Unable to allocate string pool");
+    }
 
-    for(CharPtr = Value; *CharPtr; CharPtr++) 
-        fprintf(OutputFile, "\t.byte\t%d\r\n", *CharPtr);
-    fprintf(OutputFile, "\t.byte\t0\r\n");
-    
+    // Labels only ever increase, so the pool stays sorted by label.
+    StringPool[PoolCount].Value = strdup(Value);
+    StringPool[PoolCount].Length = strlen(Value);
+    StringPool[PoolCount].Label = NewLabel();
+    StringPool[PoolCount].Used = 0;
+    StringPool[PoolCount].Owner = NULL;
+    StringPool[PoolCount].Offset = 0;
+    StringPool[PoolCount].Next = PoolBuckets[Bucket];
+    PoolBuckets[Bucket] = PoolCount;
+
+    Label = StringPool[PoolCount++].Label;
+    UnlockShared();
     return Label;
 }
 
+/*
+ * Find a pooled string by its label.
+ * The caller must hold the shared lock, as the pool may be growing on another thread.
+ * @param ID: the Label number of the string
+ * @return the string, or NULL if there is none
+ */
+static struct PooledString* AsFindString(int ID) {
+    int Low = 0, High = PoolCount - 1, Middle;
+
+    while(Low <= High) {
+        Middle = (Low + High) / 2;
+        if(StringPool[Middle].Label == ID)
+            return &StringPool[Middle];
+        if(StringPool[Middle].Label < ID)
+            Low = Middle + 1;
+        else
+            High = Middle - 1;
+    }
+
+    return NULL;
+}
+
 /*
  * Load a string into a Register.
  * @param ID: the Label number of the string
  */ 
 int AsLoadString(int ID) {
     int Register = RetrieveRegister();
+    struct PooledString* String;
+
+    // Mark it as used, so it is written out with the pool.
+    LockShared();
+    if((String = AsFindString(ID)) != NULL)
+        String->Used = 1;
+    UnlockShared();
+
     fprintf(OutputFile, "\tleaq\tL%d(\%%rip), %s\r\n", ID, Registers[Register]);
     return Register;
 }
 
-// Assemble a While loop
+/*
+ * Find the contents of a pooled string, for the bytecode backend.
+ * @param ID: the Label number of the string
+ */
+char* AsStringValue(int ID) {
+    struct PooledString* String;
+    char* Value;
+
+    LockShared();
+    String = AsFindString(ID);
+    Value = String != NULL ? String->Value : NULL;
+    UnlockShared();
+
+    if(Value == NULL)
+        DieDecimal("No such string", ID);
+    return Value;
+}
+
+// Longest first, so that every string is placed after anything it could be a suffix of.
+static int CompareStringLengths(const void* Left, const void* Right) {
+    return (*(struct PooledString**) Right)->Length - (*(struct PooledString**) Left)->Length;
+}
+
+// Order the strings inside one owner by where they start.
+static int CompareStringOffsets(const void* Left, const void* Right) {
+    return (*(struct PooledString**) Left)->Offset - (*(struct PooledString**) Right)->Offset;
+}
+
+// Write Length characters of a string as the inside of an assembler string.
+static void AsStringCharacters(char* Value, int Length) {
+    for(int i = 0; i < Length; i++) {
+        unsigned char Char = Value[i];
+        if(Char == '"' || Char == '\\')
+            fprintf(OutputFile, "\\%c", Char);
+        else if(Char < ' ' || Char > '~')
+            fprintf(OutputFile, "\\%03o", Char);
+        else
+            fputc(Char, OutputFile);
+    }
+}
+
+/*
+ * Write the pool out, and empty it for the next translation unit.
+ */
+void AsStringPool(void) {
+    struct PooledString** Sorted, **Members, *Owner;
+    int Count = 0, MemberCount, Position;
+
+    Sorted = malloc((PoolCount + 1) * sizeof(struct PooledString*));
+    Members = malloc((PoolCount + 1) * sizeof(struct PooledString*));
+    if(Sorted == NULL || Members == NULL)
+        Die("Unable to allocate string pool");
+
+    for(int i = 0; i < PoolCount; i++)
+        if(StringPool[i].Used)
+            Sorted[Count++] = &StringPool[i];
+
+    qsort(Sorted, Count, sizeof(struct PooledString*), CompareStringLengths);
+
+    // Find the longest string each one is the end of.
+    for(int i = 0; i < Count; i++) {
+        for(int j = 0; j < i; j++) {
+            Owner = Sorted[j];
+            if(Owner->Owner != NULL)
+                continue;
+
+            Position = Owner->Length - Sorted[i]->Length;
+            if(!strcmp(Owner->Value + Position, Sorted[i]->Value)) {
+                Sorted[i]->Owner = Owner;
+                Sorted[i]->Offset = Position;
+                break;
+            }
+        }
+    }
+
+    if(Count > 0)
+        fprintf(OutputFile, "\t.section\t.rdata,\"dr\"\n");
+
+    // Each owner is written once, with a label where each of its suffixes begins.
+    for(int i = 0; i < Count; i++) {
+        Owner = Sorted[i];
+        if(Owner->Owner != NULL)
+            continue;
+
+        MemberCount = 0;
+        Members[MemberCount++] = Owner;
+        for(int j = i + 1; j < Count; j++)
+            if(Sorted[j]->Owner == Owner)
+                Members[MemberCount++] = Sorted[j];
+
+        qsort(Members, MemberCount, sizeof(struct PooledString*), CompareStringOffsets);
+
+        for(int j = 0; j < MemberCount; j++) {
+            AsDataLabel(Members[j]->Label);
+            if(j + 1 < MemberCount) {
+                fprintf(OutputFile, "\t.ascii\t\"");
+                AsStringCharacters(Owner->Value + Members[j]->Offset, Members[j + 1]->Offset - Members[j]->Offset);
+            } else {
+                fprintf(OutputFile, "\t.string\t\"");
+                AsStringCharacters(Owner->Value + Members[j]->Offset, Owner->Length - Members[j]->Offset);
+            }
+            fprintf(OutputFile, "\"\n");
+        }
+    }
+
+    if(OptVerboseOutput && PoolCount > 0)
+        printf("String pool: %d literals, %d used\n", PoolCount, Count);
+
+    for(int i = 0; i < PoolCount; i++)
+        free(StringPool[i].Value);
+    PoolCount = 0;
+
+    for(int i = 0; i < BucketCount; i++)
+        PoolBuckets[i] = -1;
+
+    free(Sorted);
+    free(Members);
+}
+
+/*
+ * Assemble a While loop.
+ * With a profile, a loop that usually goes around more than once is rotated,
+ *  so the condition is at the bottom, and each iteration takes one branch instead of two.
+ */
 int AsWhile(struct ASTNode* Node) {
-    int BodyLabel, BreakLabel;
+    int BodyLabel, BreakLabel, TopLabel = 0;
     
     BodyLabel = NewLabel();
     BreakLabel = NewLabel();
 
+    // Profiling needs to count the iterations separately from the condition.
+    if(OptProfileGenerate || OptProfileUse)
+        TopLabel = NewLabel();
+
     printf("\tInitiating loop between labels %d and %d\n", BodyLabel, BreakLabel);
 
+    if(OptProfileUse && ProfileCount(TopLabel) > ProfileCount(BreakLabel)) {
+        printf("\tProfile: rotating loop at label %d\n", BodyLabel);
+
+        AsJmp(BodyLabel);
+
+        AsHotLabel(TopLabel);
+        AssembleTree(Node->Right, -1, Node->Operation);
+        DeallocateAllRegisters();
+
+        // The condition jumps back to the top while it holds.
+        AsLabel(BodyLabel);
+        BranchOnTrue = 1;
+        AssembleTree(Node->Left, TopLabel, Node->Operation);
+        BranchOnTrue = 0;
+        DeallocateAllRegisters();
+
+        AsLabel(BreakLabel);
+        return -1;
+    }
+
     // Mark the start position
-    AsLabel(BodyLabel);
+    AsHotLabel(BodyLabel);
 
     // Assemble the condition - this should include a jump to end!
     AssembleTree(Node->Left, BreakLabel, Node->Operation);
     DeallocateAllRegisters();
 
+    if(TopLabel)
+        AsLabel(TopLabel);
+
     // Assemble the body
     AssembleTree(Node->Right, -1, Node->Operation);
     DeallocateAllRegisters();
@@ -472,6 +955,219 @@ int AsWhile(struct ASTNode* Node) {
 
 }
 
+/*
+ * Switch statements are dispatched in one of three ways:
+ *  * a jump table, for 4 or more cases with at most 3 slots per case,
+ *  * a binary search of compares, for 4 or more cases that are spread out,
+ *  * a chain of compares, for anything smaller.
+ *
+ * The binary search falls back to a chain once it gets below 4 cases.
+ */
+#define SWITCH_MIN_CASES 4
+#define SWITCH_TABLE_DENSITY 3
+
+struct SwitchCase {
+    long Value;
+    int Label;
+};
+
+static int CompareCases(const void* Left, const void* Right) {
+    long L = ((struct SwitchCase*) Left)->Value, R = ((struct SwitchCase*) Right)->Value;
+    return (L > R) - (L < R);
+}
+
+// Whether Count cases, from Low to High, are close enough together for a jump table.
+static int SwitchIsDense(int Count, long Low, long High) {
+    return Count >= SWITCH_MIN_CASES && High - Low < (long) Count * SWITCH_TABLE_DENSITY;
+}
+
+// Assemble a jump table over the cases, which are sorted.
+static void AsSwitchTable(int Register, struct SwitchCase* Cases, int Count, int Default) {
+    long Low = Cases[0].Value, Range = Cases[Count - 1].Value - Low + 1;
+    int Table = NewLabel(), Base = RetrieveRegister();
+
+    printf("\tSwitch: jump table of %ld entries at label %d\n", Range, Table);
+
+    // One unsigned compare catches values both below and above the table.
+    if(Low != 0)
+        fprintf(OutputFile, "\tsubq\t$%ld, %s\n", Low, Registers[Register]);
+    fprintf(OutputFile, "\tcmpq\t$%ld, %s\n", Range - 1, Registers[Register]);
+    fprintf(OutputFile, "\tja\tL%d\n", Default);
+    fprintf(OutputFile, "\tleaq\tL%d(%%rip), %s\n", Table, Registers[Base]);
+    fprintf(OutputFile, "\tjmp\t*(%s,%s,8)\n", Registers[Base], Registers[Register]);
+    DeallocateRegister(Base);
+
+    // With the function, so the linker keeps or drops them together.
+    fprintf(OutputFile, "\t.section\t.rdata$%s,\"dr\"\n\t.p2align\t3\n", FunctionEntry->Name);
+    AsDataLabel(Table);
+    for(long Value = Low, i = 0; Value < Low + Range; Value++) {
+        if(Cases[i].Value == Value)
+            fprintf(OutputFile, "\t.quad\tL%d\n", Cases[i++].Label);
+        else
+            fprintf(OutputFile, "\t.quad\tL%d\n", Default);
+    }
+    AsCurrentSection();
+}
+
+// Assemble a binary search over the sorted cases from Low to High inclusive.
+static void AsSwitchSearch(int Register, struct SwitchCase* Cases, int Low, int High, int Default) {
+    int Middle, Below;
+
+    if(High - Low + 1 < SWITCH_MIN_CASES) {
+        for(int i = Low; i <= High; i++) {
+            fprintf(OutputFile, "\tcmpq\t$%ld, %s\n", Cases[i].Value, Registers[Register]);
+            fprintf(OutputFile, "\tje\tL%d\n", Cases[i].Label);
+        }
+        AsJmp(Default);
+        return;
+    }
+
+    Middle = (Low + High) / 2;
+    Below = NewLabel();
+
+    fprintf(OutputFile, "\tcmpq\t$%ld, %s\n", Cases[Middle].Value, Registers[Register]);
+    fprintf(OutputFile, "\tje\tL%d\n", Cases[Middle].Label);
+    fprintf(OutputFile, "\tjl\tL%d\n", Below);
+
+    AsSwitchSearch(Register, Cases, Middle + 1, High, Default);
+    AsLabel(Below);
+    AsSwitchSearch(Register, Cases, Low, Middle - 1, Default);
+}
+
+// Assemble a Switch statement
+int AsSwitch(struct ASTNode* Node) {
+    struct SwitchCase* Cases;
+    struct ASTNode* Case, *Label;
+    int* Bodies;
+    int Register, Count = 0, BodyCount = 0, EndLabel, DefaultLabel;
+
+    EndLabel = NewLabel();
+    DefaultLabel = EndLabel;
+
+    for(Case = Node->Right; Case != NULL; Case = Case->Right)
+        BodyCount++;
+
+    Cases = malloc((Node->IntValue + 1) * sizeof(struct SwitchCase));
+    Bodies = malloc((BodyCount + 1) * sizeof(int));
+    if(Cases == NULL || Bodies == NULL)
+        Die("Unable to allocate switch cases");
+
+    // Give every body a label, and collect the values that lead to it.
+    BodyCount = 0;
+    for(Case = Node->Right; Case != NULL; Case = Case->Right) {
+        Bodies[BodyCount] = NewLabel();
+
+        for(Label = Case; Label != NULL; Label = Label->Middle) {
+            if(Label->Operation == OP_DEFAULT) {
+                DefaultLabel = Bodies[BodyCount];
+            } else {
+                Cases[Count].Value = Label->IntValue;
+                Cases[Count++].Label = Bodies[BodyCount];
+            }
+        }
+
+        BodyCount++;
+    }
+
+    qsort(Cases, Count, sizeof(struct SwitchCase), CompareCases);
+
+    Register = AssembleTree(Node->Left, -1, Node->Operation);
+
+    // A switch with only a default has no cases to read the range of.
+    if(Count > 0 && SwitchIsDense(Count, Cases[0].Value, Cases[Count - 1].Value))
+        AsSwitchTable(Register, Cases, Count, DefaultLabel);
+    else
+        AsSwitchSearch(Register, Cases, 0, Count - 1, DefaultLabel);
+
+    DeallocateAllRegisters();
+
+    // Every body ends the switch, apart from the last which falls out of it anyway.
+    BodyCount = 0;
+    for(Case = Node->Right; Case != NULL; Case = Case->Right) {
+        AsLabel(Bodies[BodyCount++]);
+        AssembleTree(Case->Left, -1, Node->Operation);
+        DeallocateAllRegisters();
+
+        if(Case->Right != NULL)
+            AsJmp(EndLabel);
+    }
+
+    AsLabel(EndLabel);
+
+    free(Cases);
+    free(Bodies);
+    return -1;
+}
+
+// How many labels AsSwitchSearch takes for Count cases.
+static int SwitchSearchLabels(int Count) {
+    if(Count < SWITCH_MIN_CASES)
+        return 0;
+
+    return 1 + SwitchSearchLabels(Count - 1 - (Count - 1) / 2) + SwitchSearchLabels((Count - 1) / 2);
+}
+
+// How many labels AsSwitch takes for itself, apart from its bodies.
+static int SwitchLabels(struct ASTNode* Node) {
+    struct ASTNode* Case, *Label;
+    long Low = 0, High = 0;
+    int Count = 0, Labels = 1;
+
+    for(Case = Node->Right; Case != NULL; Case = Case->Right) {
+        Labels++;
+
+        for(Label = Case; Label != NULL; Label = Label->Middle) {
+            if(Label->Operation == OP_DEFAULT)
+                continue;
+
+            if(Count == 0 || Label->IntValue < Low)
+                Low = Label->IntValue;
+            if(Count == 0 || Label->IntValue > High)
+                High = Label->IntValue;
+            Count++;
+        }
+    }
+
+    return Labels + (SwitchIsDense(Count, Low, High) ? 1 : SwitchSearchLabels(Count));
+}
+
+/*
+ * Count the labels that assembling a tree will take.
+ * A function can then be given its labels before it is assembled,
+ *  and be numbered the same whichever thread assembles it, and when.
+ *
+ * This must agree with AsIf, AsWhile, AsSwitch and AsVectorLoop.
+ */
+int CountLabels(struct ASTNode* Node) {
+    int Profiling = OptProfileGenerate || OptProfileUse, Count = 0;
+
+    if(Node == NULL)
+        return 0;
+
+    switch(Node->Operation) {
+        case OP_IF:
+            Count = 1 + (Node->Right != NULL) + Profiling;
+            break;
+
+        case OP_LOOP:
+            Count = 2 + Profiling;
+            break;
+
+        case OP_VECLOOP:
+            Count = 2;
+            break;
+
+        case OP_SWITCH:
+            // Only the bodies of the cases are assembled, not the cases themselves.
+            Count = SwitchLabels(Node) + CountLabels(Node->Left);
+            for(struct ASTNode* Case = Node->Right; Case != NULL; Case = Case->Right)
+                Count += CountLabels(Case->Left);
+            return Count;
+    }
+
+    return Count + CountLabels(Node->Left) + CountLabels(Node->Middle) + CountLabels(Node->Right);
+}
+
 // Load a value into a register.
 int AsLoad(int Value) {
     int Register = RetrieveRegister();
@@ -526,6 +1222,247 @@ int AsDiv(int Left, int Right) {
     return Left;
 }
 
+// Assemble a %, which idivq leaves in %rdx.
+int AsMod(int Left, int Right) {
+    printf("\tModulo of Registers %s, %s\n", Registers[Left], Registers[Right]);
+    fprintf(OutputFile, "\tmovq\t%s, %%rax\n", Registers[Left]);
+    fprintf(OutputFile, "\tcqo\n");
+    fprintf(OutputFile, "\tidivq\t%s\n", Registers[Right]);
+    fprintf(OutputFile, "\tmovq\t%%rdx, %s\n", Registers[Left]);
+
+    DeallocateRegister(Right);
+
+    return Left;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     S T R E N G T H     R E D U C T I O N     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Is a value a power of two? Returns the power, or -1.
+static int PowerOfTwo(unsigned long Value) {
+    if(Value == 0 || (Value & (Value - 1)))
+        return -1;
+    return __builtin_ctzl(Value);
+}
+
+// Does a value fit in the sign extended 32 bit immediate of most instructions?
+static int FitsImmediate(long Value) {
+    return Value >= -2147483648L && Value <= 2147483647L;
+}
+
+/*
+ * Multiply a register by a constant.
+ * Small factors are built from lea, shifts and adds, which take a cycle each;
+ *  anything else uses the immediate form of imulq, which saves loading the constant.
+ */
+int AsMulConstant(int Register, long Value) {
+    char* Name = Registers[Register];
+    unsigned long Magnitude = Value < 0 ? -(unsigned long) Value : (unsigned long) Value;
+    int Shift, Temp;
+
+    printf("\tMultiplying %s by constant %ld\n", Name, Value);
+
+    if(Value == 0) {
+        fprintf(OutputFile, "\tmovq\t$0, %s\n", Name);
+        return Register;
+    }
+
+    // A power of two, or 3, 5 or 9 times one, is a lea and a shift.
+    Shift = __builtin_ctzl(Magnitude);
+    switch(Magnitude >> Shift) {
+        case 1:
+            break;
+        case 3: case 5: case 9:
+            fprintf(OutputFile, "\tleaq\t(%s,%s,%lu), %s\n", Name, Name, (Magnitude >> Shift) - 1, Name);
+            break;
+        default:
+            Shift = -1;
+    }
+
+    if(Shift >= 0) {
+        if(Shift > 0)
+            fprintf(OutputFile, "\tsalq\t$%d, %s\n", Shift, Name);
+        if(Value < 0)
+            fprintf(OutputFile, "\tnegq\t%s\n", Name);
+        return Register;
+    }
+
+    // One more or one less than a power of two is a shift and an add or subtract.
+    if((Shift = PowerOfTwo(Magnitude - 1)) > 0 || (Shift = PowerOfTwo(Magnitude + 1)) > 0) {
+        Temp = RetrieveRegister();
+        fprintf(OutputFile, "\tmovq\t%s, %s\n", Name, Registers[Temp]);
+        fprintf(OutputFile, "\tsalq\t$%d, %s\n", Shift, Name);
+        fprintf(OutputFile, "\t%s\t%s, %s\n", PowerOfTwo(Magnitude - 1) == Shift ? "addq" : "subq", Registers[Temp], Name);
+        DeallocateRegister(Temp);
+        if(Value < 0)
+            fprintf(OutputFile, "\tnegq\t%s\n", Name);
+        return Register;
+    }
+
+    if(FitsImmediate(Value)) {
+        fprintf(OutputFile, "\timulq\t$%ld, %s, %s\n", Value, Name, Name);
+        return Register;
+    }
+
+    Temp = AsLoad(Value);
+    return AsMul(Temp, Register);
+}
+
+/*
+ * Find the magic number and shift that turn a signed division by a constant
+ *  into a multiply. This is the method of Granlund and Montgomery,
+ *   as given in Hacker's Delight, chapter 10.
+ *
+ * @param Divisor: The constant, which must not be -1, 0 or 1.
+ * @param Shift: Filled in with how far to shift the high half of the product.
+ * @return the magic multiplier.
+ */
+static long DivisionMagic(long Divisor, int* Shift) {
+    const unsigned long Two63 = 1UL << 63;
+    unsigned long AbsDivisor = Divisor < 0 ? -(unsigned long) Divisor : (unsigned long) Divisor;
+    unsigned long Test = Two63 + ((unsigned long) Divisor >> 63);
+    unsigned long AbsNc = Test - 1 - Test % AbsDivisor;
+    unsigned long Q1 = Two63 / AbsNc, R1 = Two63 - Q1 * AbsNc;
+    unsigned long Q2 = Two63 / AbsDivisor, R2 = Two63 - Q2 * AbsDivisor;
+    unsigned long Delta;
+    int Power = 63;
+    long Magic;
+
+    do {
+        Power++;
+        Q1 = 2 * Q1; R1 = 2 * R1;
+        if(R1 >= AbsNc) { Q1++; R1 -= AbsNc; }
+        Q2 = 2 * Q2; R2 = 2 * R2;
+        if(R2 >= AbsDivisor) { Q2++; R2 -= AbsDivisor; }
+        Delta = AbsDivisor - R2;
+    } while(Q1 < Delta || (Q1 == Delta && R1 == 0));
+
+    Magic = Q2 + 1;
+    if(Divisor < 0)
+        Magic = -Magic;
+
+    *Shift = Power - 64;
+    return Magic;
+}
+
+/*
+ * Divide a register by a constant, or take the remainder, without idivq.
+ * Like AsDiv, this uses %rax and %rdx as scratch.
+ *
+ * @param Register: The dividend, which gets the result.
+ * @param Divisor: The constant to divide by.
+ * @param Modulo: Whether we want the remainder instead of the quotient.
+ * @return the Register, or -1 if the divisor needs a real idivq.
+ */
+static int AsDivConstant(int Register, long Divisor, int Modulo) {
+    char* Name = Registers[Register];
+    unsigned long Magnitude = Divisor < 0 ? -(unsigned long) Divisor : (unsigned long) Divisor;
+    int Power = PowerOfTwo(Magnitude), Shift;
+    long Magic;
+
+    // Dividing by zero must still trap, and the most negative number has no magnitude.
+    if(Divisor == 0 || Power == 63)
+        return -1;
+
+    printf("\t%s of %s by constant %ld\n", Modulo ? "Modulo" : "Dividing", Name, Divisor);
+
+    if(Magnitude == 1) {
+        if(Modulo)
+            fprintf(OutputFile, "\tmovq\t$0, %s\n", Name);
+        else if(Divisor < 0)
+            fprintf(OutputFile, "\tnegq\t%s\n", Name);
+        return Register;
+    }
+
+    if(Power > 0) {
+        // Shifting rounds down, so negative dividends are biased by Magnitude - 1 to round towards zero.
+        fprintf(OutputFile, "\tmovq\t%s, %%rax\n", Name);
+        if(Power > 1)
+            fprintf(OutputFile, "\tsarq\t$63, %%rax\n");
+        fprintf(OutputFile, "\tshrq\t$%d, %%rax\n", 64 - Power);
+        fprintf(OutputFile, "\taddq\t%s, %%rax\n", Name);
+
+        if(Modulo) {
+            // Clearing the low bits of the biased value leaves the quotient times the divisor.
+            if(Power <= 31) {
+                fprintf(OutputFile, "\tandq\t$%ld, %%rax\n", -(1L << Power));
+            } else {
+                fprintf(OutputFile, "\tmovabsq\t$%ld, %%rdx\n", -(1L << Power));
+                fprintf(OutputFile, "\tandq\t%%rdx, %%rax\n");
+            }
+            fprintf(OutputFile, "\tsubq\t%%rax, %s\n", Name);
+            return Register;
+        }
+
+        fprintf(OutputFile, "\tsarq\t$%d, %%rax\n", Power);
+        if(Divisor < 0)
+            fprintf(OutputFile, "\tnegq\t%%rax\n");
+        fprintf(OutputFile, "\tmovq\t%%rax, %s\n", Name);
+        return Register;
+    }
+
+    // The quotient is the high half of the product with the magic number, corrected and shifted.
+    Magic = DivisionMagic(Divisor, &Shift);
+
+    fprintf(OutputFile, "\tmovabsq\t$%ld, %%rax\n", Magic);
+    fprintf(OutputFile, "\timulq\t%s\n", Name);
+    if(Divisor > 0 && Magic < 0)
+        fprintf(OutputFile, "\taddq\t%s, %%rdx\n", Name);
+    if(Divisor < 0 && Magic > 0)
+        fprintf(OutputFile, "\tsubq\t%s, %%rdx\n", Name);
+    if(Shift > 0)
+        fprintf(OutputFile, "\tsarq\t$%d, %%rdx\n", Shift);
+
+    // Add one if the quotient is negative, to round towards zero.
+    fprintf(OutputFile, "\tmovq\t%%rdx, %%rax\n");
+    fprintf(OutputFile, "\tshrq\t$63, %%rax\n");
+    fprintf(OutputFile, "\taddq\t%%rax, %%rdx\n");
+
+    if(Modulo) {
+        if(FitsImmediate(Divisor)) {
+            fprintf(OutputFile, "\timulq\t$%ld, %%rdx, %%rdx\n", Divisor);
+        } else {
+            fprintf(OutputFile, "\tmovabsq\t$%ld, %%rax\n", Divisor);
+            fprintf(OutputFile, "\timulq\t%%rax, %%rdx\n");
+        }
+        fprintf(OutputFile, "\tsubq\t%%rdx, %s\n", Name);
+    } else {
+        fprintf(OutputFile, "\tmovq\t%%rdx, %s\n", Name);
+    }
+
+    return Register;
+}
+
+/*
+ * Assemble a multiply, divide or modulo where one side is a constant.
+ *
+ * @return the Register holding the result, or -1 if there is no constant
+ *  to take advantage of, and the normal path should be used.
+ */
+int AsArithmeticByConstant(struct ASTNode* Node) {
+    struct ASTNode* Variable = Node->Left;
+    long Value;
+    int Register;
+
+    // Multiplication goes either way around.
+    if(!ConstantValue(Node->Right, &Value)) {
+        if(Node->Operation != OP_MULTIPLY || !ConstantValue(Node->Left, &Value))
+            return -1;
+        Variable = Node->Right;
+    }
+
+    if(Node->Operation != OP_MULTIPLY && (Value == 0 || Value == (long) (1UL << 63)))
+        return -1;
+
+    Register = AssembleTree(Variable, -1, Node->Operation);
+
+    if(Node->Operation == OP_MULTIPLY)
+        return AsMulConstant(Register, Value);
+
+    return AsDivConstant(Register, Value, Node->Operation == OP_MODULO);
+}
+
 // Assemble an ASL
 int AsShl(int Register, int Val) {
     printf("\tShifting %s to the left by %d bits.\n", Registers[Register], Val);
@@ -647,6 +1584,11 @@ int AsStrGlobalVar(struct SymbolTableEntry* Entry, int Register) {
 int AsLdLocalVar(struct SymbolTableEntry* Entry, int Operation) {
     int Reg = RetrieveRegister();
 
+    // Incrementing in place reads and writes the local once more.
+    int InPlace = Operation == OP_PREINC || Operation == OP_PREDEC || Operation == OP_POSTINC || Operation == OP_POSTDEC;
+    TallyFunction(STAT_LOADS, 1 + InPlace);
+    TallyFunction(STAT_STORES, InPlace);
+
     printf("\tStoring the var at %d's contents into %s, locally\n", Entry->SinkOffset, Registers[Reg]);
     
     int TypeSize = PrimitiveSize(Entry->Type);
@@ -722,6 +1664,7 @@ int AsLdLocalVar(struct SymbolTableEntry* Entry, int Operation) {
  */
 int AsStrLocalVar(struct SymbolTableEntry* Entry, int Register) {
     printf("\tStoring contents of %s into %s, type %d, locally\n", Registers[Register], Entry->Name, Entry->Type);
+    TallyFunction(STAT_STORES, 1);
 
     int TypeSize = PrimitiveSize(Entry->Type);
     switch(TypeSize) {
@@ -764,9 +1707,9 @@ int AsDeref(int Reg, int Type) {
         case 1:
             fprintf(OutputFile, "\tmovzbq\t(%s), %s\n", Registers[Reg], Registers[Reg]);
             break;
-        case 2:
-            fprintf(OutputFile, "\tmovslq\t(%s), %s\n", Registers[Reg], Registers[Reg]);
         case 4:
+            fprintf(OutputFile, "\tmovslq\t(%s), %s\n", Registers[Reg], Registers[Reg]);
+            break;
         case 8:
             fprintf(OutputFile, "\tmovq\t(%s), %s\n", Registers[Reg], Registers[Reg]);
             break;
@@ -786,6 +1729,8 @@ int AsStrDeref(int Register1, int Register2, int Type) {
             fprintf(OutputFile, "\tmovb\t%s, (%s)\n", ByteRegisters[Register1], Registers[Register2]);
             break;
         case RET_INT:
+            fprintf(OutputFile, "\tmovl\t%s, (%s)\n", DoubleRegisters[Register1], Registers[Register2]);
+            break;
         case RET_LONG:
             fprintf(OutputFile, "\tmovq\t%s, (%s)\n", Registers[Register1], Registers[Register2]);
             break;
@@ -803,23 +1748,38 @@ void AsGlobalSymbol(struct SymbolTableEntry* Entry) {
     if(Entry->Structure == ST_FUNC) return;
 
 
-    int Size = TypeSize(Entry->Type, Entry->CompositeType);
+    int Size;
+    unsigned char* Contents = EvaluatedGlobal(Entry);
 
-    fprintf(OutputFile, "\t.data\n"
-                        "\t.globl\t%s\n",
-                                          Entry->Name);
+    // Arrays are stored as a pointer to their first element, but we need room for all of them.
+    if(Entry->Structure == ST_ARR)
+        Size = PrimitiveSize(ValueAt(Entry->Type)) * Entry->Length;
+    else
+        Size = TypeSize(Entry->Type, Entry->CompositeType);
+
+    // Globals start as zero, so they all live in their own bss section.
+    // That way the linker can throw away the ones nothing uses.
+    // Those worked out at compile time go in data instead, with their contents.
+    if(Contents)
+        fprintf(OutputFile, "\t.section\t.data.%s,\"w\"\n", Entry->Name);
+    else
+        fprintf(OutputFile, "\t.section\t.bss.%s,\"bw\"\n", Entry->Name);
+    fprintf(OutputFile, "\t.balign\t%d\n", Size >= 8 ? 8 : Size >= 4 ? 4 : 1);
+    if(SymbolIsExported(Entry))
+        fprintf(OutputFile, "\t.globl\t%s\n", Entry->Name);
 
     fprintf(OutputFile, "%s:\n", Entry->Name);
-    
-    switch(Size) {
-        case 1: fprintf(OutputFile, "\t.byte\t0\r\n", Entry->Name); break;
-        case 4: fprintf(OutputFile, "\t.long\t0\r\n", Entry->Name); break;
-        case 8: fprintf(OutputFile, "\t.quad\t0\r\n", Entry->Name); break;
-        default:
-            for(int i = 0; i < Size; i++)
-                fprintf(OutputFile, "\t.byte\t0\n");
+    if(Contents == NULL) {
+        fprintf(OutputFile, "\t.zero\t%d\n", Size);
+        return;
     }
-    
+
+    for(int i = 0; i < Size; i++) {
+        fprintf(OutputFile, i % 16 == 0 ? "\t.byte\t%d" : ", %d", Contents[i]);
+        if(i % 16 == 15 || i == Size - 1)
+            fprintf(OutputFile, "\n");
+    }
+
 }
 
 // Assemble a function call, with all associated parameter bumping and stack movement.
@@ -843,7 +1803,7 @@ void AsCopyArgs(int Register, int Position) {
     if(Position > 4) { // Args above 4 go on the stack
         fprintf(OutputFile, "\tpushq\t%s\n", Registers[Register]);
     } else {
-        fprintf(OutputFile, "\tmovq\t%s, %s\n", Registers[Register], Registers[10 - Position]);
+        fprintf(OutputFile, "\tmovq\t%s, %s\n", Registers[Register], Registers[8 - Position]);
     }
 }
 
@@ -856,6 +1816,8 @@ int AsCall(struct SymbolTableEntry* Entry, int Args) {
     printf("\t\tCalling function %s with %d parameters\n", Entry->Name, Args);
     printf("\t\t\tFunction returns into %s\n", Registers[OutRegister]);
 
+    TallyFunction(STAT_CALLS, 1);
+    UseRuntime(Entry->Name);
     fprintf(OutputFile, "\tcall\t%s\n", Entry->Name);
     if(Args > 4)
         fprintf(OutputFile, "\taddq\t$%d, %%rsp\n", 8 * (Args - 4));
@@ -876,7 +1838,7 @@ int AsReturn(struct SymbolTableEntry* Entry, int Register) {
             break;
         
         case RET_INT:
-            fprintf(OutputFile, "\tmovl\t%s, %%eax\n", DoubleRegisters[Register]);
+            fprintf(OutputFile, "\tmovslq\t%s, %%rax\n", DoubleRegisters[Register]);
             break;
         
         case RET_LONG:
@@ -934,6 +1896,7 @@ void AssemblerPrint(int Register) {
 
     fprintf(OutputFile, "\tmovq\t%s, %%rcx\n", Registers[Register]);
     //fprintf(OutputFile, "\tleaq\t.LC0(%%rip), %%rcx\n");
+    UseRuntime("PrintInteger");
     fprintf(OutputFile, "\tcall\tPrintInteger\n");
 
     DeallocateRegister(Register);
@@ -1004,7 +1967,7 @@ int AsBooleanConvert(int Register, int Operation, int Label) {
     switch(Operation) {
         case OP_IF:
         case OP_LOOP:
-            fprintf(OutputFile, "\tje\tL%d\n", Label);
+            fprintf(OutputFile, "\t%s\tL%d\n", BranchOnTrue ? "jne" : "je", Label);
             break;
         default:
             fprintf(OutputFile, "\tsetnz\t%s\n", ByteRegisters[Register]);
@@ -1025,6 +1988,47 @@ void AssemblerPreamble() {
             OutputFile);
 }
 
+/*
+ * Assemble a whole function.
+ * Under -O, it is assembled into a buffer first, so the scheduler can reorder it.
+ */
+int AsFunction(struct ASTNode* Node) {
+    FILE* Output = OutputFile;
+    long Start = ftell(Output);
+
+    if(OptOptimise && (OutputFile = tmpfile()) == NULL)
+        Die("Unable to create a buffer for the scheduler");
+
+    AsFunctionPreamble(Node->Symbol);
+    AssembleTree(Node->Left, -1, Node->Operation);
+    AsFunctionEpilogue(Node->Symbol);
+
+    if(OptOptimise) {
+        PhaseStart(PHASE_SCHEDULE);
+        ScheduleFunction(OutputFile, Output, Node->Symbol);
+        PhaseEnd(PHASE_SCHEDULE);
+        fclose(OutputFile);
+        OutputFile = Output;
+    }
+
+    if(CountingFunction())
+        TallyFunction(STAT_INSTRUCTIONS, InstructionsFrom(Output, Start));
+
+    return -1;
+}
+
+/*
+ * Switch to the section of a function.
+ * Each function gets its own, so the linker can drop it
+ *  with --gc-sections if nothing calls it.
+ * 
+ * @param Entry: The function whose code follows
+ */
+void AsFunctionSection(struct SymbolTableEntry* Entry) {
+    InColdSection = 0;
+    fprintf(OutputFile, "\t.section\t.text.%s,\"x\"\n", Entry->Name);
+}
+
 /*
  * Assemble a function block for the Entry.
  * Handles all stack logic for local variables,
@@ -1037,18 +2041,20 @@ void AssemblerPreamble() {
 void AsFunctionPreamble(struct SymbolTableEntry* Entry) {
     char* Name = Entry->Name;
     struct SymbolTableEntry* Param, *Local;
-    int ParamOffset = 0, ParamReg = 9, ParamCount = 0;
+    int ParamOffset = 16, ParamReg = 7, ParamCount = 0;
 
     LocalVarOffset = 4; // Prepare parameters
 
+    AsFunctionSection(Entry);
+    // Storage class 2 is external, 3 is static.
+    if(SymbolIsExported(Entry))
+        fprintf(OutputFile, "\t.globl\t%s\n", Name);
     fprintf(OutputFile,
-            "\t.text\n"
-            "\t.globl\t%s\n"
-            "\t.def\t%s; .scl 2; .type 32; .endef\n"
+            "\t.def\t%s; .scl %d; .type 32; .endef\n"
             "%s:\n"
             "\tpushq\t%%rbp\n"
             "\tmovq\t%%rsp, %%rbp\r\n",
-            Name, Name, Name);
+            Name, SymbolIsExported(Entry) ? 2 : 3, Name);
     
     //PECOFF requires we call the global initialisers
     if(!strcmp(Name, "main"))
@@ -1057,15 +2063,16 @@ void AsFunctionPreamble(struct SymbolTableEntry* Entry) {
     // Need to share this between two loops. Fun.
     int LoopIndex;
 
-    // If we have parameters, move them to the last 4 registers
+    // The first 4 parameters arrive in the last 4 registers, so we spill them into the frame.
+    // The rest were pushed by the caller, and sit above the return address.
     for(Param = Entry->Start, ParamCount = 1; Param != NULL; Param = Param->NextSymbol, ParamCount++) {
         if(ParamCount > 4) { // We only have 4 argument registers
             Param->SinkOffset = ParamOffset;
             ParamOffset += 8;
+            continue;
         }
 
-        Entry->SinkOffset = AsCalcOffset(Param->Type);
-        AsStrLocalVar(Param, ParamReg--);
+        Param->SinkOffset = AsCalcOffset(Param->Type);
     }
 
     // If we have more parameters, move them to the stack
@@ -1075,9 +2082,16 @@ void AsFunctionPreamble(struct SymbolTableEntry* Entry) {
 
     // With all the parameters on the stack, we can allocate the shadow space
     StackFrameOffset = ((LocalVarOffset + 31) & ~31);
+    TallyFunction(STAT_FRAME, StackFrameOffset);
     fprintf(OutputFile, 
             "\taddq\t$%d, %%rsp\n", -StackFrameOffset);
 
+    // Now there's room, spill the register parameters.
+    for(Param = Entry->Start, ParamCount = 1; Param != NULL && ParamCount <= 4; Param = Param->NextSymbol, ParamCount++) {
+        TallyFunction(STAT_SPILLS, 1);
+        AsStrLocalVar(Param, ParamReg--);
+    }
+
 }
 
 
@@ -1086,8 +2100,530 @@ void AsFunctionEpilogue(struct SymbolTableEntry* Entry) {
     AsLabel(Entry->EndLabel);
 
     fprintf(OutputFile,
-            "\tpopq\t%%rbp\n"
             "\taddq\t$%d, %%rsp\n"
+            "\tpopq\t%%rbp\n"
             "\tret\n",
             StackFrameOffset);
-}
\ No newline at end of file
+}
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     V E C T O R     G E N E R A T I O N     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * SSE2 names its integer instructions by the size of the element;
+ *  paddb, paddd, paddq and so on.
+ */
+static char VectorSuffix(int Size) {
+    switch(Size) {
+        case 1: return 'b';
+        case 4: return 'd';
+        case 8: return 'q';
+        default:
+            DieDecimal("Can't vectorise elements of size", Size);
+    }
+    return 0;
+}
+
+/*
+ * Copy the value in a register into every lane of a vector register.
+ * @param Register: The Registers index of the value. It is deallocated.
+ * @param Size: The size of each lane, in bytes.
+ * @return the VectorRegisters index holding the result.
+ */
+int AsVectorBroadcast(int Register, int Size) {
+    int Vector = RetrieveVectorRegister();
+
+    printf("\tBroadcasting %s into %s\n", Registers[Register], VectorRegisters[Vector]);
+    switch(Size) {
+        case 1:
+            // Double the byte up into a word, then a dword, then spread that.
+            fprintf(OutputFile, "\tmovd\t%s, %s\n", DoubleRegisters[Register], VectorRegisters[Vector]);
+            fprintf(OutputFile, "\tpunpcklbw\t%s, %s\n", VectorRegisters[Vector], VectorRegisters[Vector]);
+            fprintf(OutputFile, "\tpunpcklwd\t%s, %s\n", VectorRegisters[Vector], VectorRegisters[Vector]);
+            fprintf(OutputFile, "\tpshufd\t$0, %s, %s\n", VectorRegisters[Vector], VectorRegisters[Vector]);
+            break;
+        case 4:
+            fprintf(OutputFile, "\tmovd\t%s, %s\n", DoubleRegisters[Register], VectorRegisters[Vector]);
+            fprintf(OutputFile, "\tpshufd\t$0, %s, %s\n", VectorRegisters[Vector], VectorRegisters[Vector]);
+            break;
+        case 8:
+            fprintf(OutputFile, "\tmovq\t%s, %s\n", Registers[Register], VectorRegisters[Vector]);
+            fprintf(OutputFile, "\tpunpcklqdq\t%s, %s\n", VectorRegisters[Vector], VectorRegisters[Vector]);
+            break;
+        default:
+            DieDecimal("Can't broadcast elements of size", Size);
+    }
+
+    DeallocateRegister(Register);
+    return Vector;
+}
+
+/*
+ * Load the 16 bytes of an array starting at an index.
+ * @param Entry: The array to load from
+ * @param Index: The Registers index holding the element index
+ * @param Size: The size of each element
+ * @return the VectorRegisters index holding the elements
+ */
+int AsVectorLoad(struct SymbolTableEntry* Entry, int Index, int Size) {
+    int Base = AsAddr(Entry);
+    int Vector = RetrieveVectorRegister();
+
+    fprintf(OutputFile, "\tmovdqu\t(%s,%s,%d), %s\n", Registers[Base], Registers[Index], Size, VectorRegisters[Vector]);
+
+    DeallocateRegister(Base);
+    return Vector;
+}
+
+/*
+ * Store 16 bytes into an array starting at an index.
+ * @param Entry: The array to store into
+ * @param Vector: The VectorRegisters index holding the elements. It is deallocated.
+ * @param Index: The Registers index holding the element index
+ * @param Size: The size of each element
+ */
+void AsVectorStore(struct SymbolTableEntry* Entry, int Vector, int Index, int Size) {
+    int Base = AsAddr(Entry);
+
+    fprintf(OutputFile, "\tmovdqu\t%s, (%s,%s,%d)\n", VectorRegisters[Vector], Registers[Base], Registers[Index], Size);
+
+    DeallocateRegister(Base);
+    DeallocateVectorRegister(Vector);
+}
+
+/*
+ * Assemble one of the lane-wise operations that every vector type supports.
+ * @param Operation: The SyntaxOps entry to perform
+ * @param Left: The VectorRegisters index of the left operand, which receives the result
+ * @param Right: The VectorRegisters index of the right operand. It is deallocated.
+ * @param Size: The size of each lane
+ * @return the VectorRegisters index holding the result
+ */
+int AsVectorBinary(int Operation, int Left, int Right, int Size) {
+    char Suffix = VectorSuffix(Size);
+
+    switch(Operation) {
+        case OP_ADD:
+            fprintf(OutputFile, "\tpadd%c\t%s, %s\n", Suffix, VectorRegisters[Right], VectorRegisters[Left]);
+            break;
+        case OP_SUBTRACT:
+            fprintf(OutputFile, "\tpsub%c\t%s, %s\n", Suffix, VectorRegisters[Right], VectorRegisters[Left]);
+            break;
+        case OP_BITAND:
+            fprintf(OutputFile, "\tpand\t%s, %s\n", VectorRegisters[Right], VectorRegisters[Left]);
+            break;
+        case OP_BITOR:
+            fprintf(OutputFile, "\tpor\t%s, %s\n", VectorRegisters[Right], VectorRegisters[Left]);
+            break;
+        case OP_BITXOR:
+            fprintf(OutputFile, "\tpxor\t%s, %s\n", VectorRegisters[Right], VectorRegisters[Left]);
+            break;
+        default:
+            DieDecimal("Can't vectorise operation", Operation);
+    }
+
+    DeallocateVectorRegister(Right);
+    return Left;
+}
+
+// Assemble a lane-wise ~
+int AsVectorInvert(int Vector) {
+    // XOR with all ones; comparing a register with itself is the quickest way to get them.
+    int Ones = RetrieveVectorRegister();
+    fprintf(OutputFile, "\tpcmpeqd\t%s, %s\n", VectorRegisters[Ones], VectorRegisters[Ones]);
+    fprintf(OutputFile, "\tpxor\t%s, %s\n", VectorRegisters[Ones], VectorRegisters[Vector]);
+    DeallocateVectorRegister(Ones);
+    return Vector;
+}
+
+/*
+ * Assemble an expression a vector at a time.
+ * The Vectoriser has already checked that the tree only contains things
+ *  we know how to do here, so anything without an array access in it is a scalar
+ *  that is the same in every lane.
+ *
+ * @param Node: The expression to assemble
+ * @param Induction: The variable the arrays are indexed by
+ * @param Index: The Registers index holding its value
+ * @param Size: The size of each element
+ * @return the VectorRegisters index holding the result
+ */
+int AsVectorExpression(struct ASTNode* Node, struct SymbolTableEntry* Induction, int Index, int Size) {
+    struct SymbolTableEntry* Array;
+    int Left, Right;
+
+    if((Array = VectorArrayAccess(Node, Induction)) != NULL)
+        return AsVectorLoad(Array, Index, Size);
+
+    if(!TreeContainsOperation(Node, OP_DEREF))
+        return AsVectorBroadcast(AssembleTree(Node, -1, OP_VECLOOP), Size);
+
+    Left = AsVectorExpression(Node->Left, Induction, Index, Size);
+
+    if(Node->Operation == OP_BITNOT)
+        return AsVectorInvert(Left);
+
+    Right = AsVectorExpression(Node->Right, Induction, Index, Size);
+    return AsVectorBinary(Node->Operation, Left, Right, Size);
+}
+
+/*
+ * Assemble each array store in a vectorised loop body.
+ */
+static void AsVectorStatements(struct ASTNode* Node, struct SymbolTableEntry* Induction, int Index, int Size) {
+    int Vector;
+
+    if(Node->Operation == OP_COMP) {
+        AsVectorStatements(Node->Left, Induction, Index, Size);
+        AsVectorStatements(Node->Right, Induction, Index, Size);
+        return;
+    }
+
+    Vector = AsVectorExpression(Node->Left, Induction, Index, Size);
+    AsVectorStore(VectorArrayAccess(Node->Right, Induction), Vector, Index, Size);
+}
+
+/*
+ * Assemble a vectorised loop.
+ * It runs 16 bytes' worth of iterations at a time, for as long as all of them
+ *  would pass the loop condition, and then drops into the original loop
+ *  to finish off whatever is left.
+ *
+ * @param Node: The OP_VECLOOP built by the Vectoriser
+ */
+int AsVectorLoop(struct ASTNode* Node) {
+    int VectorLabel, RemainderLabel;
+    int Index, Bound, Limit;
+    int Lanes = 16 / Node->Size;
+    struct SymbolTableEntry* Induction = Node->Symbol;
+
+    VectorLabel = NewLabel();
+    RemainderLabel = NewLabel();
+
+    printf("\tInitiating %d-lane vector loop between labels %d and %d\n", Lanes, VectorLabel, RemainderLabel);
+
+    AsLabel(VectorLabel);
+
+    if(Induction->Storage == SC_LOCAL || Induction->Storage == SC_PARAM)
+        Index = AsLdLocalVar(Induction, REF_IDENT);
+    else
+        Index = AsLdGlobalVar(Induction, REF_IDENT);
+
+    // The last lane must still pass the condition, or we finish up one at a time.
+    Bound = AssembleTree(Node->Left->Right, -1, Node->Operation);
+    Limit = RetrieveRegister();
+    fprintf(OutputFile, "\tleaq\t%d(%s), %s\n", Lanes - 1, Registers[Index], Registers[Limit]);
+    fprintf(OutputFile, "\tcmpq\t%s, %s\n", Registers[Bound], Registers[Limit]);
+    fprintf(OutputFile, "\t%s\tL%d\n", InvComparisons[Node->Left->Operation - OP_EQUAL], RemainderLabel);
+    DeallocateRegister(Limit);
+    DeallocateRegister(Bound);
+
+    AsVectorStatements(Node->Middle, Induction, Index, Node->Size);
+
+    fprintf(OutputFile, "\taddq\t$%d, %s\n", Lanes, Registers[Index]);
+    if(Induction->Storage == SC_LOCAL || Induction->Storage == SC_PARAM)
+        AsStrLocalVar(Induction, Index);
+    else
+        AsStrGlobalVar(Induction, Index);
+    DeallocateAllRegisters();
+
+    AsJmp(VectorLabel);
+
+    // The original loop handles the rest.
+    AsLabel(RemainderLabel);
+    AssembleTree(Node->Right, -1, Node->Operation);
+    DeallocateAllRegisters();
+
+    return -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     V E C T O R     V A R I A B L E S     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Load a vector variable into a vector register.
+int AsLdVectorVar(struct SymbolTableEntry* Entry) {
+    int Vector = RetrieveVectorRegister();
+
+    printf("\tLoading vector %s into %s\n", Entry->Name, VectorRegisters[Vector]);
+    if(Entry->Storage == SC_LOCAL || Entry->Storage == SC_PARAM) {
+        TallyFunction(STAT_LOADS, 1);
+        fprintf(OutputFile, "\tmovdqu\t%d(%%rbp), %s\n", Entry->SinkOffset, VectorRegisters[Vector]);
+    } else
+        fprintf(OutputFile, "\tmovdqu\t%s(%%rip), %s\n", Entry->Name, VectorRegisters[Vector]);
+
+    return Vector;
+}
+
+// Store a vector register into a vector variable.
+int AsStrVectorVar(struct SymbolTableEntry* Entry, int Vector) {
+    printf("\tStoring %s into vector %s\n", VectorRegisters[Vector], Entry->Name);
+    if(Entry->Storage == SC_LOCAL || Entry->Storage == SC_PARAM) {
+        TallyFunction(STAT_STORES, 1);
+        fprintf(OutputFile, "\tmovdqu\t%s, %d(%%rbp)\n", VectorRegisters[Vector], Entry->SinkOffset);
+    } else
+        fprintf(OutputFile, "\tmovdqu\t%s, %s(%%rip)\n", VectorRegisters[Vector], Entry->Name);
+
+    return Vector;
+}
+
+/*
+ * Assemble the multiplication of two i32x4s.
+ * SSE2 can only multiply the even lanes into 64-bit results, so we do the
+ *  even and odd lanes separately, and stitch the low halves back together.
+ */
+static int AsVectorMultiply(int Left, int Right) {
+    int Even = RetrieveVectorRegister();
+
+    fprintf(OutputFile, "\tmovdqa\t%s, %s\n", VectorRegisters[Left], VectorRegisters[Even]);
+    fprintf(OutputFile, "\tpmuludq\t%s, %s\n", VectorRegisters[Right], VectorRegisters[Even]);
+    fprintf(OutputFile, "\tpsrlq\t$32, %s\n", VectorRegisters[Left]);
+    fprintf(OutputFile, "\tpsrlq\t$32, %s\n", VectorRegisters[Right]);
+    fprintf(OutputFile, "\tpmuludq\t%s, %s\n", VectorRegisters[Right], VectorRegisters[Left]);
+    fprintf(OutputFile, "\tpshufd\t$8, %s, %s\n", VectorRegisters[Even], VectorRegisters[Even]);
+    fprintf(OutputFile, "\tpshufd\t$8, %s, %s\n", VectorRegisters[Left], VectorRegisters[Left]);
+    fprintf(OutputFile, "\tpunpckldq\t%s, %s\n", VectorRegisters[Left], VectorRegisters[Even]);
+
+    DeallocateVectorRegister(Left);
+    DeallocateVectorRegister(Right);
+    return Even;
+}
+
+/*
+ * Assemble a lane-wise comparison.
+ * Each lane of the result is all ones if the comparison holds, and all zeroes if not.
+ * SSE2 only has equal and greater-than, so the rest are built from those.
+ */
+static int AsVectorCompare(int Operation, int Left, int Right, char Suffix) {
+    int Result = Left;
+
+    switch(Operation) {
+        case OP_EQUAL:
+        case OP_INEQ:
+            fprintf(OutputFile, "\tpcmpeq%c\t%s, %s\n", Suffix, VectorRegisters[Right], VectorRegisters[Left]);
+            DeallocateVectorRegister(Right);
+            break;
+        case OP_GREAT:
+        case OP_LESSE:
+            fprintf(OutputFile, "\tpcmpgt%c\t%s, %s\n", Suffix, VectorRegisters[Right], VectorRegisters[Left]);
+            DeallocateVectorRegister(Right);
+            break;
+        case OP_LESS:
+        case OP_GREATE:
+            fprintf(OutputFile, "\tpcmpgt%c\t%s, %s\n", Suffix, VectorRegisters[Left], VectorRegisters[Right]);
+            DeallocateVectorRegister(Left);
+            Result = Right;
+            break;
+    }
+
+    if(Operation == OP_INEQ || Operation == OP_LESSE || Operation == OP_GREATE)
+        AsVectorInvert(Result);
+
+    return Result;
+}
+
+/*
+ * Assemble an operation whose result is a vector.
+ * AssembleTree has already assembled the children into Left and Right;
+ *  vector values are held in VectorRegisters, scalars and addresses in Registers.
+ *
+ * @param Node: The node to assemble
+ * @param Left: The register holding the left child, if any
+ * @param Right: The register holding the right child, if any
+ * @param ParentOp: The Operation of the parent of this Node
+ * @return the VectorRegisters index holding the result
+ */
+int AsVectorOperation(struct ASTNode* Node, int Left, int Right, int ParentOp) {
+    int Size = PrimitiveSize(VectorElementType(Node->ExprType));
+    char Suffix = VectorSuffix(Size);
+    int Vector;
+
+    switch(Node->Operation) {
+        case REF_IDENT:
+            return Node->RVal ? AsLdVectorVar(Node->Symbol) : -1;
+
+        case OP_DEREF:
+            if(!Node->RVal)
+                return Left;
+            Vector = RetrieveVectorRegister();
+            fprintf(OutputFile, "\tmovdqu\t(%s), %s\n", Registers[Left], VectorRegisters[Vector]);
+            DeallocateRegister(Left);
+            return Vector;
+
+        case OP_ASSIGN:
+            switch(Node->Right->Operation) {
+                case REF_IDENT:
+                    return AsStrVectorVar(Node->Right->Symbol, Left);
+                case OP_DEREF:
+                    fprintf(OutputFile, "\tmovdqu\t%s, (%s)\n", VectorRegisters[Left], Registers[Right]);
+                    DeallocateRegister(Right);
+                    return Left;
+            }
+            break;
+
+        case OP_ADD: case OP_SUBTRACT:
+        case OP_BITAND: case OP_BITOR: case OP_BITXOR:
+            return AsVectorBinary(Node->Operation, Left, Right, Size);
+
+        case OP_MULTIPLY:
+            return AsVectorMultiply(Left, Right);
+
+        case OP_BITNOT:
+            return AsVectorInvert(Left);
+
+        case OP_NEGATE:
+            Vector = RetrieveVectorRegister();
+            fprintf(OutputFile, "\tpxor\t%s, %s\n", VectorRegisters[Vector], VectorRegisters[Vector]);
+            return AsVectorBinary(OP_SUBTRACT, Vector, Left, Size);
+
+        case OP_SHIFTL:
+        case OP_SHIFTR:
+            // The count goes in the low quad of another vector register.
+            Vector = RetrieveVectorRegister();
+            fprintf(OutputFile, "\tmovq\t%s, %s\n", Registers[Right], VectorRegisters[Vector]);
+            fprintf(OutputFile, "\t%s%c\t%s, %s\n", Node->Operation == OP_SHIFTL ? "psll" : "psrl",
+                Suffix, VectorRegisters[Vector], VectorRegisters[Left]);
+            DeallocateVectorRegister(Vector);
+            DeallocateRegister(Right);
+            return Left;
+
+        case OP_EQUAL: case OP_INEQ:
+        case OP_LESS: case OP_GREAT:
+        case OP_LESSE: case OP_GREATE:
+            if(ParentOp == OP_IF || ParentOp == OP_LOOP)
+                Die("Vector comparisons make masks, and can't be used as a condition");
+            return AsVectorCompare(Node->Operation, Left, Right, Suffix);
+    }
+
+    DieDecimal("Can't assemble vector operation", Node->Operation);
+    return -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     I N T R I N S I C S     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Assemble a call to an intrinsic.
+ * popcount needs popcnt, from SSE4.2 or ABM, which processors since 2008
+ *  have, and everything else is SSE2.
+ * clz and ctz use bsr and bsf, which every x86-64 has, rather than lzcnt
+ *  and tzcnt, which a processor without BMI1 quietly runs as bsr and bsf.
+ *  Those leave a zero alone, so a zero is given the width instead.
+ *
+ * Chars and ints are counted as 32 bits, longs as 64.
+ *
+ * @param Node: The OP_INTRINSIC node
+ * @return the register holding the result, in Registers or VectorRegisters
+ *  depending on the type of the result.
+ */
+int AsIntrinsic(struct ASTNode* Node) {
+    int Value, Other, Lane;
+    int Wide = Node->Left->ExprType == RET_LONG;
+
+    Value = AssembleTree(Node->Left, -1, Node->Operation);
+
+    switch(Node->IntValue) {
+        case IN_POPCOUNT:
+            if(Wide)
+                fprintf(OutputFile, "\tpopcntq\t%s, %s\n", Registers[Value], Registers[Value]);
+            else
+                fprintf(OutputFile, "\tpopcntl\t%s, %s\n", DoubleRegisters[Value], DoubleRegisters[Value]);
+            return Value;
+
+        // The highest set bit, from the top, is its index xor'd with the top bit's.
+        // A zero gets twice the width less one, which that turns into the width.
+        case IN_CLZ:
+            Other = RetrieveRegister();
+            if(Wide) {
+                fprintf(OutputFile, "\tmovq\t$127, %s\n", Registers[Other]);
+                fprintf(OutputFile, "\tbsrq\t%s, %s\n", Registers[Value], Registers[Value]);
+                fprintf(OutputFile, "\tcmoveq\t%s, %s\n", Registers[Other], Registers[Value]);
+                fprintf(OutputFile, "\txorq\t$63, %s\n", Registers[Value]);
+            } else {
+                fprintf(OutputFile, "\tmovl\t$63, %s\n", DoubleRegisters[Other]);
+                fprintf(OutputFile, "\tbsrl\t%s, %s\n", DoubleRegisters[Value], DoubleRegisters[Value]);
+                fprintf(OutputFile, "\tcmovel\t%s, %s\n", DoubleRegisters[Other], DoubleRegisters[Value]);
+                fprintf(OutputFile, "\txorl\t$31, %s\n", DoubleRegisters[Value]);
+            }
+            DeallocateRegister(Other);
+            return Value;
+
+        case IN_CTZ:
+            Other = RetrieveRegister();
+            if(Wide) {
+                fprintf(OutputFile, "\tmovq\t$64, %s\n", Registers[Other]);
+                fprintf(OutputFile, "\tbsfq\t%s, %s\n", Registers[Value], Registers[Value]);
+                fprintf(OutputFile, "\tcmoveq\t%s, %s\n", Registers[Other], Registers[Value]);
+            } else {
+                fprintf(OutputFile, "\tmovl\t$32, %s\n", DoubleRegisters[Other]);
+                fprintf(OutputFile, "\tbsfl\t%s, %s\n", DoubleRegisters[Value], DoubleRegisters[Value]);
+                fprintf(OutputFile, "\tcmovel\t%s, %s\n", DoubleRegisters[Other], DoubleRegisters[Value]);
+            }
+            DeallocateRegister(Other);
+            return Value;
+
+        case IN_BSWAP:
+            if(Wide) {
+                fprintf(OutputFile, "\tbswapq\t%s\n", Registers[Value]);
+            } else {
+                fprintf(OutputFile, "\tbswapl\t%s\n", DoubleRegisters[Value]);
+                fprintf(OutputFile, "\tmovslq\t%s, %s\n", DoubleRegisters[Value], Registers[Value]);
+            }
+            return Value;
+
+        case IN_SPLAT:
+            return AsVectorBroadcast(Value, PrimitiveSize(VectorElementType(Node->ExprType)));
+
+        case IN_VLOAD:
+            Other = RetrieveVectorRegister();
+            fprintf(OutputFile, "\tmovdqu\t(%s), %s\n", Registers[Value], VectorRegisters[Other]);
+            DeallocateRegister(Value);
+            return Other;
+
+        case IN_VSTORE:
+            Other = AssembleTree(Node->Right, -1, Node->Operation);
+            fprintf(OutputFile, "\tmovdqu\t%s, (%s)\n", VectorRegisters[Other], Registers[Value]);
+            DeallocateVectorRegister(Other);
+            DeallocateRegister(Value);
+            return -1;
+
+        case IN_VSHUFFLE:
+            fprintf(OutputFile, "\tpshufd\t$%d, %s, %s\n", Node->Right->IntValue, VectorRegisters[Value], VectorRegisters[Value]);
+            return Value;
+
+        case IN_VEXTRACT:
+            Lane = Node->Right->IntValue;
+            Other = RetrieveRegister();
+            switch(Node->ExprType) {
+                case RET_CHAR:
+                    // SSE2 can only extract words, so pick the right half of one.
+                    fprintf(OutputFile, "\tpextrw\t$%d, %s, %s\n", Lane / 2, VectorRegisters[Value], DoubleRegisters[Other]);
+                    if(Lane % 2)
+                        fprintf(OutputFile, "\tshrl\t$8, %s\n", DoubleRegisters[Other]);
+                    fprintf(OutputFile, "\tmovzbq\t%s, %s\n", ByteRegisters[Other], Registers[Other]);
+                    break;
+                case RET_INT:
+                    fprintf(OutputFile, "\tpshufd\t$%d, %s, %s\n", Lane, VectorRegisters[Value], VectorRegisters[Value]);
+                    fprintf(OutputFile, "\tmovd\t%s, %s\n", VectorRegisters[Value], DoubleRegisters[Other]);
+                    fprintf(OutputFile, "\tmovslq\t%s, %s\n", DoubleRegisters[Other], Registers[Other]);
+                    break;
+                case RET_LONG:
+                    if(Lane)
+                        fprintf(OutputFile, "\tpshufd\t$0xEE, %s, %s\n", VectorRegisters[Value], VectorRegisters[Value]);
+                    fprintf(OutputFile, "\tmovq\t%s, %s\n", VectorRegisters[Value], Registers[Other]);
+                    break;
+            }
+            DeallocateVectorRegister(Value);
+            return Other;
+
+        case IN_VMOVEMASK:
+            Other = RetrieveRegister();
+            fprintf(OutputFile, "\tpmovmskb\t%s, %s\n", VectorRegisters[Value], DoubleRegisters[Other]);
+            DeallocateVectorRegister(Value);
+            return Other;
+    }
+
+    DieDecimal("Unknown intrinsic", Node->IntValue);
+    return -1;
+}
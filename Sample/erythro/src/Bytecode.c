@@ -0,0 +1,764 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+#include <limits.h>
+
+/********************************************************************************
+ * The Bytecode backend is the second backend, next to the Assembler.           *
+ *                                                                              *
+ * Under --vm, every function is lowered into bytecode for the VM in VM.c,      *
+ *  instead of being assembled, so a program can be run and checked without    *
+ *  an assembler or linker.                                                     *
+ *                                                                              *
+ * The bytecode works on registers, of which a function may have as many as    *
+ *  it likes:                                                                   *
+ *  * every parameter and local gets a register of its own, from 0 up, in the   *
+ *     order they are declared, so reading a variable costs nothing,            *
+ *  * temporaries are numbered after them, and are all free again at the end    *
+ *     of every statement, like DeallocateAllRegisters.                         *
+ *                                                                              *
+ * Values are always 64 bits wide. They are narrowed when they are stored into  *
+ *  something smaller, and read back the same way the Assembler reads them:     *
+ *  chars are unsigned, and ints are signed.                                    *
+ *                                                                              *
+ * Globals live in memory of their own, so that pointers to them and into      *
+ *  arrays work as they do natively. Functions are called by name, and bound   *
+ *  when the VM starts, either to bytecode or to a library function.            *
+ *                                                                              *
+ ********************************************************************************/
+
+// A global variable, and the memory the VM keeps it in.
+struct BytecodeGlobal {
+    char* Name;
+    void* Memory;
+    struct BytecodeGlobal* Next;
+};
+
+static struct BytecodeGlobal* BytecodeGlobals;
+static struct BytecodeFunction* BytecodeFunctionsEnd;
+static int BytecodeCalleeCapacity;
+
+// The function being lowered.
+static struct BytecodeFunction* Function;
+static struct SymbolTableEntry* FunctionSymbol;
+static int CodeCapacity, ConstantCapacity, SwitchCapacity;
+
+// How many registers belong to variables, and the next free temporary.
+static int LocalCount, NextRegister;
+
+// Labels are numbered per function, and hold the instruction they lead to.
+static int* Labels;
+static int LabelCount, LabelCapacity;
+
+// Conditional jumps, by the compare they make, and the jumps that make the opposite one.
+static int Inverse[6] = { OP_INEQ, OP_EQUAL, OP_GREATE, OP_LESSE, OP_GREAT, OP_LESS };
+
+static int BcTree(struct ASTNode* Node, int ParentOp);
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * * * *     E M I T T I N G     * * * * * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Add an instruction to the end of the function.
+static void BcEmit(int Operation, int A, int B, int C) {
+    if(Function->Length == CodeCapacity) {
+        CodeCapacity = CodeCapacity ? CodeCapacity * 2 : 64;
+        if((Function->Code = realloc(Function->Code, CodeCapacity * sizeof(struct BytecodeInstruction))) == NULL)
+            Die("Unable to allocate bytecode");
+    }
+
+    Function->Code[Function->Length].Operation = Operation;
+    Function->Code[Function->Length].A = A;
+    Function->Code[Function->Length].B = B;
+    Function->Code[Function->Length].C = C;
+    Function->Length++;
+}
+
+// Find or add a constant.
+static int BcConstant(long Value) {
+    for(int i = 0; i < Function->ConstantCount; i++)
+        if(Function->Constants[i] == Value)
+            return i;
+
+    if(Function->ConstantCount == ConstantCapacity) {
+        ConstantCapacity = ConstantCapacity ? ConstantCapacity * 2 : 16;
+        if((Function->Constants = realloc(Function->Constants, ConstantCapacity * sizeof(long))) == NULL)
+            Die("Unable to allocate bytecode constants");
+    }
+
+    Function->Constants[Function->ConstantCount] = Value;
+    return Function->ConstantCount++;
+}
+
+static int BcNewLabel(void) {
+    if(LabelCount == LabelCapacity) {
+        LabelCapacity = LabelCapacity ? LabelCapacity * 2 : 32;
+        if((Labels = realloc(Labels, LabelCapacity * sizeof(int))) == NULL)
+            Die("Unable to allocate bytecode labels");
+    }
+
+    Labels[LabelCount] = -1;
+    return LabelCount++;
+}
+
+// Put a label at the next instruction.
+static void BcLabel(int Label) {
+    Labels[Label] = Function->Length;
+}
+
+// Allocate a temporary register.
+static int BcTemporary(void) {
+    if(++NextRegister > Function->Registers)
+        Function->Registers = NextRegister;
+    return NextRegister - 1;
+}
+
+static int BcIsTemporary(int Register) {
+    return Register >= LocalCount;
+}
+
+// A register to put the result of an operation on Left and Right in; one of theirs, if it can.
+static int BcTarget(int Left, int Right) {
+    if(BcIsTemporary(Left))
+        return Left;
+    if(Right >= 0 && BcIsTemporary(Right))
+        return Right;
+    return BcTemporary();
+}
+
+/*
+ * Copy a value, narrowing it to the size it will be stored as.
+ * Chars are read back unsigned, and ints signed.
+ */
+static void BcNarrow(int Destination, int Source, int Size) {
+    switch(Size) {
+        case 1:
+            BcEmit(BC_TRUNC8, Destination, Source, 0);
+            break;
+        case 4:
+            BcEmit(BC_EXTEND32, Destination, Source, 0);
+            break;
+        default:
+            if(Destination != Source)
+                BcEmit(BC_MOVE, Destination, Source, 0);
+            break;
+    }
+}
+
+// The load and store of a value of each size are in the order 8, 32, 64.
+static int BcSizeIndex(int Size) {
+    switch(Size) {
+        case 1: return 0;
+        case 4: return 1;
+        case 8: return 2;
+        default:
+            DieDecimal("The VM can't move values of size", Size);
+    }
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     S Y M B O L S     &     C A L L S     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Find the memory that holds a global, allocating it the first time.
+ * Globals are found by name, as each translation unit has its own symbols.
+ */
+static long BcGlobal(struct SymbolTableEntry* Entry) {
+    struct BytecodeGlobal* Global;
+    int Size;
+
+    for(Global = BytecodeGlobals; Global != NULL; Global = Global->Next)
+        if(!strcmp(Global->Name, Entry->Name))
+            return (long) Global->Memory;
+
+    if(Entry->Structure == ST_ARR)
+        Size = PrimitiveSize(ValueAt(Entry->Type)) * Entry->Length;
+    else
+        Size = TypeSize(Entry->Type, Entry->CompositeType);
+
+    // Globals always start as zero.
+    if((Global = malloc(sizeof(struct BytecodeGlobal))) == NULL
+        || (Global->Name = strdup(Entry->Name)) == NULL
+        || (Global->Memory = calloc(1, Size > 8 ? Size : 8)) == NULL)
+        Die("Unable to allocate global for the VM");
+
+    // Unless the compiler worked them out already.
+    if(EvaluatedGlobal(Entry))
+        memcpy(Global->Memory, EvaluatedGlobal(Entry), Size);
+
+    Global->Next = BytecodeGlobals;
+    BytecodeGlobals = Global;
+    return (long) Global->Memory;
+}
+
+// Find or add a function to call by name.
+static int BcCallee(char* Name) {
+    for(int i = 0; i < BytecodeCalleeCount; i++)
+        if(!strcmp(BytecodeCallees[i].Name, Name))
+            return i;
+
+    if(BytecodeCalleeCount == BytecodeCalleeCapacity) {
+        BytecodeCalleeCapacity = BytecodeCalleeCapacity ? BytecodeCalleeCapacity * 2 : 32;
+        if((BytecodeCallees = realloc(BytecodeCallees, BytecodeCalleeCapacity * sizeof(struct BytecodeCallee))) == NULL)
+            Die("Unable to allocate bytecode callees");
+    }
+
+    if((BytecodeCallees[BytecodeCalleeCount].Name = strdup(Name)) == NULL)
+        Die("Unable to allocate bytecode callees");
+    BytecodeCallees[BytecodeCalleeCount].Function = NULL;
+    BytecodeCallees[BytecodeCalleeCount].Native = NULL;
+    return BytecodeCalleeCount++;
+}
+
+static int IsLocal(struct SymbolTableEntry* Entry) {
+    return Entry->Storage == SC_LOCAL || Entry->Storage == SC_PARAM;
+}
+
+/*
+ * Lower a function call.
+ * The arguments are put in a row of registers, which the result replaces.
+ * Like AsCallWrapper, they are worked out from the last to the first.
+ */
+static int BcCall(struct ASTNode* Node) {
+    struct ASTNode* Argument;
+    int Base, Count = 0, Value;
+
+    if(Node->Left)
+        Count = Node->Left->Size;
+
+    Base = NextRegister;
+    for(int i = 0; i < (Count ? Count : 1); i++)
+        BcTemporary();
+
+    for(Argument = Node->Left; Argument != NULL; Argument = Argument->Left) {
+        Value = BcTree(Argument->Right, Argument->Operation);
+        if(Value != Base + Argument->Size - 1)
+            BcEmit(BC_MOVE, Base + Argument->Size - 1, Value, 0);
+        NextRegister = Base + (Count ? Count : 1);
+    }
+
+    BcEmit(BC_CALL, Base, BcCallee(Node->Symbol->Name), Count);
+
+    NextRegister = Base + 1;
+    return Base;
+}
+
+/*
+ * Lower a pre or post increment or decrement of a variable.
+ * The value is narrowed as the Assembler's inc and dec would wrap it.
+ */
+static int BcIncrement(struct SymbolTableEntry* Entry, int Operation) {
+    int Result = BcTemporary(), Value, Size = PrimitiveSize(Entry->Type), Constant;
+    int Step = Operation == OP_PREINC || Operation == OP_POSTINC ? 1 : -1;
+    int Post = Operation == OP_POSTINC || Operation == OP_POSTDEC;
+
+    if(IsLocal(Entry)) {
+        if(Post)
+            BcEmit(BC_MOVE, Result, Entry->SinkOffset, 0);
+        BcEmit(BC_ADDI, Entry->SinkOffset, Entry->SinkOffset, Step);
+        BcNarrow(Entry->SinkOffset, Entry->SinkOffset, Size);
+        if(!Post)
+            BcEmit(BC_MOVE, Result, Entry->SinkOffset, 0);
+        return Result;
+    }
+
+    Constant = BcConstant(BcGlobal(Entry));
+    Value = BcTemporary();
+    BcEmit(BC_LOADG8 + BcSizeIndex(Size), Result, Constant, 0);
+    BcEmit(BC_ADDI, Value, Result, Step);
+    BcEmit(BC_STOREG8 + BcSizeIndex(Size), Constant, Value, 0);
+    if(!Post)
+        BcEmit(BC_LOADG8 + BcSizeIndex(Size), Result, Constant, 0);
+    return Result;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * * *     C O N T R O L     F L O W     * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Lower a statement, after which every temporary is free.
+static void BcStatement(struct ASTNode* Node) {
+    BcTree(Node, OP_COMP);
+    NextRegister = LocalCount;
+}
+
+// Does a node fit in an immediate?
+static int BcImmediate(struct ASTNode* Node, int* Value) {
+    if(Node == NULL || Node->Operation != TERM_INTLITERAL)
+        return 0;
+    *Value = Node->IntValue;
+    return 1;
+}
+
+/*
+ * Lower a condition into a jump.
+ *
+ * @param Label: Where to jump
+ * @param OnTrue: Jump if the condition holds, rather than if it doesn't
+ */
+static void BcCondition(struct ASTNode* Node, int Label, int OnTrue) {
+    int Left, Right, Operation, Immediate;
+
+    if(Node->Operation >= OP_EQUAL && Node->Operation <= OP_GREATE && !TypeIsVector(Node->Left->ExprType)) {
+        Operation = OnTrue ? Node->Operation : Inverse[Node->Operation - OP_EQUAL];
+
+        Left = BcTree(Node->Left, Node->Operation);
+        if(BcImmediate(Node->Right, &Immediate)) {
+            BcEmit(BC_JEQI + Operation - OP_EQUAL, Label, Left, Immediate);
+        } else {
+            if(!BcIsTemporary(Left) && TreeHasSideEffects(Node->Right))
+                BcEmit(BC_MOVE, Left = BcTemporary(), Node->Left->Symbol->SinkOffset, 0);
+            Right = BcTree(Node->Right, Node->Operation);
+            BcEmit(BC_JEQ + Operation - OP_EQUAL, Label, Left, Right);
+        }
+        return;
+    }
+
+    if(Node->Operation == OP_BOOLCONV)
+        Node = Node->Left;
+
+    Left = BcTree(Node, OP_BOOLCONV);
+    BcEmit(OnTrue ? BC_JNZ : BC_JZ, Label, Left, 0);
+}
+
+static int BcIf(struct ASTNode* Node) {
+    int FalseLabel = BcNewLabel(), EndLabel = BcNewLabel();
+
+    BcCondition(Node->Left, FalseLabel, 0);
+    NextRegister = LocalCount;
+
+    BcStatement(Node->Middle);
+
+    if(Node->Right) {
+        BcEmit(BC_JMP, EndLabel, 0, 0);
+        BcLabel(FalseLabel);
+        BcStatement(Node->Right);
+    } else {
+        BcLabel(FalseLabel);
+    }
+
+    BcLabel(EndLabel);
+    return -1;
+}
+
+/*
+ * Lower a loop.
+ * The condition goes at the bottom, so each time around takes only one jump.
+ */
+static int BcWhile(struct ASTNode* Node) {
+    int BodyLabel = BcNewLabel(), ConditionLabel = BcNewLabel();
+
+    BcEmit(BC_JMP, ConditionLabel, 0, 0);
+
+    BcLabel(BodyLabel);
+    BcStatement(Node->Right);
+
+    BcLabel(ConditionLabel);
+    BcCondition(Node->Left, BodyLabel, 1);
+    NextRegister = LocalCount;
+
+    return -1;
+}
+
+static int CompareValues(const void* Left, const void* Right) {
+    long L = ((long*) Left)[0], R = ((long*) Right)[0];
+    return (L > R) - (L < R);
+}
+
+/*
+ * Lower a switch statement into a single instruction, and its bodies.
+ * The table is dense when it would be at most 3 slots per case, like AsSwitch.
+ */
+static int BcSwitch(struct ASTNode* Node) {
+    struct BytecodeSwitch* Switch;
+    struct ASTNode* Case, *Label;
+    long* Pairs;
+    int Count = 0, Bodies = 0, EndLabel = BcNewLabel(), DefaultLabel = EndLabel, Body, Value;
+
+    for(Case = Node->Right; Case != NULL; Case = Case->Right)
+        for(Label = Case; Label != NULL; Label = Label->Middle)
+            Count++;
+
+    // Value and label pairs, to be sorted by value.
+    if((Pairs = malloc((Count + 1) * 2 * sizeof(long))) == NULL)
+        Die("Unable to allocate switch cases");
+
+    Count = 0;
+    Body = LabelCount;
+    for(Case = Node->Right; Case != NULL; Case = Case->Right, Bodies++) {
+        BcNewLabel();
+        for(Label = Case; Label != NULL; Label = Label->Middle) {
+            if(Label->Operation == OP_DEFAULT) {
+                DefaultLabel = Body + Bodies;
+            } else {
+                Pairs[Count * 2] = Label->IntValue;
+                Pairs[Count++ * 2 + 1] = Body + Bodies;
+            }
+        }
+    }
+
+    qsort(Pairs, Count, 2 * sizeof(long), CompareValues);
+
+    if(Function->SwitchCount == SwitchCapacity) {
+        SwitchCapacity = SwitchCapacity ? SwitchCapacity * 2 : 4;
+        if((Function->Switches = realloc(Function->Switches, SwitchCapacity * sizeof(struct BytecodeSwitch))) == NULL)
+            Die("Unable to allocate switch tables");
+    }
+
+    Switch = &Function->Switches[Function->SwitchCount];
+    Switch->Default = DefaultLabel;
+    Switch->Low = Count ? Pairs[0] : 0;
+    Switch->Dense = Count > 0 && Pairs[(Count - 1) * 2] - Pairs[0] < (long) Count * 3;
+    Switch->Count = Switch->Dense ? Pairs[(Count - 1) * 2] - Pairs[0] + 1 : Count;
+    Switch->Values = Switch->Dense ? NULL : malloc((Count + 1) * sizeof(long));
+    Switch->Targets = malloc((Switch->Count + 1) * sizeof(int));
+    if((!Switch->Dense && Switch->Values == NULL) || Switch->Targets == NULL)
+        Die("Unable to allocate switch tables");
+
+    for(int i = 0, j = 0; i < Switch->Count; i++) {
+        if(!Switch->Dense) {
+            Switch->Values[i] = Pairs[i * 2];
+            Switch->Targets[i] = Pairs[i * 2 + 1];
+        } else if(Pairs[j * 2] == Switch->Low + i) {
+            Switch->Targets[i] = Pairs[j++ * 2 + 1];
+        } else {
+            Switch->Targets[i] = DefaultLabel;
+        }
+    }
+    free(Pairs);
+
+    Value = BcTree(Node->Left, Node->Operation);
+    BcEmit(BC_SWITCH, 0, Value, Function->SwitchCount++);
+    NextRegister = LocalCount;
+
+    // Every body ends the switch, apart from the last which falls out of it anyway.
+    Bodies = 0;
+    for(Case = Node->Right; Case != NULL; Case = Case->Right) {
+        BcLabel(Body + Bodies++);
+        BcStatement(Case->Left);
+        if(Case->Right != NULL)
+            BcEmit(BC_JMP, EndLabel, 0, 0);
+    }
+
+    BcLabel(EndLabel);
+    return -1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * * *     E X P R E S S I O N S     * * * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static int BcIntrinsic(struct ASTNode* Node) {
+    int Value, Target, Wide = Node->Left->ExprType == RET_LONG;
+
+    if(TypeIsVector(Node->ExprType) || TypeIsVector(Node->Left->ExprType))
+        DieMessage("The VM can't run vector code, in", FunctionSymbol->Name);
+
+    Value = BcTree(Node->Left, Node->Operation);
+    Target = BcTarget(Value, -1);
+
+    switch(Node->IntValue) {
+        case IN_POPCOUNT:
+            BcEmit(Wide ? BC_POPCOUNT64 : BC_POPCOUNT32, Target, Value, 0);
+            break;
+        case IN_CLZ:
+            BcEmit(Wide ? BC_CLZ64 : BC_CLZ32, Target, Value, 0);
+            break;
+        case IN_CTZ:
+            BcEmit(Wide ? BC_CTZ64 : BC_CTZ32, Target, Value, 0);
+            break;
+        case IN_BSWAP:
+            BcEmit(Wide ? BC_BSWAP64 : BC_BSWAP32, Target, Value, 0);
+            break;
+        default:
+            DieDecimal("The VM can't run intrinsic", Node->IntValue);
+    }
+
+    return Target;
+}
+
+/*
+ * Lower an assignment.
+ * Like the Assembler, it gives back the value as it was before being narrowed.
+ */
+static int BcAssign(struct ASTNode* Node) {
+    int Value, Address, Size;
+    struct SymbolTableEntry* Entry = Node->Right->Symbol;
+
+    if(Node->Right == NULL)
+        Die("Fault in assigning a null rvalue");
+
+    Value = BcTree(Node->Left, Node->Operation);
+
+    switch(Node->Right->Operation) {
+        case REF_IDENT:
+            Size = PrimitiveSize(Entry->Type);
+            if(IsLocal(Entry)) {
+                BcNarrow(Entry->SinkOffset, Value, Size);
+            } else {
+                BcEmit(BC_STOREG8 + BcSizeIndex(Size), BcConstant(BcGlobal(Entry)), Value, 0);
+            }
+            return Value;
+
+        case OP_DEREF:
+            // Anything the address works out must not change the value first.
+            if(!BcIsTemporary(Value) && TreeHasSideEffects(Node->Right)) {
+                BcEmit(BC_MOVE, BcTemporary(), Value, 0);
+                Value = NextRegister - 1;
+            }
+            Address = BcTree(Node->Right, Node->Operation);
+            BcEmit(BC_STORE8 + BcSizeIndex(PrimitiveSize(Node->Right->ExprType)), Address, Value, 0);
+            return Value;
+
+        default:
+            DieDecimal("Can't ASSIGN in the VM", Node->Right->Operation);
+    }
+    return -1;
+}
+
+/*
+ * Lower a node.
+ *
+ * @param ParentOp: The Operation of the parent of the node
+ * @return the register that holds the value of the node, or -1 if it has none
+ */
+static int BcTree(struct ASTNode* Node, int ParentOp) {
+    int Left = -1, Right = -1, Target, Immediate, Opcode = -1;
+
+    if(Node == NULL)
+        return -1;
+
+    if(TypeIsVector(Node->ExprType) || (Node->Operation == OP_VECLOOP && Node->Right == NULL))
+        DieMessage("The VM can't run vector code, in", FunctionSymbol->Name);
+
+    switch(Node->Operation) {
+        case OP_IF:
+            return BcIf(Node);
+
+        case OP_LOOP:
+            return BcWhile(Node);
+
+        // The original loop is kept for the iterations the vectors don't cover.
+        case OP_VECLOOP:
+            BcStatement(Node->Right);
+            return -1;
+
+        case OP_SWITCH:
+            return BcSwitch(Node);
+
+        case OP_COMP:
+            BcStatement(Node->Left);
+            BcStatement(Node->Right);
+            return -1;
+
+        case OP_CALL:
+            return BcCall(Node);
+
+        case OP_INTRINSIC:
+            return BcIntrinsic(Node);
+
+        case OP_ASSIGN:
+            return BcAssign(Node);
+
+        case OP_PREINC:
+        case OP_PREDEC:
+            return BcIncrement(Node->Left->Symbol, Node->Operation);
+
+        case OP_POSTINC:
+        case OP_POSTDEC:
+            return BcIncrement(Node->Symbol, Node->Operation);
+
+        case REF_IDENT:
+            if(!Node->RVal && ParentOp != OP_DEREF)
+                return -1;
+            if(IsLocal(Node->Symbol))
+                return Node->Symbol->SinkOffset;
+            Target = BcTemporary();
+            BcEmit(BC_LOADG8 + BcSizeIndex(PrimitiveSize(Node->Symbol->Type)), Target, BcConstant(BcGlobal(Node->Symbol)), 0);
+            return Target;
+
+        case TERM_INTLITERAL:
+            Target = BcTemporary();
+            BcEmit(BC_CONST, Target, BcConstant(Node->IntValue), 0);
+            return Target;
+
+        case TERM_STRLITERAL:
+            Target = BcTemporary();
+            BcEmit(BC_CONST, Target, BcConstant((long) strdup(AsStringValue(Node->IntValue))), 0);
+            return Target;
+
+        case OP_ADDRESS:
+            if(IsLocal(Node->Symbol))
+                DieMessage("The VM can't take the address of a local", Node->Symbol->Name);
+            Target = BcTemporary();
+            BcEmit(BC_CONST, Target, BcConstant(BcGlobal(Node->Symbol)), 0);
+            return Target;
+
+        case OP_RET:
+            Left = BcTree(Node->Left, Node->Operation);
+            Target = BcTemporary();
+            switch(FunctionSymbol->Type) {
+                case RET_CHAR: BcNarrow(Target, Left, 1); break;
+                case RET_INT:  BcNarrow(Target, Left, 4); break;
+                default:       BcNarrow(Target, Left, 8); break;
+            }
+            BcEmit(BC_RET, Target, 0, 0);
+            return -1;
+
+        case OP_PRINT:
+            Left = BcTree(Node->Left, Node->Operation);
+            Target = BcTemporary();
+            BcEmit(BC_MOVE, Target, Left, 0);
+            BcEmit(BC_CALL, Target, BcCallee("PrintInteger"), 1);
+            return -1;
+
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+            // The negative of the smallest int doesn't fit in one.
+            if(!BcImmediate(Node->Right, &Immediate) || (Node->Operation == OP_SUBTRACT && Immediate == INT_MIN))
+                break;
+            Left = BcTree(Node->Left, Node->Operation);
+            Target = BcTarget(Left, -1);
+            if(Node->Operation == OP_MULTIPLY)
+                BcEmit(BC_MULI, Target, Left, Immediate);
+            else
+                BcEmit(BC_ADDI, Target, Left, Node->Operation == OP_ADD ? Immediate : -Immediate);
+            return Target;
+
+        case OP_SCALE:
+            Left = BcTree(Node->Left, Node->Operation);
+            Target = BcTarget(Left, -1);
+            BcEmit(BC_MULI, Target, Left, Node->Size);
+            return Target;
+
+        case OP_WIDEN:
+            return BcTree(Node->Left, Node->Operation);
+
+        case OP_DEREF:
+            Left = BcTree(Node->Left, Node->Operation);
+            if(!Node->RVal)
+                return Left;
+            Target = BcTarget(Left, -1);
+            BcEmit(BC_LOAD8 + BcSizeIndex(PrimitiveSize(ValueAt(Node->Left->ExprType))), Target, Left, 0);
+            return Target;
+
+        // Conditions are lowered by BcCondition, so this one is wanted as 0 or 1.
+        case OP_BOOLCONV:
+            Left = BcTree(Node->Left, Node->Operation);
+            Target = BcTarget(Left, -1);
+            BcEmit(BC_BOOL, Target, Left, 0);
+            return Target;
+    }
+
+    // Everything else works on its operands' values.
+    Left = BcTree(Node->Left, Node->Operation);
+    if(Left >= 0 && !BcIsTemporary(Left) && TreeHasSideEffects(Node->Right)) {
+        Target = BcTemporary();
+        BcEmit(BC_MOVE, Target, Left, 0);
+        Left = Target;
+    }
+    Right = BcTree(Node->Right, Node->Operation);
+
+    switch(Node->Operation) {
+        case OP_ADD:      Opcode = BC_ADD; break;
+        case OP_SUBTRACT: Opcode = BC_SUB; break;
+        case OP_MULTIPLY: Opcode = BC_MUL; break;
+        case OP_DIVIDE:   Opcode = BC_DIV; break;
+        case OP_MODULO:   Opcode = BC_MOD; break;
+        case OP_BITAND:   Opcode = BC_AND; break;
+        case OP_BITOR:    Opcode = BC_OR;  break;
+        case OP_BITXOR:   Opcode = BC_XOR; break;
+        case OP_SHIFTL:   Opcode = BC_SHL; break;
+        case OP_SHIFTR:   Opcode = BC_SHR; break;
+
+        case OP_EQUAL: case OP_INEQ:
+        case OP_LESS: case OP_GREAT:
+        case OP_LESSE: case OP_GREATE:
+            Opcode = BC_EQ + Node->Operation - OP_EQUAL;
+            break;
+
+        case OP_NEGATE:
+        case OP_BITNOT:
+        case OP_BOOLNOT:
+            Target = BcTarget(Left, -1);
+            BcEmit(Node->Operation == OP_NEGATE ? BC_NEG : Node->Operation == OP_BITNOT ? BC_NOT : BC_LNOT, Target, Left, 0);
+            return Target;
+
+        default:
+            DieDecimal("Unknown bytecode operation", Node->Operation);
+    }
+
+    Target = BcTarget(Left, Right);
+    BcEmit(Opcode, Target, Left, Right);
+    return Target;
+}
+
+/*
+ * Lower a whole function into bytecode, for the VM to run.
+ * Called instead of AsFunction, under --vm.
+ *
+ * @param Node: The OP_FUNC node of the function
+ */
+int BcFunction(struct ASTNode* Node) {
+    struct SymbolTableEntry* Entry;
+    int Zero, Register = 0;
+
+    if((Function = calloc(1, sizeof(struct BytecodeFunction))) == NULL
+        || (Function->Name = strdup(Node->Symbol->Name)) == NULL)
+        Die("Unable to allocate bytecode function");
+
+    FunctionSymbol = Node->Symbol;
+    CodeCapacity = ConstantCapacity = SwitchCapacity = 0;
+    LabelCount = 0;
+
+    // The variables take the first registers. The Assembler doesn't run, so their stack offsets are free to hold them.
+    for(Entry = Node->Symbol->Start; Entry != NULL; Entry = Entry->NextSymbol, Function->Parameters++)
+        Entry->SinkOffset = Register++;
+    for(Entry = Locals; Entry != NULL; Entry = Entry->NextSymbol) {
+        if(Entry->Structure == ST_ARR || TypeSize(Entry->Type, Entry->CompositeType) > 8)
+            DieMessage("The VM can only keep scalars in locals, not", Entry->Name);
+        Entry->SinkOffset = Register++;
+    }
+
+    LocalCount = NextRegister = Function->Registers = Register;
+
+    BcStatement(Node->Left);
+
+    // Falling off the end returns nothing in particular.
+    Zero = BcTemporary();
+    BcEmit(BC_CONST, Zero, BcConstant(0), 0);
+    BcEmit(BC_RET, Zero, 0, 0);
+
+    // Now every label has a place, the jumps can be pointed at them.
+    for(int i = 0; i < Function->Length; i++) {
+        struct BytecodeInstruction* Instruction = &Function->Code[i];
+        if(Instruction->Operation >= BC_JEQ && Instruction->Operation <= BC_JMP)
+            Instruction->A = Labels[Instruction->A];
+    }
+
+    for(int i = 0; i < Function->SwitchCount; i++) {
+        Function->Switches[i].Default = Labels[Function->Switches[i].Default];
+        for(int j = 0; j < Function->Switches[i].Count; j++)
+            Function->Switches[i].Targets[j] = Labels[Function->Switches[i].Targets[j]];
+    }
+
+    if(BytecodeFunctionsEnd)
+        BytecodeFunctionsEnd->Next = Function;
+    else
+        BytecodeFunctions = Function;
+    BytecodeFunctionsEnd = Function;
+
+    if(OptVerboseOutput)
+        printf("Bytecode: %s has %d instructions, %d registers and %d constants\n",
+                Function->Name, Function->Length, Function->Registers, Function->ConstantCount);
+
+    return -1;
+}
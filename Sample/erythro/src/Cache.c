@@ -0,0 +1,354 @@
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/********************************************************************************
+ * The Cache keeps the output of compiling and assembling, for --cache.         *
+ *                                                                              *
+ * Every entry is named after a hash of everything that went into it:           *
+ *  * the version of the compiler, and the flags that change what it makes,     *
+ *  * the bytes of the source, and of its profile under -fprofile-use,          *
+ *  * the sources compiled before it in the same run, as their symbols are      *
+ *     still there when it is compiled,                                         *
+ *  * or, for an object, the bytes of the assembly it came from.                *
+ *                                                                              *
+ * So an entry never has to be checked; if it exists, it is right.              *
+ *                                                                              *
+ * The cache lives in $ERYTHRO_CACHE, or .erythro-cache if that isn't set.      *
+ *  It holds at most $ERYTHRO_CACHE_SIZE megabytes (256 otherwise). When it      *
+ *  grows past that, the entries used longest ago are removed, as each use      *
+ *  touches the entry.                                                          *
+ *                                                                              *
+ ********************************************************************************/
+
+// What invalidates the whole cache when the compiler changes.
+#define CACHE_VERSION "Erythro Compiler v5, built " __DATE__ " " __TIME__
+#define CACHE_LIMIT 256
+
+// An entry, for deciding which to evict.
+struct CacheEntry {
+    char* Name;
+    time_t Used;
+    long Size;
+};
+
+// A pair of FNV-1a hashes, with different starting points, for 128 bits.
+struct CacheHash {
+    unsigned long long Low, High;
+};
+
+// The hash of every unit compiled so far in this run.
+static struct CacheHash Chain = { 0xcbf29ce484222325ULL, 0x6c62272e07bb0142ULL };
+static int Hits, Misses;
+
+static void HashBytes(struct CacheHash* Hash, void* Data, long Length) {
+    unsigned char* Bytes = Data;
+
+    for(long i = 0; i < Length; i++) {
+        Hash->Low = (Hash->Low ^ Bytes[i]) * 0x100000001b3ULL;
+        Hash->High = (Hash->High ^ Bytes[i]) * 0x100000001b3ULL;
+        Hash->High ^= Hash->High >> 29;
+    }
+}
+
+static void HashString(struct CacheHash* Hash, char* String) {
+    HashBytes(Hash, String, strlen(String) + 1);
+}
+
+/*
+ * Hash the contents of a file.
+ *
+ * @return 0 if it can't be read.
+ */
+static int HashFile(struct CacheHash* Hash, char* Name) {
+    char Buffer[8192];
+    FILE* File;
+    long Length;
+
+    if((File = fopen(Name, "rb")) == NULL)
+        return 0;
+
+    while((Length = fread(Buffer, 1, sizeof(Buffer), File)) > 0)
+        HashBytes(Hash, Buffer, Length);
+
+    fclose(File);
+    return 1;
+}
+
+// Hash the compiler and the flags that change its output.
+static void HashCompiler(struct CacheHash* Hash, char* Kind) {
+    int Flags = OptOptimise | OptWholeProgram << 1 | OptProfileGenerate << 2 | OptProfileUse << 3;
+
+    HashString(Hash, CACHE_VERSION);
+    HashString(Hash, Kind);
+    HashBytes(Hash, &Flags, sizeof(Flags));
+}
+
+// Hash a source file, with its name and its profile.
+static int HashSource(struct CacheHash* Hash, char* Name) {
+    char* Profile;
+    int Found;
+
+    HashString(Hash, Name);
+    if(!HashFile(Hash, Name))
+        return 0;
+
+    if(!OptProfileUse)
+        return 1;
+
+    if((Profile = malloc(strlen(Name) + 9)) == NULL)
+        Die("Unable to allocate profile name");
+    sprintf(Profile, "%s.profile", Name);
+
+    // A missing profile has to be told apart from an empty one.
+    Found = HashFile(Hash, Profile);
+    HashBytes(Hash, &Found, sizeof(Found));
+    free(Profile);
+    return 1;
+}
+
+// Name an entry after its hash.
+static char* CacheName(struct CacheHash* Hash, char Suffix) {
+    char* Name = malloc(36);
+
+    if(Name == NULL)
+        Die("Unable to allocate cache entry");
+
+    sprintf(Name, "%016llx%016llx.%c", Hash->High, Hash->Low, Suffix);
+    return Name;
+}
+
+static char* CacheDirectory(void) {
+    char* Directory = getenv("ERYTHRO_CACHE");
+    return Directory && *Directory ? Directory : ".erythro-cache";
+}
+
+static char* CachePath(char* Entry) {
+    char* Directory = CacheDirectory(), *Path = malloc(strlen(Directory) + strlen(Entry) + 6);
+
+    if(Path == NULL)
+        Die("Unable to allocate cache path");
+
+    sprintf(Path, "%s/%s", Directory, Entry);
+    return Path;
+}
+
+/*
+ * Name the entry for the assembly of a translation unit.
+ * Every unit is chained onto the ones before it, whose symbols it can see.
+ *
+ * @param InputFile: The source file
+ * @return the name of the entry, or NULL if it can't be cached.
+ */
+char* CacheUnitKey(char* InputFile) {
+    struct CacheHash Hash = Chain;
+
+    if(!OptCache || OptDumpTree)
+        return NULL;
+
+    HashCompiler(&Hash, "unit");
+    if(!HashSource(&Hash, InputFile))
+        return NULL;
+
+    Chain = Hash;
+    return CacheName(&Hash, 's');
+}
+
+/*
+ * Name the entry for the assembly of a whole program.
+ *
+ * @param InputFiles: The source files
+ * @param Count: How many there are
+ * @return the name of the entry, or NULL if it can't be cached.
+ */
+char* CacheProgramKey(char* InputFiles[], int Count) {
+    struct CacheHash Hash = Chain;
+
+    if(!OptCache || OptDumpTree)
+        return NULL;
+
+    HashCompiler(&Hash, "program");
+    for(int i = 0; i < Count; i++)
+        if(!HashSource(&Hash, InputFiles[i]))
+            return NULL;
+
+    return CacheName(&Hash, 's');
+}
+
+/*
+ * Name the entry for the object assembled from some assembly.
+ *
+ * @param AssemblyFile: The assembly
+ * @return the name of the entry, or NULL if it can't be cached.
+ */
+char* CacheObjectKey(char* AssemblyFile) {
+    struct CacheHash Hash = { 0xcbf29ce484222325ULL, 0x6c62272e07bb0142ULL };
+
+    if(!OptCache)
+        return NULL;
+
+    HashString(&Hash, CACHE_VERSION);
+    HashString(&Hash, "object");
+    if(!HashFile(&Hash, AssemblyFile))
+        return NULL;
+
+    return CacheName(&Hash, 'o');
+}
+
+// Copy a file, returning 0 if it couldn't be.
+static int CopyFile(char* From, char* To) {
+    char Buffer[8192];
+    FILE* Source, *Destination;
+    long Length;
+    int Failed = 0;
+
+    if((Source = fopen(From, "rb")) == NULL)
+        return 0;
+
+    if((Destination = fopen(To, "wb")) == NULL) {
+        fclose(Source);
+        return 0;
+    }
+
+    while((Length = fread(Buffer, 1, sizeof(Buffer), Source)) > 0)
+        if(fwrite(Buffer, 1, Length, Destination) != (size_t) Length)
+            Failed = 1;
+
+    fclose(Source);
+    if(fclose(Destination) != 0 || Failed) {
+        unlink(To);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Fetch an entry from the cache.
+ *
+ * @param Key: The name of the entry
+ * @param OutputName: Where to put it
+ * @return 1 if it was there.
+ */
+int CacheFetch(char* Key, char* OutputName) {
+    char* Path = CachePath(Key);
+    int Found = CopyFile(Path, OutputName);
+
+    // Touch it, so it is the last to go.
+    if(Found)
+        utime(Path, NULL);
+
+    Found ? Hits++ : Misses++;
+    if(OptVerboseOutput)
+        printf("Cache: %s %s for %s\n", Found ? "hit" : "miss", Key, OutputName);
+
+    free(Path);
+    return Found;
+}
+
+static int CompareUse(const void* Left, const void* Right) {
+    time_t L = ((struct CacheEntry*) Left)->Used, R = ((struct CacheEntry*) Right)->Used;
+    return (L > R) - (L < R);
+}
+
+/*
+ * Remove the entries used longest ago, until the cache fits in its limit.
+ */
+static void CacheEvict(void) {
+    struct CacheEntry* Entries = NULL;
+    struct dirent* File;
+    struct stat Status;
+    char* Limit = getenv("ERYTHRO_CACHE_SIZE"), *Path;
+    long Total = 0, Maximum = (Limit && atol(Limit) > 0 ? atol(Limit) : CACHE_LIMIT) * 1024L * 1024L;
+    int Count = 0, Capacity = 0;
+    DIR* Directory;
+
+    if((Directory = opendir(CacheDirectory())) == NULL)
+        return;
+
+    while((File = readdir(Directory)) != NULL) {
+        if(strlen(File->d_name) != 34 || File->d_name[32] != '.')
+            continue;
+
+        Path = CachePath(File->d_name);
+        if(stat(Path, &Status) == 0) {
+            if(Count == Capacity) {
+                Capacity = Capacity ? Capacity * 2 : 64;
+                if((Entries = realloc(Entries, Capacity * sizeof(struct CacheEntry))) == NULL)
+                    Die("Unable to allocate cache entries");
+            }
+
+            Entries[Count].Name = Path;
+            Entries[Count].Used = Status.st_mtime;
+            Entries[Count++].Size = Status.st_size;
+            Total += Status.st_size;
+        } else {
+            free(Path);
+        }
+    }
+    closedir(Directory);
+
+    qsort(Entries, Count, sizeof(struct CacheEntry), CompareUse);
+
+    for(int i = 0; i < Count; i++) {
+        if(Total > Maximum && unlink(Entries[i].Name) == 0) {
+            Total -= Entries[i].Size;
+            if(OptVerboseOutput)
+                printf("Cache: evicted %s\n", Entries[i].Name);
+        }
+        free(Entries[i].Name);
+    }
+    free(Entries);
+}
+
+/*
+ * Keep a file in the cache.
+ * It is written under a temporary name first, so no one sees half of it.
+ *
+ * @param Key: The name of the entry
+ * @param InputName: The file to keep
+ */
+void CacheStore(char* Key, char* InputName) {
+    char* Path = CachePath(Key), *Temporary = malloc(strlen(Path) + 16);
+
+    if(Temporary == NULL)
+        Die("Unable to allocate cache path");
+
+#ifdef _WIN32
+    mkdir(CacheDirectory());
+#else
+    mkdir(CacheDirectory(), 0755);
+#endif
+
+    sprintf(Temporary, "%s.%ld", Path, (long) time(NULL) ^ (long) clock());
+    remove(Path);
+    if(!CopyFile(InputName, Temporary) || rename(Temporary, Path) != 0) {
+        fprintf(stderr, "Warning: unable to cache %s in %s: %s\n", InputName, CacheDirectory(), strerror(errno));
+        unlink(Temporary);
+    } else {
+        CacheEvict();
+    }
+
+    free(Temporary);
+    free(Path);
+}
+
+// Say how useful the cache was.
+void CacheReport(void) {
+    if(OptCache)
+        printf("Cache: %d hit%s, %d miss%s\n", Hits, Hits == 1 ? "" : "s", Misses, Misses == 1 ? "" : "es");
+}
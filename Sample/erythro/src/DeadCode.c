@@ -0,0 +1,396 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+
+/********************************************************************************
+ * Dead Code Elimination removes the parts of a function that can never         *
+ *  affect what it does:                                                        *
+ *                                                                              *
+ *  * statements after a return, in the same block,                             *
+ *  * the branch of an if, or the body of a loop, that a constant               *
+ *     condition rules out,                                                     *
+ *  * expression statements whose value is thrown away,                         *
+ *     and which have no side effects,                                          *
+ *  * stores to locals that are never read again,                               *
+ *  * locals that are no longer mentioned at all, so they take no stack.        *
+ *                                                                              *
+ * Only locals whose address is never taken are tracked, as anything else       *
+ *  may be read through a pointer, or by another function.                      *
+ * Calls, and stores through pointers, are always kept. When a dead store's     *
+ *  value has a side effect, like a call, the value is kept as a statement.     *
+ *                                                                              *
+ * Liveness is worked out backwards over the tree, since the tree is            *
+ *  structured there's no need to build a control flow graph:                   *
+ *  * a sequence is walked right to left,                                       *
+ *  * an if joins what is live in either branch,                                *
+ *  * a loop is walked until what is live at the top stops changing.            *
+ *                                                                              *
+ ********************************************************************************/
+
+// The function being optimised, for reporting.
+static struct ASTNode* Function;
+
+// The locals we can reason about, and how many of them there are.
+static struct SymbolTableEntry** Tracked;
+static int TrackedCount;
+
+// How many statements were removed, for reporting.
+static int Removed;
+
+/*
+ * Find the index of a tracked local.
+ *
+ * @return the index into Tracked, or -1 if the symbol is not tracked.
+ */
+static int TrackedIndex(struct SymbolTableEntry* Symbol) {
+    for(int i = 0; i < TrackedCount; i++)
+        if(Tracked[i] == Symbol)
+            return i;
+    return -1;
+}
+
+/*
+ * Mark every tracked local that a tree reads as live.
+ * Targets of assignments inside expressions are counted too,
+ *  which only ever keeps more alive than needed.
+ */
+static void MarkUses(struct ASTNode* Node, char* Live) {
+    int Index;
+
+    if(Node == NULL)
+        return;
+
+    if(Node->Symbol != NULL && (Index = TrackedIndex(Node->Symbol)) >= 0)
+        Live[Index] = 1;
+
+    MarkUses(Node->Left, Live);
+    MarkUses(Node->Middle, Live);
+    MarkUses(Node->Right, Live);
+}
+
+/*
+ * Can a condition be decided at compile time?
+ *
+ * @param Condition: The condition of an if or a loop
+ * @param Value: Filled in with the truth of the condition
+ * @return 1 if the condition is constant, 0 otherwise
+ */
+static int ConstantCondition(struct ASTNode* Condition, long* Value) {
+    long Left, Right;
+
+    if(Condition == NULL)
+        return 0;
+
+    if(Condition->Operation == OP_BOOLCONV) {
+        if(!ConstantValue(Condition->Left, Value))
+            return 0;
+        *Value = *Value != 0;
+        return 1;
+    }
+
+    if(!ConstantValue(Condition->Left, &Left) || !ConstantValue(Condition->Right, &Right))
+        return 0;
+
+    switch(Condition->Operation) {
+        case OP_EQUAL:  *Value = Left == Right; return 1;
+        case OP_INEQ:   *Value = Left != Right; return 1;
+        case OP_LESS:   *Value = Left <  Right; return 1;
+        case OP_GREAT:  *Value = Left >  Right; return 1;
+        case OP_LESSE:  *Value = Left <= Right; return 1;
+        case OP_GREATE: *Value = Left >= Right; return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Remove the statements that can never run.
+ *
+ * @param Slot: The pointer to the statement, so it can be replaced.
+ * @return 1 if the statement always returns, so nothing after it can run.
+ */
+static int RemoveUnreachable(struct ASTNode** Slot) {
+    struct ASTNode* Node = *Slot, *Case;
+    long Value;
+    int Returns;
+
+    if(Node == NULL)
+        return 0;
+
+    switch(Node->Operation) {
+        case OP_RET:
+            return 1;
+
+        case OP_COMP:
+            if(RemoveUnreachable(&Node->Left)) {
+                if(Node->Right != NULL)
+                    Removed++;
+                *Slot = Node->Left;
+                return 1;
+            }
+            Returns = RemoveUnreachable(&Node->Right);
+            *Slot = ConstructSequence(Node->Left, Node->Right);
+            return Returns;
+
+        case OP_IF:
+            if(ConstantCondition(Node->Left, &Value)) {
+                Removed++;
+                *Slot = Value ? Node->Middle : Node->Right;
+                return RemoveUnreachable(Slot);
+            }
+            Returns = RemoveUnreachable(&Node->Middle);
+            return RemoveUnreachable(&Node->Right) && Returns;
+
+        case OP_LOOP:
+            if(ConstantCondition(Node->Left, &Value) && !Value) {
+                Removed++;
+                *Slot = NULL;
+                return 0;
+            }
+            RemoveUnreachable(&Node->Right);
+            return 0;
+
+        case OP_SWITCH:
+            // Without a default, a value that matches no case runs nothing.
+            Returns = 0;
+            for(Case = Node->Right; Case != NULL; Case = Case->Right) {
+                for(struct ASTNode* Label = Case; Label != NULL; Label = Label->Middle)
+                    if(Label->Operation == OP_DEFAULT)
+                        Returns = 1;
+            }
+            for(Case = Node->Right; Case != NULL; Case = Case->Right)
+                if(!RemoveUnreachable(&Case->Left))
+                    Returns = 0;
+            return Returns;
+    }
+
+    return 0;
+}
+
+/*
+ * Work out what is live before a statement, given what is live after it,
+ *  removing the stores that nothing reads along the way.
+ *
+ * @param Slot: The pointer to the statement, so it can be removed.
+ * @param Live: What is live after the statement. Updated to what is live before it.
+ * @param Remove: Whether to remove dead stores, or just calculate liveness.
+ */
+static void RemoveDeadStores(struct ASTNode** Slot, char* Live, int Remove) {
+    struct ASTNode* Node = *Slot, *Case;
+    char* Before, *Branch;
+    int Index, Changed;
+
+    if(Node == NULL)
+        return;
+
+    switch(Node->Operation) {
+        case OP_COMP:
+            RemoveDeadStores(&Node->Right, Live, Remove);
+            RemoveDeadStores(&Node->Left, Live, Remove);
+            if(Remove)
+                *Slot = ConstructSequence(Node->Left, Node->Right);
+            return;
+
+        case OP_IF:
+            Branch = malloc(TrackedCount + 1);
+            memcpy(Branch, Live, TrackedCount);
+
+            RemoveDeadStores(&Node->Middle, Live, Remove);
+            RemoveDeadStores(&Node->Right, Branch, Remove);
+
+            for(int i = 0; i < TrackedCount; i++)
+                Live[i] |= Branch[i];
+            free(Branch);
+
+            MarkUses(Node->Left, Live);
+            return;
+
+        case OP_LOOP:
+            // The top of the loop can be reached from before it, and from the end of the body.
+            Before = malloc(TrackedCount + 1);
+            Branch = malloc(TrackedCount + 1);
+            MarkUses(Node->Left, Live);
+
+            do {
+                memcpy(Branch, Live, TrackedCount);
+                RemoveDeadStores(&Node->Right, Branch, 0);
+                MarkUses(Node->Left, Branch);
+
+                Changed = 0;
+                for(int i = 0; i < TrackedCount; i++) {
+                    if(Branch[i] && !Live[i]) {
+                        Live[i] = 1;
+                        Changed = 1;
+                    }
+                }
+            } while(Changed);
+
+            if(Remove) {
+                memcpy(Before, Live, TrackedCount);
+                RemoveDeadStores(&Node->Right, Before, 1);
+            }
+
+            free(Before);
+            free(Branch);
+            return;
+
+        case OP_SWITCH:
+            Before = malloc(TrackedCount + 1);
+            Branch = malloc(TrackedCount + 1);
+            memcpy(Before, Live, TrackedCount);
+
+            for(Case = Node->Right; Case != NULL; Case = Case->Right) {
+                memcpy(Branch, Before, TrackedCount);
+                RemoveDeadStores(&Case->Left, Branch, Remove);
+                for(int i = 0; i < TrackedCount; i++)
+                    Live[i] |= Branch[i];
+            }
+
+            free(Before);
+            free(Branch);
+
+            MarkUses(Node->Left, Live);
+            return;
+
+        case OP_RET:
+            // Nothing local lives past a return.
+            memset(Live, 0, TrackedCount);
+            MarkUses(Node->Left, Live);
+            return;
+
+        case OP_ASSIGN:
+            if(Node->Right == NULL || Node->Right->Operation != REF_IDENT
+                || (Index = TrackedIndex(Node->Right->Symbol)) < 0)
+                break;
+
+            if(!Live[Index]) {
+                if(Remove) {
+                    Removed++;
+                    // The value may still have to be calculated for its side effects.
+                    *Slot = TreeHasSideEffects(Node->Left) ? Node->Left : NULL;
+                }
+                MarkUses(TreeHasSideEffects(Node->Left) ? Node->Left : NULL, Live);
+                return;
+            }
+
+            Live[Index] = 0;
+            MarkUses(Node->Left, Live);
+            return;
+
+        case OP_POSTINC:
+        case OP_POSTDEC:
+        case OP_PREINC:
+        case OP_PREDEC:
+            // An increment on its own only matters if the variable is read later.
+            Index = TrackedIndex(Node->Symbol ? Node->Symbol : Node->Left->Symbol);
+            if(Index >= 0 && !Live[Index]) {
+                if(Remove) {
+                    Removed++;
+                    *Slot = NULL;
+                }
+                return;
+            }
+            break;
+    }
+
+    // Any other statement is kept if it does something, and its reads are live.
+    if(Remove && !TreeHasSideEffects(Node)) {
+        Removed++;
+        *Slot = NULL;
+        return;
+    }
+
+    MarkUses(Node, Live);
+}
+
+/*
+ * Does a tree mention a symbol at all?
+ */
+static int TreeMentions(struct ASTNode* Node, struct SymbolTableEntry* Symbol) {
+    if(Node == NULL)
+        return 0;
+
+    if(Node->Symbol == Symbol)
+        return 1;
+
+    return TreeMentions(Node->Left, Symbol)
+        || TreeMentions(Node->Middle, Symbol)
+        || TreeMentions(Node->Right, Symbol);
+}
+
+/*
+ * Drop the locals the function no longer uses, so that
+ *  AsFunctionPreamble does not make room for them.
+ */
+static void RemoveUnusedLocals(struct ASTNode* Tree) {
+    struct SymbolTableEntry* Local, *Previous = NULL, *Next;
+
+    for(Local = Locals; Local != NULL; Local = Next) {
+        Next = Local->NextSymbol;
+
+        if(Local->Storage != SC_LOCAL || TreeMentions(Tree, Local)) {
+            Previous = Local;
+            continue;
+        }
+
+        if(OptVerboseOutput)
+            printf("Optimiser: removed unused local %s in %s\n", Local->Name, Function->Symbol->Name);
+
+        if(Previous == NULL)
+            Locals = Next;
+        else
+            Previous->NextSymbol = Next;
+
+        if(LocalsEnd == Local)
+            LocalsEnd = Previous;
+    }
+}
+
+/*
+ * Entry point for dead code elimination.
+ *
+ * @param Tree: The OP_FUNC node of the function to clean up.
+ */
+void EliminateDeadCode(struct ASTNode* Tree) {
+    struct SymbolTableEntry* Local;
+    char* Live;
+
+    Function = Tree;
+    Removed = 0;
+
+    RemoveUnreachable(&Tree->Left);
+
+    // Find the locals that can only be reached by name.
+    TrackedCount = 0;
+    for(Local = Locals; Local != NULL; Local = Local->NextSymbol)
+        TrackedCount++;
+
+    Tracked = malloc((TrackedCount + 1) * sizeof(struct SymbolTableEntry*));
+    Live = malloc(TrackedCount + 1);
+    if(Tracked == NULL || Live == NULL)
+        Die("Unable to allocate liveness sets");
+
+    TrackedCount = 0;
+    for(Local = Locals; Local != NULL; Local = Local->NextSymbol)
+        if(Local->Storage == SC_LOCAL && Local->Structure == ST_VAR && !TreeTakesAddress(Tree->Left, Local))
+            Tracked[TrackedCount++] = Local;
+
+    // Nothing local is live once the function ends.
+    memset(Live, 0, TrackedCount + 1);
+    RemoveDeadStores(&Tree->Left, Live, 1);
+
+    free(Live);
+    free(Tracked);
+    Tracked = NULL;
+    TrackedCount = 0;
+
+    RemoveUnusedLocals(Tree->Left);
+
+    if(OptVerboseOutput && Removed)
+        printf("Optimiser: removed %d dead statements in %s\n", Removed, Tree->Symbol->Name);
+}
@@ -7,6 +7,12 @@
 #include <Data.h>
 #include <errno.h>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 /********************************************************************************
  * The Delegate is what allows the compiler backend to be abstracted.           *
  *                                                                              *
@@ -19,6 +25,9 @@
  * Assemble uses GCC-as to compile the assembly to an object file.              *
  * Link links the object files into an executable.                              *
  *                                                                              *
+ * With --cache, Compile and Assemble look in the Cache first.                  *
+ * With -j, the code of functions is generated in Parallel.                     *
+ *                                                                              *
  ********************************************************************************/
 
 /*
@@ -50,6 +59,116 @@ char* Suffixate(char* String, char Suffix) {
 }
 
 
+// The units that came from the cache, without being parsed.
+static char** Skipped;
+static int SkippedCount, SkippedCapacity;
+
+/*
+ * Compile one translation unit into the OutputFile.
+ *
+ * @param InputFile: The filename of the Erythro Source code to compile
+ */
+static void CompileUnit(char* InputFile) {
+    if((SourceFile = fopen(InputFile, "r")) == NULL) {
+        fprintf(stderr, "Unable to open %s: %s\n", InputFile, strerror(errno));
+        exit(1);
+    }
+
+    StartLexer();
+    CurrentGlobal = 0;
+    CurrentLocal = SYMBOLS - 1;
+    DeclareRuntime();
+
+    if(OptVerboseOutput)
+        printf("Compiling %s\r\n", InputFile);
+    
+    PhaseStart(PHASE_PARSE);
+    Tokenise();
+
+    AssemblerPreamble();
+    ProfileStart(InputFile);
+
+    ParseGlobals();
+    PhaseEnd(PHASE_PARSE);
+
+    PhaseStart(PHASE_EMIT);
+    FinishFunctions();
+
+    AsProfileRuntime();
+    AsStringPool();
+    PhaseEnd(PHASE_EMIT);
+
+    StopLexer();
+    fclose(SourceFile);
+}
+
+/*
+ * Parse the units that came from the cache, throwing away their code.
+ * A unit sees the symbols and labels of those before it, so they are needed
+ *  before a unit after them can be compiled as it would have been.
+ */
+static void ReplaySkipped(void) {
+    FILE* Output = OutputFile;
+
+    if(SkippedCount == 0)
+        return;
+
+    if((OutputFile = tmpfile()) == NULL) {
+        fprintf(stderr, "Unable to create a buffer for the assembly: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    for(int i = 0; i < SkippedCount; i++)
+        CompileUnit(Skipped[i]);
+
+    fclose(OutputFile);
+    OutputFile = Output;
+    SkippedCount = 0;
+}
+
+/*
+ * Compile every input file into the OutputFile, as one program.
+ *
+ * @param InputFiles: The filenames of the Erythro Source code to compile
+ * @param Count: How many files there are
+ */
+static void CompileUnits(char* InputFiles[], int Count) {
+    AssemblerPreamble();
+    ProfileStart(InputFiles[0]);
+    DeclareRuntime();
+
+    for(int i = 0; i < Count; i++) {
+        if((SourceFile = fopen(InputFiles[i], "r")) == NULL) {
+            fprintf(stderr, "Unable to open %s: %s\n", InputFiles[i], strerror(errno));
+            exit(1);
+        }
+
+        StartLexer();
+
+        if(OptVerboseOutput)
+            printf("Compiling %s\r\n", InputFiles[i]);
+
+        PhaseStart(PHASE_PARSE);
+        Tokenise();
+        ParseGlobals();
+        PhaseEnd(PHASE_PARSE);
+
+        StopLexer();
+        fclose(SourceFile);
+    }
+
+    PhaseStart(PHASE_GENERATE);
+    AssembleProgram();
+    PhaseEnd(PHASE_GENERATE);
+
+    PhaseStart(PHASE_EMIT);
+    FinishFunctions();
+
+    AsProfileRuntime();
+    AsStringPool();
+    PhaseEnd(PHASE_EMIT);
+}
+
 /*
  * Starts most of the work to do with the Erythro compiler.  
  * It:  
@@ -66,38 +185,71 @@ char* Suffixate(char* String, char Suffix) {
  * @return the filename of the generated PECOFF32+ assembly  
  */
 char* Compile(char* InputFile) {
-    char* OutputName;
+    char* OutputName, *Key;
     OutputName = Suffixate(InputFile, 's');
     if(OutputName == NULL) {
         fprintf(stderr, "%s must have a suffix.\r\n", InputFile);
         exit(1);
     }
 
-    if((SourceFile = fopen(InputFile, "r")) == NULL) {
-        fprintf(stderr, "Unable to open %s: %s\n", InputFile, strerror(errno));
-        exit(1);
-    } 
+    if((Key = CacheUnitKey(InputFile)) != NULL && CacheFetch(Key, OutputName)) {
+        if(SkippedCount == SkippedCapacity) {
+            SkippedCapacity = SkippedCapacity ? SkippedCapacity * 2 : 16;
+            if((Skipped = realloc(Skipped, SkippedCapacity * sizeof(char*))) == NULL)
+                Die("Unable to allocate the list of cached units");
+        }
+        Skipped[SkippedCount++] = InputFile;
+        return OutputName;
+    }
 
-    if((OutputFile = fopen(OutputName, "w")) == NULL) {
+    ReplaySkipped();
+
+    if((OutputFile = fopen(OutputName, "w+")) == NULL) {
         fprintf(stderr, "Unable to open %s: %s\n", OutputName, strerror(errno));
         exit(1);
     }
 
-    Line = 1;
-    Overread = '\n';
-    CurrentGlobal = 0;
-    CurrentLocal = SYMBOLS - 1;
+    CompileUnit(InputFile);
 
-    if(OptVerboseOutput)
-        printf("Compiling %s\r\n", InputFile);
-    
-    Tokenise();
+    CountInstructions(OutputFile);
+    fclose(OutputFile);
+    if(Key)
+        CacheStore(Key, OutputName);
+    return OutputName;
+}
 
-    AssemblerPreamble();
+/*
+ * The whole program variant of Compile.
+ * Every input file is parsed into the same program before any code is
+ *  generated, so that calls can be resolved to bodies in other files.
+ * The assembly is named after the first file.
+ *
+ * @param InputFiles: The filenames of the Erythro Source code to compile
+ * @param Count: How many files there are
+ * @return the filename of the generated PECOFF32+ assembly
+ */
+char* CompileProgram(char* InputFiles[], int Count) {
+    char* OutputName, *Key;
+    OutputName = Suffixate(InputFiles[0], 's');
+    if(OutputName == NULL) {
+        fprintf(stderr, "%s must have a suffix.\r\n", InputFiles[0]);
+        exit(1);
+    }
 
-    ParseGlobals();
+    if((Key = CacheProgramKey(InputFiles, Count)) != NULL && CacheFetch(Key, OutputName))
+        return OutputName;
+
+    if((OutputFile = fopen(OutputName, "w+")) == NULL) {
+        fprintf(stderr, "Unable to open %s: %s\n", OutputName, strerror(errno));
+        exit(1);
+    }
 
+    CompileUnits(InputFiles, Count);
+
+    CountInstructions(OutputFile);
     fclose(OutputFile);
+    if(Key)
+        CacheStore(Key, OutputName);
     return OutputName;
 }
 
@@ -118,32 +270,72 @@ char* Compile(char* InputFile) {
 char* Assemble(char* InputFile) {
     char Command[TEXTLEN];
     int Error;
-    char* OutputName;
+    char* OutputName, *Key;
     OutputName = Suffixate(InputFile, 'o');
     if(OutputName == NULL) {
         fprintf(stderr, "%s must have a suffix.\r\n", InputFile);
         exit(1);
     }
 
+    if((Key = CacheObjectKey(InputFile)) != NULL && CacheFetch(Key, OutputName))
+        return OutputName;
+
     snprintf(Command, TEXTLEN, "%s %s %s", "as -o ", OutputName, InputFile);
     if(OptVerboseOutput)
         printf("%s\n", Command);
     
+    PhaseStart(PHASE_ASSEMBLE);
     Error = system(Command);
+    PhaseEnd(PHASE_ASSEMBLE);
 
     if(Error != 0) {
         fprintf(stderr, "Assembling of %s failed with code %d\n", InputFile, Error);
         exit(1);
     }
+
+    if(Key)
+        CacheStore(Key, OutputName);
     return OutputName;
 }
 
+/*
+ * Assemble the builtins of the Runtime that the program doesn't define itself,
+ *  into an object named after the executable.
+ * The units that came from the cache are parsed first, in case they define some.
+ *
+ * @return the name of the object, or NULL if the program defines every builtin
+ */
+static char* CompileRuntime(void) {
+    char Name[TEXTLEN], *Object;
+    int Count;
+
+    ReplaySkipped();
+
+    snprintf(Name, TEXTLEN, "%s.runtime.s", OutputFileName);
+    if((OutputFile = fopen(Name, "w+")) == NULL) {
+        fprintf(stderr, "Unable to open %s: %s\n", Name, strerror(errno));
+        exit(1);
+    }
+
+    Count = AsRuntime(1);
+    fclose(OutputFile);
+
+    Object = Count ? Assemble(Name) : NULL;
+    unlink(Name);
+    return Object;
+}
+
 /*
  * Processes the outputted object files, turning them into an executable.
  * It does this by invoking (currently, as of 21/01/2021) the GNU GCC
  *  compiler.
  * It invokes GCC rather than LD so that it automatically links against
  *  libc and the CRT natives.
+ * Every function and global has its own section, so --gc-sections
+ *  drops the ones that nothing in the executable uses.
+ * The Runtime is linked in too, after the objects.
+ * With -ffreestanding, there is no C library to start the program, so
+ *  it invokes LD, and the Runtime's _start is the entry point.
  * 
  * @param Output: The desired name for the executable.
  * @param Objects: A list of the Object files to be linked.
@@ -152,10 +344,15 @@ char* Assemble(char* InputFile) {
 
 void Link(char* Output, char* Objects[]) {
     int Count, Size = TEXTLEN, Error;
-    char Command[TEXTLEN], *CommandPtr;
+    char Command[TEXTLEN], *CommandPtr, *Runtime;
+
+    Runtime = CompileRuntime();
 
     CommandPtr = Command;
-    Count = snprintf(CommandPtr, Size, "%s %s ", "gcc -o ", OutputFileName);
+    if(OptFreestanding)
+        Count = snprintf(CommandPtr, Size, "%s %s ", "ld --gc-sections --subsystem console -e _start -o ", OutputFileName);
+    else
+        Count = snprintf(CommandPtr, Size, "%s %s ", "gcc -Wl,--gc-sections -o ", OutputFileName);
     CommandPtr += Count;
     Size -= Count;
 
@@ -166,10 +363,24 @@ void Link(char* Output, char* Objects[]) {
         Objects++;
     }
 
+    if(Runtime != NULL) {
+        Count = snprintf(CommandPtr, Size, "%s ", Runtime);
+        CommandPtr += Count;
+        Size -= Count;
+    }
+
+    if(OptFreestanding)
+        snprintf(CommandPtr, Size, "-lkernel32");
+
     if(OptVerboseOutput)
         printf("%s\n", Command);
     
+    PhaseStart(PHASE_LINK);
     Error = system(Command);
+    PhaseEnd(PHASE_LINK);
+
+    if(Runtime != NULL)
+        unlink(Runtime);
 
     if(Error != 0) {
         fprintf(stderr, "Link failure\n");
@@ -177,6 +388,50 @@ void Link(char* Output, char* Objects[]) {
     }
 }
 
+/*
+ * Compiles a program and runs it straight away, without writing
+ *  any files, by handing the assembly to the JIT, or with --vm,
+ *  by running the bytecode in the VM.
+ *
+ * The source files are the arguments that end in .er, and
+ *  everything after them is given to the program; the last source
+ *  file takes the place of the program's name.
+ *
+ * @param Arguments: The sources, then the arguments to the program
+ * @param Count: How many of them there are
+ * @return what the program's main returned
+ */
+int Run(char* Arguments[], int Count) {
+    int Sources = 1;
+    char* Suffix;
+
+    while(Sources < Count && (Suffix = strrchr(Arguments[Sources], '.')) != NULL && !strcmp(Suffix, ".er"))
+        Sources++;
+
+    if((OutputFile = tmpfile()) == NULL) {
+        fprintf(stderr, "Unable to create a buffer for the assembly: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if(OptWholeProgram)
+        CompileUnits(Arguments, Sources);
+    else
+        for(int i = 0; i < Sources; i++)
+            CompileUnit(Arguments[i]);
+
+    // The report is of the compile, not of the program.
+    CountInstructions(OutputFile);
+    TimeReport();
+    StatsReport();
+
+    // The VM has its bytecode already, and has no use for the assembly.
+    if(OptVirtualMachine)
+        return VmRun(Count - Sources + 1, &Arguments[Sources - 1]);
+
+    AsRuntime(0);
+    return JitRun(OutputFile, Count - Sources + 1, &Arguments[Sources - 1]);
+}
+
 /*
  * Prints information about the available flags and
  *  how to structure the command.
@@ -187,11 +442,25 @@ void Link(char* Output, char* Objects[]) {
 void DisplayUsage(char* ProgName) {
     fprintf(stderr, "Erythro Compiler v5 - Gemwire Institute\n");
     fprintf(stderr, "***************************************\n");
-    fprintf(stderr, "Usage: %s -[vcST] {-o output} file [file ...]\n", ProgName);
+    fprintf(stderr, "Usage: %s -[vcSTO] [-j jobs] [--pipeline] [--whole-program] [--cache] [-ftime-report[=json]] [-fperf-counters] [--stats file] [-ffreestanding] [-fprofile-generate | -fprofile-use] {-o output} file [file ...]\n", ProgName);
+    fprintf(stderr, "       %s -[vO] [--whole-program] --run | --vm file [file ...] [arguments ...]\n", ProgName);
     fprintf(stderr, "       -v: Verbose Output Level\n");
     fprintf(stderr, "       -c: Compile without Linking\n");
     fprintf(stderr, "       -S: Assemble without Linking\n");
     fprintf(stderr, "       -T: Dump AST\n");
+    fprintf(stderr, "       -O: Optimise the AST before generating code\n");
+    fprintf(stderr, "       -j: Generate the code of functions on this many threads\n");
+    fprintf(stderr, "       --pipeline: Read tokens on a thread of their own, while parsing\n");
+    fprintf(stderr, "       --whole-program: Compile every file into one object, optimising across them\n");
+    fprintf(stderr, "       --cache: Reuse the output of earlier compiles, kept in $ERYTHRO_CACHE or .erythro-cache\n");
+    fprintf(stderr, "       -ftime-report: Report the time and memory each phase took to stderr, or as JSON with =json\n");
+    fprintf(stderr, "       -fperf-counters: Add hardware counters for each phase to -ftime-report, where the system has them\n");
+    fprintf(stderr, "       --stats: Write what each function compiled to into file, as JSON if it ends in .json or CSV otherwise\n");
+    fprintf(stderr, "       -ffreestanding: Link with ld, against kernel32 alone, starting the program with the runtime's own _start\n");
+    fprintf(stderr, "       -fprofile-generate: Count how often each branch runs, into <file>.profile\n");
+    fprintf(stderr, "       -fprofile-use: Lay out branches and loops using <file>.profile\n");
+    fprintf(stderr, "       --run: Run the program in memory, passing it the arguments after the .er files\n");
+    fprintf(stderr, "       --vm: Run the program in the bytecode VM instead, like --run\n");
     fprintf(stderr, "       -o: Name of the destination [executable/object/assembly] file.\n");
     exit(1);
 }
@@ -17,6 +17,10 @@ static int GenerateSrg() {
  */
 void DumpTree(struct ASTNode* Node, int level) {
     int Lfalse, Lstart, Lend;
+    struct ASTNode* Case, *Label;
+
+    if(Node == NULL)
+        return;
 
     // Handle weirdo loops and conditions first.
     switch(Node->Operation) {
@@ -47,6 +51,34 @@ void DumpTree(struct ASTNode* Node, int level) {
             DumpTree(Node->Left, level + 2);
             DumpTree(Node->Right, level + 2);
             return;
+        case OP_VECLOOP:
+            for(int i = 0; i < level; i++)
+                fprintf(stdout, " ");
+            fprintf(stdout, "VECLOOP over %s, %d lanes\n", Node->Symbol->Name, 16 / Node->Size);
+            DumpTree(Node->Left, level + 2);
+            DumpTree(Node->Middle, level + 2);
+            for(int i = 0; i < level; i++)
+                fprintf(stdout, " ");
+            fprintf(stdout, "VECLOOP remainder\n");
+            DumpTree(Node->Right, level + 2);
+            return;
+        case OP_SWITCH:
+            for(int i = 0; i < level; i++)
+                fprintf(stdout, " ");
+            fprintf(stdout, "SWITCH with %d cases\n", Node->IntValue);
+            DumpTree(Node->Left, level + 2);
+            for(Case = Node->Right; Case != NULL; Case = Case->Right) {
+                for(Label = Case; Label != NULL; Label = Label->Middle) {
+                    for(int i = 0; i < level + 2; i++)
+                        fprintf(stdout, " ");
+                    if(Label->Operation == OP_CASE)
+                        fprintf(stdout, "CASE %d\n", Label->IntValue);
+                    else
+                        fprintf(stdout, "DEFAULT\n");
+                }
+                DumpTree(Case->Left, level + 4);
+            }
+            return;
     }
 
     // If current node is a compound, we treat it as if we didn't just enter a loop.
@@ -70,6 +102,7 @@ void DumpTree(struct ASTNode* Node, int level) {
         case OP_SUBTRACT:  fprintf(stdout, "OP_SUBTRACT\n"); return;
         case OP_MULTIPLY:  fprintf(stdout, "OP_MULTIPLY\n"); return;
         case OP_DIVIDE:  fprintf(stdout, "OP_DIVIDE\n"); return;
+        case OP_MODULO:  fprintf(stdout, "OP_MODULO\n"); return;
         case OP_EQUAL:  fprintf(stdout, "OP_EQUAL\n"); return;
         case OP_INEQ:  fprintf(stdout, "OP_INEQ\n"); return;
         case OP_LESS:  fprintf(stdout, "OP_LESS\n"); return;
@@ -91,7 +124,7 @@ void DumpTree(struct ASTNode* Node, int level) {
         case OP_ADDRESS:  fprintf(stdout, "OP_ADDRESS %s\n", Node->Symbol->Name); return;
         case OP_DEREF:  
             fprintf(stdout, "OP_DEREF %s\n", Node->RVal ? "rval" : ""); return;
-        case OP_SCALE:  fprintf(stdout, "OP_SCALE %s\n", TypeNames(Node->Size)); return;
+        case OP_SCALE:  fprintf(stdout, "OP_SCALE %d\n", Node->Size); return;
 
         case OP_BOOLOR: fprintf(stdout, "OP_BOOLOR\n"); return;
         case OP_BOOLAND: fprintf(stdout, "OP_BOOLAND\n"); return;
@@ -113,6 +146,8 @@ void DumpTree(struct ASTNode* Node, int level) {
 
         case OP_BOOLCONV: fprintf(stdout, "OP_BOOLCONV\n"); return;
 
+        case OP_INTRINSIC: fprintf(stdout, "OP_INTRINSIC %d\n", Node->IntValue); return;
+
         default:
             DieDecimal("Unknown Dump Operator", Node->Operation);
     }
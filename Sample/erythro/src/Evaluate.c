@@ -0,0 +1,621 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+
+/********************************************************************************
+ * Compile time function evaluation runs parts of the program in the compiler.  *
+ *                                                                              *
+ * Under -O, every function is remembered as it was parsed, and the calls to    *
+ *  them are run by a small interpreter over the AST:                           *
+ *  * a call whose arguments are all constant, to a function that only works    *
+ *     on its parameters and locals, becomes the literal it returns,            *
+ *  * in a whole program, the calls main starts with, which fill in globals     *
+ *     (lookup tables, seeds and the like), are run against an image of the     *
+ *     globals, which all start as zero. The calls are removed, and the globals  *
+ *     they changed are written into .data with their contents already in.      *
+ *                                                                              *
+ * The interpreter works out values exactly as the Assembler's code would:     *
+ *  chars are unsigned and ints are signed when read, stores truncate, and      *
+ *  shifts right are logical.                                                   *
+ *                                                                              *
+ * Anything it can't be sure of - a call to the library, a division by zero,   *
+ *  a pointer outside of the globals, printing, or running for too long -       *
+ *  abandons the evaluation, and the code is left to run as it was.             *
+ *                                                                              *
+ ********************************************************************************/
+
+// The most nodes one evaluation may visit.
+#define STEP_LIMIT 10000000
+// The deepest that calls may nest.
+#define DEPTH_LIMIT 256
+// The most memory the globals may take, in bytes.
+#define MEMORY_LIMIT (1 << 20)
+
+// A function as it was parsed, before the Optimiser changed it.
+struct EvalFunction {
+    struct ASTNode* Tree;
+    struct SymbolTableEntry* Locals;
+    struct EvalFunction* Next;
+};
+
+// A global in the image, and its contents before the current evaluation.
+struct EvalGlobal {
+    struct SymbolTableEntry* Symbol;
+    unsigned char* Memory;
+    unsigned char* Saved;
+    int Size;
+    struct EvalGlobal* Next;
+};
+
+// The variables of a call in progress.
+struct EvalFrame {
+    struct SymbolTableEntry* Function;
+    struct SymbolTableEntry* Symbols[64];
+    long Values[64];
+    int Count;
+    int Returning;
+    long Result;
+};
+
+static struct EvalFunction* Functions;
+static struct EvalGlobal* Image, *SavedImage;
+static int ImageSize;
+
+static int Steps, Depth, Failed;
+// Whether the globals may be used, which they can't when folding calls, as they may have changed by then.
+static int UseGlobals;
+
+static long EvalTree(struct ASTNode* Node, struct EvalFrame* Frame);
+
+/*
+ * Remember a function as it was parsed, so that calls to it can be evaluated.
+ * A copy is kept, as the original is about to be optimised and assembled.
+ *
+ * @param Tree: The OP_FUNC node of the function
+ */
+void RememberFunction(struct ASTNode* Tree) {
+    struct EvalFunction* Function = malloc(sizeof(struct EvalFunction));
+
+    if(Function == NULL)
+        Die("Unable to allocate evaluated function");
+
+    Function->Tree = CopyTree(Tree);
+    Function->Locals = Locals;
+    Function->Next = Functions;
+    Functions = Function;
+}
+
+static struct EvalFunction* FindFunction(struct SymbolTableEntry* Symbol) {
+    for(struct EvalFunction* Function = Functions; Function != NULL; Function = Function->Next)
+        if(Function->Tree->Symbol == Symbol)
+            return Function;
+    return NULL;
+}
+
+// Give up on this evaluation.
+static long Fail(void) {
+    Failed = 1;
+    return 0;
+}
+
+// Can a value of this type be held in one variable?
+static int EvalScalar(int Type) {
+    return TypeIsPtr(Type) || Type == RET_CHAR || Type == RET_INT || Type == RET_LONG;
+}
+
+// Narrow a value to how it would read back, once stored as a type.
+static long Narrow(long Value, int Type) {
+    switch(Type) {
+        case RET_CHAR: return (unsigned char) Value;
+        case RET_INT:  return (int) Value;
+        default:       return Value;
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * *
+ * * * * *     M E M O R Y     * * * * * *
+ * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Find the image of a global, making it the first time it is used.
+ * Everything starts as zero, as the real globals do.
+ */
+static struct EvalGlobal* EvalGlobalImage(struct SymbolTableEntry* Symbol) {
+    struct EvalGlobal* Global;
+    int Size;
+
+    for(Global = Image; Global != NULL; Global = Global->Next)
+        if(Global->Symbol == Symbol)
+            return Global;
+
+    if(!UseGlobals || !EvalScalar(Symbol->Structure == ST_ARR ? ValueAt(Symbol->Type) : Symbol->Type)
+        || (Symbol->Structure != ST_ARR && Symbol->Structure != ST_VAR))
+        return NULL;
+
+    Size = Symbol->Structure == ST_ARR ? PrimitiveSize(ValueAt(Symbol->Type)) * Symbol->Length : PrimitiveSize(Symbol->Type);
+    if(ImageSize + Size > MEMORY_LIMIT)
+        return NULL;
+
+    if((Global = malloc(sizeof(struct EvalGlobal))) == NULL || (Global->Memory = calloc(1, Size)) == NULL)
+        Die("Unable to allocate evaluated global");
+
+    Global->Symbol = Symbol;
+    Global->Saved = NULL;
+    Global->Size = Size;
+    Global->Next = Image;
+    Image = Global;
+    ImageSize += Size;
+    return Global;
+}
+
+// Find the memory at an address, if all of it lies inside one global.
+static unsigned char* EvalMemory(long Address, int Size) {
+    for(struct EvalGlobal* Global = Image; Global != NULL; Global = Global->Next)
+        if(Address >= (long) Global->Memory && Address + Size <= (long) Global->Memory + Global->Size)
+            return (unsigned char*) Address;
+
+    Fail();
+    return NULL;
+}
+
+static long EvalLoad(long Address, int Type) {
+    unsigned char* Memory = EvalMemory(Address, PrimitiveSize(Type));
+    long Value = 0;
+
+    if(Memory == NULL)
+        return 0;
+
+    memcpy(&Value, Memory, PrimitiveSize(Type));
+    return PrimitiveSize(Type) == 8 ? Value : Narrow(Value, Type);
+}
+
+static void EvalStore(long Address, int Type, long Value) {
+    unsigned char* Memory = EvalMemory(Address, PrimitiveSize(Type));
+
+    if(Memory != NULL)
+        memcpy(Memory, &Value, PrimitiveSize(Type));
+}
+
+// Keep the image as it is, so a failed evaluation can be undone.
+static void EvalSave(void) {
+    for(struct EvalGlobal* Global = Image; Global != NULL; Global = Global->Next) {
+        free(Global->Saved);
+        if((Global->Saved = malloc(Global->Size)) == NULL)
+            Die("Unable to allocate evaluated global");
+        memcpy(Global->Saved, Global->Memory, Global->Size);
+    }
+    SavedImage = Image;
+}
+
+static void EvalRestore(void) {
+    struct EvalGlobal* Global;
+
+    // The newest globals are first, so the ones made since are before the saved head.
+    while(Image != SavedImage) {
+        Global = Image;
+        Image = Global->Next;
+        ImageSize -= Global->Size;
+        free(Global->Memory);
+        free(Global->Saved);
+        free(Global);
+    }
+
+    for(Global = Image; Global != NULL; Global = Global->Next)
+        memcpy(Global->Memory, Global->Saved, Global->Size);
+}
+
+/*
+ * The contents a global starts with, if they were worked out at compile time.
+ * Called by AsGlobalSymbol, and by the VM.
+ *
+ * @return the contents, or NULL if the global starts as zero.
+ */
+unsigned char* EvaluatedGlobal(struct SymbolTableEntry* Symbol) {
+    for(struct EvalGlobal* Global = Image; Global != NULL; Global = Global->Next)
+        if(Global->Symbol == Symbol)
+            return Global->Memory;
+    return NULL;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ * * * * *     I N T E R P R E T E R     * * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Find where a local or parameter lives in the frame.
+static long* EvalVariable(struct EvalFrame* Frame, struct SymbolTableEntry* Symbol) {
+    for(int i = 0; i < Frame->Count; i++)
+        if(Frame->Symbols[i] == Symbol)
+            return &Frame->Values[i];
+
+    Fail();
+    return NULL;
+}
+
+static int IsLocal(struct SymbolTableEntry* Symbol) {
+    return Symbol->Storage == SC_LOCAL || Symbol->Storage == SC_PARAM;
+}
+
+// Read a variable, wherever it lives.
+static long EvalRead(struct EvalFrame* Frame, struct SymbolTableEntry* Symbol) {
+    struct EvalGlobal* Global;
+    long* Value;
+
+    if(IsLocal(Symbol))
+        return (Value = EvalVariable(Frame, Symbol)) ? *Value : 0;
+
+    if(Symbol->Structure != ST_VAR || (Global = EvalGlobalImage(Symbol)) == NULL)
+        return Fail();
+    return EvalLoad((long) Global->Memory, Symbol->Type);
+}
+
+static void EvalWrite(struct EvalFrame* Frame, struct SymbolTableEntry* Symbol, long Value) {
+    struct EvalGlobal* Global;
+    long* Variable;
+
+    if(IsLocal(Symbol)) {
+        if((Variable = EvalVariable(Frame, Symbol)) != NULL)
+            *Variable = Narrow(Value, Symbol->Type);
+        return;
+    }
+
+    if(Symbol->Structure != ST_VAR || (Global = EvalGlobalImage(Symbol)) == NULL) {
+        Fail();
+        return;
+    }
+    EvalStore((long) Global->Memory, Symbol->Type, Value);
+}
+
+// Increment or decrement a variable, as inc and dec would.
+static long EvalIncrement(struct EvalFrame* Frame, struct SymbolTableEntry* Symbol, int Operation) {
+    long Value = EvalRead(Frame, Symbol);
+    long Changed = Value + (Operation == OP_PREINC || Operation == OP_POSTINC ? 1 : -1);
+
+    EvalWrite(Frame, Symbol, Changed);
+    return Operation == OP_POSTINC || Operation == OP_POSTDEC ? Value : Narrow(Changed, Symbol->Type);
+}
+
+static long EvalIntrinsic(struct ASTNode* Node, long Value) {
+    int Wide = Node->Left->ExprType == RET_LONG, Width = Wide ? 64 : 32, Count = 0;
+    unsigned long Bits = Wide ? (unsigned long) Value : (unsigned int) Value, Result = 0;
+
+    switch(Node->IntValue) {
+        case IN_POPCOUNT:
+            for(; Bits != 0; Bits &= Bits - 1)
+                Count++;
+            return Count;
+
+        case IN_CLZ:
+            while(Count < Width && !(Bits & (1UL << (Width - 1 - Count))))
+                Count++;
+            return Count;
+
+        case IN_CTZ:
+            while(Count < Width && !(Bits & (1UL << Count)))
+                Count++;
+            return Count;
+
+        case IN_BSWAP:
+            for(int i = 0; i < Width / 8; i++)
+                Result = (Result << 8) | ((Bits >> (i * 8)) & 0xFF);
+            return Wide ? (long) Result : (int) Result;
+    }
+
+    return Fail();
+}
+
+static long EvalCall(struct EvalFunction* Function, long* Arguments, int Count);
+
+// Work out the arguments of a call, in the order the Assembler does, and make it.
+static long EvalCallNode(struct ASTNode* Node, struct EvalFrame* Frame) {
+    struct EvalFunction* Function;
+    struct ASTNode* Argument;
+    long Arguments[16];
+    int Count = Node->Left ? Node->Left->Size : 0;
+
+    if((Function = FindFunction(Node->Symbol)) == NULL || Count > 16)
+        return Fail();
+
+    for(Argument = Node->Left; Argument != NULL && !Failed; Argument = Argument->Left)
+        Arguments[Argument->Size - 1] = EvalTree(Argument->Right, Frame);
+
+    return Failed ? 0 : EvalCall(Function, Arguments, Count);
+}
+
+static long EvalSwitch(struct ASTNode* Node, struct EvalFrame* Frame) {
+    struct ASTNode* Case, *Label, *Default = NULL;
+    long Value = EvalTree(Node->Left, Frame);
+
+    for(Case = Node->Right; Case != NULL; Case = Case->Right) {
+        for(Label = Case; Label != NULL; Label = Label->Middle) {
+            if(Label->Operation == OP_DEFAULT)
+                Default = Case;
+            else if(Label->IntValue == Value)
+                return EvalTree(Case->Left, Frame);
+        }
+    }
+
+    if(Default != NULL)
+        EvalTree(Default->Left, Frame);
+    return 0;
+}
+
+/*
+ * Work out the value of a node.
+ * Statements are run for what they do, and give 0.
+ */
+static long EvalTree(struct ASTNode* Node, struct EvalFrame* Frame) {
+    long Left, Right;
+
+    if(Node == NULL || Failed || Frame->Returning)
+        return 0;
+
+    if(++Steps > STEP_LIMIT || TypeIsVector(Node->ExprType))
+        return Fail();
+
+    switch(Node->Operation) {
+        case OP_COMP:
+            EvalTree(Node->Left, Frame);
+            EvalTree(Node->Right, Frame);
+            return 0;
+
+        case OP_IF:
+            if(EvalTree(Node->Left, Frame))
+                EvalTree(Node->Middle, Frame);
+            else
+                EvalTree(Node->Right, Frame);
+            return 0;
+
+        case OP_LOOP:
+            while(!Failed && !Frame->Returning && EvalTree(Node->Left, Frame))
+                EvalTree(Node->Right, Frame);
+            return 0;
+
+        case OP_SWITCH:
+            return EvalSwitch(Node, Frame);
+
+        case OP_RET:
+            Left = EvalTree(Node->Left, Frame);
+            Frame->Result = Narrow(Left, Frame->Function->Type);
+            Frame->Returning = 1;
+            return 0;
+
+        case OP_CALL:
+            return EvalCallNode(Node, Frame);
+
+        case OP_INTRINSIC:
+            return EvalIntrinsic(Node, EvalTree(Node->Left, Frame));
+
+        case OP_ASSIGN:
+            Left = EvalTree(Node->Left, Frame);
+            if(Node->Right == NULL)
+                return Fail();
+
+            if(Node->Right->Operation == REF_IDENT)
+                EvalWrite(Frame, Node->Right->Symbol, Left);
+            else if(Node->Right->Operation == OP_DEREF)
+                EvalStore(EvalTree(Node->Right, Frame), Node->Right->ExprType, Left);
+            else
+                return Fail();
+            return Left;
+
+        case OP_PREINC:
+        case OP_PREDEC:
+            return EvalIncrement(Frame, Node->Left->Symbol, Node->Operation);
+
+        case OP_POSTINC:
+        case OP_POSTDEC:
+            return EvalIncrement(Frame, Node->Symbol, Node->Operation);
+
+        case REF_IDENT:
+            return EvalRead(Frame, Node->Symbol);
+
+        case TERM_INTLITERAL:
+            return Node->IntValue;
+
+        case OP_ADDRESS:
+            if(IsLocal(Node->Symbol) || EvalGlobalImage(Node->Symbol) == NULL)
+                return Fail();
+            return (long) EvalGlobalImage(Node->Symbol)->Memory;
+
+        case OP_DEREF:
+            Left = EvalTree(Node->Left, Frame);
+            return Node->RVal ? EvalLoad(Left, ValueAt(Node->Left->ExprType)) : Left;
+
+        case OP_WIDEN:
+            return EvalTree(Node->Left, Frame);
+
+        case OP_SCALE:
+            return (unsigned long) EvalTree(Node->Left, Frame) * Node->Size;
+
+        case OP_NEGATE:
+            return -(unsigned long) EvalTree(Node->Left, Frame);
+
+        case OP_BITNOT:
+            return ~EvalTree(Node->Left, Frame);
+
+        case OP_BOOLNOT:
+            return !EvalTree(Node->Left, Frame);
+
+        case OP_BOOLCONV:
+            return EvalTree(Node->Left, Frame) != 0;
+    }
+
+    Left = EvalTree(Node->Left, Frame);
+    Right = EvalTree(Node->Right, Frame);
+
+    switch(Node->Operation) {
+        case OP_ADD:      return (unsigned long) Left + Right;
+        case OP_SUBTRACT: return (unsigned long) Left - Right;
+        case OP_MULTIPLY: return (unsigned long) Left * Right;
+
+        // Anything idiv would fault on is left for the program to do.
+        case OP_DIVIDE:
+        case OP_MODULO:
+            if(Right == 0 || (Right == -1 && Left == (long) (1UL << 63)))
+                return Fail();
+            return Node->Operation == OP_DIVIDE ? Left / Right : Left % Right;
+
+        case OP_BITAND:   return Left & Right;
+        case OP_BITOR:    return Left | Right;
+        case OP_BITXOR:   return Left ^ Right;
+        case OP_SHIFTL:   return (unsigned long) Left << (Right & 63);
+        case OP_SHIFTR:   return (unsigned long) Left >> (Right & 63);
+
+        case OP_EQUAL:    return Left == Right;
+        case OP_INEQ:     return Left != Right;
+        case OP_LESS:     return Left < Right;
+        case OP_GREAT:    return Left > Right;
+        case OP_LESSE:    return Left <= Right;
+        case OP_GREATE:   return Left >= Right;
+    }
+
+    // Strings, printing, and whatever else can't be done here.
+    return Fail();
+}
+
+/*
+ * Run a function, in a frame of its own.
+ * Its locals start as zero; the program can't rely on them being anything else.
+ */
+static long EvalCall(struct EvalFunction* Function, long* Arguments, int Count) {
+    struct SymbolTableEntry* Symbol = Function->Tree->Symbol, *Variable;
+    struct EvalFrame Frame;
+
+    if(Count != Symbol->Elements || Depth == DEPTH_LIMIT)
+        return Fail();
+
+    Frame.Function = Symbol;
+    Frame.Count = Frame.Returning = 0;
+    Frame.Result = 0;
+
+    for(Variable = Symbol->Start; Variable != NULL && Frame.Count < 64; Variable = Variable->NextSymbol, Frame.Count++) {
+        Frame.Symbols[Frame.Count] = Variable;
+        Frame.Values[Frame.Count] = Narrow(Arguments[Frame.Count], Variable->Type);
+    }
+
+    for(Variable = Function->Locals; Variable != NULL && Frame.Count < 64; Variable = Variable->NextSymbol, Frame.Count++) {
+        if(Variable->Structure != ST_VAR || !EvalScalar(Variable->Type))
+            Fail();
+        Frame.Symbols[Frame.Count] = Variable;
+        Frame.Values[Frame.Count] = 0;
+    }
+
+    if(Variable != NULL)
+        Fail();
+
+    Depth++;
+    EvalTree(Function->Tree->Left, &Frame);
+    Depth--;
+    return Frame.Result;
+}
+
+/*
+ * Evaluate a call, if its arguments are constant.
+ *
+ * @return 1 and the value, if it could be worked out.
+ */
+static int EvalConstantCall(struct ASTNode* Call, long* Value) {
+    struct EvalFunction* Function;
+    struct ASTNode* Argument;
+    long Arguments[16];
+    int Count = Call->Left ? Call->Left->Size : 0;
+
+    if((Function = FindFunction(Call->Symbol)) == NULL || Count > 16)
+        return 0;
+
+    for(Argument = Call->Left; Argument != NULL; Argument = Argument->Left)
+        if(!ConstantValue(Argument->Right, &Arguments[Argument->Size - 1]))
+            return 0;
+
+    Steps = Depth = Failed = 0;
+    *Value = EvalCall(Function, Arguments, Count);
+    return !Failed;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * *
+ * * * * *     F O L D I N G     * * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * * */
+
+// Replace every call that can be worked out, innermost first.
+static void FoldCalls(struct ASTNode** Slot, struct ASTNode* Caller) {
+    struct ASTNode* Node = *Slot;
+    long Value;
+
+    if(Node == NULL)
+        return;
+
+    FoldCalls(&Node->Left, Caller);
+    FoldCalls(&Node->Middle, Caller);
+    FoldCalls(&Node->Right, Caller);
+
+    // Literals are built from an int, so wider results stay as calls.
+    if(Node->Operation != OP_CALL || !EvalConstantCall(Node, &Value) || Value != (int) Value)
+        return;
+
+    *Slot = ConstructLiteral(Node->ExprType, Value);
+
+    if(OptVerboseOutput)
+        printf("Evaluate: a call to %s in %s is always %ld, found in %d steps\n", Node->Symbol->Name, Caller->Symbol->Name, Value, Steps);
+}
+
+/*
+ * Replace the calls to pure functions with constant arguments, by their results.
+ *
+ * @param Tree: The OP_FUNC node of the function to fold calls in
+ */
+void EvaluateCalls(struct ASTNode* Tree) {
+    UseGlobals = 0;
+    FoldCalls(&Tree->Left, Tree);
+}
+
+/*
+ * Run the calls a statement starts with, against the image of the globals.
+ *
+ * @return 1 if the whole statement was run, and removed.
+ */
+static int EvalLeading(struct ASTNode** Slot) {
+    struct ASTNode* Node = *Slot;
+    long Value;
+
+    if(Node == NULL)
+        return 1;
+
+    if(Node->Operation == OP_COMP)
+        return EvalLeading(&Node->Left) && EvalLeading(&Node->Right);
+
+    if(Node->Operation != OP_CALL)
+        return 0;
+
+    EvalSave();
+    if(!EvalConstantCall(Node, &Value)) {
+        EvalRestore();
+        return 0;
+    }
+
+    *Slot = NULL;
+
+    if(OptVerboseOutput)
+        printf("Evaluate: ran %s at compile time, in %d steps\n", Node->Symbol->Name, Steps);
+    return 1;
+}
+
+/*
+ * Run the calls main starts with, while every global is still zero,
+ *  so their results can be put in the globals before the program starts.
+ * Only a whole program can do this, as it decides how the globals are emitted.
+ *
+ * @param Main: The OP_FUNC node of main
+ */
+void EvaluateInitialisers(struct ASTNode* Main) {
+    UseGlobals = 1;
+    EvalLeading(&Main->Left);
+    UseGlobals = 0;
+
+    if(OptVerboseOutput && Image != NULL)
+        printf("Evaluate: %d bytes of globals were worked out at compile time\n", ImageSize);
+}
@@ -0,0 +1,172 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+
+/****************************************************************
+ * Intrinsics look like function calls, but are assembled       *
+ *  inline into one or a few instructions.                      *
+ *                                                              *
+ * Scalars:                                                     *
+ *  popcount(x), clz(x), ctz(x)     bit counts, as a long       *
+ *  bswap(x)                        byte reversal of an int/long*
+ *                                                              *
+ * Vectors:                                                     *
+ *  i32x4(x)                        x in every lane             *
+ *  vload(p)                        16 bytes from p, where p is *
+ *                                   a char*, int* or long*     *
+ *  vstore(p, v)                    16 bytes to p               *
+ *  vshuffle(v, imm)                pshufd - rearrange the      *
+ *                                   32-bit lanes of v          *
+ *  vextract(v, lane)               a single lane of v          *
+ *  vmovemask(v)                    the top bit of each byte    *
+ *                                                              *
+ * They become an OP_INTRINSIC node, with the Intrinsics entry  *
+ *  in IntValue and the arguments in Left, Middle and Right.    *
+ *                                                              *
+ ****************************************************************/
+
+static char* IntrinsicNames[] = {
+    "popcount",
+    "clz",
+    "ctz",
+    "bswap",
+    NULL,       // Splats are spelled with the vector type's name
+    "vload",
+    "vstore",
+    "vshuffle",
+    "vextract",
+    "vmovemask"
+};
+
+static int IntrinsicArguments[] = { 1, 1, 1, 1, 1, 1, 2, 2, 2, 1 };
+
+/*
+ * Check whether an identifier names an intrinsic.
+ *
+ * @param Name: The identifier that is about to be called
+ * @return the Intrinsics entry, or -1 if it is an ordinary function.
+ */
+int FindIntrinsic(char* Name) {
+    for(size_t i = 0; i < sizeof(IntrinsicNames) / sizeof(IntrinsicNames[0]); i++)
+        if(IntrinsicNames[i] != NULL && !strcmp(Name, IntrinsicNames[i]))
+            return i;
+    return -1;
+}
+
+/*
+ * Some arguments must be known at compile time, as they are
+ *  encoded in the instruction itself.
+ */
+static int ImmediateArgument(struct ASTNode* Node, int Limit) {
+    long Value;
+
+    if(!ConstantValue(Node, &Value) || Value < 0 || Value >= Limit)
+        DieDecimal("Intrinsic argument must be a constant below", Limit);
+    return Value;
+}
+
+/*
+ * Parse the arguments of an intrinsic, check their types,
+ *  and work out the type of the result.
+ *
+ * @param Intrinsic: The Intrinsics entry being called
+ * @return the OP_INTRINSIC node
+ */
+struct ASTNode* ParseIntrinsic(int Intrinsic) {
+    struct ASTNode* Arguments[2] = { NULL, NULL }, *List;
+    int Count, Type;
+
+    VerifyToken(LI_LPARE, "(");
+    List = GetExpressionList();
+    VerifyToken(LI_RPARE, ")");
+
+    // The list is built back to front.
+    Count = List ? List->Size : 0;
+    if(Count != IntrinsicArguments[Intrinsic])
+        DieMessage("Wrong number of arguments to intrinsic", IntrinsicNames[Intrinsic]);
+
+    for(; List != NULL; List = List->Left) {
+        List->Right->RVal = 1;
+        Arguments[List->Size - 1] = List->Right;
+    }
+
+    Type = Arguments[0]->ExprType;
+
+    switch(Intrinsic) {
+        case IN_POPCOUNT:
+        case IN_CLZ:
+        case IN_CTZ:
+            if(!TypeIsInt(Type) || TypeIsVector(Type))
+                DieMessage("Bit counting needs an integer, in", IntrinsicNames[Intrinsic]);
+            Type = RET_LONG;
+            break;
+
+        case IN_BSWAP:
+            if(Type != RET_INT && Type != RET_LONG)
+                Die("bswap needs an int or a long");
+            break;
+
+        case IN_VLOAD:
+            if(!TypeIsPtr(Type) || (Type & 0xf) != 1)
+                Die("vload needs a pointer to char, int or long");
+            Type = VectorOf(ValueAt(Type));
+            break;
+
+        case IN_VSTORE:
+            if(!TypeIsPtr(Type) || (Type & 0xf) != 1 || !TypeIsVector(Arguments[1]->ExprType)
+                || VectorOf(ValueAt(Type)) != Arguments[1]->ExprType)
+                Die("vstore needs a pointer and a vector of the same element type");
+            Type = RET_NONE;
+            break;
+
+        case IN_VSHUFFLE:
+            if(!TypeIsVector(Type))
+                Die("vshuffle needs a vector");
+            ImmediateArgument(Arguments[1], 256);
+            break;
+
+        case IN_VEXTRACT:
+            if(!TypeIsVector(Type))
+                Die("vextract needs a vector");
+            ImmediateArgument(Arguments[1], 16 / PrimitiveSize(VectorElementType(Type)));
+            Type = VectorElementType(Type);
+            break;
+
+        case IN_VMOVEMASK:
+            if(!TypeIsVector(Type))
+                Die("vmovemask needs a vector");
+            Type = RET_INT;
+            break;
+    }
+
+    return ConstructASTNode(OP_INTRINSIC, Type, Arguments[0], NULL, Arguments[1], NULL, Intrinsic);
+}
+
+/*
+ * Parse a vector type used as a function, which copies
+ *  a scalar into every lane:
+ *   i32x4(0)
+ *
+ * @param Type: The vector type named
+ * @return the OP_INTRINSIC node
+ */
+struct ASTNode* ParseSplat(int Type) {
+    struct ASTNode* Value;
+
+    Tokenise();
+    VerifyToken(LI_LPARE, "(");
+
+    Value = ParsePrecedenceASTNode(0);
+    if(!TypeIsInt(Value->ExprType) || TypeIsVector(Value->ExprType))
+        Die("Vectors can only be filled with an integer");
+    Value->RVal = 1;
+
+    VerifyToken(LI_RPARE, ")");
+
+    return ConstructASTNode(OP_INTRINSIC, Type, Value, NULL, NULL, NULL, IN_SPLAT);
+}
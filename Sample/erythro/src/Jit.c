@@ -0,0 +1,1372 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#endif
+
+/********************************************************************************
+ * The JIT runs a program straight out of memory, for erythro --run.            *
+ *                                                                              *
+ * Rather than going through as and gcc, the assembly we generate is encoded    *
+ *  here, by a small assembler that understands exactly the instructions and    *
+ *  directives the code generator writes, and nothing else.                     *
+ *                                                                              *
+ * It works in one pass:                                                        *
+ *  * every section is encoded into its own buffer,                             *
+ *  * every jump, call and %rip relative address uses a 32 bit displacement,    *
+ *     so that an instruction's size never depends on where its label is,       *
+ *  * references to labels are noted as fixups, and patched once all of the     *
+ *     sections have been laid out in memory.                                   *
+ *                                                                              *
+ * Code goes into pages that are made executable once they are linked, and      *
+ *  data goes into pages after them.                                            *
+ * Anything we call that isn't defined by the program is looked up in the       *
+ *  libraries loaded into the compiler, and called through a stub, because      *
+ *  the library may be further away than a 32 bit displacement can reach.      *
+ *                                                                              *
+ * The code follows the Windows calling convention, as always, so main and     *
+ *  the constructors are called through ms_abi pointers.                        *
+ * What the program registers with atexit is kept here, and run once main has   *
+ *  returned, as the host's atexit would call it the wrong way on Linux.        *
+ *                                                                              *
+ ********************************************************************************/
+
+#define JIT_BUCKETS 1024
+// A stub is jmp *0(%rip), followed by the address it jumps to.
+#define STUB_SIZE 16
+// %rip, as a base register.
+#define RIP 16
+
+#define JITABI __attribute__((ms_abi))
+
+enum {
+    FIX_REL32,  // A 32 bit displacement from the end of the instruction
+    FIX_ABS64   // A 64 bit address
+};
+
+enum {
+    OPD_REGISTER,
+    OPD_VECTOR,
+    OPD_IMMEDIATE,
+    OPD_MEMORY,
+    OPD_SYMBOL
+};
+
+struct JitSection {
+    char* Name;
+    unsigned char* Data;
+    int Length;
+    int Capacity;
+    int Align;
+    int Code;
+    unsigned char* Address;
+};
+
+struct JitSymbol {
+    char* Name;
+    int Section;        // -1 until the symbol is defined
+    int Offset;
+    int Stub;           // -1 unless it's external, and called
+    void* Address;
+    struct JitSymbol* Next;
+};
+
+struct JitFixup {
+    int Kind;
+    int Section;
+    int Offset;
+    int End;
+    struct JitSymbol* Symbol;
+    long Addend;
+};
+
+struct JitOperand {
+    int Kind;
+    int Register;       // Registers and vectors
+    int Width;          // Registers, in bytes
+    long Value;         // Immediates, and the displacement or addend of memory and symbols
+    struct JitSymbol* Symbol;
+    int Base;           // Memory; -1 if there is none
+    int Index;
+    int Scale;
+};
+
+static struct JitSection* Sections;
+static int SectionCount, SectionCapacity, CurrentSection;
+
+static struct JitSymbol* Symbols[JIT_BUCKETS];
+
+static struct JitFixup* Fixups;
+static int FixupCount, FixupCapacity, InstructionFixups;
+
+static int StubCount;
+
+#define JIT_EXIT_HANDLERS 32
+typedef void (JITABI *JitHandler)(void);
+static JitHandler ExitHandlers[JIT_EXIT_HANDLERS];
+static int ExitHandlerCount;
+
+// The legacy registers, in encoding order.
+static char* JitRegisterNames[3][8] = {
+    { "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi" },
+    { "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi" },
+    { "al",  "cl",  "dl",  "bl",  "spl", "bpl", "sil", "dil" }
+};
+static int JitRegisterWidths[3] = { 8, 4, 1 };
+
+// The condition codes, shared by jcc and setcc.
+static struct { char* Suffix; int Code; } JitConditions[] = {
+    { "o",  0 }, { "no", 1 },
+    { "b",  2 }, { "c",  2 }, { "nae", 2 },
+    { "ae", 3 }, { "nb", 3 }, { "nc",  3 },
+    { "e",  4 }, { "z",  4 },
+    { "ne", 5 }, { "nz", 5 },
+    { "be", 6 }, { "na", 6 },
+    { "a",  7 }, { "nbe", 7 },
+    { "s",  8 }, { "ns", 9 },
+    { "p", 10 }, { "pe", 10 }, { "np", 11 }, { "po", 11 },
+    { "l", 12 }, { "nge", 12 },
+    { "ge", 13 }, { "nl", 13 },
+    { "le", 14 }, { "ng", 14 },
+    { "g", 15 }, { "nle", 15 },
+    { NULL, 0 }
+};
+
+// The instructions with the add family's encodings, in the order of their /digit.
+static char* JitArithmetic[8] = { "add", "or", "adc", "sbb", "and", "sub", "xor", "cmp" };
+
+// The instructions with the inc family's encodings, with their opcode and /digit.
+static struct { char* Name; int Opcode; int Digit; } JitUnary[] = {
+    { "inc",  0xFF, 0 }, { "dec",  0xFF, 1 },
+    { "not",  0xF7, 2 }, { "neg",  0xF7, 3 },
+    { "mul",  0xF7, 4 }, { "imul", 0xF7, 5 },
+    { "div",  0xF7, 6 }, { "idiv", 0xF7, 7 },
+    { NULL, 0, 0 }
+};
+
+static struct { char* Name; int Digit; } JitShifts[] = {
+    { "rol", 0 }, { "ror", 1 }, { "shl", 4 }, { "sal", 4 }, { "shr", 5 }, { "sar", 7 },
+    { NULL, 0 }
+};
+
+/*
+ * The SSE instructions that take an xmm register or memory, and an xmm register.
+ * Shifts have a second form, by an immediate, with its own opcode and /digit.
+ */
+static struct { char* Name; int Opcode; int ImmediateOpcode; int Digit; } JitVector[] = {
+    { "pand",       0x0FDB,   0,      0 }, { "pandn",      0x0FDF,   0,      0 },
+    { "por",        0x0FEB,   0,      0 }, { "pxor",       0x0FEF,   0,      0 },
+    { "paddb",      0x0FFC,   0,      0 }, { "paddw",      0x0FFD,   0,      0 },
+    { "paddd",      0x0FFE,   0,      0 }, { "paddq",      0x0FD4,   0,      0 },
+    { "psubb",      0x0FF8,   0,      0 }, { "psubw",      0x0FF9,   0,      0 },
+    { "psubd",      0x0FFA,   0,      0 }, { "psubq",      0x0FFB,   0,      0 },
+    { "pcmpeqb",    0x0F74,   0,      0 }, { "pcmpeqw",    0x0F75,   0,      0 },
+    { "pcmpeqd",    0x0F76,   0,      0 }, { "pcmpeqq",    0x0F3829, 0,      0 },
+    { "pcmpgtb",    0x0F64,   0,      0 }, { "pcmpgtw",    0x0F65,   0,      0 },
+    { "pcmpgtd",    0x0F66,   0,      0 }, { "pcmpgtq",    0x0F3837, 0,      0 },
+    { "pmullw",     0x0FD5,   0,      0 }, { "pmulld",     0x0F3840, 0,      0 },
+    { "pmuludq",    0x0FF4,   0,      0 },
+    { "punpcklbw",  0x0F60,   0,      0 }, { "punpcklwd",  0x0F61,   0,      0 },
+    { "punpckldq",  0x0F62,   0,      0 }, { "punpcklqdq", 0x0F6C,   0,      0 },
+    { "psllw",      0x0FF1,   0x0F71, 6 }, { "pslld",      0x0FF2,   0x0F72, 6 },
+    { "psllq",      0x0FF3,   0x0F73, 6 },
+    { "psrlw",      0x0FD1,   0x0F71, 2 }, { "psrld",      0x0FD2,   0x0F72, 2 },
+    { "psrlq",      0x0FD3,   0x0F73, 2 },
+    { "psraw",      0x0FE1,   0x0F71, 4 }, { "psrad",      0x0FE2,   0x0F72, 4 },
+    { NULL, 0, 0, 0 }
+};
+
+/*
+ * Stop assembling.
+ * Line holds the line of assembly we were on.
+ */
+static void JitError(char* Error, char* Reason) {
+    DieMessage(Error, Reason);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * * *      S E C T I O N S   &   S Y M B O L S     *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Switch to the section of the given name, creating it if it's new.
+ * All of the .text sections hold code, and everything else holds data.
+ */
+static void JitSwitchSection(char* Name) {
+    for(CurrentSection = 0; CurrentSection < SectionCount; CurrentSection++)
+        if(!strcmp(Sections[CurrentSection].Name, Name))
+            return;
+
+    if(SectionCount == SectionCapacity) {
+        SectionCapacity = SectionCapacity ? SectionCapacity * 2 : 16;
+        if((Sections = realloc(Sections, SectionCapacity * sizeof(struct JitSection))) == NULL)
+            Die("Unable to allocate JIT sections");
+    }
+
+    memset(&Sections[SectionCount], 0, sizeof(struct JitSection));
+    if((Sections[SectionCount].Name = strdup(Name)) == NULL)
+        Die("Unable to allocate JIT sections");
+    Sections[SectionCount].Align = 1;
+    Sections[SectionCount].Code = !strncmp(Name, ".text", 5);
+    CurrentSection = SectionCount++;
+}
+
+// Add bytes to the end of the current section.
+static void JitBytes(unsigned long Value, int Count) {
+    struct JitSection* Section = &Sections[CurrentSection];
+
+    if(Section->Length + Count > Section->Capacity) {
+        Section->Capacity = Section->Capacity ? Section->Capacity * 2 : 256;
+        if(Section->Capacity < Section->Length + Count)
+            Section->Capacity = Section->Length + Count;
+        if((Section->Data = realloc(Section->Data, Section->Capacity)) == NULL)
+            Die("Unable to allocate JIT section");
+    }
+
+    for(int i = 0; i < Count; i++, Value >>= 8)
+        Section->Data[Section->Length++] = Value & 0xFF;
+}
+
+static void JitByte(int Value) {
+    JitBytes(Value, 1);
+}
+
+/*
+ * Pad the current section out to a multiple of Align.
+ * Code is padded with nops, in case the padding runs.
+ */
+static void JitAlign(int Align) {
+    struct JitSection* Section = &Sections[CurrentSection];
+
+    if(Align < 1 || (Align & (Align - 1)))
+        JitError("Bad alignment", "not a power of two");
+
+    if(Align > Section->Align)
+        Section->Align = Align;
+
+    while(Section->Length % Align)
+        JitByte(Section->Code ? 0x90 : 0);
+}
+
+// Find a symbol by name, adding it as undefined if it hasn't been seen yet.
+static struct JitSymbol* JitSymbolFor(char* Name) {
+    unsigned int Hash = 0;
+    struct JitSymbol* Symbol;
+
+    for(char* Char = Name; *Char; Char++)
+        Hash = Hash * 31 + *Char;
+    Hash %= JIT_BUCKETS;
+
+    for(Symbol = Symbols[Hash]; Symbol != NULL; Symbol = Symbol->Next)
+        if(!strcmp(Symbol->Name, Name))
+            return Symbol;
+
+    if((Symbol = calloc(1, sizeof(struct JitSymbol))) == NULL || (Symbol->Name = strdup(Name)) == NULL)
+        Die("Unable to allocate JIT symbol");
+    Symbol->Section = -1;
+    Symbol->Stub = -1;
+    Symbol->Next = Symbols[Hash];
+    Symbols[Hash] = Symbol;
+    return Symbol;
+}
+
+// Note that the bytes about to be emitted refer to a symbol.
+static void JitFixup(int Kind, struct JitSymbol* Symbol, long Addend) {
+    if(FixupCount == FixupCapacity) {
+        FixupCapacity = FixupCapacity ? FixupCapacity * 2 : 256;
+        if((Fixups = realloc(Fixups, FixupCapacity * sizeof(struct JitFixup))) == NULL)
+            Die("Unable to allocate JIT fixups");
+    }
+
+    Fixups[FixupCount].Kind = Kind;
+    Fixups[FixupCount].Section = CurrentSection;
+    Fixups[FixupCount].Offset = Sections[CurrentSection].Length;
+    Fixups[FixupCount].End = -1;
+    Fixups[FixupCount].Symbol = Symbol;
+    Fixups[FixupCount].Addend = Addend;
+    FixupCount++;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * * * * *      O P E R A N D S       * * * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Strip the whitespace from both ends of some text, in place.
+static char* JitTrim(char* Text) {
+    char* End;
+
+    while(isspace((unsigned char) *Text))
+        Text++;
+
+    End = Text + strlen(Text);
+    while(End > Text && isspace((unsigned char) End[-1]))
+        *--End = '\0';
+
+    return Text;
+}
+
+/*
+ * Take the next comma separated part of some text, in place.
+ *
+ * @return the part, or NULL once there are none left
+ */
+static char* JitNextPart(char** Text) {
+    char* Part = *Text, *Comma;
+
+    if(Part == NULL)
+        return NULL;
+
+    if((Comma = strchr(Part, ',')) != NULL) {
+        *Comma = '\0';
+        *Text = Comma + 1;
+    } else {
+        *Text = NULL;
+    }
+
+    return Part;
+}
+
+/*
+ * Read the name of a register, without its %.
+ *
+ * @param Width: Set to the size of the register, in bytes, or 16 for an xmm register
+ * @return the number it is encoded with
+ */
+static int JitRegister(char* Name, int* Width) {
+    char* End;
+    long Number;
+
+    if(!strcmp(Name, "rip")) {
+        *Width = 8;
+        return RIP;
+    }
+
+    for(int Size = 0; Size < 3; Size++)
+        for(int i = 0; i < 8; i++)
+            if(!strcmp(Name, JitRegisterNames[Size][i])) {
+                *Width = JitRegisterWidths[Size];
+                return i;
+            }
+
+    if(!strncmp(Name, "xmm", 3)) {
+        Number = strtol(Name + 3, &End, 10);
+        if(End != Name + 3 && *End == '\0' && Number < 16) {
+            *Width = 16;
+            return Number;
+        }
+    }
+
+    // r8 to r15, and their d, w and b halves.
+    if(*Name == 'r') {
+        Number = strtol(Name + 1, &End, 10);
+        if(End != Name + 1 && Number >= 8 && Number < 16) {
+            *Width = *End == '\0' ? 8 : !strcmp(End, "d") ? 4 : !strcmp(End, "w") ? 2 : !strcmp(End, "b") ? 1 : 0;
+            if(*Width)
+                return Number;
+        }
+    }
+
+    JitError("Unknown register", Name);
+    return -1;
+}
+
+/*
+ * Read an address; a number, a symbol, or a symbol plus or minus a number.
+ */
+static void JitAddress(char* Text, struct JitOperand* Operand) {
+    char Name[TEXTLEN + 1], *End;
+    int Length = 0;
+
+    Text = JitTrim(Text);
+    Operand->Symbol = NULL;
+    Operand->Value = 0;
+
+    if(*Text == '\0')
+        return;
+
+    if(!isdigit((unsigned char) *Text) && *Text != '-') {
+        while(Text[Length] && Text[Length] != '+' && Text[Length] != '-' && Length < TEXTLEN)
+            Length++;
+        memcpy(Name, Text, Length);
+        Name[Length] = '\0';
+        Operand->Symbol = JitSymbolFor(JitTrim(Name));
+        Text += Length;
+        if(*Text == '+')
+            Text++;
+        if(*Text == '\0')
+            return;
+    }
+
+    Operand->Value = strtol(Text, &End, 0);
+    if(*JitTrim(End) != '\0')
+        JitError("Bad address", Text);
+}
+
+// Read one operand, in AT&T syntax.
+static void JitOperand(char* Text, struct JitOperand* Operand) {
+    char* Open, *Part, *Next;
+    int Width;
+
+    Text = JitTrim(Text);
+    memset(Operand, 0, sizeof(struct JitOperand));
+    Operand->Base = Operand->Index = -1;
+    Operand->Scale = 1;
+
+    // Indirect jumps; the instruction knows what it means.
+    if(*Text == '*')
+        Text = JitTrim(Text + 1);
+
+    if(*Text == '%') {
+        Operand->Register = JitRegister(Text + 1, &Operand->Width);
+        Operand->Kind = Operand->Width == 16 ? OPD_VECTOR : OPD_REGISTER;
+        return;
+    }
+
+    if(*Text == '$') {
+        Operand->Kind = OPD_IMMEDIATE;
+        Operand->Value = strtol(Text + 1, &Next, 0);
+        if(Next == Text + 1 || *JitTrim(Next) != '\0')
+            JitError("Bad immediate", Text);
+        return;
+    }
+
+    if((Open = strchr(Text, '(')) == NULL) {
+        Operand->Kind = OPD_SYMBOL;
+        JitAddress(Text, Operand);
+        return;
+    }
+
+    // disp(base, index, scale)
+    Operand->Kind = OPD_MEMORY;
+    *Open++ = '\0';
+    JitAddress(Text, Operand);
+
+    if((Next = strchr(Open, ')')) == NULL)
+        JitError("Bad memory operand", Text);
+    *Next = '\0';
+
+    for(int i = 0; (Part = JitNextPart(&Open)) != NULL; i++) {
+        Part = JitTrim(Part);
+        if(i == 2) {
+            Operand->Scale = atoi(Part);
+            if(Operand->Scale != 1 && Operand->Scale != 2 && Operand->Scale != 4 && Operand->Scale != 8)
+                JitError("Bad scale", Part);
+        } else if(*Part == '%') {
+            if(i == 0)
+                Operand->Base = JitRegister(Part + 1, &Width);
+            else
+                Operand->Index = JitRegister(Part + 1, &Width);
+        } else if(*Part || i > 1) {
+            JitError("Bad memory operand", Part);
+        }
+    }
+
+    if(Operand->Index == RIP || Operand->Index == 4 || (Operand->Base == RIP && Operand->Index != -1))
+        JitError("Bad memory operand", "unencodable index");
+    if(Operand->Symbol != NULL && Operand->Base != RIP)
+        JitError("Bad memory operand", "symbols must be addressed relative to %rip");
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * * * *      E N C O D I N G       * * * * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static int FitsByte(long Value) {
+    return Value >= -128 && Value <= 127;
+}
+
+static int FitsLong(long Value) {
+    return Value >= INT32_MIN && Value <= INT32_MAX;
+}
+
+/*
+ * spl, bpl, sil and dil need a REX prefix, or they mean ah, ch, dh and bh.
+ */
+static int JitByteRex(struct JitOperand* Operand) {
+    return Operand->Kind == OPD_REGISTER && Operand->Width == 1 && Operand->Register >= 4 && Operand->Register < 8 ? 0x40 : 0;
+}
+
+/*
+ * Emit an instruction in the usual form:
+ *  [Prefix] [REX] Opcode ModRM [SIB] [Displacement]
+ * The immediate, if there is one, is left for the caller.
+ *
+ * @param Prefix: 0x66 or 0xF3 for the SSE instructions, or 0 for none
+ * @param Rex: 0x48 for a 64 bit operation, 0x40 to force the prefix, or 0
+ * @param Opcode: One to three bytes; the escape bytes are in the high bytes
+ * @param Reg: The register, or /digit, that goes in the reg field
+ * @param Rm: The register or memory that goes in the r/m field
+ */
+static void JitEncode(int Prefix, int Rex, int Opcode, int Reg, struct JitOperand* Rm) {
+    int Base = Rm->Base, Index = Rm->Index, Mode, Displacement = Rm->Value;
+
+    if(Prefix)
+        JitByte(Prefix);
+
+    Rex |= (Reg & 8) ? 0x44 : 0;
+    if(Rm->Kind == OPD_MEMORY) {
+        Rex |= (Base != -1 && Base != RIP && (Base & 8)) ? 0x41 : 0;
+        Rex |= (Index != -1 && (Index & 8)) ? 0x42 : 0;
+    } else {
+        Rex |= (Rm->Register & 8) ? 0x41 : 0;
+    }
+    if(Rex)
+        JitByte(Rex);
+
+    if(Opcode > 0xFFFF)
+        JitByte(Opcode >> 16);
+    if(Opcode > 0xFF)
+        JitByte((Opcode >> 8) & 0xFF);
+    JitByte(Opcode & 0xFF);
+
+    Reg &= 7;
+
+    if(Rm->Kind != OPD_MEMORY) {
+        JitByte(0xC0 | Reg << 3 | (Rm->Register & 7));
+        return;
+    }
+
+    if(!FitsLong(Rm->Value))
+        JitError("Bad memory operand", "the displacement is too large");
+
+    if(Base == RIP) {
+        JitByte(Reg << 3 | 5);
+        if(Rm->Symbol != NULL)
+            JitFixup(FIX_REL32, Rm->Symbol, Rm->Value);
+        JitBytes(Rm->Symbol != NULL ? 0 : Displacement, 4);
+        return;
+    }
+
+    // With no base, there's always a 32 bit displacement.
+    if(Base == -1) {
+        JitByte(Reg << 3 | 4);
+        JitByte((Rm->Scale == 8 ? 3 : Rm->Scale == 4 ? 2 : Rm->Scale == 2 ? 1 : 0) << 6 | (Index == -1 ? 4 : Index & 7) << 3 | 5);
+        JitBytes(Displacement, 4);
+        return;
+    }
+
+    // rbp and r13 can't go without a displacement.
+    Mode = Displacement == 0 && (Base & 7) != 5 ? 0 : FitsByte(Displacement) ? 1 : 2;
+
+    if(Index == -1 && (Base & 7) != 4) {
+        JitByte(Mode << 6 | Reg << 3 | (Base & 7));
+    } else {
+        JitByte(Mode << 6 | Reg << 3 | 4);
+        JitByte((Rm->Scale == 8 ? 3 : Rm->Scale == 4 ? 2 : Rm->Scale == 2 ? 1 : 0) << 6 | (Index == -1 ? 4 : Index & 7) << 3 | (Base & 7));
+    }
+
+    if(Mode == 1)
+        JitByte(Displacement);
+    else if(Mode == 2)
+        JitBytes(Displacement, 4);
+}
+
+// Emit a relative jump or call, with the displacement filled in later.
+static void JitBranch(int Opcode, struct JitOperand* Target) {
+    if(Target->Kind != OPD_SYMBOL || Target->Symbol == NULL)
+        JitError("Bad operand", "branches need a label");
+
+    if(Opcode > 0xFF)
+        JitByte(Opcode >> 8);
+    JitByte(Opcode & 0xFF);
+
+    JitFixup(FIX_REL32, Target->Symbol, Target->Value);
+    JitBytes(0, 4);
+}
+
+/*
+ * Does a mnemonic name a sized instruction?
+ *
+ * @param Base: The instruction without its size suffix
+ * @return the size in bytes, -1 if there's no suffix, or 0 if it's another instruction
+ */
+static int JitSized(char* Mnemonic, char* Base) {
+    int Length = strlen(Base);
+
+    if(strncmp(Mnemonic, Base, Length))
+        return 0;
+
+    switch(Mnemonic[Length]) {
+        case '\0':
+            return -1;
+        case 'b':
+            return Mnemonic[Length + 1] ? 0 : 1;
+        case 'w':
+            return Mnemonic[Length + 1] ? 0 : 2;
+        case 'l':
+            return Mnemonic[Length + 1] ? 0 : 4;
+        case 'q':
+            return Mnemonic[Length + 1] ? 0 : 8;
+        default:
+            return 0;
+    }
+}
+
+// The condition code of a jcc or setcc, or -1 if it isn't one.
+static int JitCondition(char* Suffix) {
+    for(int i = 0; JitConditions[i].Suffix != NULL; i++)
+        if(!strcmp(Suffix, JitConditions[i].Suffix))
+            return JitConditions[i].Code;
+    return -1;
+}
+
+/*
+ * Work out the size of an instruction that had no suffix, from its registers.
+ */
+static int JitInferWidth(struct JitOperand* Operands, int Count) {
+    for(int i = 0; i < Count; i++)
+        if(Operands[i].Kind == OPD_REGISTER)
+            return Operands[i].Width;
+
+    JitError("Ambiguous operand size", "add a suffix");
+    return 0;
+}
+
+/*
+ * The prefix and REX for a general purpose operation of this size.
+ */
+static int JitSizePrefix(int Width) {
+    return Width == 2 ? 0x66 : 0;
+}
+
+static int JitSizeRex(int Width) {
+    return Width == 8 ? 0x48 : 0;
+}
+
+/*
+ * Encode an SSE instruction.
+ *
+ * @return whether the mnemonic was one
+ */
+static int JitVectorInstruction(char* Mnemonic, struct JitOperand* Operands, int Count) {
+    struct JitOperand* Source = &Operands[0], *Destination = &Operands[Count - 1];
+
+    for(int i = 0; JitVector[i].Name != NULL; i++) {
+        if(strcmp(Mnemonic, JitVector[i].Name))
+            continue;
+
+        if(Count != 2 || Destination->Kind != OPD_VECTOR)
+            JitError("Bad operands", Mnemonic);
+
+        if(Source->Kind == OPD_IMMEDIATE) {
+            if(!JitVector[i].ImmediateOpcode)
+                JitError("Bad operands", Mnemonic);
+            JitEncode(0x66, 0, JitVector[i].ImmediateOpcode, JitVector[i].Digit, Destination);
+            JitByte(Source->Value);
+        } else {
+            JitEncode(0x66, 0, JitVector[i].Opcode, Destination->Register, Source);
+        }
+        return 1;
+    }
+
+    if(!strcmp(Mnemonic, "movdqu") || !strcmp(Mnemonic, "movdqa")) {
+        if(Count != 2)
+            JitError("Bad operands", Mnemonic);
+        if(Destination->Kind == OPD_VECTOR)
+            JitEncode(Mnemonic[5] == 'u' ? 0xF3 : 0x66, 0, 0x0F6F, Destination->Register, Source);
+        else
+            JitEncode(Mnemonic[5] == 'u' ? 0xF3 : 0x66, 0, 0x0F7F, Source->Register, Destination);
+        return 1;
+    }
+
+    // movd, and movq when it involves an xmm register.
+    if(!strcmp(Mnemonic, "movd") || (!strcmp(Mnemonic, "movq") && Count == 2 &&
+            (Source->Kind == OPD_VECTOR || Destination->Kind == OPD_VECTOR))) {
+        if(Source->Kind == OPD_VECTOR && Destination->Kind == OPD_VECTOR)
+            JitEncode(0xF3, 0, 0x0F7E, Destination->Register, Source);
+        else if(Destination->Kind == OPD_VECTOR)
+            JitEncode(0x66, Mnemonic[3] == 'q' ? 0x48 : 0, 0x0F6E, Destination->Register, Source);
+        else if(Source->Kind == OPD_VECTOR)
+            JitEncode(0x66, Mnemonic[3] == 'q' ? 0x48 : 0, 0x0F7E, Source->Register, Destination);
+        else
+            JitError("Bad operands", Mnemonic);
+        return 1;
+    }
+
+    // The ones with an immediate as well.
+    if(!strcmp(Mnemonic, "pshufd") || !strcmp(Mnemonic, "pextrw")) {
+        if(Count != 3 || Source->Kind != OPD_IMMEDIATE)
+            JitError("Bad operands", Mnemonic);
+        JitEncode(0x66, 0, Mnemonic[1] == 's' ? 0x0F70 : 0x0FC5, Destination->Register, &Operands[1]);
+        JitByte(Source->Value);
+        return 1;
+    }
+
+    if(!strcmp(Mnemonic, "pmovmskb")) {
+        if(Count != 2 || Source->Kind != OPD_VECTOR)
+            JitError("Bad operands", Mnemonic);
+        JitEncode(0x66, 0, 0x0FD7, Destination->Register, Source);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Encode one instruction.
+ * The operands are in AT&T order; source first, destination last.
+ */
+static void JitInstruction(char* Mnemonic, struct JitOperand* Operands, int Count) {
+    struct JitOperand* Source = &Operands[0], *Destination = &Operands[Count - 1];
+    int Width, Condition;
+
+    if(JitVectorInstruction(Mnemonic, Operands, Count))
+        return;
+
+    // Instructions without operands.
+    if(Count == 0) {
+        if(!strcmp(Mnemonic, "ret"))
+            JitByte(0xC3);
+        else if(!strcmp(Mnemonic, "cqo") || !strcmp(Mnemonic, "cqto"))
+            JitBytes(0x9948, 2);
+        else if(!strcmp(Mnemonic, "cltq") || !strcmp(Mnemonic, "cdqe"))
+            JitBytes(0x9848, 2);
+        else if(!strcmp(Mnemonic, "nop"))
+            JitByte(0x90);
+        else
+            JitError("Unknown instruction", Mnemonic);
+        return;
+    }
+
+    // Branches.
+    if(!strcmp(Mnemonic, "jmp") || !strcmp(Mnemonic, "call")) {
+        if(Count != 1)
+            JitError("Bad operands", Mnemonic);
+        if(Source->Kind == OPD_SYMBOL)
+            JitBranch(*Mnemonic == 'j' ? 0xE9 : 0xE8, Source);
+        else
+            JitEncode(0, 0, 0xFF, *Mnemonic == 'j' ? 4 : 2, Source);
+        return;
+    }
+
+    if(*Mnemonic == 'j' && (Condition = JitCondition(Mnemonic + 1)) != -1) {
+        if(Count != 1)
+            JitError("Bad operands", Mnemonic);
+        JitBranch(0x0F80 | Condition, Source);
+        return;
+    }
+
+    if(!strncmp(Mnemonic, "set", 3) && (Condition = JitCondition(Mnemonic + 3)) != -1) {
+        if(Count != 1 || (Source->Kind == OPD_REGISTER && Source->Width != 1))
+            JitError("Bad operands", Mnemonic);
+        JitEncode(0, JitByteRex(Source), 0x0F90 | Condition, 0, Source);
+        return;
+    }
+
+    // The moves that change size.
+    if(!strcmp(Mnemonic, "movslq") || !strcmp(Mnemonic, "movsxd")) {
+        JitEncode(0, 0x48, 0x63, Destination->Register, Source);
+        return;
+    }
+
+    if(!strcmp(Mnemonic, "movzbq") || !strcmp(Mnemonic, "movzbl")) {
+        JitEncode(0, (Mnemonic[5] == 'q' ? 0x48 : 0) | JitByteRex(Source), 0x0FB6, Destination->Register, Source);
+        return;
+    }
+
+    if(!strcmp(Mnemonic, "movabsq")) {
+        if(Count != 2 || Source->Kind != OPD_IMMEDIATE || Destination->Kind != OPD_REGISTER)
+            JitError("Bad operands", Mnemonic);
+        JitByte(0x48 | (Destination->Register >> 3));
+        JitByte(0xB8 + (Destination->Register & 7));
+        JitBytes(Source->Value, 8);
+        return;
+    }
+
+    // push and pop only ever see whole registers.
+    if((Width = JitSized(Mnemonic, "push")) || JitSized(Mnemonic, "pop")) {
+        if(Count != 1 || Source->Kind != OPD_REGISTER || Source->Width != 8)
+            JitError("Bad operands", Mnemonic);
+        if(Source->Register & 8)
+            JitByte(0x41);
+        JitByte((Width ? 0x50 : 0x58) + (Source->Register & 7));
+        return;
+    }
+
+    if((Width = JitSized(Mnemonic, "bswap"))) {
+        if(Count != 1 || Source->Kind != OPD_REGISTER)
+            JitError("Bad operands", Mnemonic);
+        Width = Width == -1 ? Source->Width : Width;
+        if(JitSizeRex(Width) || (Source->Register & 8))
+            JitByte(JitSizeRex(Width) | 0x40 | (Source->Register >> 3));
+        JitByte(0x0F);
+        JitByte(0xC8 + (Source->Register & 7));
+        return;
+    }
+
+    if((Width = JitSized(Mnemonic, "lzcnt")) || (Width = JitSized(Mnemonic, "tzcnt")) || (Width = JitSized(Mnemonic, "popcnt"))) {
+        Width = Width == -1 ? JitInferWidth(Operands, Count) : Width;
+        JitEncode(0xF3, JitSizeRex(Width), *Mnemonic == 'l' ? 0x0FBD : *Mnemonic == 't' ? 0x0FBC : 0x0FB8, Destination->Register, Source);
+        return;
+    }
+
+    if((Width = JitSized(Mnemonic, "bsr")) || (Width = JitSized(Mnemonic, "bsf"))) {
+        Width = Width == -1 ? JitInferWidth(Operands, Count) : Width;
+        JitEncode(JitSizePrefix(Width), JitSizeRex(Width), Mnemonic[2] == 'r' ? 0x0FBD : 0x0FBC, Destination->Register, Source);
+        return;
+    }
+
+    // Only with a size suffix, as cmovl would be cmov on less.
+    if(!strncmp(Mnemonic, "cmov", 4) && strlen(Mnemonic) > 5) {
+        char Condition[8];
+
+        snprintf(Condition, sizeof(Condition), "%.*s", (int) strlen(Mnemonic) - 5, Mnemonic + 4);
+        Width = JitSized(Mnemonic + strlen(Mnemonic) - 1, "");
+        if(Width <= 1 || JitCondition(Condition) == -1)
+            JitError("Unknown instruction", Mnemonic);
+        JitEncode(JitSizePrefix(Width), JitSizeRex(Width), 0x0F40 + JitCondition(Condition), Destination->Register, Source);
+        return;
+    }
+
+    if((Width = JitSized(Mnemonic, "lea"))) {
+        Width = Width == -1 ? JitInferWidth(Operands, Count) : Width;
+        if(Count != 2 || Source->Kind != OPD_MEMORY)
+            JitError("Bad operands", Mnemonic);
+        JitEncode(JitSizePrefix(Width), JitSizeRex(Width), 0x8D, Destination->Register, Source);
+        return;
+    }
+
+    if((Width = JitSized(Mnemonic, "mov"))) {
+        Width = Width == -1 ? JitInferWidth(Operands, Count) : Width;
+        if(Count != 2)
+            JitError("Bad operands", Mnemonic);
+
+        if(Source->Kind == OPD_IMMEDIATE) {
+            // A 64 bit constant needs the whole 10 byte form.
+            if(Width == 8 && !FitsLong(Source->Value) && Destination->Kind == OPD_REGISTER) {
+                JitByte(0x48 | (Destination->Register >> 3));
+                JitByte(0xB8 + (Destination->Register & 7));
+                JitBytes(Source->Value, 8);
+                return;
+            }
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Destination), Width == 1 ? 0xC6 : 0xC7, 0, Destination);
+            JitBytes(Source->Value, Width == 8 ? 4 : Width);
+        } else if(Source->Kind == OPD_REGISTER) {
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Source) | JitByteRex(Destination), Width == 1 ? 0x88 : 0x89, Source->Register, Destination);
+        } else if(Destination->Kind == OPD_REGISTER) {
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Destination), Width == 1 ? 0x8A : 0x8B, Destination->Register, Source);
+        } else {
+            JitError("Bad operands", Mnemonic);
+        }
+        return;
+    }
+
+    if((Width = JitSized(Mnemonic, "test"))) {
+        Width = Width == -1 ? JitInferWidth(Operands, Count) : Width;
+        if(Count != 2 || Source->Kind != OPD_REGISTER)
+            JitError("Bad operands", Mnemonic);
+        JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Source) | JitByteRex(Destination), Width == 1 ? 0x84 : 0x85, Source->Register, Destination);
+        return;
+    }
+
+    for(int Digit = 0; Digit < 8; Digit++) {
+        if(!(Width = JitSized(Mnemonic, JitArithmetic[Digit])))
+            continue;
+        Width = Width == -1 ? JitInferWidth(Operands, Count) : Width;
+        if(Count != 2)
+            JitError("Bad operands", Mnemonic);
+
+        if(Source->Kind == OPD_IMMEDIATE) {
+            if(!FitsLong(Source->Value))
+                JitError("Bad operands", "the immediate is too large");
+            if(Width == 1) {
+                JitEncode(0, JitByteRex(Destination), 0x80, Digit, Destination);
+                JitByte(Source->Value);
+            } else if(FitsByte(Source->Value)) {
+                JitEncode(JitSizePrefix(Width), JitSizeRex(Width), 0x83, Digit, Destination);
+                JitByte(Source->Value);
+            } else {
+                JitEncode(JitSizePrefix(Width), JitSizeRex(Width), 0x81, Digit, Destination);
+                JitBytes(Source->Value, Width == 2 ? 2 : 4);
+            }
+        } else if(Source->Kind == OPD_REGISTER) {
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Source) | JitByteRex(Destination), Digit * 8 + (Width == 1 ? 0 : 1), Source->Register, Destination);
+        } else if(Destination->Kind == OPD_REGISTER) {
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Destination), Digit * 8 + (Width == 1 ? 2 : 3), Destination->Register, Source);
+        } else {
+            JitError("Bad operands", Mnemonic);
+        }
+        return;
+    }
+
+    for(int i = 0; JitShifts[i].Name != NULL; i++) {
+        if(!(Width = JitSized(Mnemonic, JitShifts[i].Name)))
+            continue;
+        Width = Width == -1 ? JitInferWidth(&Operands[Count - 1], 1) : Width;
+
+        // A shift by one has its own form.
+        if(Count == 1 || (Source->Kind == OPD_IMMEDIATE && Source->Value == 1)) {
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Destination), Width == 1 ? 0xD0 : 0xD1, JitShifts[i].Digit, Destination);
+        } else if(Source->Kind == OPD_IMMEDIATE) {
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Destination), Width == 1 ? 0xC0 : 0xC1, JitShifts[i].Digit, Destination);
+            JitByte(Source->Value);
+        } else if(Source->Kind == OPD_REGISTER && Source->Register == 1 && Source->Width == 1) {
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Destination), Width == 1 ? 0xD2 : 0xD3, JitShifts[i].Digit, Destination);
+        } else {
+            JitError("Bad operands", "shifts count by an immediate or %cl");
+        }
+        return;
+    }
+
+    // imul also has two and three operand forms.
+    if((Width = JitSized(Mnemonic, "imul")) && Count > 1) {
+        Width = Width == -1 ? JitInferWidth(&Operands[Count - 1], 1) : Width;
+        if(Count == 2) {
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width), 0x0FAF, Destination->Register, Source);
+        } else {
+            if(Source->Kind != OPD_IMMEDIATE || !FitsLong(Source->Value))
+                JitError("Bad operands", Mnemonic);
+            JitEncode(JitSizePrefix(Width), JitSizeRex(Width), FitsByte(Source->Value) ? 0x6B : 0x69, Destination->Register, &Operands[1]);
+            JitBytes(Source->Value, FitsByte(Source->Value) ? 1 : Width == 2 ? 2 : 4);
+        }
+        return;
+    }
+
+    for(int i = 0; JitUnary[i].Name != NULL; i++) {
+        if(!(Width = JitSized(Mnemonic, JitUnary[i].Name)))
+            continue;
+        Width = Width == -1 ? JitInferWidth(Operands, Count) : Width;
+        if(Count != 1)
+            JitError("Bad operands", Mnemonic);
+        JitEncode(JitSizePrefix(Width), JitSizeRex(Width) | JitByteRex(Source), Width == 1 ? JitUnary[i].Opcode - 1 : JitUnary[i].Opcode, JitUnary[i].Digit, Source);
+        return;
+    }
+
+    JitError("Unknown instruction", Mnemonic);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * * * *      D I R E C T I V E S     * * * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Emit the contents of a quoted string, undoing the escapes that
+ *  AsStringCharacters writes.
+ */
+static void JitString(char* Text, int Terminate) {
+    int Value;
+
+    Text = JitTrim(Text);
+    if(*Text++ != '"')
+        JitError("Bad string", Text);
+
+    while(*Text != '"') {
+        if(*Text == '\0')
+            JitError("Bad string", "it isn't closed");
+
+        if(*Text != '\\') {
+            JitByte(*Text++);
+            continue;
+        }
+
+        Text++;
+        if(*Text >= '0' && *Text <= '7') {
+            Value = 0;
+            for(int i = 0; i < 3 && *Text >= '0' && *Text <= '7'; i++)
+                Value = Value * 8 + *Text++ - '0';
+            JitByte(Value);
+            continue;
+        }
+
+        switch(*Text++) {
+            case 'n': JitByte('\n'); break;
+            case 't': JitByte('\t'); break;
+            case 'r': JitByte('\r'); break;
+            case '0': JitByte('\0'); break;
+            default:  JitByte(Text[-1]); break;
+        }
+    }
+
+    if(Terminate)
+        JitByte(0);
+}
+
+/*
+ * Emit a list of numbers, each Size bytes long.
+ * Quads may also be the addresses of symbols.
+ */
+static void JitData(char* Text, int Size) {
+    struct JitOperand Value;
+    char* Part;
+
+    while((Part = JitNextPart(&Text)) != NULL) {
+        JitAddress(Part, &Value);
+        if(Value.Symbol != NULL) {
+            if(Size != 8)
+                JitError("Bad data", "only quads can hold addresses");
+            JitFixup(FIX_ABS64, Value.Symbol, Value.Value);
+            JitBytes(0, 8);
+        } else {
+            JitBytes(Value.Value, Size);
+        }
+    }
+}
+
+// Handle one directive.
+static void JitDirective(char* Name, char* Arguments) {
+    char* Comma;
+
+    if(!strcmp(Name, ".text") || !strcmp(Name, ".data") || !strcmp(Name, ".bss")) {
+        JitSwitchSection(Name);
+    } else if(!strcmp(Name, ".section")) {
+        if((Comma = strchr(Arguments, ',')) != NULL)
+            *Comma = '\0';
+        JitSwitchSection(JitTrim(Arguments));
+    } else if(!strcmp(Name, ".p2align")) {
+        JitAlign(1 << atoi(Arguments));
+    } else if(!strcmp(Name, ".balign") || !strcmp(Name, ".align")) {
+        JitAlign(atoi(Arguments));
+    } else if(!strcmp(Name, ".zero") || !strcmp(Name, ".skip")) {
+        for(int Count = atoi(Arguments); Count > 0; Count--)
+            JitByte(0);
+    } else if(!strcmp(Name, ".byte")) {
+        JitData(Arguments, 1);
+    } else if(!strcmp(Name, ".short") || !strcmp(Name, ".word")) {
+        JitData(Arguments, 2);
+    } else if(!strcmp(Name, ".long") || !strcmp(Name, ".int")) {
+        JitData(Arguments, 4);
+    } else if(!strcmp(Name, ".quad")) {
+        JitData(Arguments, 8);
+    } else if(!strcmp(Name, ".ascii")) {
+        JitString(Arguments, 0);
+    } else if(!strcmp(Name, ".string") || !strcmp(Name, ".asciz")) {
+        JitString(Arguments, 1);
+    } else if(strcmp(Name, ".globl") && strcmp(Name, ".global") && strcmp(Name, ".def") && strcmp(Name, ".file")) {
+        // Every symbol is visible to every other, and there are no debug records, so those are ignored.
+        JitError("Unknown directive", Name);
+    }
+}
+
+/*
+ * Assemble one line.
+ */
+static void JitLine(char* Text) {
+    struct JitOperand Operands[3];
+    char* Mnemonic, *Part, *Arguments, *Char;
+    int Count = 0, Depth = 0;
+
+    Text = JitTrim(Text);
+    if(*Text == '\0' || *Text == '#')
+        return;
+
+    // A label.
+    if(Text[strlen(Text) - 1] == ':') {
+        struct JitSymbol* Symbol;
+
+        Text[strlen(Text) - 1] = '\0';
+        Symbol = JitSymbolFor(JitTrim(Text));
+        if(Symbol->Section != -1)
+            JitError("Symbol defined twice", Symbol->Name);
+        Symbol->Section = CurrentSection;
+        Symbol->Offset = Sections[CurrentSection].Length;
+        return;
+    }
+
+    Mnemonic = Text;
+    for(Arguments = Text; *Arguments && !isspace((unsigned char) *Arguments); Arguments++)
+        ;
+    if(*Arguments)
+        *Arguments++ = '\0';
+
+    if(*Mnemonic == '.') {
+        JitDirective(Mnemonic, Arguments);
+        return;
+    }
+
+    if(!Sections[CurrentSection].Code)
+        JitError("Instruction outside of code", Mnemonic);
+
+    // Split on the commas that aren't inside of brackets.
+    Arguments = JitTrim(Arguments);
+    for(Part = Char = Arguments; *Part; Char++) {
+        if(*Char == '(') {
+            Depth++;
+        } else if(*Char == ')') {
+            Depth--;
+        } else if((*Char == ',' && Depth == 0) || *Char == '\0') {
+            if(Count == 3)
+                JitError("Too many operands", Mnemonic);
+            if(*Char == '\0') {
+                JitOperand(Part, &Operands[Count++]);
+                break;
+            }
+            *Char = '\0';
+            JitOperand(Part, &Operands[Count++]);
+            Part = Char + 1;
+        }
+    }
+
+    InstructionFixups = FixupCount;
+    JitInstruction(Mnemonic, Operands, Count);
+
+    // Displacements count from the end of the instruction, which is only known now.
+    for(int i = InstructionFixups; i < FixupCount; i++)
+        Fixups[i].End = Sections[CurrentSection].Length;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * * * * * *      L I N K I N G     * * * * * * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// __main runs the constructors, which the JIT does itself.
+static void JITABI JitMainStub(void) {
+}
+
+// atexit, for the program. The handlers run when main returns.
+static int JITABI JitAtExit(JitHandler Handler) {
+    if(ExitHandlerCount == JIT_EXIT_HANDLERS)
+        return -1;
+    ExitHandlers[ExitHandlerCount++] = Handler;
+    return 0;
+}
+
+/*
+ * Look a function up in the libraries loaded into the compiler.
+ * The VM uses this too, to call into libc.
+ *
+ * @return its address, or NULL if there is no such function
+ */
+void* JitLibrarySymbol(char* Name) {
+    void* Address = NULL;
+
+#ifdef _WIN32
+    static char* Libraries[] = { "msvcrt.dll", "ucrtbase.dll", "kernel32.dll", NULL };
+    HMODULE Library;
+
+    for(int i = 0; Libraries[i] != NULL && Address == NULL; i++)
+        if((Library = GetModuleHandleA(Libraries[i])) != NULL || (Library = LoadLibraryA(Libraries[i])) != NULL)
+            Address = (void*) GetProcAddress(Library, Name);
+#else
+    static void* Self;
+
+    if(Self == NULL && (Self = dlopen(NULL, RTLD_NOW)) == NULL)
+        Die("Unable to look up library symbols");
+    Address = dlsym(Self, Name);
+#endif
+
+    return Address;
+}
+
+/*
+ * Find a symbol the program doesn't define.
+ */
+static void* JitResolve(char* Name) {
+    void* Address;
+
+    if(!strcmp(Name, "__main"))
+        return (void*) JitMainStub;
+    if(!strcmp(Name, "atexit"))
+        return (void*) JitAtExit;
+
+    if((Address = JitLibrarySymbol(Name)) == NULL)
+        JitError("Undefined symbol", Name);
+    return Address;
+}
+
+static long JitPageSize(void) {
+#ifdef _WIN32
+    SYSTEM_INFO Info;
+    GetSystemInfo(&Info);
+    return Info.dwPageSize;
+#else
+    return sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Round up to a multiple of a power of two.
+static long JitRound(long Value, long Align) {
+    return (Value + Align - 1) & ~(Align - 1);
+}
+
+/*
+ * Lay the sections out in memory, resolve every symbol, and patch every fixup.
+ *
+ * @return the start of the memory, whose first CodeSize bytes must be made executable
+ */
+static unsigned char* JitLink(long* CodeSize, long* TotalSize) {
+    unsigned char* Memory, *Stubs = NULL;
+    long Offset = 0, Page = JitPageSize(), Target, Value;
+    struct JitSymbol* Symbol;
+
+    // Work out how many stubs we need.
+    for(int i = 0; i < FixupCount; i++) {
+        Symbol = Fixups[i].Symbol;
+        if(Symbol->Section == -1 && Symbol->Address == NULL) {
+            Symbol->Address = JitResolve(Symbol->Name);
+            if(Fixups[i].Kind == FIX_REL32)
+                Symbol->Stub = StubCount++;
+        } else if(Symbol->Section == -1 && Fixups[i].Kind == FIX_REL32 && Symbol->Stub == -1) {
+            Symbol->Stub = StubCount++;
+        }
+    }
+
+    // Code first, then the stubs, then the data on their own pages.
+    for(int Pass = 1; Pass >= 0; Pass--) {
+        for(int i = 0; i < SectionCount; i++) {
+            if(Sections[i].Code != Pass)
+                continue;
+            Offset = JitRound(Offset, Sections[i].Align);
+            Sections[i].Address = (unsigned char*) Offset;
+            Offset += Sections[i].Length;
+        }
+
+        if(Pass) {
+            Offset = JitRound(Offset, STUB_SIZE);
+            Stubs = (unsigned char*) Offset;
+            Offset = JitRound(Offset + StubCount * STUB_SIZE, Page);
+            *CodeSize = Offset;
+        }
+    }
+    *TotalSize = JitRound(Offset ? Offset : 1, Page);
+
+#ifdef _WIN32
+    Memory = VirtualAlloc(NULL, *TotalSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    Memory = mmap(NULL, *TotalSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(Memory == MAP_FAILED)
+        Memory = NULL;
+#endif
+    if(Memory == NULL)
+        Die("Unable to allocate memory for the program");
+
+    for(int i = 0; i < SectionCount; i++) {
+        Sections[i].Address = Memory + (long) Sections[i].Address;
+        if(Sections[i].Length)
+            memcpy(Sections[i].Address, Sections[i].Data, Sections[i].Length);
+    }
+    Stubs = Memory + (long) Stubs;
+
+    for(int i = 0; i < FixupCount; i++) {
+        struct JitFixup* Fixup = &Fixups[i];
+        unsigned char* Place = Sections[Fixup->Section].Address + Fixup->Offset;
+
+        Symbol = Fixup->Symbol;
+        if(Symbol->Section != -1)
+            Target = (long) (Sections[Symbol->Section].Address + Symbol->Offset);
+        else if(Fixup->Kind == FIX_REL32)
+            Target = (long) (Stubs + Symbol->Stub * STUB_SIZE);
+        else
+            Target = (long) Symbol->Address;
+        Target += Fixup->Addend;
+
+        if(Fixup->Kind == FIX_ABS64) {
+            memcpy(Place, &Target, 8);
+            continue;
+        }
+
+        Value = Target - (long) (Sections[Fixup->Section].Address + Fixup->End);
+        if(!FitsLong(Value))
+            JitError("Relocation out of range", Symbol->Name);
+        memcpy(Place, &(int32_t) { Value }, 4);
+    }
+
+    // jmp *0(%rip), then the address.
+    for(int i = 0; i < JIT_BUCKETS; i++)
+        for(Symbol = Symbols[i]; Symbol != NULL; Symbol = Symbol->Next)
+            if(Symbol->Stub != -1) {
+                unsigned char* Stub = Stubs + Symbol->Stub * STUB_SIZE;
+                memcpy(Stub, "\xFF\x25\0\0\0\0", 6);
+                memcpy(Stub + 6, &Symbol->Address, 8);
+                memcpy(Stub + 14, "\x90\x90", 2);
+            }
+
+    return Memory;
+}
+
+/*
+ * Read a whole line of assembly, however long it is.
+ * String literals can make for very long lines.
+ *
+ * @return the line, or NULL at the end of the file
+ */
+static char* JitReadLine(FILE* Assembly) {
+    static char* Text;
+    static int Capacity;
+    int Length = 0;
+
+    if(Text == NULL && (Text = malloc(Capacity = TEXTLEN)) == NULL)
+        Die("Unable to allocate JIT line");
+
+    while(fgets(Text + Length, Capacity - Length, Assembly) != NULL) {
+        Length += strlen(Text + Length);
+        if(Text[Length - 1] == '\n')
+            return Text;
+
+        if(Length == Capacity - 1 && (Text = realloc(Text, Capacity *= 2)) == NULL)
+            Die("Unable to allocate JIT line");
+    }
+
+    return Length ? Text : NULL;
+}
+
+/*
+ * Assemble the generated code, load it into memory, and run main.
+ *
+ * @param Assembly: The file holding the assembly of the whole program
+ * @param Count: The number of arguments to give to main
+ * @param Arguments: The arguments; the first is the name of the program
+ * @return what main returned
+ */
+int JitRun(FILE* Assembly, int Count, char* Arguments[]) {
+    char* Text;
+    unsigned char* Memory;
+    long CodeSize = 0, TotalSize = 0;
+    struct JitSymbol* Main;
+    struct JitSection* Constructors = NULL;
+    typedef long (JITABI *JitEntry)(long, char**);
+    long Result;
+
+    rewind(Assembly);
+    JitSwitchSection(".text");
+
+    for(Line = 1; (Text = JitReadLine(Assembly)) != NULL; Line++)
+        JitLine(Text);
+
+    Main = JitSymbolFor("main");
+    if(Main->Section == -1)
+        Die("There is no main function to run");
+
+    Memory = JitLink(&CodeSize, &TotalSize);
+
+#ifdef _WIN32
+    DWORD Old;
+    if(!VirtualProtect(Memory, CodeSize, PAGE_EXECUTE_READ, &Old))
+        Die("Unable to make the program executable");
+#else
+    if(mprotect(Memory, CodeSize, PROT_READ | PROT_EXEC))
+        Die("Unable to make the program executable");
+#endif
+
+    if(OptVerboseOutput)
+        printf("JIT: %d sections, %ld bytes of code, %ld of data, %d library functions\n",
+                SectionCount, CodeSize, TotalSize - CodeSize, StubCount);
+
+    for(int i = 0; i < SectionCount; i++)
+        if(!strcmp(Sections[i].Name, ".ctors"))
+            Constructors = &Sections[i];
+
+    // .ctors runs backwards.
+    if(Constructors != NULL)
+        for(int i = Constructors->Length / 8 - 1; i >= 0; i--)
+            ((JitHandler*) Constructors->Address)[i]();
+
+    fflush(stdout);
+    Result = ((JitEntry) (Sections[Main->Section].Address + Main->Offset))(Count, Arguments);
+
+    // atexit handlers run backwards too.
+    while(ExitHandlerCount > 0)
+        ExitHandlers[--ExitHandlerCount]();
+    return Result;
+}
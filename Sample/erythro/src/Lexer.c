@@ -6,6 +6,9 @@
 
 #include <Defs.h>
 #include <Data.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * *
@@ -275,6 +278,13 @@ static int ReadKeyword(char* Str) {
         case 'c':
             if(!strcmp(Str, "char"))
                 return TY_CHAR;
+            if(!strcmp(Str, "case"))
+                return KW_CASE;
+            break;
+
+        case 'd':
+            if(!strcmp(Str, "default"))
+                return KW_DEFAULT;
             break;
 
         case 'e':
@@ -298,6 +308,14 @@ static int ReadKeyword(char* Str) {
             if(!strcmp(Str, "i64"))
                 return TY_LONG;
 
+            // and the vectors of them
+            if(!strcmp(Str, "i8x16"))
+                return TY_I8X16;
+            if(!strcmp(Str, "i32x4"))
+                return TY_I32X4;
+            if(!strcmp(Str, "i64x2"))
+                return TY_I64X2;
+
             if(!strcmp(Str, "int"))
                 return TY_INT;
             
@@ -325,6 +343,8 @@ static int ReadKeyword(char* Str) {
         case 's':
             if(!strcmp(Str, "struct"))
                 return KW_STRUCT;
+            if(!strcmp(Str, "switch"))
+                return KW_SWITCH;
             break;
             
         case 'v':
@@ -359,16 +379,12 @@ static int ReadKeyword(char* Str) {
  * 
  * This function may be the main bottleneck in the lexer.
  * 
+ * @param Token: Where to put the token
+ * @param Text: Where to put the text of identifiers and strings
+ * 
  */
-void Tokenise() {
+static void ScanToken(struct Token* Token, char* Text) {
     int Char, TokenType;
-    struct Token* Token = &CurrentToken;
-
-    if(RejectedToken != NULL) {
-        Token = RejectedToken;
-        RejectedToken = NULL;
-        return;
-    }
 
     Char = FindChar();
 
@@ -407,6 +423,10 @@ void Tokenise() {
             Token->type = AR_SLASH;
             break;
 
+        case '%':
+            Token->type = AR_PERCENT;
+            break;
+
         case '&':
             Char = NextChar();
             if(Char == '&') {
@@ -524,6 +544,7 @@ void Tokenise() {
             if(Char == ':') {
                 Token->type = KW_FUNC;
             } else {
+                Token->type = LI_COLON;
                 ReturnCharToStream(Char);
             }
             break;
@@ -537,7 +558,7 @@ void Tokenise() {
             break;
 
         case '"':
-            ReadStringLiteral(CurrentIdentifier);
+            ReadStringLiteral(Text);
             Token->type = LI_STR;
             break;
 
@@ -549,9 +570,9 @@ void Tokenise() {
                 break;
             
             } else if(isalpha(Char) || Char == '_') { // This is what defines what a variable/function/keyword can START with.
-                ReadIdentifier(Char, CurrentIdentifier, TEXTLEN);
+                ReadIdentifier(Char, Text, TEXTLEN);
 
-                if(TokenType = ReadKeyword(CurrentIdentifier)) {
+                if(TokenType = ReadKeyword(Text)) {
                     Token->type = TokenType;
                     break;
                 }
@@ -568,3 +589,154 @@ void Tokenise() {
     }
 }
 
+/* * * * * * * * * * * * * * * * * * * * *
+ * * * *      P I P E L I N E      * * * *
+ * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * With --pipeline, the tokens are scanned on a thread of their own, and
+ *  handed to the parser through a ring, while it parses and generates code.
+ *
+ * There is one writer and one reader, so the ring needs no lock:
+ *  the lexer only moves RingHead, and the parser only moves RingTail.
+ * When the ring is full the lexer waits for the parser, and the other way around.
+ *
+ * Each token carries the Line it ended on, and the text the lexer had at the time,
+ *  so the parser sees exactly what Tokenise would have given it.
+ */
+
+#define RING_SIZE 256
+
+struct LexedToken {
+    struct Token Token;
+    int Line;
+    char Text[TEXTLEN + 1];
+};
+
+static struct LexedToken Ring[RING_SIZE];
+static atomic_uint RingHead, RingTail;
+static atomic_int LexerStopping;
+
+static pthread_t Lexer;
+static int Pipelined, LexerFinished;
+
+// What the lexer starts from, as Tokenise would have left it.
+static struct Token StartToken;
+static char StartText[TEXTLEN + 1];
+
+static void* LexerThread(void* Unused) {
+    struct Token Token = StartToken;
+    struct LexedToken* Slot;
+    char Text[TEXTLEN + 1];
+    unsigned Head;
+
+    (void) Unused;
+    strcpy(Text, StartText);
+
+    Line = 1;
+    Overread = '\n';
+
+    do {
+        PhaseStart(PHASE_LEX);
+        ScanToken(&Token, Text);
+        PhaseEnd(PHASE_LEX);
+
+        // Wait for room.
+        Head = atomic_load_explicit(&RingHead, memory_order_relaxed);
+        while(Head - atomic_load_explicit(&RingTail, memory_order_acquire) == RING_SIZE) {
+            if(atomic_load_explicit(&LexerStopping, memory_order_relaxed))
+                return NULL;
+            sched_yield();
+        }
+
+        Slot = &Ring[Head % RING_SIZE];
+        Slot->Token = Token;
+        Slot->Line = Line;
+        strcpy(Slot->Text, Text);
+        atomic_store_explicit(&RingHead, Head + 1, memory_order_release);
+    } while(Token.type != LI_EOF && !atomic_load_explicit(&LexerStopping, memory_order_relaxed));
+
+    return NULL;
+}
+
+// Take the next token from the ring.
+static void ReceiveToken(void) {
+    unsigned Tail = atomic_load_explicit(&RingTail, memory_order_relaxed);
+    struct LexedToken* Slot;
+
+    // Past the end, the file keeps on ending.
+    if(LexerFinished) {
+        CurrentToken.type = LI_EOF;
+        return;
+    }
+
+    while(atomic_load_explicit(&RingHead, memory_order_acquire) == Tail)
+        sched_yield();
+
+    Slot = &Ring[Tail % RING_SIZE];
+    CurrentToken = Slot->Token;
+    Line = Slot->Line;
+    strcpy(CurrentIdentifier, Slot->Text);
+    LexerFinished = CurrentToken.type == LI_EOF;
+
+    atomic_store_explicit(&RingTail, Tail + 1, memory_order_release);
+}
+
+/*
+ * Get ready to read the SourceFile from the start.
+ * With --pipeline, this starts the lexer thread.
+ */
+void StartLexer(void) {
+    Line = 1;
+    Overread = '\n';
+
+    if(!OptPipeline)
+        return;
+
+    StartToken = CurrentToken;
+    strcpy(StartText, CurrentIdentifier);
+
+    atomic_store(&RingHead, 0);
+    atomic_store(&RingTail, 0);
+    atomic_store(&LexerStopping, 0);
+    LexerFinished = 0;
+
+    if(pthread_create(&Lexer, NULL, LexerThread, NULL) != 0)
+        Die("Unable to start the lexer thread");
+    Pipelined = 1;
+}
+
+// Stop reading the SourceFile, before it is closed.
+void StopLexer(void) {
+    if(!Pipelined)
+        return;
+
+    atomic_store(&LexerStopping, 1);
+    pthread_join(Lexer, NULL);
+    Pipelined = 0;
+
+    if(OptVerboseOutput)
+        printf("Lexer: %u tokens through the pipeline\n", atomic_load(&RingTail));
+}
+
+/*
+ * Move on to the next token, into CurrentToken.
+ * Identifiers and strings also fill CurrentIdentifier.
+ */
+void Tokenise() {
+    if(RejectedToken != NULL) {
+        RejectedToken = NULL;
+        return;
+    }
+
+    Tally(COUNT_TOKENS, 1);
+
+    if(Pipelined) {
+        ReceiveToken();
+        return;
+    }
+
+    PhaseStart(PHASE_LEX);
+    ScanToken(&CurrentToken, CurrentIdentifier);
+    PhaseEnd(PHASE_LEX);
+}
@@ -0,0 +1,529 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+#include <limits.h>
+
+/********************************************************************************
+ * Loop optimisations.                                                          *
+ *                                                                              *
+ * Both while and for loops arrive here as OP_LOOP nodes:                       *
+ *  Left holds the condition, Right holds the body.                             *
+ * A for loop's body ends with the iterator, and its initialiser is the         *
+ *  statement just before the loop - which is exactly what a while loop with a  *
+ *  counter looks like too, so the two are treated the same.                    *
+ *                                                                              *
+ * Loops are visited innermost first. Each one is run through:                  *
+ *  * Full unrolling, if the trip count is known and small,                     *
+ *  * Strength reduction of scaled induction variables into pointer bumps,      *
+ *  * Hoisting of loop-invariant expressions into the preheader,                *
+ *  * Partial unrolling, if the trip count is known and the body is small.      *
+ *                                                                              *
+ ********************************************************************************/
+
+// Loops that run at most this many times are unrolled completely..
+#define UNROLL_FULL_TRIPS   8
+// ..as long as that produces no more than this many AST nodes.
+#define UNROLL_FULL_BUDGET  256
+// Longer loops are unrolled by 4 or 2 if their body is at most this many nodes.
+#define UNROLL_PARTIAL_BODY 48
+
+/*
+ * What we know about a single loop.
+ */
+struct LoopInfo {
+    struct ASTNode* Loop;                   // The OP_LOOP node
+    struct ASTNode* Body;                   // The body, without the step
+    struct ASTNode* Step;                   // The trailing statement(s) that advance the loop
+    struct ASTNode* Preheader;              // Statements to run once, before the loop
+    struct SymbolTableEntry* Induction;     // The variable advanced by the step, if any
+    long Stride;                            // How far the step moves it
+    long TripCount;                         // How many times the body runs, or -1 if unknown
+};
+
+// The function being optimised, for reporting and alias checks.
+static struct ASTNode* Function;
+
+static void OptimiseStatement(struct ASTNode** Slot, struct ASTNode* Previous);
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     L O O P     A N A L Y S I S     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Can the variable change without being named?
+ *  Locals only if their address is taken, globals by calls or stores through pointers.
+ */
+static int IsStableIn(struct ASTNode* Tree, struct SymbolTableEntry* Symbol) {
+    if(TreeWritesSymbol(Tree, Symbol))
+        return 0;
+    if(Symbol->Storage != SC_GLOBAL && TreeTakesAddress(Function->Left, Symbol))
+        return 0;
+    return 1;
+}
+
+/*
+ * Check that every value an induction variable takes fits in its type,
+ *  so that the trip count we calculate is the one the hardware will see.
+ */
+static int FitsInType(int Type, long Value) {
+    switch(Type) {
+        case RET_CHAR: return Value >= 0 && Value <= UCHAR_MAX;
+        case RET_INT:  return Value >= INT_MIN && Value <= INT_MAX;
+        case RET_LONG: return 1;
+    }
+    return 0;
+}
+
+/*
+ * Work out how many times a loop runs, from
+ *  its initialiser (i = Start), its condition (i <op> Bound) and its stride.
+ *
+ * @return the trip count, or -1 if it cannot be known.
+ */
+static long CalculateTripCount(struct LoopInfo* Info, struct ASTNode* Preop) {
+    struct ASTNode* Condition = Info->Loop->Left;
+    long Start, Bound, Stride = Info->Stride, Distance, Trips;
+    int Relation;
+
+    if(Preop == NULL || Preop->Operation != OP_ASSIGN || Preop->Right == NULL
+        || Preop->Right->Operation != REF_IDENT || Preop->Right->Symbol != Info->Induction)
+        return -1;
+
+    if(!ConstantValue(Preop->Left, &Start))
+        return -1;
+
+    if(Condition == NULL || Condition->Operation < OP_EQUAL || Condition->Operation > OP_GREATE)
+        return -1;
+
+    Relation = Condition->Operation;
+    if(IsReferenceTo(Condition->Left, Info->Induction) && ConstantValue(Condition->Right, &Bound)) {
+        // i <op> Bound, as written
+    } else if(IsReferenceTo(Condition->Right, Info->Induction) && ConstantValue(Condition->Left, &Bound)) {
+        // Bound <op> i, so mirror the comparison
+        switch(Relation) {
+            case OP_LESS:   Relation = OP_GREAT; break;
+            case OP_GREAT:  Relation = OP_LESS; break;
+            case OP_LESSE:  Relation = OP_GREATE; break;
+            case OP_GREATE: Relation = OP_LESSE; break;
+        }
+    } else {
+        return -1;
+    }
+
+    switch(Relation) {
+        case OP_LESS:
+            if(Stride < 0) return -1;
+            Trips = Start < Bound ? (Bound - Start + Stride - 1) / Stride : 0;
+            break;
+        case OP_LESSE:
+            if(Stride < 0) return -1;
+            Trips = Start <= Bound ? (Bound - Start) / Stride + 1 : 0;
+            break;
+        case OP_GREAT:
+            if(Stride > 0) return -1;
+            Trips = Start > Bound ? (Start - Bound - Stride - 1) / -Stride : 0;
+            break;
+        case OP_GREATE:
+            if(Stride > 0) return -1;
+            Trips = Start >= Bound ? (Start - Bound) / -Stride + 1 : 0;
+            break;
+        case OP_INEQ:
+            Distance = Bound - Start;
+            if(Distance % Stride != 0 || Distance / Stride < 0)
+                return -1;
+            Trips = Distance / Stride;
+            break;
+        default:
+            return -1;
+    }
+
+    if(Trips > INT_MAX || !FitsInType(Info->Induction->Type, Start)
+        || !FitsInType(Info->Induction->Type, Start + Trips * Stride))
+        return -1;
+
+    return Trips;
+}
+
+/*
+ * Gather what we know about a loop.
+ *
+ * @param Loop: The OP_LOOP node
+ * @param Preop: The statement executed just before the loop, if any
+ * @param Info: Filled in with the loop's details
+ */
+static void AnalyseLoop(struct ASTNode* Loop, struct ASTNode* Preop, struct LoopInfo* Info) {
+    struct ASTNode* Body = Loop->Right;
+
+    Info->Loop = Loop;
+    Info->Preheader = NULL;
+    Info->Induction = NULL;
+    Info->Stride = 0;
+    Info->TripCount = -1;
+
+    // The last statement of the body is the step, if it has the right shape.
+    if(Body && Body->Operation == OP_COMP) {
+        Info->Body = Body->Left;
+        Info->Step = Body->Right;
+    } else {
+        Info->Body = NULL;
+        Info->Step = Body;
+    }
+
+    if(!MatchInductionStep(Info->Step, &Info->Induction, &Info->Stride)
+        || TreeHasSideEffects(Loop->Left)
+        || !IsStableIn(Info->Body, Info->Induction)) {
+        // Without an induction variable, the whole body is just a body.
+        Info->Body = Body;
+        Info->Step = NULL;
+        Info->Induction = NULL;
+        return;
+    }
+
+    Info->TripCount = CalculateTripCount(Info, Preop);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *        U N R O L L I N G        * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Build Count back-to-back copies of the body and step.
+ * The first copy reuses the original nodes.
+ */
+static struct ASTNode* ReplicateBody(struct LoopInfo* Info, long Count) {
+    struct ASTNode* Result = NULL;
+
+    for(long i = 0; i < Count; i++) {
+        if(i == 0)
+            Result = ConstructSequence(Info->Body, Info->Step);
+        else
+            Result = ConstructSequence(Result, ConstructSequence(CopyTree(Info->Body), CopyTree(Info->Step)));
+    }
+
+    return Result;
+}
+
+/*
+ * Replace a loop that runs a small, known number of times with
+ *  straight-line copies of its body.
+ *
+ * @return 1 if the loop was removed.
+ */
+static int UnrollFully(struct ASTNode** Slot, struct LoopInfo* Info) {
+    int Size = TreeSize(Info->Body) + TreeSize(Info->Step);
+
+    if(Info->TripCount < 0 || Info->TripCount > UNROLL_FULL_TRIPS
+        || Info->TripCount * Size > UNROLL_FULL_BUDGET)
+        return 0;
+
+    *Slot = ReplicateBody(Info, Info->TripCount);
+
+    if(OptVerboseOutput)
+        printf("Optimiser: fully unrolled loop in %s (%ld iterations)\n", Function->Symbol->Name, Info->TripCount);
+    return 1;
+}
+
+/*
+ * A loop that runs a known number of times, which is a multiple of N,
+ *  only needs to check its condition once every N iterations.
+ *
+ * @return 1 if the loop body was replaced.
+ */
+static int UnrollPartially(struct LoopInfo* Info) {
+    int Factor;
+
+    if(Info->TripCount <= UNROLL_FULL_TRIPS
+        || TreeSize(Info->Body) + TreeSize(Info->Step) > UNROLL_PARTIAL_BODY)
+        return 0;
+
+    if(Info->TripCount % 4 == 0)
+        Factor = 4;
+    else if(Info->TripCount % 2 == 0)
+        Factor = 2;
+    else
+        return 0;
+
+    Info->Loop->Right = ReplicateBody(Info, Factor);
+
+    if(OptVerboseOutput)
+        printf("Optimiser: unrolled loop in %s by %d\n", Function->Symbol->Name, Factor);
+    return 1;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     S T R E N G T H      R E D U C T I O N     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * The bases we can bump a pointer from: the address of a global,
+ *  or a pointer variable that the loop does not change.
+ */
+static int IsInvariantBase(struct ASTNode* Node, struct LoopInfo* Info) {
+    if(Node->Operation == OP_ADDRESS)
+        return 1;
+
+    return Node->Operation == REF_IDENT && TypeIsPtr(Node->ExprType)
+        && Node->Symbol->Structure == ST_VAR && IsStableIn(Info->Loop, Node->Symbol);
+}
+
+/*
+ * Find base + (i * size) in a tree, where i is the induction variable,
+ *  and replace it with a pointer that is advanced by stride * size in the step.
+ *
+ * Identical expressions share one pointer, so a[i] = a[i] + 1 only needs one.
+ */
+static void ReduceScaledIndices(struct ASTNode** Slot, struct LoopInfo* Info) {
+    struct ASTNode* Node = *Slot, *Base, *Index, *Bump;
+    struct SymbolTableEntry* Pointer;
+
+    if(Node == NULL)
+        return;
+
+    if(Node->Operation == OP_ADD && TypeIsPtr(Node->ExprType)) {
+        Base = Node->Left;
+        Index = Node->Right;
+        if(Index && Index->Operation != OP_SCALE) {
+            Base = Node->Right;
+            Index = Node->Left;
+        }
+
+        if(Base && Index && Index->Operation == OP_SCALE && IsReferenceTo(Index->Left, Info->Induction)
+            && IsInvariantBase(Base, Info)) {
+
+            // Reuse the pointer made for an identical expression, if there is one.
+            for(struct ASTNode* Made = Info->Preheader; Made != NULL; ) {
+                struct ASTNode* Statement = Made->Operation == OP_COMP ? Made->Right : Made;
+                if(Statement->Operation == OP_ASSIGN && TreesEqual(Statement->Left, Node)) {
+                    *Slot = ConstructReference(Statement->Right->Symbol);
+                    return;
+                }
+                Made = Made->Operation == OP_COMP ? Made->Left : NULL;
+            }
+
+            Pointer = AddTemporary(Node->ExprType);
+
+            Info->Preheader = ConstructSequence(Info->Preheader, ConstructAssignment(Pointer, Node));
+
+            Bump = ConstructASTNode(OP_ADD, Pointer->Type, ConstructReference(Pointer), NULL,
+                                    ConstructLiteral(RET_LONG, Info->Stride * Index->Size), NULL, 0);
+            Info->Step = ConstructSequence(Info->Step, ConstructAssignment(Pointer, Bump));
+
+            *Slot = ConstructReference(Pointer);
+
+            if(OptVerboseOutput)
+                printf("Optimiser: strength-reduced index scaling of %s in %s\n",
+                    Info->Induction->Name, Function->Symbol->Name);
+            return;
+        }
+    }
+
+    // The target of an assignment is a name, not a value.
+    if(Node->Operation != OP_ASSIGN || Node->Right == NULL || Node->Right->Operation != REF_IDENT)
+        ReduceScaledIndices(&Node->Right, Info);
+    ReduceScaledIndices(&Node->Left, Info);
+    ReduceScaledIndices(&Node->Middle, Info);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     I N V A R I A N T     C O D E     M O T I O N     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Does this expression produce the same value on every iteration,
+ *  without any side effects or chance of faulting?
+ *
+ * Division is left alone, as hoisting it out of a loop that never runs
+ *  could introduce a division by zero.
+ */
+static int IsInvariant(struct ASTNode* Node, struct LoopInfo* Info) {
+    if(Node == NULL)
+        return 1;
+
+    // The temporaries are scalars.
+    if(TypeIsVector(Node->ExprType))
+        return 0;
+
+    switch(Node->Operation) {
+        case TERM_INTLITERAL:
+        case OP_ADDRESS:
+            return 1;
+
+        case REF_IDENT:
+            return Node->RVal && Node->Symbol->Structure == ST_VAR && IsStableIn(Info->Loop, Node->Symbol);
+
+        // Comparisons are left out, as they generate jumps based on their parent.
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY:
+        case OP_BITAND: case OP_BITOR: case OP_BITXOR:
+        case OP_SHIFTL: case OP_SHIFTR:
+        case OP_NEGATE: case OP_BITNOT:
+        case OP_WIDEN: case OP_SCALE:
+            return IsInvariant(Node->Left, Info) && IsInvariant(Node->Right, Info);
+    }
+
+    return 0;
+}
+
+/*
+ * Hoisting a lone variable, literal or address gains nothing.
+ */
+static int IsWorthHoisting(struct ASTNode* Node) {
+    long Value;
+
+    if(ConstantValue(Node, &Value))
+        return 0;
+
+    Node = Unwiden(Node);
+    switch(Node->Operation) {
+        case REF_IDENT: case OP_ADDRESS: case TERM_INTLITERAL: case TERM_STRLITERAL:
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Replace every maximal invariant expression in the tree with a temporary
+ *  that is computed once in the preheader.
+ */
+static void HoistInvariants(struct ASTNode** Slot, struct LoopInfo* Info) {
+    struct ASTNode* Node = *Slot, *Reference;
+    struct SymbolTableEntry* Temporary;
+    int Type;
+
+    if(Node == NULL)
+        return;
+
+    if(IsInvariant(Node, Info) && IsWorthHoisting(Node)) {
+        // Integers are kept at full register width, so no bits are lost in the round trip.
+        Type = TypeIsPtr(Node->ExprType) ? Node->ExprType : RET_LONG;
+
+        // Reuse the temporary made for an identical expression, if there is one.
+        Temporary = NULL;
+        for(struct ASTNode* Made = Info->Preheader; Made != NULL && Temporary == NULL; ) {
+            struct ASTNode* Statement = Made->Operation == OP_COMP ? Made->Right : Made;
+            if(Statement->Operation == OP_ASSIGN && TreesEqual(Statement->Left, Node))
+                Temporary = Statement->Right->Symbol;
+            Made = Made->Operation == OP_COMP ? Made->Left : NULL;
+        }
+
+        if(Temporary == NULL) {
+            Temporary = AddTemporary(Type);
+            Info->Preheader = ConstructSequence(Info->Preheader, ConstructAssignment(Temporary, Node));
+
+            if(OptVerboseOutput)
+                printf("Optimiser: hoisted loop-invariant expression out of loop in %s\n", Function->Symbol->Name);
+        }
+
+        // Parents still see the type the expression had.
+        Reference = ConstructReference(Temporary);
+        Reference->ExprType = Node->ExprType;
+        *Slot = Reference;
+        return;
+    }
+
+    switch(Node->Operation) {
+        // The variable being written is not a value, but the address of an element can move.
+        case OP_ASSIGN:
+            HoistInvariants(&Node->Left, Info);
+            if(Node->Right && Node->Right->Operation != REF_IDENT)
+                HoistInvariants(&Node->Right, Info);
+            return;
+    }
+
+    HoistInvariants(&Node->Left, Info);
+    HoistInvariants(&Node->Middle, Info);
+    HoistInvariants(&Node->Right, Info);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *        T H E    D R I V E R        * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Run all the loop transformations over a single loop.
+ *
+ * @param Slot: The pointer to the OP_LOOP node, so it can be replaced.
+ * @param Preop: The statement executed just before the loop, if any.
+ */
+static void TransformLoop(struct ASTNode** Slot, struct ASTNode* Preop) {
+    struct LoopInfo Info;
+
+    AnalyseLoop(*Slot, Preop, &Info);
+
+    if(UnrollFully(Slot, &Info))
+        return;
+
+    if(Info.Induction)
+        ReduceScaledIndices(&Info.Body, &Info);
+
+    HoistInvariants(&Info.Loop->Left, &Info);
+    HoistInvariants(&Info.Body, &Info);
+
+    // Unrolling rebuilds the body itself, otherwise put the rewritten parts back together.
+    if(!UnrollPartially(&Info))
+        Info.Loop->Right = ConstructSequence(Info.Body, Info.Step);
+
+    *Slot = ConstructSequence(Info.Preheader, Info.Loop);
+}
+
+/*
+ * Find the statement that runs last in a sequence.
+ */
+static struct ASTNode* LastStatement(struct ASTNode* Node) {
+    while(Node && Node->Operation == OP_COMP)
+        Node = Node->Right;
+    return Node;
+}
+
+/*
+ * Walk the statements of a function, visiting inner loops before outer ones.
+ *
+ * @param Slot: The pointer to the current statement, so it can be replaced.
+ * @param Previous: The statement that runs just before this one, if known.
+ */
+static void OptimiseStatement(struct ASTNode** Slot, struct ASTNode* Previous) {
+    struct ASTNode* Node = *Slot;
+
+    if(Node == NULL)
+        return;
+
+    switch(Node->Operation) {
+        case OP_COMP:
+            OptimiseStatement(&Node->Left, Previous);
+            OptimiseStatement(&Node->Right, LastStatement(Node->Left));
+
+            // A loop that was unrolled zero times leaves a hole behind.
+            *Slot = ConstructSequence(Node->Left, Node->Right);
+            return;
+
+        case OP_IF:
+            OptimiseStatement(&Node->Middle, NULL);
+            OptimiseStatement(&Node->Right, NULL);
+            return;
+
+        case OP_LOOP:
+            OptimiseStatement(&Node->Right, NULL);
+            TransformLoop(Slot, Previous);
+            return;
+
+        case OP_SWITCH:
+            for(Node = Node->Right; Node != NULL; Node = Node->Right)
+                OptimiseStatement(&Node->Left, NULL);
+            return;
+    }
+}
+
+/*
+ * Entry point for the loop optimisations.
+ *
+ * @param Tree: The OP_FUNC node of the function to optimise.
+ */
+void OptimiseLoops(struct ASTNode* Tree) {
+    Function = Tree;
+    OptimiseStatement(&Tree->Left, NULL);
+}
@@ -37,6 +37,7 @@ char* TokenNames[] = {
     "Subtraction",
     "Multiplication",
     "Division",
+    "Modulo",
 
     "Increment",
     "Decrement",
@@ -58,6 +59,7 @@ char* TokenNames[] = {
     "Logical Block End",
 
     "Comma",
+    "Colon",
 
     "Identifier",
     "None Type",
@@ -65,6 +67,9 @@ char* TokenNames[] = {
     "Int Type",
     "Long Type",
     "Void Type",
+    "i8x16 Type",
+    "i32x4 Type",
+    "i64x2 Type",
 
     "Function keyword",
     "Print Keyword",
@@ -72,6 +77,9 @@ char* TokenNames[] = {
     "Else keyword",
     "While keyword",
     "For keyword",
+    "Switch keyword",
+    "Case keyword",
+    "Default keyword",
 
     "Return keyword",
     
@@ -85,6 +93,20 @@ int main(int argc, char* argv[]) {
     OptAssembleFiles = false;
     OptLinkFiles = true;
     OptVerboseOutput = false;
+    OptOptimise = false;
+    OptWholeProgram = false;
+    OptProfileGenerate = false;
+    OptProfileUse = false;
+    OptRun = false;
+    OptVirtualMachine = false;
+    OptCache = false;
+    OptJobs = 1;
+    OptPipeline = false;
+    OptTimeReport = false;
+    OptTimeReportJSON = false;
+    OptPerfCounters = false;
+    OptStatsFile = NULL;
+    OptFreestanding = false;
 
     // Temporary .o storage and counter
     char* ObjectFiles[100];
@@ -98,6 +120,72 @@ int main(int argc, char* argv[]) {
         // ie. erc >> -v -T -o << test.exe src/main.er
         if(*argv[i] != '-')
             break;
+
+        // The long options.
+        if(!strcmp(argv[i], "--whole-program")) {
+            OptWholeProgram = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fprofile-generate")) {
+            OptProfileGenerate = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fprofile-use")) {
+            OptProfileUse = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-ftime-report")) {
+            OptTimeReport = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-ftime-report=json")) {
+            OptTimeReport = true;
+            OptTimeReportJSON = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-fperf-counters")) {
+            OptTimeReport = true;
+            OptPerfCounters = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "-ffreestanding")) {
+            OptFreestanding = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "--stats")) {
+            if(i + 1 >= argc)
+                DisplayUsage(argv[0]);
+            OptStatsFile = argv[++i];
+            continue;
+        }
+
+        if(!strcmp(argv[i], "--run")) {
+            OptRun = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "--cache")) {
+            OptCache = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "--pipeline")) {
+            OptPipeline = true;
+            continue;
+        }
+
+        if(!strcmp(argv[i], "--vm")) {
+            OptRun = true;
+            OptVirtualMachine = true;
+            continue;
+        }
         
         // Once we identify a flag, we need to make sure it's not just a minus in-place.
         for(int j = 1; (*argv[i] == '-') && argv[i][j]; j++) {
@@ -123,6 +211,13 @@ int main(int argc, char* argv[]) {
                 case 'v': // Verbose output
                     OptVerboseOutput = true;
                     break;
+                case 'O': // Optimise
+                    OptOptimise = true;
+                    break;
+                case 'j': // Jobs
+                    if(i + 1 >= argc || (OptJobs = atoi(argv[++i])) < 1)
+                        DisplayUsage(argv[0]);
+                    break;
                 default:
                     DisplayUsage(argv[0]);
             }
@@ -133,10 +228,18 @@ int main(int argc, char* argv[]) {
     if(i >= argc) 
         DisplayUsage(argv[0]);
 
+    // Running in memory needs no files, so the Delegate handles it all.
+    if(OptRun)
+        return Run(&argv[i], argc - i);
+
     // For the rest of the files specified, we can iterate them right to left.
     while(i < argc) {
-        // Compile the file by invoking the Delegate
-        CurrentASMFile = Compile(argv[i]);
+        // Compile the file by invoking the Delegate.
+        // In whole program mode, every file goes into the one assembly file.
+        if(OptWholeProgram)
+            CurrentASMFile = CompileProgram(&argv[i], argc - i);
+        else
+            CurrentASMFile = Compile(argv[i]);
         if(OptLinkFiles || OptAssembleFiles) {
             // If we need to assemble (or link, which requires assembly)
             // then we invoke the Delegate again
@@ -157,7 +260,7 @@ int main(int argc, char* argv[]) {
             // unlink = delete
             unlink(CurrentASMFile);
 
-        i++;
+        i = OptWholeProgram ? argc : i + 1;
     }
 
     if(OptLinkFiles) {
@@ -170,6 +273,9 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    CacheReport();
+    TimeReport();
+    StatsReport();
     return 0;
 
 }
@@ -181,7 +287,9 @@ int main(int argc, char* argv[]) {
 
 void Die(char* Error) {
     fprintf(stderr, "%s on line %d\n", Error, Line);
-    fclose(OutputFile);
+    // The lexer thread has no output of its own.
+    if(OutputFile)
+        fclose(OutputFile);
     unlink(OutputFileName);
     exit(1);
 }
@@ -191,7 +299,8 @@ void Die(char* Error) {
  */
 void DieMessage(char* Error, char* Reason) {
     fprintf(stderr, "%s: %s on line %d\n", Error, Reason, Line);
-    fclose(OutputFile);
+    if(OutputFile)
+        fclose(OutputFile);
     unlink(OutputFileName);
     exit(1);
 }
@@ -201,7 +310,8 @@ void DieMessage(char* Error, char* Reason) {
  */
 void DieDecimal(char* Error, int Number) {
     fprintf(stderr, "%s: %d on line %d\n", Error, Number, Line);
-    fclose(OutputFile);
+    if(OutputFile)
+        fclose(OutputFile);
     unlink(OutputFileName);
     exit(1);
 }
@@ -211,7 +321,8 @@ void DieDecimal(char* Error, int Number) {
  */
 void DieChar(char* Error, int Char) {
     fprintf(stderr, "%s: %c on line %d\n", Error, Char, Line);
-    fclose(OutputFile);
+    if(OutputFile)
+        fclose(OutputFile);
     unlink(OutputFileName);
     exit(1);
 }
\ No newline at end of file
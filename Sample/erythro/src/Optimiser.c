@@ -0,0 +1,408 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+
+/********************************************************************************
+ * The Optimiser rewrites the AST of a function after it has been parsed,       *
+ *  and before it is handed to the Assembler.                                   *
+ *                                                                              *
+ * It is only invoked when the -O flag is given.                                *
+ *                                                                              *
+ * Each pass lives in its own file, and works on the tree in place.             *
+ * This file holds the entry point, and the tree utilities the passes share.    *
+ *                                                                              *
+ ********************************************************************************/
+
+/*
+ * Run every optimisation pass over a single function.
+ *
+ * @param Tree: The OP_FUNC node of the function to optimise.
+ * @return the optimised function tree.
+ */
+struct ASTNode* OptimiseFunction(struct ASTNode* Tree) {
+    if(Tree == NULL || Tree->Operation != OP_FUNC)
+        return Tree;
+
+    PhaseStart(PHASE_OPTIMISE);
+
+    // Constant calls first, so their results are there for the rest.
+    EvaluateCalls(Tree);
+
+    // Vectorise first, as the other loop passes rewrite array indexing into forms it can't read.
+    VectoriseLoops(Tree);
+    OptimiseLoops(Tree);
+
+    // Last, so it can clean up after the others.
+    EliminateDeadCode(Tree);
+
+    PhaseEnd(PHASE_OPTIMISE);
+    return Tree;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     T R E E     Q U E R I E S     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Create a deep copy of a tree.
+ * Symbols are shared between the copies, as they are not owned by the tree.
+ *
+ * @param Node: The root of the tree to copy
+ * @return the root of the new tree
+ */
+struct ASTNode* CopyTree(struct ASTNode* Node) {
+    struct ASTNode* Copy;
+
+    if(Node == NULL)
+        return NULL;
+
+    Copy = (struct ASTNode*) malloc(sizeof(struct ASTNode));
+    if(!Copy)
+        Die("Unable to allocate node!");
+
+    *Copy = *Node;
+    Copy->Left = CopyTree(Node->Left);
+    Copy->Middle = CopyTree(Node->Middle);
+    Copy->Right = CopyTree(Node->Right);
+
+    return Copy;
+}
+
+/*
+ * Determine whether two trees compute the same thing.
+ *
+ * @return 1 if they are structurally identical, 0 otherwise
+ */
+int TreesEqual(struct ASTNode* Left, struct ASTNode* Right) {
+    if(Left == NULL || Right == NULL)
+        return Left == Right;
+
+    if(Left->Operation != Right->Operation || Left->ExprType != Right->ExprType
+        || Left->Symbol != Right->Symbol || Left->IntValue != Right->IntValue)
+        return 0;
+
+    return TreesEqual(Left->Left, Right->Left)
+        && TreesEqual(Left->Middle, Right->Middle)
+        && TreesEqual(Left->Right, Right->Right);
+}
+
+/*
+ * Count the nodes in a tree.
+ * This is the measure of "code size" that the passes use to limit themselves.
+ */
+int TreeSize(struct ASTNode* Node) {
+    if(Node == NULL)
+        return 0;
+
+    return 1 + TreeSize(Node->Left) + TreeSize(Node->Middle) + TreeSize(Node->Right);
+}
+
+/*
+ * Determine whether a tree contains a given operation anywhere.
+ */
+int TreeContainsOperation(struct ASTNode* Node, int Operation) {
+    if(Node == NULL)
+        return 0;
+
+    if(Node->Operation == Operation)
+        return 1;
+
+    return TreeContainsOperation(Node->Left, Operation)
+        || TreeContainsOperation(Node->Middle, Operation)
+        || TreeContainsOperation(Node->Right, Operation);
+}
+
+/*
+ * Determine whether evaluating a tree does anything other than
+ *  produce a value - stores, increments, calls, prints, returns and jumps.
+ */
+int TreeHasSideEffects(struct ASTNode* Node) {
+    if(Node == NULL)
+        return 0;
+
+    switch(Node->Operation) {
+        case OP_ASSIGN:
+        case OP_PREINC:
+        case OP_PREDEC:
+        case OP_POSTINC:
+        case OP_POSTDEC:
+        case OP_CALL:
+        case OP_PRINT:
+        case OP_RET:
+        case OP_IF:
+        case OP_LOOP:
+        case OP_VECLOOP:
+        case OP_SWITCH:
+            return 1;
+
+        case OP_INTRINSIC:
+            if(Node->IntValue == IN_VSTORE)
+                return 1;
+            break;
+    }
+
+    return TreeHasSideEffects(Node->Left)
+        || TreeHasSideEffects(Node->Middle)
+        || TreeHasSideEffects(Node->Right);
+}
+
+/*
+ * Determine whether a tree may change the value of a variable.
+ *
+ * Locals can only be changed by name.
+ * Globals can also be changed by any function we call, and by any store
+ *  through a pointer, so those are treated as writes too.
+ *
+ * @param Node: The tree to search
+ * @param Symbol: The variable in question
+ * @return 1 if the variable may be written, 0 if it definitely is not.
+ */
+int TreeWritesSymbol(struct ASTNode* Node, struct SymbolTableEntry* Symbol) {
+    if(Node == NULL)
+        return 0;
+
+    switch(Node->Operation) {
+        case OP_ASSIGN:
+            if(Node->Right && Node->Right->Operation == REF_IDENT && Node->Right->Symbol == Symbol)
+                return 1;
+            if(Node->Right && Node->Right->Operation == OP_DEREF && Symbol->Storage == SC_GLOBAL)
+                return 1;
+            break;
+
+        case OP_POSTINC:
+        case OP_POSTDEC:
+            if(Node->Symbol == Symbol)
+                return 1;
+            break;
+
+        case OP_PREINC:
+        case OP_PREDEC:
+            if(Node->Left && Node->Left->Symbol == Symbol)
+                return 1;
+            break;
+
+        case OP_CALL:
+            if(Symbol->Storage == SC_GLOBAL)
+                return 1;
+            break;
+
+        case OP_INTRINSIC:
+            if(Node->IntValue == IN_VSTORE && Symbol->Storage == SC_GLOBAL)
+                return 1;
+            break;
+    }
+
+    return TreeWritesSymbol(Node->Left, Symbol)
+        || TreeWritesSymbol(Node->Middle, Symbol)
+        || TreeWritesSymbol(Node->Right, Symbol);
+}
+
+/*
+ * Determine whether a tree takes the address of a variable,
+ *  after which it may be changed through a pointer.
+ */
+int TreeTakesAddress(struct ASTNode* Node, struct SymbolTableEntry* Symbol) {
+    if(Node == NULL)
+        return 0;
+
+    if(Node->Operation == OP_ADDRESS && Node->Symbol == Symbol)
+        return 1;
+
+    return TreeTakesAddress(Node->Left, Symbol)
+        || TreeTakesAddress(Node->Middle, Symbol)
+        || TreeTakesAddress(Node->Right, Symbol);
+}
+
+/*
+ * Determine whether a tree is a compile-time constant, and if so, what it is.
+ * Widening does not change the value, so it is looked through.
+ *
+ * @param Node: The tree to check
+ * @param Value: Where to store the value, if constant.
+ * @return 1 if the tree is constant, 0 otherwise.
+ */
+int ConstantValue(struct ASTNode* Node, long* Value) {
+    if(Node == NULL)
+        return 0;
+
+    switch(Node->Operation) {
+        case TERM_INTLITERAL:
+            *Value = Node->IntValue;
+            return 1;
+
+        case OP_WIDEN:
+            return ConstantValue(Node->Left, Value);
+
+        case OP_NEGATE:
+            if(!ConstantValue(Node->Left, Value))
+                return 0;
+            *Value = -*Value;
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Strip the widening that MutateType wraps around mixed-size operands.
+ */
+struct ASTNode* Unwiden(struct ASTNode* Node) {
+    while(Node && Node->Operation == OP_WIDEN)
+        Node = Node->Left;
+    return Node;
+}
+
+/*
+ * Is this node a read of the given variable?
+ */
+int IsReferenceTo(struct ASTNode* Node, struct SymbolTableEntry* Symbol) {
+    Node = Unwiden(Node);
+    return Node && Node->Operation == REF_IDENT && Node->Symbol == Symbol;
+}
+
+/*
+ * Only plain integer scalars can be reasoned about as induction variables.
+ */
+int IsScalarInteger(struct SymbolTableEntry* Symbol) {
+    if(Symbol == NULL || Symbol->Structure != ST_VAR)
+        return 0;
+
+    switch(Symbol->Type) {
+        case RET_CHAR: case RET_INT: case RET_LONG:
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Recognise a statement that advances a variable by a constant:
+ *  i = i + k, i = k + i, i = i - k, i++, i--, ++i, --i
+ *
+ * @param Step: The statement to check
+ * @param Symbol: Filled in with the variable advanced
+ * @param Stride: Filled in with the signed distance
+ * @return 1 if the statement has this shape, 0 otherwise.
+ */
+int MatchInductionStep(struct ASTNode* Step, struct SymbolTableEntry** Symbol, long* Stride) {
+    struct ASTNode* Value;
+
+    if(Step == NULL)
+        return 0;
+
+    switch(Step->Operation) {
+        case OP_POSTINC: case OP_POSTDEC:
+            *Symbol = Step->Symbol;
+            *Stride = Step->Operation == OP_POSTINC ? 1 : -1;
+            return IsScalarInteger(*Symbol);
+
+        case OP_PREINC: case OP_PREDEC:
+            if(Step->Left == NULL)
+                return 0;
+            *Symbol = Step->Left->Symbol;
+            *Stride = Step->Operation == OP_PREINC ? 1 : -1;
+            return IsScalarInteger(*Symbol);
+
+        case OP_ASSIGN:
+            if(Step->Right == NULL || Step->Right->Operation != REF_IDENT)
+                return 0;
+
+            *Symbol = Step->Right->Symbol;
+            if(!IsScalarInteger(*Symbol))
+                return 0;
+
+            Value = Unwiden(Step->Left);
+            if(Value == NULL)
+                return 0;
+
+            if(Value->Operation == OP_ADD) {
+                if(IsReferenceTo(Value->Left, *Symbol) && ConstantValue(Value->Right, Stride))
+                    return *Stride != 0;
+                if(IsReferenceTo(Value->Right, *Symbol) && ConstantValue(Value->Left, Stride))
+                    return *Stride != 0;
+            }
+
+            if(Value->Operation == OP_SUBTRACT) {
+                if(IsReferenceTo(Value->Left, *Symbol) && ConstantValue(Value->Right, Stride)) {
+                    *Stride = -*Stride;
+                    return *Stride != 0;
+                }
+            }
+            return 0;
+    }
+
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     T R E E     B U I L D I N G     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * Create a new local variable for the optimiser's own use.
+ * It is given a name that cannot be written in source, so it never
+ *  clashes with the programmer's variables.
+ *
+ * This must be called before the function is assembled, so that
+ *  AsFunctionPreamble reserves space for it.
+ *
+ * @param Type: The DataTypes value of the new variable
+ * @return the Symbol Table entry of the new variable
+ */
+struct SymbolTableEntry* AddTemporary(int Type) {
+    static int TemporaryID = 1;
+    char Name[TEXTLEN];
+
+    snprintf(Name, TEXTLEN, "__tmp%d", TemporaryID++);
+    return AddSymbol(Name, Type, ST_VAR, SC_LOCAL, 1, 0, NULL);
+}
+
+/*
+ * Build a read of a variable.
+ */
+struct ASTNode* ConstructReference(struct SymbolTableEntry* Symbol) {
+    struct ASTNode* Node = ConstructASTLeaf(REF_IDENT, Symbol->Type, Symbol, 0);
+    Node->RVal = 1;
+    return Node;
+}
+
+/*
+ * Build a literal integer.
+ */
+struct ASTNode* ConstructLiteral(int Type, int Value) {
+    struct ASTNode* Node = ConstructASTLeaf(TERM_INTLITERAL, Type, NULL, Value);
+    Node->RVal = 1;
+    return Node;
+}
+
+/*
+ * Build the statement "Symbol = Value".
+ * This mirrors the shape ParsePrecedenceASTNode gives assignments -
+ *  the value on the left, the target on the right.
+ */
+struct ASTNode* ConstructAssignment(struct SymbolTableEntry* Symbol, struct ASTNode* Value) {
+    struct ASTNode* Target = ConstructASTLeaf(REF_IDENT, Symbol->Type, Symbol, 0);
+    struct ASTNode* Node;
+
+    Value->RVal = 1;
+    Node = ConstructASTNode(OP_ASSIGN, Value->ExprType, Value, NULL, Target, NULL, 0);
+    Node->RVal = 1;
+    return Node;
+}
+
+/*
+ * Glue two statements together, so that First runs before Second.
+ * Either may be missing, in which case the other is returned alone.
+ */
+struct ASTNode* ConstructSequence(struct ASTNode* First, struct ASTNode* Second) {
+    if(First == NULL)
+        return Second;
+    if(Second == NULL)
+        return First;
+
+    return ConstructASTNode(OP_COMP, RET_NONE, First, NULL, Second, NULL, 0);
+}
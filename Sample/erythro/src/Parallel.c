@@ -0,0 +1,310 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+#include <pthread.h>
+
+/********************************************************************************
+ * Parallel generates the code of functions on worker threads, for -j.          *
+ *                                                                              *
+ * The parser hands each function over as soon as it is parsed (and optimised), *
+ *  and carries on with the next while a worker assembles it into a buffer      *
+ *  of its own. Whatever the parser writes in between, like globals, goes into  *
+ *  buffers too, so that all of them can be written out in the order of the     *
+ *  source.                                                                     *
+ *                                                                              *
+ * Every function is given its labels before it is handed over, as many as      *
+ *  CountLabels says it takes, so the output is the same as without -j,         *
+ *  byte for byte.                                                              *
+ *                                                                              *
+ * Each worker has its own registers, locals and output, as those are           *
+ *  _Thread_local. The string pool is shared, so it is locked.                  *
+ *                                                                              *
+ ********************************************************************************/
+
+// Workers recurse as deeply as the trees they assemble.
+#define WORKER_STACK (8 * 1024 * 1024)
+
+// A piece of the output, in the order it is written out.
+struct OutputChunk {
+    // The function to assemble, or NULL if the parser wrote this chunk.
+    struct ASTNode* Tree;
+    struct SymbolTableEntry* Locals, *LocalsEnd, *Entry;
+    int FirstLabel, LabelCount, Line;
+    struct FunctionStats* Stats;
+
+    FILE* Output;
+    int Done;
+
+    struct OutputChunk* Next;
+    // The next function waiting for a worker.
+    struct OutputChunk* NextWaiting;
+};
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t SharedLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t Finished = PTHREAD_COND_INITIALIZER;
+
+// Every chunk not yet written out, in order.
+static struct OutputChunk* Chunks, *ChunksEnd;
+static int ChunkCount;
+
+static struct OutputChunk* Waiting, *WaitingEnd;
+static int Stopping;
+
+static pthread_t* Workers;
+static int WorkerCount;
+
+// Where the chunks go, while the parser writes into one of its own.
+static FILE* Destination;
+static int Functions;
+
+// Open a buffer for a chunk.
+static FILE* NewChunk(void) {
+    FILE* Buffer = tmpfile();
+
+    if(Buffer == NULL)
+        Die("Unable to create a buffer for a function");
+    return Buffer;
+}
+
+// Assemble one function, on whichever thread this is.
+static void AssembleFunction(struct ASTNode* Tree, int FirstLabel, int LabelCount, struct FunctionStats* Stats) {
+    PhaseStart(PHASE_GENERATE);
+    UseLabels(FirstLabel, LabelCount);
+    UseFunctionStats(Stats);
+    AssembleTree(Tree, -1, 0);
+    UseFunctionStats(NULL);
+    EndLabels();
+    PhaseEnd(PHASE_GENERATE);
+}
+
+static void* Worker(void* Unused) {
+    struct OutputChunk* Chunk;
+
+    (void) Unused;
+    pthread_mutex_lock(&Lock);
+    for(;;) {
+        while(Waiting == NULL && !Stopping)
+            pthread_cond_wait(&Work, &Lock);
+
+        if(Waiting == NULL)
+            break;
+
+        Chunk = Waiting;
+        if((Waiting = Chunk->NextWaiting) == NULL)
+            WaitingEnd = NULL;
+        pthread_mutex_unlock(&Lock);
+
+        OutputFile = NewChunk();
+        Locals = Chunk->Locals;
+        LocalsEnd = Chunk->LocalsEnd;
+        FunctionEntry = Chunk->Entry;
+        Line = Chunk->Line;
+
+        AssembleFunction(Chunk->Tree, Chunk->FirstLabel, Chunk->LabelCount, Chunk->Stats);
+
+        pthread_mutex_lock(&Lock);
+        Chunk->Output = OutputFile;
+        Chunk->Done = 1;
+        pthread_cond_broadcast(&Finished);
+    }
+    pthread_mutex_unlock(&Lock);
+
+    return NULL;
+}
+
+static void StartWorkers(void) {
+    pthread_attr_t Attributes;
+
+    if((Workers = malloc(OptJobs * sizeof(pthread_t))) == NULL)
+        Die("Unable to allocate worker threads");
+
+    pthread_attr_init(&Attributes);
+    pthread_attr_setstacksize(&Attributes, WORKER_STACK);
+
+    for(WorkerCount = 0; WorkerCount < OptJobs; WorkerCount++)
+        if(pthread_create(&Workers[WorkerCount], &Attributes, Worker, NULL) != 0)
+            Die("Unable to start a worker thread");
+
+    pthread_attr_destroy(&Attributes);
+}
+
+// Add a chunk to the end of the output. The Lock must be held.
+static void AddChunk(struct OutputChunk* Chunk) {
+    Chunk->Next = NULL;
+    if(ChunksEnd)
+        ChunksEnd->Next = Chunk;
+    else
+        Chunks = Chunk;
+    ChunksEnd = Chunk;
+    ChunkCount++;
+}
+
+// Close off what the parser has written, as a chunk of its own. The Lock must be held.
+static void AddParserChunk(void) {
+    struct OutputChunk* Chunk = calloc(1, sizeof(struct OutputChunk));
+
+    if(Chunk == NULL)
+        Die("Unable to allocate a chunk of output");
+
+    Chunk->Output = OutputFile;
+    Chunk->Done = 1;
+    AddChunk(Chunk);
+}
+
+/*
+ * Write out the finished chunks at the front of the output.
+ *
+ * @param Wait: Whether to wait until there are few enough left.
+ *  Every chunk holds a file open, so the parser can't get too far ahead.
+ */
+static void WriteChunks(int Wait) {
+    struct OutputChunk* Chunk;
+    char Buffer[8192];
+    long Length;
+
+    PhaseStart(PHASE_EMIT);
+    for(;;) {
+        pthread_mutex_lock(&Lock);
+        while(Wait && ChunkCount > 2 * WorkerCount + 2 && !Chunks->Done)
+            pthread_cond_wait(&Finished, &Lock);
+
+        if((Chunk = Chunks) == NULL || !Chunk->Done) {
+            pthread_mutex_unlock(&Lock);
+            PhaseEnd(PHASE_EMIT);
+            return;
+        }
+
+        if((Chunks = Chunk->Next) == NULL)
+            ChunksEnd = NULL;
+        ChunkCount--;
+        pthread_mutex_unlock(&Lock);
+
+        rewind(Chunk->Output);
+        while((Length = fread(Buffer, 1, sizeof(Buffer), Chunk->Output)) > 0)
+            fwrite(Buffer, 1, Length, Destination);
+
+        fclose(Chunk->Output);
+        free(Chunk);
+    }
+}
+
+/*
+ * Generate the code of a function, once it has been parsed.
+ * With -j, it is left to a worker, and this returns straight away.
+ *
+ * The Locals and FunctionEntry must be those of the function.
+ *
+ * @param Tree: The OP_FUNC tree of the function
+ */
+void GenerateFunction(struct ASTNode* Tree) {
+    struct FunctionStats* Stats;
+    struct OutputChunk* Chunk;
+    int Count, First;
+
+    // The VM numbers its own labels.
+    if(OptVirtualMachine) {
+        PhaseStart(PHASE_GENERATE);
+        AssembleTree(Tree, -1, 0);
+        PhaseEnd(PHASE_GENERATE);
+        return;
+    }
+
+    Count = CountLabels(Tree);
+    First = ReserveLabels(Count);
+    Stats = NewFunctionStats(FunctionEntry);
+    Functions++;
+
+    // The tree is dumped as it is assembled, which has to be in order.
+    if(OptJobs <= 1 || OptDumpTree) {
+        AssembleFunction(Tree, First, Count, Stats);
+        return;
+    }
+
+    if(Destination == NULL) {
+        Destination = OutputFile;
+        OutputFile = NewChunk();
+        StartWorkers();
+    }
+
+    if((Chunk = calloc(1, sizeof(struct OutputChunk))) == NULL)
+        Die("Unable to allocate a chunk of output");
+
+    Chunk->Tree = Tree;
+    Chunk->Locals = Locals;
+    Chunk->LocalsEnd = LocalsEnd;
+    Chunk->Entry = FunctionEntry;
+    Chunk->FirstLabel = First;
+    Chunk->LabelCount = Count;
+    Chunk->Line = Line;
+    Chunk->Stats = Stats;
+
+    pthread_mutex_lock(&Lock);
+    AddParserChunk();
+    AddChunk(Chunk);
+
+    if(WaitingEnd)
+        WaitingEnd->NextWaiting = Chunk;
+    else
+        Waiting = Chunk;
+    WaitingEnd = Chunk;
+    pthread_cond_signal(&Work);
+    pthread_mutex_unlock(&Lock);
+
+    OutputFile = NewChunk();
+    WriteChunks(1);
+}
+
+/*
+ * Wait for every function to be generated, and write them all out.
+ * Called at the end of each translation unit, before the string pool,
+ *  which needs to know which strings the functions used.
+ */
+void FinishFunctions(void) {
+    if(Destination == NULL) {
+        if(OptVerboseOutput && Functions)
+            printf("Parallel: generated %d functions on 1 thread\n", Functions);
+        Functions = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&Lock);
+    AddParserChunk();
+    Stopping = 1;
+    pthread_cond_broadcast(&Work);
+    pthread_mutex_unlock(&Lock);
+
+    for(int i = 0; i < WorkerCount; i++)
+        pthread_join(Workers[i], NULL);
+
+    WriteChunks(0);
+
+    if(OptVerboseOutput)
+        printf("Parallel: generated %d functions on %d threads\n", Functions, WorkerCount);
+
+    free(Workers);
+    Workers = NULL;
+    WorkerCount = 0;
+    Stopping = 0;
+    Functions = 0;
+
+    OutputFile = Destination;
+    Destination = NULL;
+}
+
+/*
+ * Guard what the parser and the workers share.
+ */
+void LockShared(void) {
+    pthread_mutex_lock(&SharedLock);
+}
+
+void UnlockShared(void) {
+    pthread_mutex_unlock(&SharedLock);
+}
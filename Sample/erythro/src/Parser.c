@@ -25,7 +25,7 @@ static int Precedence[] = {
           80, 90, // => <<
          90, 100, // >> +
         100, 110, // - *
-        110       // /
+        110, 110  // / %
 };    
 
 /*
@@ -97,6 +97,7 @@ struct ASTNode* ConstructASTNode(int Operation, int Type,
     if(!Node)
         Die("Unable to allocate node!");
 
+    Tally(COUNT_NODES, 1);
 
     Node->Operation = Operation;
     Node->ExprType = Type;
@@ -105,6 +106,7 @@ struct ASTNode* ConstructASTNode(int Operation, int Type,
     Node->Right = Right;
     Node->Symbol = Symbol;
     Node->IntValue = IntValue;
+    Node->RVal = 0;
 
     return Node;
 }
@@ -187,6 +189,13 @@ struct ASTNode* ParsePrimary(void) {
         case TY_IDENTIFIER:
             return PostfixStatement();
 
+        case TY_I8X16:
+            return ParseSplat(RET_I8X16);
+        case TY_I32X4:
+            return ParseSplat(RET_I32X4);
+        case TY_I64X2:
+            return ParseSplat(RET_I64X2);
+
         case LI_LPARE:
             // Starting a ( expr ) block
             Tokenise();
@@ -254,11 +263,12 @@ struct ASTNode* ParsePrecedenceASTNode(int PreviousTokenPrecedence) {
             LeftNode->RVal = 0;
 
             RightNode = MutateType(RightNode, LeftNode->ExprType, 0);
-            if(LeftNode == NULL)
+            if(RightNode == NULL)
                 Die("Incompatible Expression encountered in assignment");
 
             // LeftNode holds the target, the target variable in this case
-            printf("\t\tAssigning variable: %s\n", LeftNode->Symbol->Name);
+            if(LeftNode->Symbol)
+                printf("\t\tAssigning variable: %s\n", LeftNode->Symbol->Name);
 
             LeftTemp = LeftNode;
             LeftNode = RightNode;
@@ -272,6 +282,11 @@ struct ASTNode* ParsePrecedenceASTNode(int PreviousTokenPrecedence) {
             LeftNode->RVal = 1;
             RightNode->RVal = 1;
 
+            // Every lane of a vector is shifted by the same scalar, never the other way around.
+            if((OpType == OP_SHIFTL || OpType == OP_SHIFTR)
+                && !TypeIsVector(LeftNode->ExprType) && TypeIsVector(RightNode->ExprType))
+                Die("Can't shift a scalar by a vector");
+
             LeftTemp = MutateType(LeftNode, RightNode->ExprType, OpType);
 
             RightTemp = MutateType(RightNode, LeftNode->ExprType, OpType);
@@ -376,7 +391,7 @@ struct ASTNode* CallFunction() {
  */
 struct ASTNode* GetExpressionList() {
     struct ASTNode* Tree = NULL, *Child = NULL;
-    int Count;
+    int Count = 0;
 
     while(CurrentToken.type != LI_RPARE) {
         Child = ParsePrecedenceASTNode(0);
@@ -410,6 +425,7 @@ struct ASTNode* GetExpressionList() {
  *  * If Statement
  *  * While Statement
  *  * For Statement
+ *  * Switch Statement
  *  * Return Statement
  *  * Numeric literals and variables
  *  * Binary Expressions
@@ -423,6 +439,9 @@ struct ASTNode* ParseStatement(void) {
         case TY_CHAR:
         case TY_LONG:
         case TY_INT:
+        case TY_I8X16:
+        case TY_I32X4:
+        case TY_I64X2:
             printf("\t\tNew Variable: %s\n", CurrentIdentifier);
             Type = ParseOptionalPointer(NULL);
             VerifyToken(TY_IDENTIFIER, "ident");
@@ -439,45 +458,41 @@ struct ASTNode* ParseStatement(void) {
         case KW_FOR:
             return ForStatement();
 
+        case KW_SWITCH:
+            return SwitchStatement();
+
         case KW_RETURN:
             return ReturnStatement();
         
         default:
-            ParsePrecedenceASTNode(0);
+            return ParsePrecedenceASTNode(0);
     }
 }
 
 
 /*
- * Handles parsing multiple statements or expressions in a row.
- * These are typically grouped together with the Compound tokens "{ }"
- *  and seperated by the semicolon ";".
+ * Handles parsing multiple statements or expressions in a row,
+ *  seperated by the semicolon ";".
+ *
+ * Statements are parsed until a Right Compound token is reached ("}"),
+ *  or the label of the next case in a switch.
+ * The token that stops parsing is left for the caller.
+ *
+ * @return the AST Node representing these statements, or NULL if there are none
  *
- * Single Statements are parsed until a semicolon is reached, at which
- *  point another statement will be parsed, or until a Right Compound
- *   token is reached ("}"), at which point parsing will stop.
- * 
- * It is useful for:
- *  * Tightly identifying related blocks of code
- *  * Containing the many statements of functions
- * 
- * @return the AST Node representing this compound statement
- * 
  */
-struct ASTNode* ParseCompound() {
+struct ASTNode* ParseStatements() {
     struct ASTNode* Left = NULL, *Tree;
-    
-    // Compound statements are defined by comprising
-    //  multiple statements inside { a bracket block }
-    VerifyToken(LI_LBRAC, "{");
 
-    while(1) {
+    while(CurrentToken.type != LI_RBRAC && CurrentToken.type != KW_CASE && CurrentToken.type != KW_DEFAULT) {
         printf("\tNew branch in compound\n");
        
         Tree = ParseStatement();
 
-        if(Tree && (Tree->Operation == OP_PRINT || Tree->Operation == OP_ASSIGN
-                        || Tree->Operation == OP_RET || Tree->Operation == OP_CALL))
+        // Everything but the block statements ends with a semicolon.
+        // For loops come back as the initialiser glued to the loop.
+        if(Tree && Tree->Operation != OP_IF && Tree->Operation != OP_LOOP
+                && Tree->Operation != OP_COMP && Tree->Operation != OP_SWITCH)
             VerifyToken(LI_SEMIC, ";");
         
         if(Tree) {
@@ -486,12 +501,33 @@ struct ASTNode* ParseCompound() {
             else
                 Left = ConstructASTNode(OP_COMP, RET_NONE, Left, NULL, Tree, NULL, 0);
         }
-
-        if(CurrentToken.type == LI_RBRAC) {
-            VerifyToken(LI_RBRAC, "}");
-            return Left;
-        }
     }
+
+    return Left;
+}
+
+/*
+ * Handles parsing a block of statements grouped together with the
+ *  Compound tokens "{ }".
+ *
+ * It is useful for:
+ *  * Tightly identifying related blocks of code
+ *  * Containing the many statements of functions
+ * 
+ * @return the AST Node representing this compound statement
+ * 
+ */
+struct ASTNode* ParseCompound() {
+    struct ASTNode* Tree;
+    
+    // Compound statements are defined by comprising
+    //  multiple statements inside { a bracket block }
+    VerifyToken(LI_LBRAC, "{");
+
+    Tree = ParseStatements();
+
+    VerifyToken(LI_RBRAC, "}");
+    return Tree;
 }
 
 /*
@@ -544,9 +580,19 @@ void ParseGlobals() {
         if(FunctionComing && CurrentToken.type == LI_LPARE) {
             printf("\tParsing function");
             Tree = ParseFunction(Type);
-            if(Tree) {
+            // Calls to it may be worked out at compile time, from the tree as it was written.
+            if(Tree && OptOptimise)
+                RememberFunction(Tree);
+
+            if(Tree && OptWholeProgram) {
+                // Code generation waits until every file has been read.
+                AddProgramFunction(Tree);
+                FreeLocals();
+            } else if(Tree) {
+                if(OptOptimise)
+                    Tree = OptimiseFunction(Tree);
                 printf("\nBeginning assembler creation of new function %s\n", Tree->Symbol->Name);
-                AssembleTree(Tree, -1, 0);
+                GenerateFunction(Tree);
                 FreeLocals();
             } else {
                 printf("\nFunction prototype saved\r\n");
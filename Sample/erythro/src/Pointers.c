@@ -92,6 +92,18 @@ int ParseOptionalPointer(struct SymbolTableEntry** Composite) {
             Type = RET_LONG;
             Tokenise();
             break;
+        case TY_I8X16:
+            Type = RET_I8X16;
+            Tokenise();
+            break;
+        case TY_I32X4:
+            Type = RET_I32X4;
+            Tokenise();
+            break;
+        case TY_I64X2:
+            Type = RET_I64X2;
+            Tokenise();
+            break;
         case KW_STRUCT:
             Type = DAT_STRUCT;
             *Composite = BeginStructDeclaration();
@@ -146,7 +158,7 @@ struct ASTNode* AccessArray() {
     if(!TypeIsInt(RightNode->ExprType))
         Die("Array index is not integer");
     
-    printf("\t\tPreparing types - RightNode of type %s must be mutated to LeftNode type %s\r\n", (RightNode->ExprType), TypeNames(LeftNode->ExprType));
+    printf("\t\tPreparing types - RightNode of type %s must be mutated to LeftNode type %s\r\n", TypeNames(RightNode->ExprType), TypeNames(LeftNode->ExprType));
     RightNode = MutateType(RightNode, LeftNode->ExprType, OP_ADD);
 
     LeftNode = ConstructASTNode(OP_ADD, Entry->Type, LeftNode, NULL, RightNode, NULL, 0);
@@ -0,0 +1,226 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+
+/********************************************************************************
+ * Profile Guided Optimisation takes two compiles.                              *
+ *                                                                              *
+ * With -fprofile-generate, every code label counts how many times it is        *
+ *  reached. When the program exits, the counts of each translation unit are    *
+ *  appended to <source>.profile, so several runs add up.                       *
+ *                                                                              *
+ * With -fprofile-use, the counts are read back, and the assembler uses them:   *
+ *  * an if whose branch is rarely taken moves that branch into                 *
+ *     .text.unlikely.<function>, so the common path falls straight through,    *
+ *  * a loop that usually goes round more than once is rotated, so that it      *
+ *     only takes one branch per iteration,                                     *
+ *  * the headers of hot loops are aligned to 16 bytes.                         *
+ *                                                                              *
+ * Counters are indexed by label number, counted from the first label of the    *
+ *  translation unit, so both compiles must be given the same source and the    *
+ *  same flags, or the profile will not line up.                                *
+ *                                                                              *
+ * The counters are written by a small function that the unit registers with   *
+ *  atexit, from a .ctors entry, which __main runs before main does anything.   *
+ *                                                                              *
+ ********************************************************************************/
+
+// A branch is cold when it runs less than 1/COLD_RATIO as often as the other way.
+#define COLD_RATIO 16
+// A label is hot when it runs at least 1/HOT_RATIO as often as the hottest.
+#define HOT_RATIO 16
+
+// The first label of this translation unit, which also labels the counters.
+static int ProfileBase;
+static char* ProfileName;
+
+// The counts read from the profile, and the largest of them.
+static long* Counts;
+static int CountsLength;
+static long HottestCount;
+
+/*
+ * Read every record of a profile, adding them up.
+ * Each record starts with how many counts it holds, including that one.
+ */
+static void ReadProfile(FILE* Profile) {
+    long Length, Count;
+
+    while(fread(&Length, sizeof(long), 1, Profile) == 1) {
+        if(Length < 1 || (Counts != NULL && Length != CountsLength)) {
+            fprintf(stderr, "Warning: %s does not match the source, ignoring it\n", ProfileName);
+            free(Counts);
+            Counts = NULL;
+            return;
+        }
+
+        if(Counts == NULL) {
+            CountsLength = Length;
+            Counts = calloc(Length, sizeof(long));
+            if(Counts == NULL)
+                Die("Unable to allocate profile");
+        }
+
+        for(int i = 1; i < Length; i++) {
+            if(fread(&Count, sizeof(long), 1, Profile) != 1) {
+                fprintf(stderr, "Warning: %s is truncated\n", ProfileName);
+                return;
+            }
+            Counts[i] += Count;
+        }
+    }
+}
+
+/*
+ * Prepare profiling for a new translation unit.
+ *
+ * @param InputFile: The source file, which the profile is named after.
+ */
+void ProfileStart(char* InputFile) {
+    FILE* Profile;
+
+    if(!OptProfileGenerate && !OptProfileUse)
+        return;
+
+    ProfileBase = NewLabel();
+
+    ProfileName = malloc(strlen(InputFile) + 9);
+    if(ProfileName == NULL)
+        Die("Unable to allocate profile name");
+    sprintf(ProfileName, "%s.profile", InputFile);
+
+    free(Counts);
+    Counts = NULL;
+    CountsLength = 0;
+    HottestCount = 0;
+
+    if(!OptProfileUse)
+        return;
+
+    if((Profile = fopen(ProfileName, "rb")) == NULL) {
+        fprintf(stderr, "Warning: no profile %s, compiling without it\n", ProfileName);
+        return;
+    }
+
+    ReadProfile(Profile);
+    fclose(Profile);
+
+    for(int i = 1; i < CountsLength; i++)
+        if(Counts[i] > HottestCount)
+            HottestCount = Counts[i];
+
+    if(OptVerboseOutput && Counts != NULL)
+        printf("Profile: read %d counters from %s, the hottest ran %ld times\n", CountsLength - 1, ProfileName, HottestCount);
+}
+
+/*
+ * How many times a label was reached in the profiled runs.
+ *
+ * @return the count, or -1 if there is no profile for it.
+ */
+long ProfileCount(int Label) {
+    if(Counts == NULL || Label <= ProfileBase || Label - ProfileBase >= CountsLength)
+        return -1;
+
+    return Counts[Label - ProfileBase];
+}
+
+/*
+ * Is one way out of a branch cold, compared to the other?
+ * A branch neither way ever took tells us nothing.
+ */
+int ProfileIsCold(long Count, long Other) {
+    return Count >= 0 && Other > 0 && Count * COLD_RATIO < Other;
+}
+
+// Is a label one of the hottest in the unit?
+int ProfileIsHot(int Label) {
+    long Count = ProfileCount(Label);
+
+    return Count > 0 && Count * HOT_RATIO >= HottestCount;
+}
+
+/*
+ * Count a label as it is reached.
+ * Called by AsLabel for every label in code.
+ */
+void AsProfileCounter(int Label) {
+    if(!OptProfileGenerate || Label <= ProfileBase)
+        return;
+
+    fprintf(OutputFile, "\tincq\tL%d+%d(%%rip)\n", ProfileBase, (Label - ProfileBase) * 8);
+}
+
+/*
+ * Write out the counters for this translation unit, and the code to save them.
+ */
+void AsProfileRuntime(void) {
+    int Length, Name, Mode, Write, Done, Init;
+
+    if(!OptProfileGenerate)
+        return;
+
+    Length = NewLabel() - ProfileBase;
+    Name = NewLabel();
+    Mode = NewLabel();
+    Write = NewLabel();
+    Done = NewLabel();
+    Init = NewLabel();
+
+    // The first counter holds how many there are, so a profile can be checked against the source.
+    fprintf(OutputFile, "\t.section\t.data.erythro_profile,\"w\"\n\t.balign\t8\n");
+    fprintf(OutputFile, "L%d:\n\t.quad\t%d\n\t.zero\t%d\n", ProfileBase, Length, (Length - 1) * 8);
+
+    fprintf(OutputFile, "\t.section\t.rdata,\"dr\"\nL%d:\n\t.string\t\"", Name);
+    for(char* Char = ProfileName; *Char; Char++) {
+        if(*Char == '\\' || *Char == '"')
+            fputc('\\', OutputFile);
+        fputc(*Char, OutputFile);
+    }
+    fprintf(OutputFile, "\"\nL%d:\n\t.string\t\"ab\"\n", Mode);
+
+    // fwrite(Counters, 8, Length, fopen(Name, "ab")), when the program exits.
+    fprintf(OutputFile,
+            "\t.section\t.text.erythro_profile,\"x\"\n"
+            "L%d:\n"
+            "\tpushq\t%%rbp\n"
+            "\tmovq\t%%rsp, %%rbp\n"
+            "\tsubq\t$48, %%rsp\n"
+            "\tleaq\tL%d(%%rip), %%rcx\n"
+            "\tleaq\tL%d(%%rip), %%rdx\n"
+            "\tcall\tfopen\n"
+            "\ttestq\t%%rax, %%rax\n"
+            "\tje\tL%d\n"
+            "\tmovq\t%%rax, -8(%%rbp)\n"
+            "\tleaq\tL%d(%%rip), %%rcx\n"
+            "\tmovq\t$8, %%rdx\n"
+            "\tmovq\t$%d, %%r8\n"
+            "\tmovq\t%%rax, %%r9\n"
+            "\tcall\tfwrite\n"
+            "\tmovq\t-8(%%rbp), %%rcx\n"
+            "\tcall\tfclose\n"
+            "L%d:\n"
+            "\tmovq\t%%rbp, %%rsp\n"
+            "\tpopq\t%%rbp\n"
+            "\tret\n",
+            Write, Name, Mode, Done, ProfileBase, Length, Done);
+
+    fprintf(OutputFile,
+            "L%d:\n"
+            "\tsubq\t$40, %%rsp\n"
+            "\tleaq\tL%d(%%rip), %%rcx\n"
+            "\tcall\tatexit\n"
+            "\taddq\t$40, %%rsp\n"
+            "\tret\n"
+            "\t.section\t.ctors,\"w\"\n"
+            "\t.quad\tL%d\n",
+            Init, Write, Init);
+
+    if(OptVerboseOutput)
+        printf("Profile: %d counters will be written to %s\n", Length - 1, ProfileName);
+}
@@ -0,0 +1,466 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/********************************************************************************
+ * The Report measures where the compiler spends its time, for -ftime-report.   *
+ *                                                                              *
+ * Each phase is started and ended around the work it names, and phases nest:   *
+ *  while a nested phase runs, the time goes to it and not to the one outside.  *
+ * Every thread keeps its own nesting, so the lexer thread and the workers of   *
+ *  -j are counted too. Their CPU time is added up, but a phase's wall time is  *
+ *  how long any thread was in it, so four workers generating code for one      *
+ *  second is one second of wall time, and four of CPU. With one thread, the    *
+ *  phases add up to the whole.                                                 *
+ *                                                                              *
+ * For each phase, it reports the wall and CPU time, how often it was entered,  *
+ *  and the peak resident memory when it last ended. Assembling and linking     *
+ *  are done by other programs, whose CPU time is counted to them.              *
+ *                                                                              *
+ * It also counts the tokens, AST nodes, symbols, labels and instructions made, *
+ *  and how many symbols were compared in all to find the names looked up.      *
+ *                                                                              *
+ * The report goes to stderr, as a table, or as JSON with -ftime-report=json.   *
+ *                                                                              *
+ * With -fperf-counters, each phase also counts instructions, cycles, cache     *
+ *  misses and branch misses, with perf_event_open on Linux. Where the counters *
+ *  can't be had, as in many containers, the report says so and goes on.        *
+ *                                                                              *
+ ********************************************************************************/
+
+#define PHASE_DEPTH 64
+#define HARDWARE_COUNTERS 4
+
+static char* PhaseNames[PHASES] = {
+    "lexing", "parsing", "symbol lookup", "type mutation", "optimisation", "code generation", "scheduling", "emission", "assembly", "linking"
+};
+static char* PhaseKeys[PHASES] = {
+    "lex", "parse", "lookup", "mutate_type", "optimise", "generate", "schedule", "emit", "assemble", "link"
+};
+
+static char* HardwareNames[HARDWARE_COUNTERS] = { "instructions", "cycles", "cache misses", "branch misses" };
+static char* HardwareKeys[HARDWARE_COUNTERS] = { "instructions", "cycles", "cache_misses", "branch_misses" };
+
+static char* CounterNames[COUNTERS] = { "tokens", "AST nodes", "symbols", "labels", "instructions", "lookup steps" };
+static char* CounterKeys[COUNTERS] = { "tokens", "ast_nodes", "symbols", "labels", "instructions", "lookup_steps" };
+
+struct PhaseTotal {
+    long long Wall, Cpu;    // In nanoseconds
+    long Entries;
+    long PeakMemory;        // In kilobytes
+    long long Hardware[HARDWARE_COUNTERS];
+};
+
+static struct PhaseTotal Totals[PHASES];
+static long Counters[COUNTERS];
+static pthread_mutex_t TotalsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long StartWall, StartCpu;
+static pthread_once_t StartOnce = PTHREAD_ONCE_INIT;
+
+// How many threads are inside each phase, and since when any has been.
+static int Active[PHASES];
+static long long ActiveSince[PHASES];
+
+// The phases this thread is inside, and when the innermost one last started counting.
+static _Thread_local int Stack[PHASE_DEPTH];
+static _Thread_local int Depth;
+static _Thread_local long long SliceCpu;
+
+// What children had used when a phase that runs them started.
+static long long ChildrenCpu[PHASES];
+
+/*
+ * The hardware counters of this thread, as one group read all at once.
+ * Members holds which counter each value read is, as some may not exist.
+ */
+static _Thread_local int HardwareTried, HardwareGroup = -1, MemberCount;
+static _Thread_local int Members[HARDWARE_COUNTERS];
+static _Thread_local long long SliceHardware[HARDWARE_COUNTERS];
+
+// Which counters any thread could open, and why not if none could, under TotalsLock.
+static int HardwareSupported[HARDWARE_COUNTERS];
+static int HardwareError;
+
+#ifdef __linux__
+static pthread_key_t HardwareKey;
+static pthread_once_t HardwareOnce = PTHREAD_ONCE_INIT;
+
+// Close the counters of a thread as it ends.
+static void CloseHardware(void* Descriptors) {
+    for(int* Fd = Descriptors; *Fd >= 0; Fd++)
+        close(*Fd);
+    free(Descriptors);
+}
+
+static void CreateHardwareKey(void) {
+    pthread_key_create(&HardwareKey, CloseHardware);
+}
+
+static void OpenHardware(void) {
+    static const unsigned long long Events[HARDWARE_COUNTERS] = {
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    struct perf_event_attr Attributes;
+    int* Descriptors = malloc((HARDWARE_COUNTERS + 1) * sizeof(int)), Fd;
+
+    HardwareTried = 1;
+    if(Descriptors == NULL)
+        return;
+
+    for(int i = 0; i < HARDWARE_COUNTERS; i++) {
+        memset(&Attributes, 0, sizeof(Attributes));
+        Attributes.type = PERF_TYPE_HARDWARE;
+        Attributes.size = sizeof(Attributes);
+        Attributes.config = Events[i];
+        Attributes.read_format = PERF_FORMAT_GROUP;
+        // Only our own code, which is what most kernels allow without privileges.
+        Attributes.exclude_kernel = 1;
+        Attributes.exclude_hv = 1;
+
+        if((Fd = syscall(__NR_perf_event_open, &Attributes, 0, -1, HardwareGroup, 0)) < 0) {
+            // Without the first, there is no group for the rest.
+            if(HardwareGroup < 0) {
+                int Error = errno;
+                pthread_mutex_lock(&TotalsLock);
+                HardwareError = Error;
+                pthread_mutex_unlock(&TotalsLock);
+                break;
+            }
+            continue;
+        }
+
+        if(HardwareGroup < 0)
+            HardwareGroup = Fd;
+        Descriptors[MemberCount] = Fd;
+        Members[MemberCount++] = i;
+    }
+
+    // Other threads are opening theirs at the same time.
+    pthread_mutex_lock(&TotalsLock);
+    for(int i = 0; i < MemberCount; i++)
+        HardwareSupported[Members[i]] = 1;
+    pthread_mutex_unlock(&TotalsLock);
+
+    Descriptors[MemberCount] = -1;
+    pthread_once(&HardwareOnce, CreateHardwareKey);
+    pthread_setspecific(HardwareKey, Descriptors);
+}
+
+// Read the counters of this thread, or return 0 if it has none.
+static int ReadHardware(long long* Values) {
+    unsigned long long Buffer[HARDWARE_COUNTERS + 1];
+
+    if(!HardwareTried)
+        OpenHardware();
+
+    if(HardwareGroup < 0 || read(HardwareGroup, Buffer, sizeof(Buffer)) < (long) sizeof(unsigned long long))
+        return 0;
+
+    for(int i = 0; i < MemberCount && i < (int) Buffer[0]; i++)
+        Values[Members[i]] = Buffer[i + 1];
+    return 1;
+}
+#else
+static int ReadHardware(long long* Values) {
+    pthread_mutex_lock(&TotalsLock);
+    HardwareError = ENOSYS;
+    pthread_mutex_unlock(&TotalsLock);
+    return 0;
+}
+#endif
+
+static long long Nanoseconds(clockid_t Clock) {
+    struct timespec Time;
+
+    clock_gettime(Clock, &Time);
+    return Time.tv_sec * 1000000000LL + Time.tv_nsec;
+}
+
+// The CPU time used by programs we ran, like the assembler.
+static long long ChildrenTime(void) {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage Usage;
+
+    getrusage(RUSAGE_CHILDREN, &Usage);
+    return (Usage.ru_utime.tv_sec + Usage.ru_stime.tv_sec) * 1000000000LL
+         + (Usage.ru_utime.tv_usec + Usage.ru_stime.tv_usec) * 1000LL;
+#endif
+}
+
+// The most memory we have held so far, in kilobytes.
+static long PeakMemory(void) {
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage Usage;
+
+    getrusage(RUSAGE_SELF, &Usage);
+    return Usage.ru_maxrss;
+#endif
+}
+
+/*
+ * Give the CPU time, and the counts, since the last slice to the innermost phase,
+ *  which this thread is leaving for Next.
+ * Wall time goes to a phase only while some thread is in it, so it is never counted twice.
+ *
+ * @param Next: The phase this thread is going into, or -1 if none
+ */
+static void ChargeSlice(long long Wall, long long Cpu, int Next) {
+    long long Hardware[HARDWARE_COUNTERS] = { 0 };
+    int Counted = OptPerfCounters && ReadHardware(Hardware);
+
+    pthread_mutex_lock(&TotalsLock);
+    if(Depth > 0) {
+        int Phase = Stack[Depth - 1];
+        Totals[Phase].Cpu += Cpu - SliceCpu;
+        for(int i = 0; Counted && i < HARDWARE_COUNTERS; i++)
+            Totals[Phase].Hardware[i] += Hardware[i] - SliceHardware[i];
+        if(--Active[Phase] == 0)
+            Totals[Phase].Wall += Wall - ActiveSince[Phase];
+    }
+    if(Next >= 0 && Active[Next]++ == 0)
+        ActiveSince[Next] = Wall;
+    pthread_mutex_unlock(&TotalsLock);
+
+    SliceCpu = Cpu;
+    if(Counted)
+        memcpy(SliceHardware, Hardware, sizeof(Hardware));
+}
+
+// Whether any thread had any counters.
+static int HardwareCounted(void) {
+    for(int i = 0; i < HARDWARE_COUNTERS; i++)
+        if(HardwareSupported[i])
+            return 1;
+    return 0;
+}
+
+static void ReportHardwareTable(void) {
+    if(!OptPerfCounters)
+        return;
+
+    if(!HardwareCounted()) {
+        fprintf(stderr, "\nHardware counters unavailable: %s\n", strerror(HardwareError ? HardwareError : ENOSYS));
+        return;
+    }
+
+    fprintf(stderr, "\nHardware counters:\n  %-18s", "phase");
+    for(int i = 0; i < HARDWARE_COUNTERS; i++)
+        fprintf(stderr, " %15s", HardwareNames[i]);
+    fprintf(stderr, " %6s\n", "IPC");
+
+    for(int i = 0; i < PHASES; i++) {
+        if(Totals[i].Entries == 0 || i == PHASE_ASSEMBLE || i == PHASE_LINK)
+            continue;
+
+        fprintf(stderr, "  %-18s", PhaseNames[i]);
+        for(int j = 0; j < HARDWARE_COUNTERS; j++) {
+            if(HardwareSupported[j])
+                fprintf(stderr, " %15lld", Totals[i].Hardware[j]);
+            else
+                fprintf(stderr, " %15s", "-");
+        }
+
+        if(HardwareSupported[0] && HardwareSupported[1] && Totals[i].Hardware[1])
+            fprintf(stderr, " %6.2f\n", (double) Totals[i].Hardware[0] / Totals[i].Hardware[1]);
+        else
+            fprintf(stderr, " %6s\n", "-");
+    }
+}
+
+// The whole run is timed from when the first phase starts, on whichever thread.
+static void StartClocks(void) {
+    StartWall = Nanoseconds(CLOCK_MONOTONIC);
+    StartCpu = Nanoseconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/*
+ * Start counting time for a phase, until PhaseEnd.
+ *
+ * @param Phase: The value of the Phases enum
+ */
+void PhaseStart(int Phase) {
+    if(!OptTimeReport)
+        return;
+
+    if(Depth == PHASE_DEPTH)
+        DieDecimal("Phases nested too deeply", Phase);
+
+    pthread_once(&StartOnce, StartClocks);
+    ChargeSlice(Nanoseconds(CLOCK_MONOTONIC), Nanoseconds(CLOCK_THREAD_CPUTIME_ID), Phase);
+
+    if(Phase == PHASE_ASSEMBLE || Phase == PHASE_LINK)
+        ChildrenCpu[Phase] = ChildrenTime();
+
+    Stack[Depth++] = Phase;
+}
+
+/*
+ * Stop counting time for a phase, and go back to the one it was inside.
+ *
+ * @param Phase: The value of the Phases enum
+ */
+void PhaseEnd(int Phase) {
+    if(!OptTimeReport || Depth == 0)
+        return;
+
+    ChargeSlice(Nanoseconds(CLOCK_MONOTONIC), Nanoseconds(CLOCK_THREAD_CPUTIME_ID), Depth > 1 ? Stack[Depth - 2] : -1);
+    Depth--;
+
+    pthread_mutex_lock(&TotalsLock);
+    Totals[Phase].Entries++;
+
+    if(Phase == PHASE_ASSEMBLE || Phase == PHASE_LINK)
+        Totals[Phase].Cpu += ChildrenTime() - ChildrenCpu[Phase];
+
+    // Lexing, lookup and type mutation happen too often to ask the kernel every time.
+    if(Phase != PHASE_LEX && Phase != PHASE_LOOKUP && Phase != PHASE_MUTATE)
+        Totals[Phase].PeakMemory = PeakMemory();
+    pthread_mutex_unlock(&TotalsLock);
+}
+
+/*
+ * Count something the compiler made.
+ *
+ * @param Counter: The value of the Counters enum
+ * @param Amount: How many more
+ */
+void Tally(int Counter, long Amount) {
+    if(OptTimeReport)
+        Counters[Counter] += Amount;
+}
+
+/*
+ * Count the instructions in some assembly, leaving it where it was.
+ * Instructions are the indented lines that are not directives.
+ */
+void CountInstructions(FILE* Assembly) {
+    if(OptTimeReport)
+        Counters[COUNT_INSTRUCTIONS] += InstructionsFrom(Assembly, 0);
+}
+
+/*
+ * Count the instructions written to some assembly since a point in it.
+ * The file is left where it was, to carry on writing.
+ *
+ * @param Assembly: The file, which must be open for reading too
+ * @param Start: Where to count from, as ftell gave it
+ * @return how many instructions there are
+ */
+long InstructionsFrom(FILE* Assembly, long Start) {
+    char Line[TEXTLEN];
+    long Position, Count = 0;
+
+    fflush(Assembly);
+    Position = ftell(Assembly);
+    fseek(Assembly, Start, SEEK_SET);
+
+    while(fgets(Line, TEXTLEN, Assembly) != NULL)
+        if(Line[0] == '\t' && isalpha(Line[1]))
+            Count++;
+
+    fseek(Assembly, Position, SEEK_SET);
+    return Count;
+}
+
+static void ReportTable(long long Wall, long long Cpu) {
+    fprintf(stderr, "\nTime report:\n");
+    fprintf(stderr, "  %-18s %12s %12s %14s %10s\n", "phase", "wall ms", "cpu ms", "peak RSS KB", "entries");
+
+    for(int i = 0; i < PHASES; i++) {
+        if(Totals[i].Entries == 0)
+            continue;
+
+        fprintf(stderr, "  %-18s %12.3f %12.3f ", PhaseNames[i], Totals[i].Wall / 1e6, Totals[i].Cpu / 1e6);
+        if(i == PHASE_LEX || i == PHASE_LOOKUP || i == PHASE_MUTATE)
+            fprintf(stderr, "%14s", "-");
+        else
+            fprintf(stderr, "%14ld", Totals[i].PeakMemory);
+        fprintf(stderr, " %10ld\n", Totals[i].Entries);
+    }
+
+    fprintf(stderr, "  %-18s %12.3f %12.3f %14ld\n", "total", Wall / 1e6, Cpu / 1e6, PeakMemory());
+
+    fprintf(stderr, "\n");
+    for(int i = 0; i < COUNTERS; i++)
+        fprintf(stderr, "%s%ld %s", i ? ", " : "  ", Counters[i], CounterNames[i]);
+    fprintf(stderr, "\n");
+
+    ReportHardwareTable();
+}
+
+static void ReportJSON(long long Wall, long long Cpu) {
+    fprintf(stderr, "{\"phases\": {");
+
+    for(int i = 0, First = 1; i < PHASES; i++) {
+        if(Totals[i].Entries == 0)
+            continue;
+
+        fprintf(stderr, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, ",
+                First ? "" : ", ", PhaseKeys[i], Totals[i].Wall / 1e6, Totals[i].Cpu / 1e6);
+        if(i == PHASE_LEX || i == PHASE_LOOKUP || i == PHASE_MUTATE)
+            fprintf(stderr, "\"peak_rss_kb\": null, ");
+        else
+            fprintf(stderr, "\"peak_rss_kb\": %ld, ", Totals[i].PeakMemory);
+        fprintf(stderr, "\"entries\": %ld", Totals[i].Entries);
+
+        // The assembler and linker are other programs, which we don't count.
+        for(int j = 0; OptPerfCounters && j < HARDWARE_COUNTERS; j++) {
+            if(HardwareSupported[j] && i != PHASE_ASSEMBLE && i != PHASE_LINK)
+                fprintf(stderr, ", \"%s\": %lld", HardwareKeys[j], Totals[i].Hardware[j]);
+            else
+                fprintf(stderr, ", \"%s\": null", HardwareKeys[j]);
+        }
+
+        fprintf(stderr, "}");
+        First = 0;
+    }
+
+    fprintf(stderr, "}, \"total\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"peak_rss_kb\": %ld}, \"counts\": {",
+            Wall / 1e6, Cpu / 1e6, PeakMemory());
+
+    for(int i = 0; i < COUNTERS; i++)
+        fprintf(stderr, "%s\"%s\": %ld", i ? ", " : "", CounterKeys[i], Counters[i]);
+    fprintf(stderr, "}");
+
+    if(OptPerfCounters)
+        fprintf(stderr, ", \"hardware_counters\": %s", HardwareCounted() ? "true" : "false");
+    fprintf(stderr, "}\n");
+}
+
+// Say where the time went, with -ftime-report.
+void TimeReport(void) {
+    long long Wall, Cpu;
+
+    if(!OptTimeReport)
+        return;
+
+    Wall = StartWall ? Nanoseconds(CLOCK_MONOTONIC) - StartWall : 0;
+    Cpu = StartWall ? Nanoseconds(CLOCK_PROCESS_CPUTIME_ID) - StartCpu + ChildrenTime() : 0;
+
+    if(OptTimeReportJSON)
+        ReportJSON(Wall, Cpu);
+    else
+        ReportTable(Wall, Cpu);
+}
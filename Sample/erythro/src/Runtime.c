@@ -0,0 +1,437 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+
+/********************************************************************************
+ * The Runtime is a little library of builtins, linked into every program.      *
+ *                                                                              *
+ *  * PrintInteger(long) writes a number and a newline,                         *
+ *  * PrintString(char*) writes a string and a newline,                         *
+ *  * PrintChar(char) writes a single character.                                *
+ *                                                                              *
+ * They need no declaration. Rather than going through printf, they format      *
+ *  into a buffer of 64KB, which is written out with write() when it fills,     *
+ *  and when the program exits. The first print registers that with atexit.     *
+ *  So what they write comes out after anything printf has flushed first.       *
+ *                                                                              *
+ * Link assembles the runtime into an object of its own, and links it in.       *
+ *  Each builtin has its own section, so those nothing calls are dropped.       *
+ *  The JIT is given only the builtins the program called.                      *
+ * A program may define any of them itself, and then its own is used.           *
+ *                                                                              *
+ * With -ffreestanding, there is no C library, and the runtime starts the       *
+ *  program itself. It has:                                                     *
+ *  * _start, which splits the command line at spaces into argc and argv,       *
+ *     calls main, and exits with what it returned,                             *
+ *  * __main, which main calls first, to run the constructors in .ctors,        *
+ *  * atexit, for up to 32 functions, which run before the process exits.       *
+ * The buffer is written with WriteFile, and the process ends with ExitProcess. *
+ *  Windows has no system calls a program may make itself, so kernel32 is as    *
+ *  close to the system as it gets, and is all the program is linked against.   *
+ *                                                                              *
+ ********************************************************************************/
+
+#define RUNTIME_BUFFER 65536
+#define RUNTIME_ARGUMENTS 64
+#define RUNTIME_HANDLERS 32
+
+enum {
+    RT_INTEGER,
+    RT_STRING,
+    RT_CHARACTER,
+    RUNTIME_FUNCTIONS
+};
+
+static char* RuntimeNames[RUNTIME_FUNCTIONS] = { "PrintInteger", "PrintString", "PrintChar" };
+static int RuntimeParameters[RUNTIME_FUNCTIONS] = { RET_LONG, 0, RET_CHAR };
+
+static struct SymbolTableEntry* Builtins[RUNTIME_FUNCTIONS];
+static int Called[RUNTIME_FUNCTIONS];
+
+/*
+ * Declare the builtins, as if the program had.
+ * A builtin has no end label until the program defines it.
+ */
+void DeclareRuntime(void) {
+    if(Builtins[0] != NULL)
+        return;
+
+    for(int i = 0; i < RUNTIME_FUNCTIONS; i++) {
+        Builtins[i] = AddSymbol(RuntimeNames[i], RET_VOID, ST_FUNC, SC_GLOBAL, 0, 0, NULL);
+        AddSymbol("Value", RuntimeParameters[i] ? RuntimeParameters[i] : PointerTo(RET_CHAR), ST_VAR, SC_PARAM, 1, 0, NULL);
+
+        Builtins[i]->Elements = 1;
+        Builtins[i]->Start = Params;
+        Params = ParamsEnd = NULL;
+    }
+}
+
+// Note a call, in case it is to a builtin.
+void UseRuntime(char* Name) {
+    for(int i = 0; i < RUNTIME_FUNCTIONS; i++)
+        if(!strcmp(Name, RuntimeNames[i]))
+            Called[i] = 1;
+}
+
+static void AsRuntimeFunction(char* Name) {
+    fprintf(OutputFile,
+            "\t.section\t.text.%s,\"x\"\n"
+            "\t.globl\t%s\n"
+            "\t.def\t%s; .scl 2; .type 32; .endef\n"
+            "%s:\n"
+            "\tpushq\t%%rbp\n"
+            "\tmovq\t%%rsp, %%rbp\n",
+            Name, Name, Name, Name);
+}
+
+static void AsRuntimeReturn(void) {
+    fprintf(OutputFile,
+            "\tmovq\t%%rbp, %%rsp\n"
+            "\tpopq\t%%rbp\n"
+            "\tret\n");
+}
+
+// Count what's between the start of the buffer and %rax as used.
+static void AsRuntimeUsed(void) {
+    fprintf(OutputFile,
+            "\tleaq\tErythroBuffer(%%rip), %%rdx\n"
+            "\tsubq\t%%rdx, %%rax\n"
+            "\tmovq\t%%rax, ErythroUsed(%%rip)\n");
+}
+
+/*
+ * The buffer, and what every builtin shares:
+ *  ErythroFlush writes the buffer out, and empties it.
+ *  ErythroReserve makes room for as many bytes as %rcx says, and
+ *   returns where to put them, registering ErythroFlush the first time.
+ */
+static void AsRuntimeBuffer(void) {
+    fprintf(OutputFile,
+            "\t.section\t.bss.ErythroBuffer,\"bw\"\n"
+            "\t.balign\t8\n"
+            "ErythroBuffer:\n"
+            "\t.zero\t%d\n"
+            "ErythroUsed:\n"
+            "\t.zero\t8\n"
+            "ErythroRegistered:\n"
+            "\t.zero\t8\n",
+            RUNTIME_BUFFER);
+
+    AsRuntimeFunction("ErythroFlush");
+    fprintf(OutputFile,
+            "\tsubq\t$48, %%rsp\n"
+            "\tmovq\tErythroUsed(%%rip), %%r8\n"
+            "\tcmpq\t$0, %%r8\n"
+            "\tje\tErythroFlush_done\n");
+
+    // WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), Buffer, Used, &Written, NULL)
+    if(OptFreestanding)
+        fprintf(OutputFile,
+                "\tmovq\t$-11, %%rcx\n"
+                "\tcall\tGetStdHandle\n"
+                "\tmovq\t%%rax, %%rcx\n"
+                "\tleaq\tErythroBuffer(%%rip), %%rdx\n"
+                "\tmovq\tErythroUsed(%%rip), %%r8\n"
+                "\tleaq\t40(%%rsp), %%r9\n"
+                "\tmovq\t$0, %%rax\n"
+                "\tmovq\t%%rax, 32(%%rsp)\n"
+                "\tcall\tWriteFile\n");
+    else
+        fprintf(OutputFile,
+                "\tmovq\t$1, %%rcx\n"
+                "\tleaq\tErythroBuffer(%%rip), %%rdx\n"
+                "\tcall\twrite\n");
+
+    fprintf(OutputFile,
+            "\tmovq\t$0, %%rax\n"
+            "\tmovq\t%%rax, ErythroUsed(%%rip)\n"
+            "ErythroFlush_done:\n");
+    AsRuntimeReturn();
+
+    AsRuntimeFunction("ErythroReserve");
+    fprintf(OutputFile,
+            "\tsubq\t$32, %%rsp\n"
+            "\tmovq\t%%rcx, 16(%%rbp)\n"
+            "\tmovq\tErythroRegistered(%%rip), %%rax\n"
+            "\tcmpq\t$0, %%rax\n"
+            "\tjne\tErythroReserve_registered\n"
+            "\tmovq\t$1, %%rax\n"
+            "\tmovq\t%%rax, ErythroRegistered(%%rip)\n"
+            "\tleaq\tErythroFlush(%%rip), %%rcx\n"
+            "\tcall\tatexit\n"
+            "ErythroReserve_registered:\n"
+            "\tmovq\tErythroUsed(%%rip), %%rax\n"
+            "\tmovq\t16(%%rbp), %%rcx\n"
+            "\taddq\t%%rcx, %%rax\n"
+            "\tcmpq\t$%d, %%rax\n"
+            "\tjle\tErythroReserve_room\n"
+            "\tcall\tErythroFlush\n"
+            "ErythroReserve_room:\n"
+            "\tleaq\tErythroBuffer(%%rip), %%rax\n"
+            "\tmovq\tErythroUsed(%%rip), %%rcx\n"
+            "\taddq\t%%rcx, %%rax\n",
+            RUNTIME_BUFFER);
+    AsRuntimeReturn();
+}
+
+/*
+ * The digits are worked out backwards, into the frame, then copied.
+ * Negating the most negative long leaves it as it was, but dividing
+ *  it unsigned still gives the right digits.
+ */
+static void AsPrintInteger(void) {
+    AsRuntimeFunction("PrintInteger");
+    fprintf(OutputFile,
+            "\tsubq\t$64, %%rsp\n"
+            "\tmovq\t%%rcx, 16(%%rbp)\n"
+            "\tmovq\t$21, %%rcx\n"
+            "\tcall\tErythroReserve\n"
+            "\tmovq\t%%rax, %%r9\n"
+            "\tmovq\t16(%%rbp), %%rax\n"
+            "\tleaq\t-1(%%rbp), %%r8\n"
+            "\tmovq\t%%r8, %%r11\n"
+            "\tmovq\t$10, %%r10\n"
+            "\tcmpq\t$0, %%rax\n"
+            "\tjge\tPrintInteger_digits\n"
+            "\tnegq\t%%rax\n"
+            "\tmovq\t$45, %%rdx\n"
+            "\tmovb\t%%dl, (%%r9)\n"
+            "\tincq\t%%r9\n"
+            "PrintInteger_digits:\n"
+            "\tmovq\t$0, %%rdx\n"
+            "\tdivq\t%%r10\n"
+            "\taddq\t$48, %%rdx\n"
+            "\tmovb\t%%dl, (%%r8)\n"
+            "\tdecq\t%%r8\n"
+            "\tcmpq\t$0, %%rax\n"
+            "\tjne\tPrintInteger_digits\n"
+            "PrintInteger_copy:\n"
+            "\tincq\t%%r8\n"
+            "\tmovzbq\t(%%r8), %%rdx\n"
+            "\tmovb\t%%dl, (%%r9)\n"
+            "\tincq\t%%r9\n"
+            "\tcmpq\t%%r11, %%r8\n"
+            "\tjne\tPrintInteger_copy\n"
+            "\tmovq\t$10, %%rdx\n"
+            "\tmovb\t%%dl, (%%r9)\n"
+            "\tincq\t%%r9\n"
+            "\tmovq\t%%r9, %%rax\n");
+    AsRuntimeUsed();
+    AsRuntimeReturn();
+}
+
+/*
+ * The string is copied until it ends, or the buffer fills, in which case
+ *  the buffer is flushed and it carries on from where it got to.
+ * There is always room for the newline, as a full buffer is never left so.
+ */
+static void AsPrintString(void) {
+    AsRuntimeFunction("PrintString");
+    fprintf(OutputFile,
+            "\tsubq\t$32, %%rsp\n"
+            "\tmovq\t%%rcx, 16(%%rbp)\n"
+            "PrintString_next:\n"
+            "\tmovq\t$1, %%rcx\n"
+            "\tcall\tErythroReserve\n"
+            "\tmovq\t16(%%rbp), %%rcx\n"
+            "\tleaq\tErythroBuffer+%d(%%rip), %%r8\n"
+            "PrintString_copy:\n"
+            "\tmovzbq\t(%%rcx), %%rdx\n"
+            "\tcmpq\t$0, %%rdx\n"
+            "\tje\tPrintString_end\n"
+            "\tmovb\t%%dl, (%%rax)\n"
+            "\tincq\t%%rax\n"
+            "\tincq\t%%rcx\n"
+            "\tcmpq\t%%r8, %%rax\n"
+            "\tjne\tPrintString_copy\n"
+            "\tmovq\t%%rcx, 16(%%rbp)\n",
+            RUNTIME_BUFFER);
+    AsRuntimeUsed();
+    fprintf(OutputFile,
+            "\tjmp\tPrintString_next\n"
+            "PrintString_end:\n"
+            "\tmovq\t$10, %%rdx\n"
+            "\tmovb\t%%dl, (%%rax)\n"
+            "\tincq\t%%rax\n");
+    AsRuntimeUsed();
+    AsRuntimeReturn();
+}
+
+static void AsPrintChar(void) {
+    AsRuntimeFunction("PrintChar");
+    fprintf(OutputFile,
+            "\tsubq\t$32, %%rsp\n"
+            "\tmovq\t%%rcx, 16(%%rbp)\n"
+            "\tmovq\t$1, %%rcx\n"
+            "\tcall\tErythroReserve\n"
+            "\tmovq\t16(%%rbp), %%rdx\n"
+            "\tmovb\t%%dl, (%%rax)\n"
+            "\tincq\t%%rax\n");
+    AsRuntimeUsed();
+    AsRuntimeReturn();
+}
+
+/*
+ * What a freestanding program has in place of the C library's startup.
+ * The handlers atexit keeps are run by ErythroExit, last first,
+ *  and the constructors by __main, last first, as the C library does.
+ * The linker puts the constructors between a -1 at __CTOR_LIST__ and a 0.
+ */
+static void AsStartup(void) {
+    fprintf(OutputFile,
+            "\t.section\t.bss.ErythroStartup,\"bw\"\n"
+            "\t.balign\t8\n"
+            "ErythroArguments:\n"
+            "\t.zero\t%d\n"
+            "ErythroHandlers:\n"
+            "\t.zero\t%d\n"
+            "ErythroHandlerCount:\n"
+            "\t.zero\t8\n",
+            8 * RUNTIME_ARGUMENTS, 8 * RUNTIME_HANDLERS);
+
+    AsRuntimeFunction("atexit");
+    fprintf(OutputFile,
+            "\tmovq\tErythroHandlerCount(%%rip), %%rax\n"
+            "\tcmpq\t$%d, %%rax\n"
+            "\tjl\tatexit_room\n"
+            "\tmovq\t$-1, %%rax\n"
+            "\tjmp\tatexit_done\n"
+            "atexit_room:\n"
+            "\tleaq\tErythroHandlers(%%rip), %%rdx\n"
+            "\tmovq\t%%rcx, (%%rdx,%%rax,8)\n"
+            "\tincq\t%%rax\n"
+            "\tmovq\t%%rax, ErythroHandlerCount(%%rip)\n"
+            "\tmovq\t$0, %%rax\n"
+            "atexit_done:\n",
+            RUNTIME_HANDLERS);
+    AsRuntimeReturn();
+
+    // Takes the exit code in %rcx, and never returns.
+    AsRuntimeFunction("ErythroExit");
+    fprintf(OutputFile,
+            "\tsubq\t$32, %%rsp\n"
+            "\tmovq\t%%rcx, 16(%%rbp)\n"
+            "ErythroExit_next:\n"
+            "\tmovq\tErythroHandlerCount(%%rip), %%rax\n"
+            "\tcmpq\t$0, %%rax\n"
+            "\tje\tErythroExit_done\n"
+            "\tdecq\t%%rax\n"
+            "\tmovq\t%%rax, ErythroHandlerCount(%%rip)\n"
+            "\tleaq\tErythroHandlers(%%rip), %%rdx\n"
+            "\tmovq\t(%%rdx,%%rax,8), %%rax\n"
+            "\tcall\t*%%rax\n"
+            "\tjmp\tErythroExit_next\n"
+            "ErythroExit_done:\n"
+            "\tmovq\t16(%%rbp), %%rcx\n"
+            "\tcall\tExitProcess\n");
+
+    // main calls this before it has stored its parameters, so they are kept.
+    AsRuntimeFunction("__main");
+    fprintf(OutputFile,
+            "\tsubq\t$80, %%rsp\n"
+            "\tmovq\t%%rcx, -16(%%rbp)\n"
+            "\tmovq\t%%rdx, -24(%%rbp)\n"
+            "\tmovq\t%%r8, -32(%%rbp)\n"
+            "\tmovq\t%%r9, -40(%%rbp)\n"
+            "\tleaq\t__CTOR_LIST__(%%rip), %%rax\n"
+            "__main_end:\n"
+            "\taddq\t$8, %%rax\n"
+            "\tmovq\t(%%rax), %%rdx\n"
+            "\tcmpq\t$0, %%rdx\n"
+            "\tjne\t__main_end\n"
+            "\tmovq\t%%rax, -8(%%rbp)\n"
+            "__main_next:\n"
+            "\tmovq\t-8(%%rbp), %%rax\n"
+            "\tsubq\t$8, %%rax\n"
+            "\tmovq\t%%rax, -8(%%rbp)\n"
+            "\tleaq\t__CTOR_LIST__(%%rip), %%rdx\n"
+            "\tcmpq\t%%rdx, %%rax\n"
+            "\tje\t__main_done\n"
+            "\tmovq\t(%%rax), %%rax\n"
+            "\tcall\t*%%rax\n"
+            "\tjmp\t__main_next\n"
+            "__main_done:\n"
+            "\tmovq\t-16(%%rbp), %%rcx\n"
+            "\tmovq\t-24(%%rbp), %%rdx\n"
+            "\tmovq\t-32(%%rbp), %%r8\n"
+            "\tmovq\t-40(%%rbp), %%r9\n");
+    AsRuntimeReturn();
+
+    // The command line is split in place, without regard for quotes.
+    AsRuntimeFunction("_start");
+    fprintf(OutputFile,
+            "\tsubq\t$32, %%rsp\n"
+            "\tcall\tGetCommandLineA\n"
+            "\tleaq\tErythroArguments(%%rip), %%r8\n"
+            "\tmovq\t$0, %%r9\n"
+            "_start_space:\n"
+            "\tmovzbq\t(%%rax), %%rdx\n"
+            "\tcmpq\t$32, %%rdx\n"
+            "\tje\t_start_skip\n"
+            "\tcmpq\t$9, %%rdx\n"
+            "\tje\t_start_skip\n"
+            "\tcmpq\t$0, %%rdx\n"
+            "\tje\t_start_main\n"
+            "\tcmpq\t$%d, %%r9\n"
+            "\tje\t_start_main\n"
+            "\tmovq\t%%rax, (%%r8,%%r9,8)\n"
+            "\tincq\t%%r9\n"
+            "_start_word:\n"
+            "\tincq\t%%rax\n"
+            "\tmovzbq\t(%%rax), %%rdx\n"
+            "\tcmpq\t$0, %%rdx\n"
+            "\tje\t_start_main\n"
+            "\tcmpq\t$32, %%rdx\n"
+            "\tje\t_start_end\n"
+            "\tcmpq\t$9, %%rdx\n"
+            "\tjne\t_start_word\n"
+            "_start_end:\n"
+            "\tmovq\t$0, %%rdx\n"
+            "\tmovb\t%%dl, (%%rax)\n"
+            "_start_skip:\n"
+            "\tincq\t%%rax\n"
+            "\tjmp\t_start_space\n"
+            "_start_main:\n"
+            "\tmovq\t%%r9, %%rcx\n"
+            "\tleaq\tErythroArguments(%%rip), %%rdx\n"
+            "\tcall\tmain\n"
+            "\tmovq\t%%rax, %%rcx\n"
+            "\tcall\tErythroExit\n",
+            RUNTIME_ARGUMENTS - 1);
+}
+
+/*
+ * Write the builtins into the OutputFile, leaving out those the program defines.
+ *
+ * @param All: Whether to write every builtin, or only those that were called.
+ *  Code from the cache was never generated, so only Link can't tell.
+ *  With -ffreestanding, this is when the startup is written too.
+ * @return how many builtins were written, counting the startup as one.
+ */
+int AsRuntime(int All) {
+    static void (*Writers[RUNTIME_FUNCTIONS])(void) = { AsPrintInteger, AsPrintString, AsPrintChar };
+    int Count = 0;
+
+    for(int i = 0; i < RUNTIME_FUNCTIONS; i++) {
+        if(Builtins[i] == NULL || Builtins[i]->EndLabel != 0 || !(All || Called[i]))
+            continue;
+
+        if(Count++ == 0)
+            AsRuntimeBuffer();
+        Writers[i]();
+    }
+
+    if(All && OptFreestanding) {
+        AsStartup();
+        Count++;
+    }
+
+    if(OptVerboseOutput)
+        printf("Runtime: %d builtins\n", Count);
+    return Count;
+}
@@ -0,0 +1,459 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+
+/********************************************************************************
+ * The Scheduler reorders the instructions of a function, under -O, so that     *
+ *  slow instructions (loads, multiplies and divides) start as early as they    *
+ *  can, and independent work fills the time until their results are needed.   *
+ *                                                                              *
+ * The assembler writes each function into a buffer, which is then split into  *
+ *  blocks at every label, jump, call, directive, or instruction we don't know. *
+ * Those never move, so control flow is never changed.                          *
+ *                                                                              *
+ * Within a block, an instruction depends on an earlier one when:               *
+ *  * it reads a register (or the flags) the earlier one writes,                *
+ *  * it writes a register (or the flags) the earlier one reads or writes,      *
+ *  * either of them stores to memory, and the other touches memory at all.     *
+ *                                                                              *
+ * Registers are never renamed, so the register pressure is exactly what the    *
+ *  allocator chose; only the order changes.                                    *
+ *                                                                              *
+ * It is a list scheduler: each cycle, of the instructions whose inputs are     *
+ *  ready, the one with the longest chain of latency after it goes next.        *
+ *                                                                              *
+ ********************************************************************************/
+
+// The longest block we will schedule. Anything longer is split.
+#define SCHEDULE_LIMIT 128
+
+// Every register we track, then the flags, which are treated as one more register.
+#define FLAGS 16
+#define RESOURCES 17
+
+enum InstructionKind {
+    IK_MOVE,      // Reads the source, writes the destination.
+    IK_LEA,       // Like a move, but never touches memory.
+    IK_ALU,       // Reads both, writes the destination and the flags.
+    IK_UNARY,     // Reads and writes its operand, and the flags.
+    IK_COMPARE,   // Reads both, writes the flags.
+    IK_SETCC,     // Reads the flags, writes a byte.
+    IK_MULTIPLY,  // imulq, which has one, two and three operand forms.
+    IK_CQO,       // Sign extends %rax into %rdx.
+    IK_DIVIDE,    // Divides %rdx:%rax, writing both.
+};
+
+struct InstructionInfo {
+    char* Mnemonic;
+    int Kind;
+    int Latency;
+};
+
+/*
+ * The instructions the assembler emits that are safe to move, and roughly how
+ *  many cycles until their result can be used. Loads add LOAD_LATENCY on top.
+ */
+#define LOAD_LATENCY 4
+
+static struct InstructionInfo Instructions[] = {
+    { "movq",   IK_MOVE,     1 }, { "movl",   IK_MOVE,     1 }, { "movb",   IK_MOVE,     1 },
+    { "movslq", IK_MOVE,     1 }, { "movzbq", IK_MOVE,     1 }, { "movzbl", IK_MOVE,     1 },
+    { "movsbq", IK_MOVE,     1 }, { "movabsq",IK_MOVE,     1 }, { "leaq",   IK_LEA,      1 },
+    { "addq",   IK_ALU,      1 }, { "subq",   IK_ALU,      1 }, { "andq",   IK_ALU,      1 },
+    { "orq",    IK_ALU,      1 }, { "xorq",   IK_ALU,      1 }, { "shlq",   IK_ALU,      1 },
+    { "salq",   IK_ALU,      1 }, { "shrq",   IK_ALU,      1 }, { "sarq",   IK_ALU,      1 },
+    { "incq",   IK_UNARY,    1 }, { "incl",   IK_UNARY,    1 }, { "incb",   IK_UNARY,    1 },
+    { "decq",   IK_UNARY,    1 }, { "decl",   IK_UNARY,    1 }, { "decb",   IK_UNARY,    1 },
+    { "negq",   IK_UNARY,    1 }, { "notq",   IK_UNARY,    1 },
+    { "cmpq",   IK_COMPARE,  1 }, { "test",   IK_COMPARE,  1 }, { "testq",  IK_COMPARE,  1 },
+    { "sete",   IK_SETCC,    1 }, { "setne",  IK_SETCC,    1 }, { "setnz",  IK_SETCC,    1 },
+    { "setl",   IK_SETCC,    1 }, { "setg",   IK_SETCC,    1 }, { "setle",  IK_SETCC,    1 },
+    { "setge",  IK_SETCC,    1 },
+    { "imulq",  IK_MULTIPLY, 3 }, { "cqo",    IK_CQO,      1 }, { "idivq",  IK_DIVIDE,  40 },
+    { NULL, 0, 0 }
+};
+
+// The names of each register, by width, in the order of the encoding.
+static char* RegisterNames[16][4] = {
+    { "rax", "eax",  "ax",   "al"   }, { "rcx", "ecx",  "cx",   "cl"   },
+    { "rdx", "edx",  "dx",   "dl"   }, { "rbx", "ebx",  "bx",   "bl"   },
+    { "rsp", "esp",  "sp",   "spl"  }, { "rbp", "ebp",  "bp",   "bpl"  },
+    { "rsi", "esi",  "si",   "sil"  }, { "rdi", "edi",  "di",   "dil"  },
+    { "r8",  "r8d",  "r8w",  "r8b"  }, { "r9",  "r9d",  "r9w",  "r9b"  },
+    { "r10", "r10d", "r10w", "r10b" }, { "r11", "r11d", "r11w", "r11b" },
+    { "r12", "r12d", "r12w", "r12b" }, { "r13", "r13d", "r13w", "r13b" },
+    { "r14", "r14d", "r14w", "r14b" }, { "r15", "r15d", "r15w", "r15b" },
+};
+
+#define RAX 0
+#define RDX 2
+
+struct ScheduledInstruction {
+    char* Line;
+    int Latency;
+    char Reads[RESOURCES], Writes[RESOURCES];
+    int Loads, Stores;
+
+    int Priority;      // The longest chain of latency from here to the end of the block.
+    int ReadyCycle;    // The first cycle all of its inputs are available.
+    int Waiting;       // How many of the instructions it depends on are still to be placed.
+    int Scheduled;
+};
+
+static _Thread_local struct ScheduledInstruction Block[SCHEDULE_LIMIT];
+static _Thread_local int BlockLength;
+
+// Delays[i][j] is how long j must wait after i starts, or -1 if they are independent.
+static _Thread_local short Delays[SCHEDULE_LIMIT][SCHEDULE_LIMIT];
+
+// How many instructions changed place, for reporting.
+static _Thread_local int Moved;
+
+/*
+ * Find the register an operand names, such as %r10d.
+ *
+ * @param Name: The name, without the %
+ * @param Partial: Set if the name is 8 or 16 bits wide, so writing it keeps the rest.
+ * @return the register, or -1 if it is not one we track.
+ */
+static int FindRegister(char* Name, int Length, int* Partial) {
+    for(int i = 0; i < 16; i++) {
+        for(int Width = 0; Width < 4; Width++) {
+            if(strlen(RegisterNames[i][Width]) == (size_t) Length && !strncmp(RegisterNames[i][Width], Name, Length)) {
+                *Partial = Width >= 2;
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Work out what one operand reads and writes.
+ *
+ * @param Operand: The text of the operand
+ * @param Length: How long it is
+ * @param Read: Whether the instruction reads it
+ * @param Write: Whether the instruction writes it
+ * @return 0 if the operand is something we don't understand.
+ */
+static int AddOperand(struct ScheduledInstruction* Instruction, char* Operand, int Length, int Read, int Write) {
+    int Register, Partial;
+    char* End = Operand + Length;
+
+    while(Length > 0 && isspace(*Operand)) {
+        Operand++;
+        Length--;
+    }
+
+    if(Length <= 0)
+        return 0;
+
+    // Immediates need nothing.
+    if(*Operand == '$')
+        return 1;
+
+    if(*Operand == '%') {
+        if((Register = FindRegister(Operand + 1, End - Operand - 1, &Partial)) < 0)
+            return 0;
+
+        // Writing part of a register keeps the rest, so it reads it too.
+        if(Read || (Write && Partial))
+            Instruction->Reads[Register] = 1;
+        if(Write)
+            Instruction->Writes[Register] = 1;
+        return 1;
+    }
+
+    // Anything else is memory. The registers that form the address are read.
+    for(char* Char = Operand; Char < End; Char++) {
+        if(*Char != '%')
+            continue;
+
+        Char++;
+        int NameLength = 0;
+        while(Char + NameLength < End && isalnum(Char[NameLength]))
+            NameLength++;
+
+        if(NameLength == 3 && !strncmp(Char, "rip", 3))
+            continue;
+
+        if((Register = FindRegister(Char, NameLength, &Partial)) < 0)
+            return 0;
+        Instruction->Reads[Register] = 1;
+    }
+
+    if(Read)
+        Instruction->Loads = 1;
+    if(Write)
+        Instruction->Stores = 1;
+    return 1;
+}
+
+/*
+ * Decode one line of assembly.
+ *
+ * @return 1 if the line is an instruction that can be moved, 0 if it must stay put.
+ */
+static int DecodeInstruction(char* Line, struct ScheduledInstruction* Instruction) {
+    char Mnemonic[16], *Operands[3], *Char;
+    int OperandLengths[3], OperandCount = 0, Depth = 0, Length = 0;
+    struct InstructionInfo* Info;
+
+    memset(Instruction, 0, sizeof(struct ScheduledInstruction));
+    Instruction->Line = Line;
+
+    Char = Line;
+    while(*Char == '\t' || *Char == ' ')
+        Char++;
+
+    while(isalnum(*Char) && Length < 15)
+        Mnemonic[Length++] = *Char++;
+    Mnemonic[Length] = '\0';
+
+    // Labels, directives and blank lines all stay where they are.
+    if(Length == 0 || (*Char != '\t' && *Char != ' ' && *Char != '\r' && *Char != '\n' && *Char != '\0'))
+        return 0;
+
+    for(Info = Instructions; Info->Mnemonic != NULL; Info++)
+        if(!strcmp(Info->Mnemonic, Mnemonic))
+            break;
+
+    if(Info->Mnemonic == NULL)
+        return 0;
+
+    // Split the operands on the commas that are not inside an address.
+    while(*Char == '\t' || *Char == ' ')
+        Char++;
+
+    if(*Char != '\r' && *Char != '\n' && *Char != '\0') {
+        Operands[0] = Char;
+        for(; *Char != '\r' && *Char != '\n' && *Char != '\0'; Char++) {
+            if(*Char == '(') Depth++;
+            if(*Char == ')') Depth--;
+            if(*Char == ',' && Depth == 0) {
+                if(OperandCount == 2)
+                    return 0;
+                OperandLengths[OperandCount] = Char - Operands[OperandCount];
+                Operands[++OperandCount] = Char + 1;
+            }
+        }
+        OperandLengths[OperandCount] = Char - Operands[OperandCount];
+        OperandCount++;
+    }
+
+    Instruction->Latency = Info->Latency;
+
+    switch(Info->Kind) {
+        case IK_MOVE:
+        case IK_LEA:
+            if(OperandCount != 2
+                || !AddOperand(Instruction, Operands[0], OperandLengths[0], Info->Kind == IK_MOVE, 0)
+                || !AddOperand(Instruction, Operands[1], OperandLengths[1], 0, 1))
+                return 0;
+            break;
+
+        case IK_ALU:
+            if(OperandCount != 2
+                || !AddOperand(Instruction, Operands[0], OperandLengths[0], 1, 0)
+                || !AddOperand(Instruction, Operands[1], OperandLengths[1], 1, 1))
+                return 0;
+            Instruction->Writes[FLAGS] = 1;
+            break;
+
+        case IK_UNARY:
+            if(OperandCount != 1 || !AddOperand(Instruction, Operands[0], OperandLengths[0], 1, 1))
+                return 0;
+            Instruction->Writes[FLAGS] = 1;
+            break;
+
+        case IK_COMPARE:
+            if(OperandCount != 2
+                || !AddOperand(Instruction, Operands[0], OperandLengths[0], 1, 0)
+                || !AddOperand(Instruction, Operands[1], OperandLengths[1], 1, 0))
+                return 0;
+            Instruction->Writes[FLAGS] = 1;
+            break;
+
+        case IK_SETCC:
+            if(OperandCount != 1 || !AddOperand(Instruction, Operands[0], OperandLengths[0], 0, 1))
+                return 0;
+            Instruction->Reads[FLAGS] = 1;
+            break;
+
+        case IK_MULTIPLY:
+            if(OperandCount == 1) {
+                // The widening form multiplies %rax, into %rdx:%rax.
+                if(!AddOperand(Instruction, Operands[0], OperandLengths[0], 1, 0))
+                    return 0;
+                Instruction->Reads[RAX] = 1;
+                Instruction->Writes[RAX] = Instruction->Writes[RDX] = 1;
+            } else if(OperandCount == 2) {
+                if(!AddOperand(Instruction, Operands[0], OperandLengths[0], 1, 0)
+                    || !AddOperand(Instruction, Operands[1], OperandLengths[1], 1, 1))
+                    return 0;
+            } else {
+                if(!AddOperand(Instruction, Operands[0], OperandLengths[0], 1, 0)
+                    || !AddOperand(Instruction, Operands[1], OperandLengths[1], 1, 0)
+                    || !AddOperand(Instruction, Operands[2], OperandLengths[2], 0, 1))
+                    return 0;
+            }
+            Instruction->Writes[FLAGS] = 1;
+            break;
+
+        case IK_CQO:
+            if(OperandCount != 0)
+                return 0;
+            Instruction->Reads[RAX] = 1;
+            Instruction->Writes[RDX] = 1;
+            break;
+
+        case IK_DIVIDE:
+            if(OperandCount != 1 || !AddOperand(Instruction, Operands[0], OperandLengths[0], 1, 0))
+                return 0;
+            Instruction->Reads[RAX] = Instruction->Reads[RDX] = 1;
+            Instruction->Writes[RAX] = Instruction->Writes[RDX] = Instruction->Writes[FLAGS] = 1;
+            break;
+    }
+
+    // The stack pointer is only ever changed by instructions we don't move.
+    if(Instruction->Writes[4])
+        return 0;
+
+    if(Instruction->Loads)
+        Instruction->Latency += LOAD_LATENCY;
+
+    return 1;
+}
+
+/*
+ * How long Later must wait after Earlier starts.
+ *
+ * @return the delay in cycles, or -1 if the two can go in either order.
+ */
+static int Dependence(struct ScheduledInstruction* Earlier, struct ScheduledInstruction* Later) {
+    int Delay = -1;
+
+    for(int i = 0; i < RESOURCES; i++) {
+        // A true dependence waits for the result.
+        if(Earlier->Writes[i] && Later->Reads[i] && Delay < Earlier->Latency)
+            Delay = Earlier->Latency;
+        // The others only have to stay in order.
+        if(Later->Writes[i] && (Earlier->Reads[i] || Earlier->Writes[i]) && Delay < 1)
+            Delay = 1;
+    }
+
+    if(Earlier->Stores && (Later->Loads || Later->Stores) && Delay < 1)
+        Delay = 1;
+    if(Earlier->Loads && Later->Stores && Delay < 1)
+        Delay = 1;
+
+    return Delay;
+}
+
+/*
+ * Schedule the block that has been collected, and write it out.
+ */
+static void FlushBlock(FILE* Output) {
+    int Cycle = 0, Best, Position = 0, Delay;
+
+    // Every pair is compared once, up front; placing an instruction then only has to visit what follows it.
+    for(int i = 0; i < BlockLength; i++) {
+        Block[i].Waiting = 0;
+        for(int j = 0; j < i; j++)
+            if((Delays[j][i] = Dependence(&Block[j], &Block[i])) >= 0)
+                Block[i].Waiting++;
+    }
+
+    // Work out priorities from the end, as each depends only on what follows.
+    for(int i = BlockLength - 1; i >= 0; i--) {
+        Block[i].Priority = Block[i].Latency;
+        for(int j = i + 1; j < BlockLength; j++)
+            if((Delay = Delays[i][j]) >= 0 && Delay + Block[j].Priority > Block[i].Priority)
+                Block[i].Priority = Delay + Block[j].Priority;
+    }
+
+    for(int Count = 0; Count < BlockLength; Count++) {
+        Best = -1;
+
+        // Of the instructions whose dependences have all been placed,
+        // prefer what can start now, then the longest chain, then the original order.
+        for(int i = 0; i < BlockLength; i++) {
+            if(Block[i].Scheduled || Block[i].Waiting)
+                continue;
+
+            if(Best < 0) {
+                Best = i;
+            } else {
+                int BestWaits = Block[Best].ReadyCycle > Cycle, Waits = Block[i].ReadyCycle > Cycle;
+                if(Waits < BestWaits
+                    || (Waits == BestWaits && Waits && Block[i].ReadyCycle < Block[Best].ReadyCycle)
+                    || (Waits == BestWaits && !Waits && Block[i].Priority > Block[Best].Priority))
+                    Best = i;
+            }
+        }
+
+        if(Block[Best].ReadyCycle > Cycle)
+            Cycle = Block[Best].ReadyCycle;
+
+        // ReadyCycle now records when it was issued.
+        Block[Best].ReadyCycle = Cycle++;
+        Block[Best].Scheduled = 1;
+
+        // Everything that depends on it can start no sooner than its result.
+        for(int i = Best + 1; i < BlockLength; i++) {
+            if((Delay = Delays[Best][i]) < 0)
+                continue;
+            Block[i].Waiting--;
+            if(Block[Best].ReadyCycle + Delay > Block[i].ReadyCycle)
+                Block[i].ReadyCycle = Block[Best].ReadyCycle + Delay;
+        }
+
+        if(Best != Position)
+            Moved++;
+        Position++;
+
+        fputs(Block[Best].Line, Output);
+    }
+
+    for(int i = 0; i < BlockLength; i++)
+        free(Block[i].Line);
+    BlockLength = 0;
+}
+
+/*
+ * Schedule a function that was assembled into a buffer.
+ *
+ * @param Buffer: The assembly of the function
+ * @param Output: Where the scheduled assembly goes
+ * @param Function: The function, for reporting
+ */
+void ScheduleFunction(FILE* Buffer, FILE* Output, struct SymbolTableEntry* Function) {
+    char Line[TEXTLEN];
+
+    rewind(Buffer);
+    Moved = 0;
+    BlockLength = 0;
+
+    while(fgets(Line, TEXTLEN, Buffer) != NULL) {
+        if(!DecodeInstruction(Line, &Block[BlockLength])) {
+            FlushBlock(Output);
+            fputs(Line, Output);
+            continue;
+        }
+
+        Block[BlockLength++].Line = strdup(Line);
+        if(BlockLength == SCHEDULE_LIMIT)
+            FlushBlock(Output);
+    }
+
+    FlushBlock(Output);
+
+    if(OptVerboseOutput && Moved)
+        printf("Optimiser: scheduler moved %d instructions in %s\n", Moved, Function->Name);
+}
@@ -42,6 +42,9 @@ static int ReadDeclarationList(struct SymbolTableEntry* FunctionSymbol, int Stor
         if(PrototypePointer != NULL) {
             if(TokenType != PrototypePointer->Type)
                 DieDecimal("Function parameter of invalid type at index", ParamCount + 1);
+            // The body uses the names given at the definition.
+            if(strcmp(PrototypePointer->Name, CurrentIdentifier))
+                PrototypePointer->Name = strdup(CurrentIdentifier);
             PrototypePointer=PrototypePointer->NextSymbol;
         } else {
             BeginVariableDeclaration(TokenType, Composite, Storage);
@@ -55,7 +58,7 @@ static int ReadDeclarationList(struct SymbolTableEntry* FunctionSymbol, int Stor
             Tokenise();
     }
 
-    if((FunctionSymbol != NULL) && (ParamCount != FunctionSymbol->Length))
+    if((FunctionSymbol != NULL) && (ParamCount != FunctionSymbol->Elements))
         DieMessage("Invalid number of parameters in prototyped function", FunctionSymbol->Name);
 
     return ParamCount;
@@ -150,7 +153,7 @@ struct SymbolTableEntry* BeginVariableDeclaration(int Type, struct SymbolTableEn
         if(CurrentToken.type == LI_INT) {
             switch(Scope) {
                 case SC_GLOBAL:
-                    Symbol = AddSymbol(CurrentIdentifier, PointerTo(Type), ST_ARR, Scope, 1, 0, NULL);
+                    Symbol = AddSymbol(CurrentIdentifier, PointerTo(Type), ST_ARR, Scope, CurrentToken.value, 0, NULL);
                     break;
                 case SC_LOCAL:
                 case SC_PARAM:
@@ -189,15 +192,17 @@ struct ASTNode* ParseFunction(int Type) {
     int SymbolSlot, BreakLabel, ParamCount, ID;
 
     if((OldFunction = FindSymbol(CurrentIdentifier)) != NULL)
-        if(OldFunction->Storage != ST_FUNC)
+        if(OldFunction->Structure != ST_FUNC)
             OldFunction = NULL;
     if(OldFunction == NULL) {
         BreakLabel = NewLabel();
         NewFunction = AddSymbol(CurrentIdentifier, Type, ST_FUNC, SC_GLOBAL, BreakLabel, 0, NULL);
+    } else {
+        BreakLabel = OldFunction->EndLabel;
     }
 
     VerifyToken(LI_LPARE, "(");
-    ParamCount = ReadDeclarationList(OldFunction, SC_GLOBAL, LI_RPARE);
+    ParamCount = ReadDeclarationList(OldFunction, SC_PARAM, LI_RPARE);
     VerifyToken(LI_RPARE, ")");
 
     printf("\nIdentified%sfunction %s of return type %s, end label %d\n", 
@@ -218,13 +223,17 @@ struct ASTNode* ParseFunction(int Type) {
         return NULL;
     }
 
+    // The builtins of the Runtime have no end label, until the program defines them.
+    if(BreakLabel == 0)
+        BreakLabel = OldFunction->EndLabel = NewLabel();
+
     FunctionEntry = OldFunction;
 
     Tree = ParseCompound();
 
     if(Type != RET_VOID) {
         // Functions with one statement have no composite node, so we have to check
-        FinalStatement = (Tree->Operation == OP_COMP) ? Tree->Right : Tree;
+        FinalStatement = (Tree && Tree->Operation == OP_COMP) ? Tree->Right : Tree;
 
         if(FinalStatement == NULL || FinalStatement->Operation != OP_RET) {
             Die("Function with non-void type does not return");
@@ -232,7 +241,7 @@ struct ASTNode* ParseFunction(int Type) {
 
     }
 
-    return ConstructASTBranch(OP_FUNC, Tree->ExprType, Tree, OldFunction, BreakLabel);
+    return ConstructASTBranch(OP_FUNC, Tree ? Tree->ExprType : RET_NONE, Tree, OldFunction, BreakLabel);
 }
 
 /*
@@ -431,6 +440,110 @@ struct ASTNode* ForStatement() {
     return ConstructASTNode(OP_COMP, RET_NONE, Preop, NULL, Tree, NULL, 0);
 }
 
+/*
+ * Handles the surrounding logic for Switch statements.
+ *
+ * They have the basic form of:
+ *  switch ( value ) {
+ *      case 1:
+ *      case 2:
+ *          <body>
+ *      case -1:
+ *          <body>
+ *      default:
+ *          <body>
+ *  }
+ *
+ * The value is compared against the constant of each case, and the body
+ *  of the matching case is executed. If nothing matches, the default runs,
+ *   if there is one.
+ *
+ * Unlike C, there is no break; each body finishes the switch.
+ * A case with no body shares the body of the case below it, so several
+ *  values can still lead to the same code.
+ *
+ * Each body becomes an OP_CASE (or OP_DEFAULT) in a list hanging off the
+ *  Right of the OP_SWITCH. Any other labels that share the body are
+ *   chained through its Middle.
+ *
+ * The Assembler decides how to find the right case, depending on
+ *  how many there are and how close together their values are.
+ *
+ * @return the AST of this statement
+ */
+struct ASTNode* SwitchStatement() {
+    struct ASTNode* Selector, *Value, *Head = NULL, *Tail = NULL, *Case, *Label, *Other;
+    int Count = 0, HasDefault = 0;
+    long Constant;
+
+    VerifyToken(KW_SWITCH, "switch");
+    VerifyToken(LI_LPARE, "(");
+
+    Selector = ParsePrecedenceASTNode(0);
+    Selector->RVal = 1;
+
+    if(!TypeIsInt(Selector->ExprType) || TypeIsVector(Selector->ExprType))
+        Die("Switch on a value that is not an integer");
+
+    VerifyToken(LI_RPARE, ")");
+    VerifyToken(LI_LBRAC, "{");
+
+    while(CurrentToken.type != LI_RBRAC) {
+        switch(CurrentToken.type) {
+            case KW_CASE:
+                Tokenise();
+
+                Value = PrefixStatement();
+                if(!ConstantValue(Value, &Constant))
+                    Die("Case label is not a constant");
+
+                for(Case = Head; Case != NULL; Case = Case->Right)
+                    for(Other = Case; Other != NULL; Other = Other->Middle)
+                        if(Other->Operation == OP_CASE && Other->IntValue == Constant)
+                            DieDecimal("Duplicate case value", Constant);
+
+                Label = ConstructASTNode(OP_CASE, RET_NONE, NULL, NULL, NULL, NULL, Constant);
+                Count++;
+                break;
+
+            case KW_DEFAULT:
+                Tokenise();
+
+                if(HasDefault)
+                    Die("Switch has more than one default");
+                HasDefault = 1;
+
+                Label = ConstructASTNode(OP_DEFAULT, RET_NONE, NULL, NULL, NULL, NULL, 0);
+                break;
+
+            default:
+                DieMessage("Expected case or default in switch, got", TokenNames[CurrentToken.type]);
+        }
+
+        VerifyToken(LI_COLON, ":");
+
+        if(Tail != NULL && Tail->Left == NULL) {
+            // The label above has no body, so it shares this one.
+            Label->Middle = Tail->Middle;
+            Tail->Middle = Label;
+        } else {
+            if(Head == NULL)
+                Head = Label;
+            else
+                Tail->Right = Label;
+            Tail = Label;
+        }
+
+        Tail->Left = ParseStatements();
+    }
+
+    VerifyToken(LI_RBRAC, "}");
+
+    printf("\t\tSwitch with %d cases%s\n", Count, HasDefault ? " and a default" : "");
+
+    return ConstructASTNode(OP_SWITCH, RET_NONE, Selector, NULL, Head, NULL, Count);
+}
+
 
 /*
  * Handles the surrounding logic for the Print statement.
@@ -494,11 +607,15 @@ struct ASTNode* PrintStatement(void) {
 struct ASTNode* PostfixStatement() {
     struct ASTNode* Tree;
     struct SymbolTableEntry* Entry;
+    int Intrinsic;
 
     Tokenise();
     
-    if(CurrentToken.type == LI_LPARE)
+    if(CurrentToken.type == LI_LPARE) {
+        if((Intrinsic = FindIntrinsic(CurrentIdentifier)) >= 0)
+            return ParseIntrinsic(Intrinsic);
         return CallFunction();
+    }
     
     if(CurrentToken.type == LI_LBRAS)
         return AccessArray();
@@ -507,7 +624,14 @@ struct ASTNode* PostfixStatement() {
     //  (as functions have been called and arrays have been indexed)
     // Check that the variable is recognized..
 
-    if((Entry = FindSymbol(CurrentIdentifier)) == NULL || Entry->Structure != ST_VAR)
+    if((Entry = FindSymbol(CurrentIdentifier)) == NULL)
+        DieMessage("Unknown Variable", CurrentIdentifier);
+
+    // A bare array name is the address of its first element, like in C.
+    if(Entry->Structure == ST_ARR)
+        return ConstructASTLeaf(OP_ADDRESS, Entry->Type, Entry, 0);
+
+    if(Entry->Structure != ST_VAR)
         DieMessage("Unknown Variable", CurrentIdentifier);
 
     // Here we check for postincrement and postdecrement.
@@ -0,0 +1,137 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+#include <errno.h>
+
+/********************************************************************************
+ * Stats records how well each function was compiled, for --stats <file>.       *
+ *                                                                              *
+ * For every function, it counts:                                               *
+ *  * the instructions emitted for it, after scheduling under -O,               *
+ *  * the size of its stack frame,                                              *
+ *  * the parameters spilled out of registers into the frame,                   *
+ *  * the loads and stores of locals, with the spills among the stores,         *
+ *  * the calls it makes, and the labels it creates.                            *
+ *                                                                              *
+ * The file is JSON if its name ends in .json, and CSV otherwise.               *
+ *                                                                              *
+ * A record is made as the parser hands the function over, so the functions     *
+ *  are listed in the order of the source even with -j.                         *
+ *  Units taken from the --cache are not compiled, so they have no records.     *
+ *                                                                              *
+ ********************************************************************************/
+
+static char* StatisticNames[STATISTICS] = { "instructions", "frame", "spills", "loads", "stores", "calls", "labels" };
+
+struct FunctionStats {
+    char* Name;
+    long Values[STATISTICS];
+    struct FunctionStats* Next;
+};
+
+static struct FunctionStats* Records, *RecordsEnd;
+
+// The function being assembled on this thread.
+static _Thread_local struct FunctionStats* Current;
+
+/*
+ * Make the record for a function about to be assembled.
+ * This has to be called in the order of the source.
+ *
+ * @param Function: The function
+ * @return the record, or NULL if there is no --stats.
+ */
+struct FunctionStats* NewFunctionStats(struct SymbolTableEntry* Function) {
+    struct FunctionStats* Record;
+
+    if(OptStatsFile == NULL)
+        return NULL;
+
+    if((Record = calloc(1, sizeof(struct FunctionStats))) == NULL)
+        Die("Unable to allocate function statistics");
+
+    Record->Name = Function->Name;
+    if(RecordsEnd)
+        RecordsEnd->Next = Record;
+    else
+        Records = Record;
+    RecordsEnd = Record;
+
+    return Record;
+}
+
+// Count into this record, for whatever this thread assembles until the next call.
+void UseFunctionStats(struct FunctionStats* Record) {
+    Current = Record;
+}
+
+/*
+ * Count something in the function being assembled, if it has a record.
+ *
+ * @param Statistic: The Statistics to count
+ * @param Amount: How many more of it
+ */
+void TallyFunction(int Statistic, long Amount) {
+    if(Current)
+        Current->Values[Statistic] += Amount;
+}
+
+// Whether there is a record to count into, for what is too slow to count otherwise.
+int CountingFunction(void) {
+    return Current != NULL;
+}
+
+static void WriteCSV(FILE* Stats) {
+    fprintf(Stats, "function");
+    for(int i = 0; i < STATISTICS; i++)
+        fprintf(Stats, ",%s", StatisticNames[i]);
+    fprintf(Stats, "\n");
+
+    for(struct FunctionStats* Record = Records; Record; Record = Record->Next) {
+        fprintf(Stats, "%s", Record->Name);
+        for(int i = 0; i < STATISTICS; i++)
+            fprintf(Stats, ",%ld", Record->Values[i]);
+        fprintf(Stats, "\n");
+    }
+}
+
+static void WriteJSON(FILE* Stats) {
+    fprintf(Stats, "[");
+
+    for(struct FunctionStats* Record = Records; Record; Record = Record->Next) {
+        fprintf(Stats, "%s\n  {\"function\": \"%s\"", Record == Records ? "" : ",", Record->Name);
+        for(int i = 0; i < STATISTICS; i++)
+            fprintf(Stats, ", \"%s\": %ld", StatisticNames[i], Record->Values[i]);
+        fprintf(Stats, "}");
+    }
+
+    fprintf(Stats, "\n]\n");
+}
+
+/*
+ * Write every record to the --stats file.
+ */
+void StatsReport(void) {
+    char* Suffix;
+    FILE* Stats;
+
+    if(OptStatsFile == NULL)
+        return;
+
+    if((Stats = fopen(OptStatsFile, "w")) == NULL) {
+        fprintf(stderr, "Unable to open %s: %s\n", OptStatsFile, strerror(errno));
+        return;
+    }
+
+    if((Suffix = strrchr(OptStatsFile, '.')) != NULL && !strcmp(Suffix, ".json"))
+        WriteJSON(Stats);
+    else
+        WriteCSV(Stats);
+
+    fclose(Stats);
+}
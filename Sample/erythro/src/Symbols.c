@@ -16,10 +16,18 @@
  */
 
 static struct SymbolTableEntry* SearchList(char* Name, struct SymbolTableEntry* List) {
-    for(; List != NULL; List = List->NextSymbol)
+    long Steps = 0;
+
+    PhaseStart(PHASE_LOOKUP);
+    for(; List != NULL; List = List->NextSymbol) {
+        Steps++;
         if((List->Name != NULL) && !strcmp(Name, List->Name))
-            return (List);
-    return NULL;
+            break;
+    }
+    PhaseEnd(PHASE_LOOKUP);
+
+    Tally(COUNT_LOOKUP_STEPS, Steps);
+    return List;
 }
 
 /*
@@ -36,7 +44,7 @@ static struct SymbolTableEntry* SearchList(char* Name, struct SymbolTableEntry*
 struct SymbolTableEntry* FindSymbol(char* Symbol) {
     struct SymbolTableEntry* Node;
 
-    if(CurrentFunction) {
+    if(FunctionEntry) {
         Node = SearchList(Symbol, FunctionEntry->Start);
         if(Node)
             return Node;
@@ -173,12 +181,14 @@ struct SymbolTableEntry* AddSymbol(char* Name, int Type, int Structure, int Stor
     Node->Length = Length;
     Node->SinkOffset = SinkOffset;
     Node->CompositeType = CompositeType;
+    Tally(COUNT_SYMBOLS, 1);
 
     switch(Storage) {
         case SC_GLOBAL:
             AppendSymbol(&Globals, &GlobalsEnd, Node);
             // We don't want to generate a static block for functions.
-            if(Structure != ST_FUNC) AsGlobalSymbol(Node);
+            // The whole program only generates the ones it uses, at the end.
+            if(Structure != ST_FUNC && !OptWholeProgram) AsGlobalSymbol(Node);
             break;
         case SC_STRUCT:
             AppendSymbol(&Structs, &StructsEnd, Node);
@@ -34,6 +34,54 @@ int TypeIsPtr(int Type) {
     return ((Type & 0xf) != 0);
 }
 
+/*
+ * Returns whether the input Type is one of the SIMD vector types.
+ * A pointer to a vector is not a vector.
+ *
+ * @param Type: The DataTypes representation to check
+ * @return a boolean representing whether the input Type is a vector
+ */
+
+int TypeIsVector(int Type) {
+    return Type == RET_I8X16 || Type == RET_I32X4 || Type == RET_I64X2;
+}
+
+/*
+ * Get the type of a single lane of a vector.
+ *
+ * @param Type: The vector type
+ * @return the scalar DataTypes that fills each lane
+ */
+
+int VectorElementType(int Type) {
+    switch(Type) {
+        case RET_I8X16: return RET_CHAR;
+        case RET_I32X4: return RET_INT;
+        case RET_I64X2: return RET_LONG;
+        default:
+            DieDecimal("Not a vector type", Type);
+    }
+    return 0;
+}
+
+/*
+ * Get the vector type that is filled with lanes of the given scalar type.
+ *
+ * @param Type: The scalar type
+ * @return the 16-byte vector DataTypes of that scalar
+ */
+
+int VectorOf(int Type) {
+    switch(Type) {
+        case RET_CHAR: return RET_I8X16;
+        case RET_INT: return RET_I32X4;
+        case RET_LONG: return RET_I64X2;
+        default:
+            DieDecimal("No vector type for", Type);
+    }
+    return 0;
+}
+
 /*
  * Turn a token type into its appropriate
  *  primitive type. 
@@ -47,6 +95,7 @@ int PrimitiveSize(int Type) {
         case RET_CHAR: return 1;
         case RET_INT: return 4;
         case RET_LONG: return 8;
+        case RET_I8X16: case RET_I32X4: case RET_I64X2: return 16;
         default: 
             DieDecimal("Bad type in PrimitiveSize", Type);
     }
@@ -67,20 +116,23 @@ int TypeSize(int Type, struct SymbolTableEntry* Composite) {
 
 /*
  * A char buffer we can abuse for printing type names.
- * It needs to be 7 because that's 4 (long) + 3 (ptr), the longest
- *  possible name right now.
+ * It needs to be 8 because that's 4 (long) + 3 (ptr), the longest
+ *  possible name right now, plus the terminator.
  */
-static char TypeBuffer[7];
+static char TypeBuffer[8];
 
 /*
  * Get the name of the input Type as a string.
  */
 char* TypeNames(int Type) {
-    switch(Type) {
+    switch(Type & ~0xf) {
         case RET_CHAR: memcpy(TypeBuffer, "Char", 4); break;
         case RET_INT: memcpy(TypeBuffer, "Int ", 4); break;
         case RET_LONG: memcpy(TypeBuffer, "Long", 4); break;
         case RET_VOID: memcpy(TypeBuffer, "Void", 4); break;
+        case RET_I8X16: memcpy(TypeBuffer, "Vi8 ", 4); break;
+        case RET_I32X4: memcpy(TypeBuffer, "Vi32", 4); break;
+        case RET_I64X2: memcpy(TypeBuffer, "Vi64", 4); break;
         default: DieDecimal("Bad size for printing", Type);
     };
     if(TypeIsPtr(Type)) memcpy((void*)((size_t) TypeBuffer + 4), "Ptr", 3);
@@ -183,7 +235,7 @@ int TypesCompatible(int* Left, int* Right, int STRICT) {
  *  code that TypesCompatible led us to.
  */
 
-struct ASTNode* MutateType(struct ASTNode* Tree, int RightType, int Operation) {
+static struct ASTNode* MutateTree(struct ASTNode* Tree, int RightType, int Operation) {
     int LeftType;
     int LeftSize, RightSize;
 
@@ -191,6 +243,46 @@ struct ASTNode* MutateType(struct ASTNode* Tree, int RightType, int Operation) {
 
 
     printf("\tCalculating compatibility between ltype %d and rtype %d\r\n", LeftType, RightType);
+
+    /**
+     * Vectors only combine with vectors of the same shape:
+     *  i32x4 x, y;
+     *  x = x + y;
+     * 
+     * The exception is shifting, where every lane is shifted by the same scalar:
+     *  x = x << 3;
+     * 
+     * SSE2 can't multiply bytes or longs, can't shift bytes, and can't compare longs,
+     *  so those are not allowed either.
+     */
+    if(TypeIsVector(LeftType) || TypeIsVector(RightType)) {
+        if(Operation == OP_SHIFTL || Operation == OP_SHIFTR) {
+            if(TypeIsVector(LeftType) && TypeIsInt(RightType) && !TypeIsVector(RightType))
+                return LeftType == RET_I8X16 ? NULL : Tree;
+            // This is the scalar of a vector shift, checked against the vector.
+            // A scalar shifted by a vector has already been refused by the parser.
+            if(TypeIsInt(LeftType) && !TypeIsVector(LeftType) && TypeIsVector(RightType))
+                return RightType == RET_I8X16 ? NULL : Tree;
+            return NULL;
+        }
+
+        if(LeftType != RightType)
+            return NULL;
+
+        switch(Operation) {
+            case 0:
+            case OP_ADD: case OP_SUBTRACT:
+            case OP_BITAND: case OP_BITOR: case OP_BITXOR:
+                return Tree;
+            case OP_MULTIPLY:
+                return LeftType == RET_I32X4 ? Tree : NULL;
+            case OP_EQUAL: case OP_INEQ:
+            case OP_LESS: case OP_GREAT: case OP_LESSE: case OP_GREATE:
+                return LeftType == RET_I64X2 ? NULL : Tree;
+        }
+        return NULL;
+    }
+
     if(TypeIsInt(LeftType) && TypeIsInt(RightType)) {
 
         // Short-circuit for valid types
@@ -248,6 +340,9 @@ struct ASTNode* MutateType(struct ASTNode* Tree, int RightType, int Operation) {
 
             if(RightSize > 1)
                 return ConstructASTBranch(OP_SCALE, RightType, Tree, NULL, RightSize);
+            
+            // Chars are a byte apart, so there's nothing to scale.
+            return Tree;
         }
     }
 
@@ -256,3 +351,14 @@ struct ASTNode* MutateType(struct ASTNode* Tree, int RightType, int Operation) {
     // You cannot do pointer arithmetic on void type.
     return NULL;
 }
+
+// MutateTree, timed for -ftime-report.
+struct ASTNode* MutateType(struct ASTNode* Tree, int RightType, int Operation) {
+    struct ASTNode* Result;
+
+    PhaseStart(PHASE_MUTATE);
+    Result = MutateTree(Tree, RightType, Operation);
+    PhaseEnd(PHASE_MUTATE);
+
+    return Result;
+}
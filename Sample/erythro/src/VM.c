@@ -0,0 +1,372 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+#include <time.h>
+
+/********************************************************************************
+ * The VM runs the bytecode made by Bytecode.c, for --vm.                       *
+ *                                                                              *
+ * Dispatch is threaded: every instruction ends by jumping straight to the      *
+ *  code for the next one, through a table of label addresses, rather than     *
+ *  going back round a loop with a switch in it. Each instruction then has a    *
+ *  branch of its own, which the host CPU can predict separately.               *
+ *                                                                              *
+ * Every call gets a frame, and a window of registers on a stack of its own,   *
+ *  so the VM never recurses on the C stack.                                    *
+ *                                                                              *
+ * Functions without bytecode are looked up in the C library, and called with  *
+ *  every argument passed as a long, as the native code would.                  *
+ *                                                                              *
+ ********************************************************************************/
+
+// How many registers, and calls, can be live at once.
+#define VM_REGISTERS (1 << 20)
+#define VM_FRAMES (1 << 16)
+
+struct VmFrame {
+    struct BytecodeFunction* Function;
+    struct BytecodeInstruction* Return;
+    long* Registers;
+    int Result;     // Where the caller wants the result, in its own registers
+};
+
+// What to call the builtins of the Runtime as, when the program doesn't define them.
+static long VmPrintInteger(long Value) {
+    printf("%ld\n", Value);
+    return 0;
+}
+
+static long VmPrintString(long Value) {
+    printf("%s\n", (char*) Value);
+    return 0;
+}
+
+static long VmPrintChar(long Value) {
+    putchar((char) Value);
+    return 0;
+}
+
+static struct { char* Name; void* Native; } VmBuiltins[] = {
+    { "PrintInteger", (void*) VmPrintInteger },
+    { "PrintString", (void*) VmPrintString },
+    { "PrintChar", (void*) VmPrintChar },
+    { NULL, NULL }
+};
+
+/*
+ * Call a library function.
+ * Every argument is a long, as erythro passes them, which covers pointers and smaller integers alike.
+ */
+static long VmCallNative(void* Native, long* Arguments, int Count) {
+    switch(Count) {
+        case 0: return ((long (*)(void)) Native)();
+        case 1: return ((long (*)(long)) Native)(Arguments[0]);
+        case 2: return ((long (*)(long, long)) Native)(Arguments[0], Arguments[1]);
+        case 3: return ((long (*)(long, long, long)) Native)(Arguments[0], Arguments[1], Arguments[2]);
+        case 4: return ((long (*)(long, long, long, long)) Native)(Arguments[0], Arguments[1], Arguments[2], Arguments[3]);
+        case 5: return ((long (*)(long, long, long, long, long)) Native)(Arguments[0], Arguments[1], Arguments[2], Arguments[3], Arguments[4]);
+        case 6: return ((long (*)(long, long, long, long, long, long)) Native)(Arguments[0], Arguments[1], Arguments[2], Arguments[3], Arguments[4], Arguments[5]);
+        case 7: return ((long (*)(long, long, long, long, long, long, long)) Native)(Arguments[0], Arguments[1], Arguments[2], Arguments[3], Arguments[4], Arguments[5], Arguments[6]);
+        case 8: return ((long (*)(long, long, long, long, long, long, long, long)) Native)(Arguments[0], Arguments[1], Arguments[2], Arguments[3], Arguments[4], Arguments[5], Arguments[6], Arguments[7]);
+        default:
+            fprintf(stderr, "The VM can't pass %d arguments to a library function\n", Count);
+            exit(1);
+    }
+}
+
+/*
+ * Bind every function called by name, to bytecode if there is some, or else to the library.
+ */
+static void VmBind(void) {
+    struct BytecodeFunction* Function;
+
+    for(int i = 0; i < BytecodeCalleeCount; i++) {
+        for(Function = BytecodeFunctions; Function != NULL; Function = Function->Next)
+            if(!strcmp(Function->Name, BytecodeCallees[i].Name))
+                break;
+
+        if((BytecodeCallees[i].Function = Function) != NULL)
+            continue;
+
+        BytecodeCallees[i].Native = JitLibrarySymbol(BytecodeCallees[i].Name);
+        for(int j = 0; BytecodeCallees[i].Native == NULL && VmBuiltins[j].Name != NULL; j++)
+            if(!strcmp(BytecodeCallees[i].Name, VmBuiltins[j].Name))
+                BytecodeCallees[i].Native = VmBuiltins[j].Native;
+
+        if(BytecodeCallees[i].Native == NULL) {
+            fprintf(stderr, "Undefined function %s\n", BytecodeCallees[i].Name);
+            exit(1);
+        }
+    }
+}
+
+static int VmCountLeading(unsigned long Value, int Width) {
+    int Count = 0;
+    for(unsigned long Bit = 1UL << (Width - 1); Bit != 0 && !(Value & Bit); Bit >>= 1)
+        Count++;
+    return Count;
+}
+
+static int VmCountTrailing(unsigned long Value, int Width) {
+    int Count = 0;
+    while(Count < Width && !(Value & (1UL << Count)))
+        Count++;
+    return Count;
+}
+
+static unsigned long VmSwap(unsigned long Value, int Bytes) {
+    unsigned long Result = 0;
+    for(int i = 0; i < Bytes; i++)
+        Result = (Result << 8) | ((Value >> (i * 8)) & 0xFF);
+    return Result;
+}
+
+// Find the target of a switch, for a value.
+static int VmSwitch(struct BytecodeSwitch* Switch, long Value) {
+    int Low = 0, High = Switch->Count - 1, Middle;
+
+    if(Switch->Dense)
+        return Value >= Switch->Low && Value - Switch->Low < Switch->Count ? Switch->Targets[Value - Switch->Low] : Switch->Default;
+
+    while(Low <= High) {
+        Middle = (Low + High) / 2;
+        if(Switch->Values[Middle] == Value)
+            return Switch->Targets[Middle];
+        if(Switch->Values[Middle] < Value)
+            Low = Middle + 1;
+        else
+            High = Middle - 1;
+    }
+
+    return Switch->Default;
+}
+
+/*
+ * Run a function until it returns.
+ *
+ * @param Entry: The function to start in
+ * @param Arguments: Its arguments
+ * @param Count: How many arguments there are; any more parameters start as zero
+ * @return what it returns
+ */
+static long VmExecute(struct BytecodeFunction* Entry, long* Arguments, int Count) {
+    // In the order of enum Bytecodes.
+    static void* Dispatch[] = {
+        &&Const, &&Move,
+        &&Add, &&Sub, &&Mul, &&Div, &&Mod, &&And, &&Or, &&Xor, &&Shl, &&Shr, &&AddI, &&MulI,
+        &&Neg, &&Not, &&LNot, &&Bool,
+        &&Eq, &&Ne, &&Lt, &&Gt, &&Le, &&Ge,
+        &&JEq, &&JNe, &&JLt, &&JGt, &&JLe, &&JGe,
+        &&JEqI, &&JNeI, &&JLtI, &&JGtI, &&JLeI, &&JGeI,
+        &&Jz, &&Jnz, &&Jmp,
+        &&Trunc8, &&Extend32,
+        &&Load8, &&Load32, &&Load64, &&Store8, &&Store32, &&Store64,
+        &&LoadG8, &&LoadG32, &&LoadG64, &&StoreG8, &&StoreG32, &&StoreG64,
+        &&Popcount32, &&Popcount64, &&Clz32, &&Clz64, &&Ctz32, &&Ctz64, &&Bswap32, &&Bswap64,
+        &&Switch, &&Call, &&Ret
+    };
+
+    struct VmFrame* Frames, *Frame;
+    struct BytecodeFunction* Function = Entry, *Callee;
+    struct BytecodeInstruction* Pc;
+    long* Stack, *R, *K, Result;
+    unsigned long Value;
+
+    if((Stack = malloc(VM_REGISTERS * sizeof(long))) == NULL || (Frames = malloc(VM_FRAMES * sizeof(struct VmFrame))) == NULL)
+        Die("Unable to allocate the VM stack");
+
+    if(Function->Registers > VM_REGISTERS) {
+        fprintf(stderr, "%s needs too many registers for the VM\n", Function->Name);
+        exit(1);
+    }
+
+    Frame = Frames;
+    Frame->Function = NULL;
+    R = Frame->Registers = Stack;
+    memset(R, 0, Function->Parameters * sizeof(long));
+    memcpy(R, Arguments, (Count < Function->Parameters ? Count : Function->Parameters) * sizeof(long));
+    K = Function->Constants;
+    Pc = Function->Code;
+
+#define A (Pc->A)
+#define B (Pc->B)
+#define C (Pc->C)
+#define NEXT goto *Dispatch[(++Pc)->Operation]
+#define JUMP(Condition) if(Condition) { Pc = Function->Code + A; goto *Dispatch[Pc->Operation]; } NEXT
+
+    goto *Dispatch[Pc->Operation];
+
+    Const:    R[A] = K[B]; NEXT;
+    Move:     R[A] = R[B]; NEXT;
+
+    Add:      R[A] = (unsigned long) R[B] + R[C]; NEXT;
+    Sub:      R[A] = (unsigned long) R[B] - R[C]; NEXT;
+    Mul:      R[A] = (unsigned long) R[B] * R[C]; NEXT;
+    Div:
+        if(R[C] == 0) { fprintf(stderr, "Division by zero in %s\n", Function->Name); exit(1); }
+        R[A] = R[C] == -1 ? (long) -(unsigned long) R[B] : R[B] / R[C];
+        NEXT;
+    Mod:
+        if(R[C] == 0) { fprintf(stderr, "Division by zero in %s\n", Function->Name); exit(1); }
+        R[A] = R[C] == -1 ? 0 : R[B] % R[C];
+        NEXT;
+    And:      R[A] = R[B] & R[C]; NEXT;
+    Or:       R[A] = R[B] | R[C]; NEXT;
+    Xor:      R[A] = R[B] ^ R[C]; NEXT;
+    Shl:      R[A] = (unsigned long) R[B] << (R[C] & 63); NEXT;
+    Shr:      R[A] = (unsigned long) R[B] >> (R[C] & 63); NEXT;
+    AddI:     R[A] = (unsigned long) R[B] + C; NEXT;
+    MulI:     R[A] = (unsigned long) R[B] * C; NEXT;
+
+    Neg:      R[A] = -(unsigned long) R[B]; NEXT;
+    Not:      R[A] = ~R[B]; NEXT;
+    LNot:     R[A] = !R[B]; NEXT;
+    Bool:     R[A] = R[B] != 0; NEXT;
+
+    Eq:       R[A] = R[B] == R[C]; NEXT;
+    Ne:       R[A] = R[B] != R[C]; NEXT;
+    Lt:       R[A] = R[B] < R[C]; NEXT;
+    Gt:       R[A] = R[B] > R[C]; NEXT;
+    Le:       R[A] = R[B] <= R[C]; NEXT;
+    Ge:       R[A] = R[B] >= R[C]; NEXT;
+
+    JEq:      JUMP(R[B] == R[C]);
+    JNe:      JUMP(R[B] != R[C]);
+    JLt:      JUMP(R[B] < R[C]);
+    JGt:      JUMP(R[B] > R[C]);
+    JLe:      JUMP(R[B] <= R[C]);
+    JGe:      JUMP(R[B] >= R[C]);
+
+    JEqI:     JUMP(R[B] == C);
+    JNeI:     JUMP(R[B] != C);
+    JLtI:     JUMP(R[B] < C);
+    JGtI:     JUMP(R[B] > C);
+    JLeI:     JUMP(R[B] <= C);
+    JGeI:     JUMP(R[B] >= C);
+
+    Jz:       JUMP(R[B] == 0);
+    Jnz:      JUMP(R[B] != 0);
+    Jmp:      JUMP(1);
+
+    Trunc8:   R[A] = (unsigned char) R[B]; NEXT;
+    Extend32: R[A] = (int) R[B]; NEXT;
+
+    Load8:    R[A] = *(unsigned char*) R[B]; NEXT;
+    Load32:   R[A] = *(int*) R[B]; NEXT;
+    Load64:   R[A] = *(long*) R[B]; NEXT;
+    Store8:   *(char*) R[A] = R[B]; NEXT;
+    Store32:  *(int*) R[A] = R[B]; NEXT;
+    Store64:  *(long*) R[A] = R[B]; NEXT;
+
+    LoadG8:   R[A] = *(unsigned char*) K[B]; NEXT;
+    LoadG32:  R[A] = *(int*) K[B]; NEXT;
+    LoadG64:  R[A] = *(long*) K[B]; NEXT;
+    StoreG8:  *(char*) K[A] = R[B]; NEXT;
+    StoreG32: *(int*) K[A] = R[B]; NEXT;
+    StoreG64: *(long*) K[A] = R[B]; NEXT;
+
+    Popcount32:
+        for(Value = (unsigned int) R[B], R[A] = 0; Value != 0; Value &= Value - 1)
+            R[A]++;
+        NEXT;
+    Popcount64:
+        for(Value = R[B], R[A] = 0; Value != 0; Value &= Value - 1)
+            R[A]++;
+        NEXT;
+    Clz32:    R[A] = VmCountLeading((unsigned int) R[B], 32); NEXT;
+    Clz64:    R[A] = VmCountLeading(R[B], 64); NEXT;
+    Ctz32:    R[A] = VmCountTrailing((unsigned int) R[B], 32); NEXT;
+    Ctz64:    R[A] = VmCountTrailing(R[B], 64); NEXT;
+    Bswap32:  R[A] = (int) VmSwap((unsigned int) R[B], 4); NEXT;
+    Bswap64:  R[A] = VmSwap(R[B], 8); NEXT;
+
+    Switch:
+        Pc = Function->Code + VmSwitch(&Function->Switches[C], R[B]);
+        goto *Dispatch[Pc->Operation];
+
+    Call:
+        if((Callee = BytecodeCallees[B].Function) == NULL) {
+            R[A] = VmCallNative(BytecodeCallees[B].Native, &R[A], C);
+            NEXT;
+        }
+
+        if(Frame + 1 == Frames + VM_FRAMES || R + Function->Registers + Callee->Registers > Stack + VM_REGISTERS) {
+            fprintf(stderr, "The VM ran out of stack, calling %s\n", Callee->Name);
+            exit(1);
+        }
+
+        // The callee's registers start after all of ours, with the arguments first.
+        Frame->Return = Pc;
+        Frame->Result = A;
+        (Frame + 1)->Registers = R + Function->Registers;
+        memcpy((Frame + 1)->Registers, &R[A], C * sizeof(long));
+        (++Frame)->Function = Function;
+
+        Function = Callee;
+        R = Frame->Registers;
+        K = Function->Constants;
+        Pc = Function->Code;
+        goto *Dispatch[Pc->Operation];
+
+    Ret:
+        Result = R[A];
+        if(Frame->Function == NULL) {
+            free(Stack);
+            free(Frames);
+            return Result;
+        }
+
+        Function = Frame->Function;
+        Frame--;
+        R = Frame->Registers;
+        K = Function->Constants;
+        Pc = Frame->Return;
+        R[Frame->Result] = Result;
+        NEXT;
+
+#undef A
+#undef B
+#undef C
+#undef NEXT
+#undef JUMP
+}
+
+/*
+ * Run the program in the VM, which must have a main.
+ *
+ * @param Count: How many arguments the program gets, including its own name
+ * @param Arguments: The arguments
+ * @return main's return value
+ */
+int VmRun(int Count, char* Arguments[]) {
+    struct BytecodeFunction* Main;
+    long Parameters[2] = { Count, (long) Arguments };
+    clock_t Start;
+    int Result;
+
+    for(Main = BytecodeFunctions; Main != NULL; Main = Main->Next)
+        if(!strcmp(Main->Name, "main"))
+            break;
+
+    if(Main == NULL) {
+        fprintf(stderr, "There is no main to run\n");
+        exit(1);
+    }
+
+    VmBind();
+    fflush(stdout);
+
+    Start = clock();
+    Result = VmExecute(Main, Parameters, 2);
+    fflush(stdout);
+
+    if(OptVerboseOutput)
+        printf("VM: main returned %d after %.3f seconds\n", Result, (double) (clock() - Start) / CLOCKS_PER_SEC);
+
+    return Result;
+}
@@ -0,0 +1,269 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+
+/********************************************************************************
+ * The Vectoriser turns simple counted loops over arrays into loops that        *
+ *  process 16 bytes at a time with SSE2, which every x86-64 processor has.     *
+ *                                                                              *
+ * A loop qualifies if it looks like:                                           *
+ *   for(i = ...; i < n; i++) {                                                 *
+ *      a[i] = b[i] + c[i];                                                     *
+ *      d[i] = 0;                                                               *
+ *   }                                                                          *
+ *                                                                              *
+ *  * the step adds one to a char, int or long variable,                        *
+ *  * the bound is compared with < or <=, and does not change in the loop,      *
+ *  * every statement stores to an array, at exactly index i,                   *
+ *  * every array read is also at exactly index i,                              *
+ *  * every array has the same element size,                                    *
+ *  * the values are built from +, -, &, |, ^ and ~ over array elements,        *
+ *     and scalars that do not change in the loop.                              *
+ *                                                                              *
+ * Since every access is at index i, no iteration can see the result of         *
+ *  another, so the iterations can be run side by side.                         *
+ * Every operation allowed here also gives the same low bits regardless of      *
+ *  how wide it is done, so doing them at the element size is exact.            *
+ *                                                                              *
+ * The loop is replaced by an OP_VECLOOP:                                       *
+ *  Left:   the original condition, for the bound                               *
+ *  Middle: the statements to run on each vector                                *
+ *  Right:  the original loop, which picks up the remaining elements            *
+ *  Symbol: the induction variable                                              *
+ *  Size:   the element size                                                    *
+ *                                                                              *
+ ********************************************************************************/
+
+// The Assembler has this many xmm registers to evaluate a statement in.
+#define VECTOR_REGISTERS 6
+
+// The function being optimised, for reporting.
+static struct ASTNode* Function;
+
+// The loop currently being checked.
+static struct SymbolTableEntry* Induction;
+static int ElementSize;
+
+/*
+ * Recognise base[i], where base is a global array.
+ *
+ * @param Node: The OP_DEREF to check
+ * @param Index: The variable the array must be indexed by
+ * @return the array's Symbol Table entry, or NULL if the node is some other access.
+ */
+struct SymbolTableEntry* VectorArrayAccess(struct ASTNode* Node, struct SymbolTableEntry* Index) {
+    struct ASTNode* Address, *Base, *Offset;
+    int Size;
+
+    if(Node == NULL || Node->Operation != OP_DEREF)
+        return NULL;
+
+    Address = Node->Left;
+    if(Address == NULL || Address->Operation != OP_ADD)
+        return NULL;
+
+    Base = Address->Left;
+    Offset = Address->Right;
+    if(Base == NULL || Base->Operation != OP_ADDRESS || Base->Symbol->Structure != ST_ARR)
+        return NULL;
+
+    Size = PrimitiveSize(ValueAt(Base->ExprType));
+
+    // Chars need no scaling, everything else is scaled by its size.
+    if(Offset && Offset->Operation == OP_SCALE) {
+        if(Offset->Size != Size)
+            return NULL;
+        Offset = Offset->Left;
+    } else if(Size != 1) {
+        return NULL;
+    }
+
+    if(!IsReferenceTo(Offset, Index))
+        return NULL;
+
+    return Base->Symbol;
+}
+
+/*
+ * Is this a scalar expression that gives the same value in every iteration?
+ * Those are calculated normally and copied into every lane.
+ */
+static int IsScalarInvariant(struct ASTNode* Node) {
+    if(Node == NULL)
+        return 1;
+
+    switch(Node->Operation) {
+        case TERM_INTLITERAL:
+            return 1;
+
+        case REF_IDENT:
+            return Node->Symbol != Induction && IsScalarInteger(Node->Symbol);
+
+        case OP_ADD: case OP_SUBTRACT: case OP_MULTIPLY:
+        case OP_BITAND: case OP_BITOR: case OP_BITXOR:
+        case OP_SHIFTL: case OP_SHIFTR:
+        case OP_NEGATE: case OP_BITNOT: case OP_WIDEN:
+            return IsScalarInvariant(Node->Left) && IsScalarInvariant(Node->Right);
+    }
+
+    return 0;
+}
+
+/*
+ * Work out how many xmm registers it takes to evaluate an expression
+ *  a vector at a time.
+ * The Assembler always evaluates the left side first, and holds onto it while
+ *  the right side is evaluated.
+ *
+ * @return the number of registers needed, or -1 if it cannot be vectorised.
+ */
+static int VectorCost(struct ASTNode* Node) {
+    struct SymbolTableEntry* Array;
+    int Left, Right;
+
+    if(Node == NULL)
+        return -1;
+
+    if(Node->Operation == OP_DEREF) {
+        Array = VectorArrayAccess(Node, Induction);
+        if(Array == NULL || PrimitiveSize(ValueAt(Array->Type)) != ElementSize)
+            return -1;
+        return 1;
+    }
+
+    if(IsScalarInvariant(Node))
+        return 1;
+
+    switch(Node->Operation) {
+        case OP_ADD: case OP_SUBTRACT:
+        case OP_BITAND: case OP_BITOR: case OP_BITXOR:
+            Left = VectorCost(Node->Left);
+            Right = VectorCost(Node->Right);
+            if(Left < 0 || Right < 0)
+                return -1;
+            return Left > Right + 1 ? Left : Right + 1;
+
+        case OP_BITNOT:
+            Left = VectorCost(Node->Left);
+            if(Left < 0)
+                return -1;
+            return Left > 2 ? Left : 2;
+    }
+
+    return -1;
+}
+
+/*
+ * Check that every statement in the body is a store to an array at index i,
+ *  of a value that can be calculated a vector at a time.
+ */
+static int CanVectoriseBody(struct ASTNode* Body) {
+    struct SymbolTableEntry* Array;
+    int Cost;
+
+    if(Body == NULL)
+        return 0;
+
+    if(Body->Operation == OP_COMP)
+        return CanVectoriseBody(Body->Left) && CanVectoriseBody(Body->Right);
+
+    if(Body->Operation != OP_ASSIGN)
+        return 0;
+
+    Array = VectorArrayAccess(Body->Right, Induction);
+    if(Array == NULL)
+        return 0;
+
+    // The first store decides how wide the lanes are.
+    if(ElementSize == 0)
+        ElementSize = PrimitiveSize(ValueAt(Array->Type));
+    else if(ElementSize != PrimitiveSize(ValueAt(Array->Type)))
+        return 0;
+
+    Cost = VectorCost(Body->Left);
+    return Cost > 0 && Cost <= VECTOR_REGISTERS;
+}
+
+/*
+ * Try to vectorise a single loop.
+ *
+ * @param Slot: The pointer to the OP_LOOP node, so it can be replaced.
+ */
+static void VectoriseLoop(struct ASTNode** Slot) {
+    struct ASTNode* Loop = *Slot, *Condition = Loop->Left, *Body;
+    struct SymbolTableEntry* Symbol;
+    long Stride;
+
+    if(Loop->Right == NULL || Loop->Right->Operation != OP_COMP)
+        return;
+
+    if(!MatchInductionStep(Loop->Right->Right, &Symbol, &Stride) || Stride != 1)
+        return;
+
+    if(Condition == NULL || (Condition->Operation != OP_LESS && Condition->Operation != OP_LESSE)
+        || !IsReferenceTo(Condition->Left, Symbol))
+        return;
+
+    Induction = Symbol;
+    ElementSize = 0;
+    Body = Loop->Right->Left;
+
+    if(!IsScalarInvariant(Condition->Right) || !CanVectoriseBody(Body))
+        return;
+
+    // Nothing in the body can write to a scalar, but something else may point at it.
+    if(Symbol->Storage != SC_GLOBAL && TreeTakesAddress(Function->Left, Symbol))
+        return;
+
+    *Slot = ConstructASTNode(OP_VECLOOP, RET_NONE, Condition, CopyTree(Body), Loop, Symbol, ElementSize);
+
+    if(OptVerboseOutput)
+        printf("Optimiser: vectorised loop in %s (%d lanes)\n", Function->Symbol->Name, 16 / ElementSize);
+}
+
+/*
+ * Walk the statements of a function, looking for loops to vectorise.
+ */
+static void VectoriseStatement(struct ASTNode** Slot) {
+    struct ASTNode* Node = *Slot;
+
+    if(Node == NULL)
+        return;
+
+    switch(Node->Operation) {
+        case OP_COMP:
+            VectoriseStatement(&Node->Left);
+            VectoriseStatement(&Node->Right);
+            return;
+
+        case OP_IF:
+            VectoriseStatement(&Node->Middle);
+            VectoriseStatement(&Node->Right);
+            return;
+
+        case OP_LOOP:
+            VectoriseStatement(&Node->Right);
+            VectoriseLoop(Slot);
+            return;
+
+        case OP_SWITCH:
+            for(Node = Node->Right; Node != NULL; Node = Node->Right)
+                VectoriseStatement(&Node->Left);
+            return;
+    }
+}
+
+/*
+ * Entry point for the vectoriser.
+ *
+ * @param Tree: The OP_FUNC node of the function to vectorise.
+ */
+void VectoriseLoops(struct ASTNode* Tree) {
+    Function = Tree;
+    VectoriseStatement(&Tree->Left);
+}
@@ -0,0 +1,551 @@
+
+/*************/
+/*GEMWIRE    */
+/*    ERYTHRO*/
+/*************/
+
+#include <Defs.h>
+#include <Data.h>
+
+/********************************************************************************
+ * Whole program mode (--whole-program) reads every input file before it        *
+ *  generates any code, and then assembles them all into one object.            *
+ *                                                                              *
+ * Since the symbol tables are shared between files, a prototype in one file    *
+ *  (like those in tests/cat.er) resolves to the body in another.               *
+ *                                                                              *
+ * When the program defines main, it is taken to be the whole program:          *
+ *  * only main is exported, everything else is local to the object,           *
+ *  * functions that main can never reach, and globals that nothing             *
+ *     reachable uses, are not generated at all,                                *
+ *  * under -O, calls to small functions are inlined, and constants are         *
+ *     propagated through parameters, and through globals nothing writes.       *
+ *                                                                              *
+ * Without main, everything is kept and exported, as it is a library.           *
+ *                                                                              *
+ ********************************************************************************/
+
+// A function that has been parsed, waiting to be generated.
+struct ProgramFunction {
+    struct ASTNode* Tree;
+    struct SymbolTableEntry* Locals, *LocalsEnd;
+    int Reachable;
+    struct ProgramFunction* Next;
+};
+
+static struct ProgramFunction* Program, *ProgramEnd;
+
+// Whether main is defined, so that nothing outside can see in.
+static int Closed;
+
+// The most nodes a function's return value may have, to be inlined.
+#define INLINE_LIMIT 24
+
+/*
+ * Save a function until the whole program has been read.
+ * Its locals are taken with it, as the tables are reset for the next function.
+ *
+ * @param Tree: The OP_FUNC node of the function
+ */
+void AddProgramFunction(struct ASTNode* Tree) {
+    struct ProgramFunction* Function;
+
+    for(Function = Program; Function != NULL; Function = Function->Next)
+        if(Function->Tree->Symbol == Tree->Symbol)
+            DieMessage("Redefinition of function", Tree->Symbol->Name);
+
+    Function = malloc(sizeof(struct ProgramFunction));
+    if(Function == NULL)
+        Die("Unable to allocate program function");
+
+    Function->Tree = Tree;
+    Function->Locals = Locals;
+    Function->LocalsEnd = LocalsEnd;
+    Function->Reachable = 0;
+    Function->Next = NULL;
+
+    if(ProgramEnd)
+        ProgramEnd->Next = Function;
+    else
+        Program = Function;
+    ProgramEnd = Function;
+
+    if(!strcmp(Tree->Symbol->Name, "main"))
+        Closed = 1;
+}
+
+/*
+ * Decide whether a symbol must be visible to other objects.
+ * Outside of a closed whole program, everything is.
+ */
+int SymbolIsExported(struct SymbolTableEntry* Symbol) {
+    return !OptWholeProgram || !Closed || !strcmp(Symbol->Name, "main");
+}
+
+// Find the body of a function, if the program has one.
+static struct ProgramFunction* FindDefinition(struct SymbolTableEntry* Symbol) {
+    for(struct ProgramFunction* Function = Program; Function != NULL; Function = Function->Next)
+        if(Function->Tree->Symbol == Symbol)
+            return Function;
+    return NULL;
+}
+
+// Find the index of a parameter of a function, counting from 0.
+static int ParameterIndex(struct SymbolTableEntry* Function, struct SymbolTableEntry* Symbol) {
+    struct SymbolTableEntry* Param;
+    int Index = 0;
+
+    for(Param = Function->Start; Param != NULL; Param = Param->NextSymbol, Index++)
+        if(Param == Symbol)
+            return Index;
+    return -1;
+}
+
+/*
+ * Unpack the arguments of a call, which GetExpressionList builds
+ *  back to front, into the order of the parameters.
+ *
+ * @return the number of arguments, or -1 if there are too many to hold.
+ */
+static int CallArguments(struct ASTNode* Call, struct ASTNode** Arguments, int Limit) {
+    struct ASTNode* List;
+    int Count = Call->Left ? Call->Left->Size : 0;
+
+    if(Count > Limit)
+        return -1;
+
+    for(List = Call->Left; List != NULL; List = List->Left)
+        Arguments[List->Size - 1] = List->Right;
+
+    return Count;
+}
+
+// Count the reads of a symbol in a tree.
+static int CountUses(struct ASTNode* Node, struct SymbolTableEntry* Symbol) {
+    if(Node == NULL)
+        return 0;
+
+    return (Node->Operation == REF_IDENT && Node->Symbol == Symbol)
+        + CountUses(Node->Left, Symbol) + CountUses(Node->Middle, Symbol) + CountUses(Node->Right, Symbol);
+}
+
+// Does a tree call a given function?
+static int TreeCalls(struct ASTNode* Node, struct SymbolTableEntry* Function) {
+    if(Node == NULL)
+        return 0;
+
+    if(Node->Operation == OP_CALL && Node->Symbol == Function)
+        return 1;
+
+    return TreeCalls(Node->Left, Function) || TreeCalls(Node->Middle, Function) || TreeCalls(Node->Right, Function);
+}
+
+/*
+ * Does a tree use the storage of the function it is in, other than to read a parameter?
+ * Locals and written parameters live in the function's own frame, which an inlined
+ *  copy doesn't have; in the caller, the same offsets belong to something else.
+ */
+static int UsesOwnFrame(struct ASTNode* Node, struct SymbolTableEntry* Function) {
+    if(Node == NULL)
+        return 0;
+
+    if(Node->Symbol != NULL) {
+        if(Node->Symbol->Storage == SC_LOCAL)
+            return 1;
+        if(ParameterIndex(Function, Node->Symbol) >= 0 && !(Node->Operation == REF_IDENT && Node->RVal))
+            return 1;
+    }
+
+    return UsesOwnFrame(Node->Left, Function) || UsesOwnFrame(Node->Middle, Function) || UsesOwnFrame(Node->Right, Function);
+}
+
+/*
+ * Can a literal be passed as a parameter of this type without changing?
+ */
+static int LiteralFits(long Value, int Type) {
+    switch(Type) {
+        case RET_CHAR: return Value >= 0 && Value <= 255;
+        case RET_INT:  return Value >= -2147483648L && Value <= 2147483647L;
+        case RET_LONG: return 1;
+    }
+    return 0;
+}
+
+/* * * * * * * * * * * * * * * * * * * * *
+ * * * *     I N L I N I N G     * * * *
+ * * * * * * * * * * * * * * * * * * * * */
+
+/*
+ * A function can be inlined if all it does is return an expression,
+ *  which is small, does not call the function again, and only reads its parameters.
+ *
+ * @return the returned expression, or NULL if it can't be inlined.
+ */
+static struct ASTNode* InlineExpression(struct ProgramFunction* Function) {
+    struct ASTNode* Body = Function->Tree->Left;
+
+    if(Body == NULL || Body->Operation != OP_RET || Body->Left == NULL)
+        return NULL;
+
+    if(TreeSize(Body->Left) > INLINE_LIMIT || TreeCalls(Body->Left, Function->Tree->Symbol))
+        return NULL;
+
+    for(struct SymbolTableEntry* Param = Function->Tree->Symbol->Start; Param != NULL; Param = Param->NextSymbol)
+        if(TreeWritesSymbol(Body->Left, Param))
+            return NULL;
+
+    if(UsesOwnFrame(Body->Left, Function->Tree->Symbol))
+        return NULL;
+
+    return Body->Left;
+}
+
+// Copy a tree, replacing each read of a parameter with its argument.
+static struct ASTNode* Substitute(struct ASTNode* Node, struct SymbolTableEntry* Function, struct ASTNode** Arguments) {
+    struct ASTNode* Copy;
+    int Index;
+
+    if(Node == NULL)
+        return NULL;
+
+    if(Node->Operation == REF_IDENT && (Index = ParameterIndex(Function, Node->Symbol)) >= 0) {
+        Copy = CopyTree(Arguments[Index]);
+        Copy->RVal = 1;
+        return Copy;
+    }
+
+    Copy = malloc(sizeof(struct ASTNode));
+    if(Copy == NULL)
+        Die("Unable to allocate node!");
+
+    *Copy = *Node;
+    Copy->Left = Substitute(Node->Left, Function, Arguments);
+    Copy->Middle = Substitute(Node->Middle, Function, Arguments);
+    Copy->Right = Substitute(Node->Right, Function, Arguments);
+    return Copy;
+}
+
+/*
+ * Try to replace a call with the expression the function returns.
+ *
+ * Every argument must be free of side effects, must have the type of its
+ *  parameter (or be a literal that fits), and must be a leaf if the
+ *   parameter is read more than once, so nothing is calculated twice.
+ *
+ * @param Slot: The pointer to the OP_CALL node
+ * @param Caller: The function the call is in, for reporting.
+ */
+static void InlineCall(struct ASTNode** Slot, struct ASTNode* Caller) {
+    struct ASTNode* Call = *Slot, *Expression, *Arguments[16], *Argument;
+    struct ProgramFunction* Callee;
+    struct SymbolTableEntry* Param;
+    long Value;
+    int Count;
+
+    if((Callee = FindDefinition(Call->Symbol)) == NULL || (Expression = InlineExpression(Callee)) == NULL)
+        return;
+
+    Count = CallArguments(Call, Arguments, 16);
+    if(Count < 0 || Count != Call->Symbol->Elements)
+        return;
+
+    for(Param = Call->Symbol->Start, Count = 0; Param != NULL; Param = Param->NextSymbol, Count++) {
+        Argument = Arguments[Count];
+
+        if(TreeHasSideEffects(Argument))
+            return;
+
+        if(ConstantValue(Argument, &Value)) {
+            if(!LiteralFits(Value, Param->Type))
+                return;
+        } else if(Argument->ExprType != Param->Type) {
+            return;
+        } else if(CountUses(Expression, Param) > 1 && Argument->Operation != REF_IDENT) {
+            return;
+        }
+    }
+
+    *Slot = Substitute(Expression, Call->Symbol, Arguments);
+
+    if(OptVerboseOutput)
+        printf("Whole program: inlined %s into %s\n", Call->Symbol->Name, Caller->Symbol->Name);
+}
+
+// Walk a function, inlining every call that can be.
+static void InlineCalls(struct ASTNode** Slot, struct ASTNode* Caller) {
+    struct ASTNode* Node = *Slot;
+
+    if(Node == NULL)
+        return;
+
+    InlineCalls(&Node->Left, Caller);
+    InlineCalls(&Node->Middle, Caller);
+    InlineCalls(&Node->Right, Caller);
+
+    if(Node->Operation == OP_CALL)
+        InlineCall(Slot, Caller);
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     C O N S T A N T     P R O P A G A T I O N     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Replace every read of a symbol with a literal.
+static void ReplaceReads(struct ASTNode** Slot, struct SymbolTableEntry* Symbol, long Value) {
+    struct ASTNode* Node = *Slot;
+
+    if(Node == NULL)
+        return;
+
+    if(Node->Operation == REF_IDENT && Node->Symbol == Symbol && Node->RVal) {
+        *Slot = ConstructLiteral(Symbol->Type, Value);
+        return;
+    }
+
+    ReplaceReads(&Node->Left, Symbol, Value);
+    ReplaceReads(&Node->Middle, Symbol, Value);
+    ReplaceReads(&Node->Right, Symbol, Value);
+}
+
+/*
+ * Find the value a parameter is given at every call in a tree.
+ *
+ * @param Node: The tree to search
+ * @param Function: The function whose calls we want
+ * @param Index: Which parameter
+ * @param Value: The constant seen so far
+ * @param Seen: Whether a call has been seen yet
+ * @return 0 if some call passes something else, 1 otherwise.
+ */
+static int SameArgument(struct ASTNode* Node, struct SymbolTableEntry* Function, int Index, long* Value, int* Seen) {
+    struct ASTNode* Arguments[16];
+    long Argument;
+
+    if(Node == NULL)
+        return 1;
+
+    if(Node->Operation == OP_CALL && Node->Symbol == Function) {
+        if(CallArguments(Node, Arguments, 16) != Function->Elements || !ConstantValue(Arguments[Index], &Argument))
+            return 0;
+
+        if(*Seen && Argument != *Value)
+            return 0;
+
+        *Value = Argument;
+        *Seen = 1;
+    }
+
+    return SameArgument(Node->Left, Function, Index, Value, Seen)
+        && SameArgument(Node->Middle, Function, Index, Value, Seen)
+        && SameArgument(Node->Right, Function, Index, Value, Seen);
+}
+
+/*
+ * When every call to a function passes the same constant for a parameter,
+ *  the function can use the constant instead.
+ */
+static void PropagateParameters(struct ProgramFunction* Function) {
+    struct SymbolTableEntry* Symbol = Function->Tree->Symbol, *Param;
+    struct ProgramFunction* Caller;
+    int Index, Seen;
+    long Value;
+
+    if(SymbolIsExported(Symbol))
+        return;
+
+    for(Param = Symbol->Start, Index = 0; Param != NULL; Param = Param->NextSymbol, Index++) {
+        if(TreeWritesSymbol(Function->Tree->Left, Param) || TreeTakesAddress(Function->Tree->Left, Param))
+            continue;
+
+        Seen = 0;
+        for(Caller = Program; Caller != NULL; Caller = Caller->Next)
+            if(!SameArgument(Caller->Tree->Left, Symbol, Index, &Value, &Seen))
+                break;
+
+        // Literals are built from an int, so wider values are left alone.
+        if(Caller != NULL || !Seen || !LiteralFits(Value, Param->Type) || !LiteralFits(Value, RET_INT))
+            continue;
+
+        ReplaceReads(&Function->Tree->Left, Param, Value);
+
+        if(OptVerboseOutput)
+            printf("Whole program: %s is always called with %s = %ld\n", Symbol->Name, Param->Name, Value);
+    }
+}
+
+// Does a tree change a global, by name or by taking its address?
+static int TreeChangesGlobal(struct ASTNode* Node, struct SymbolTableEntry* Symbol) {
+    if(Node == NULL)
+        return 0;
+
+    switch(Node->Operation) {
+        case OP_ASSIGN:
+            if(Node->Right && Node->Right->Operation == REF_IDENT && Node->Right->Symbol == Symbol)
+                return 1;
+            break;
+
+        case OP_ADDRESS:
+        case OP_POSTINC:
+        case OP_POSTDEC:
+            if(Node->Symbol == Symbol)
+                return 1;
+            break;
+
+        case OP_PREINC:
+        case OP_PREDEC:
+            if(Node->Left && Node->Left->Symbol == Symbol)
+                return 1;
+            break;
+    }
+
+    return TreeChangesGlobal(Node->Left, Symbol) || TreeChangesGlobal(Node->Middle, Symbol) || TreeChangesGlobal(Node->Right, Symbol);
+}
+
+/*
+ * Globals start as zero, so one that nothing in the program changes is always zero.
+ * Unless it was given contents at compile time.
+ */
+static void PropagateGlobals(void) {
+    struct SymbolTableEntry* Global;
+    struct ProgramFunction* Function;
+
+    for(Global = Globals; Global != NULL; Global = Global->NextSymbol) {
+        if(Global->Structure != ST_VAR || !IsScalarInteger(Global) || SymbolIsExported(Global) || EvaluatedGlobal(Global))
+            continue;
+
+        for(Function = Program; Function != NULL; Function = Function->Next)
+            if(TreeChangesGlobal(Function->Tree->Left, Global))
+                break;
+
+        if(Function != NULL)
+            continue;
+
+        for(Function = Program; Function != NULL; Function = Function->Next)
+            ReplaceReads(&Function->Tree->Left, Global, 0);
+
+        if(OptVerboseOutput)
+            printf("Whole program: %s is never written, so is always 0\n", Global->Name);
+    }
+}
+
+/* * * * * * * * * * * * * * * * * * * * * * * * *
+ * * * *     R E A C H A B I L I T Y     * * * *
+ * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Mark everything a function calls as reachable.
+static void MarkCalls(struct ASTNode* Node) {
+    struct ProgramFunction* Callee;
+
+    if(Node == NULL)
+        return;
+
+    if(Node->Operation == OP_CALL && (Callee = FindDefinition(Node->Symbol)) != NULL && !Callee->Reachable) {
+        Callee->Reachable = 1;
+        MarkCalls(Callee->Tree->Left);
+    }
+
+    MarkCalls(Node->Left);
+    MarkCalls(Node->Middle);
+    MarkCalls(Node->Right);
+}
+
+// Does a tree mention a symbol at all?
+static int TreeMentions(struct ASTNode* Node, struct SymbolTableEntry* Symbol) {
+    if(Node == NULL)
+        return 0;
+
+    if(Node->Symbol == Symbol)
+        return 1;
+
+    return TreeMentions(Node->Left, Symbol) || TreeMentions(Node->Middle, Symbol) || TreeMentions(Node->Right, Symbol);
+}
+
+// Is a global used by any function that will be generated?
+static int GlobalIsUsed(struct SymbolTableEntry* Global) {
+    if(SymbolIsExported(Global))
+        return 1;
+
+    for(struct ProgramFunction* Function = Program; Function != NULL; Function = Function->Next)
+        if(Function->Reachable && TreeMentions(Function->Tree->Left, Global))
+            return 1;
+
+    return 0;
+}
+
+/*
+ * Generate the whole program, once every file has been read.
+ */
+void AssembleProgram(void) {
+    struct ProgramFunction* Function;
+    struct SymbolTableEntry* Global;
+
+    if(OptOptimise && Closed) {
+        PhaseStart(PHASE_OPTIMISE);
+
+        // Before anything else changes main, while the globals are as the program starts.
+        for(Function = Program; Function != NULL; Function = Function->Next)
+            if(!strcmp(Function->Tree->Symbol->Name, "main"))
+                EvaluateInitialisers(Function->Tree);
+
+        // Calls that can be worked out are better than calls that are inlined.
+        for(Function = Program; Function != NULL; Function = Function->Next)
+            EvaluateCalls(Function->Tree);
+
+        for(Function = Program; Function != NULL; Function = Function->Next)
+            InlineCalls(&Function->Tree->Left, Function->Tree);
+
+        for(Function = Program; Function != NULL; Function = Function->Next)
+            PropagateParameters(Function);
+
+        PropagateGlobals();
+        PhaseEnd(PHASE_OPTIMISE);
+    }
+
+    // Each function is optimised with its own locals in place.
+    for(Function = Program; Function != NULL; Function = Function->Next) {
+        Locals = Function->Locals;
+        LocalsEnd = Function->LocalsEnd;
+        FunctionEntry = Function->Tree->Symbol;
+
+        if(OptOptimise)
+            Function->Tree = OptimiseFunction(Function->Tree);
+
+        Function->Locals = Locals;
+        Function->LocalsEnd = LocalsEnd;
+        FreeLocals();
+    }
+
+    // Only what main can reach is needed, unless this is a library.
+    for(Function = Program; Function != NULL; Function = Function->Next)
+        Function->Reachable = !Closed || SymbolIsExported(Function->Tree->Symbol);
+
+    for(Function = Program; Function != NULL; Function = Function->Next)
+        if(Function->Reachable)
+            MarkCalls(Function->Tree->Left);
+
+    for(Global = Globals; Global != NULL; Global = Global->NextSymbol) {
+        if(Global->Structure == ST_FUNC)
+            continue;
+
+        if(GlobalIsUsed(Global))
+            AsGlobalSymbol(Global);
+        else if(OptVerboseOutput)
+            printf("Whole program: removed unused global %s\n", Global->Name);
+    }
+
+    for(Function = Program; Function != NULL; Function = Function->Next) {
+        if(!Function->Reachable) {
+            if(OptVerboseOutput)
+                printf("Whole program: removed unreachable function %s\n", Function->Tree->Symbol->Name);
+            continue;
+        }
+
+        Locals = Function->Locals;
+        LocalsEnd = Function->LocalsEnd;
+        FunctionEntry = Function->Tree->Symbol;
+
+        printf("\nBeginning assembler creation of new function %s\n", Function->Tree->Symbol->Name);
+        GenerateFunction(Function->Tree);
+        FreeLocals();
+    }
+}
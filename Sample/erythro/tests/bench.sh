@@ -0,0 +1,107 @@
+#!/bin/sh
+#
+# Times the code the compiler generates, against the same kernels in C.
+#
+# Every kernel in tests/bench has an Erythro source and a C one, which
+#  print the same answer. Each is built by the compiler, and by $CC (gcc)
+#  with -O0 and -O2, and run a few times, keeping the fastest. The ratio
+#  of the Erythro time to each C time says how far behind the code
+#  generator is, kernel by kernel.
+#
+# The kernels are:
+#   fib: Recursion, two calls deep
+#   sieve: Byte stores over an array
+#   matrix: Array indexing, in three nested loops
+#   strings: Walking a char* to its end
+#   records: Updating fields, as longs to a record in an array
+#   calls: Calls with three arguments, in tak
+#
+# Usage: sh tests/bench.sh [-O] [-r tries] [kernel ...]
+#   -O: Optimise the Erythro kernels
+#   -r: How many times to run each build, keeping the fastest (5)
+#   kernel: Which kernels to run, or all of them
+#
+# The compiler is $ERC, or erc on the PATH.
+# Exits with 1 if any kernel gave a different answer to the C.
+#
+
+Tests=$(cd "$(dirname "$0")" && pwd)
+Tries=5
+Flags=
+
+while [ $# -gt 0 ]; do
+    case $1 in
+        -O) Flags=-O; shift ;;
+        -r) Tries=$2; shift 2 ;;
+        -*) sed -n '2,/^$/s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+        *) break ;;
+    esac
+done
+
+if [ $# -eq 0 ]; then
+    for Kernel in "$Tests"/bench/*.er; do
+        set -- "$@" "$(basename "$Kernel" .er)"
+    done
+fi
+
+ERC=${ERC:-erc}
+CC=${CC:-gcc}
+Work=$(mktemp -d)
+trap 'rm -rf "$Work"' EXIT INT TERM
+
+# Milliseconds since some point, or seconds if date can't do better.
+Now() {
+    Time=$(date +%s%N)
+    case $Time in
+        *N) echo $(( $(date +%s) * 1000 )) ;;
+        *) echo $(( Time / 1000000 )) ;;
+    esac
+}
+
+# Run a build as many times as asked, saying how long the fastest took.
+# What it printed is left in $Work/<build>.out
+Time() {
+    Fastest=
+    Try=0
+    while [ $Try -lt "$Tries" ]; do
+        Try=$((Try + 1))
+        Start=$(Now)
+        "$Work/$1" > "$Work/$1.out"
+        Elapsed=$(( $(Now) - Start ))
+        [ -z "$Fastest" ] || [ $Elapsed -lt "$Fastest" ] && Fastest=$Elapsed
+    done
+    echo "$Fastest"
+}
+
+# The first over the second, to two places, or - if either is missing.
+Ratio() {
+    awk -v A="$1" -v B="$2" 'BEGIN { if(A == "-" || B == "-" || B == 0) print "-"; else printf "%.2f\n", A / B }'
+}
+
+Wrong=0
+printf "%-10s %11s %11s %11s %8s %8s\n" "kernel" "erythro ms" "gcc -O0 ms" "gcc -O2 ms" "vs -O0" "vs -O2"
+
+for Kernel in "$@"; do
+    # The assembly goes next to the source, so it is built from a copy.
+    cp "$Tests/bench/$Kernel.er" "$Work/$Kernel.er"
+
+    Erythro=-
+    if "$ERC" $Flags -o "$Work/$Kernel" "$Work/$Kernel.er" > /dev/null 2> "$Work/$Kernel.err"; then
+        Erythro=$(Time "$Kernel")
+    else
+        echo "$Kernel: the compiler failed: $(tail -n 1 "$Work/$Kernel.err")"
+    fi
+
+    "$CC" -O0 -o "$Work/$Kernel-O0" "$Tests/bench/$Kernel.c" && O0=$(Time "$Kernel-O0") || O0=-
+    "$CC" -O2 -o "$Work/$Kernel-O2" "$Tests/bench/$Kernel.c" && O2=$(Time "$Kernel-O2") || O2=-
+
+    printf "%-10s %11s %11s %11s %8s %8s\n" "$Kernel" "$Erythro" "$O0" "$O2" "$(Ratio "$Erythro" "$O0")" "$(Ratio "$Erythro" "$O2")"
+
+    # Windows writes \r\n for a \n, in one of them but maybe not the other.
+    if [ "$Erythro" != - ] && [ "$(tr -d '\r' < "$Work/$Kernel.out")" != "$(tr -d '\r' < "$Work/$Kernel-O2.out")" ]; then
+        echo "    $Kernel printed $(cat "$Work/$Kernel.out"), but the C printed $(cat "$Work/$Kernel-O2.out")"
+        Wrong=1
+    fi
+done
+
+exit $Wrong
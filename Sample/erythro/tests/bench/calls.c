@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+long tak(long x, long y, long z) {
+    if(y < x)
+        return tak(tak(x - 1, y, z), tak(y - 1, z, x), tak(z - 1, x, y));
+    return z;
+}
+
+int main(int argc, char** argv) {
+    printf("%d\n", (int) tak(30 + argc, 16, 8));
+    return 0;
+}
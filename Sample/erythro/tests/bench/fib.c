@@ -0,0 +1,17 @@
+#include <stdio.h>
+
+long fib(long n) {
+    long a;
+    long b;
+
+    if(n < 2)
+        return n;
+    a = fib(n - 1);
+    b = fib(n - 2);
+    return a + b;
+}
+
+int main(int argc, char** argv) {
+    printf("%d\n", (int) fib(34 + argc));
+    return 0;
+}
@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+long a[9216];
+long b[9216];
+long c[9216];
+
+int main(void) {
+    long i, j, k, round, sum;
+
+    for(i = 0; i < 9216; i++) {
+        a[i] = i % 7;
+        b[i] = i % 5;
+    }
+
+    for(round = 0; round < 20; round++)
+        for(i = 0; i < 96; i++)
+            for(j = 0; j < 96; j++) {
+                sum = 0;
+                for(k = 0; k < 96; k++)
+                    sum = sum + a[i * 96 + k] * b[k * 96 + j];
+                c[i * 96 + j] = sum;
+            }
+
+    sum = 0;
+    for(i = 0; i < 9216; i++)
+        sum = sum + c[i];
+    printf("%d\n", (int) sum);
+    return 0;
+}
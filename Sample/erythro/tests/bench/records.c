@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+// The Erythro version keeps these as three longs to a record in an array.
+struct record {
+    long position, velocity, updates;
+};
+
+struct record records[10000];
+
+int main(void) {
+    long i, round, total = 0;
+
+    for(i = 0; i < 10000; i++) {
+        records[i].position = i;
+        records[i].velocity = 1;
+        records[i].updates = 0;
+    }
+
+    for(round = 0; round < 2000; round++)
+        for(i = 0; i < 10000; i++) {
+            records[i].position += records[i].velocity;
+            records[i].updates++;
+        }
+
+    for(i = 0; i < 10000; i++)
+        total = total + records[i].position + records[i].updates;
+    printf("%d\n", (int) total);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#include <stdio.h>
+
+char composite[500000];
+
+long sieve(long n) {
+    long i, j, count;
+
+    for(i = 0; i < n; i++)
+        composite[i] = 0;
+
+    count = 0;
+    for(i = 2; i < n; i++) {
+        if(composite[i] == 0) {
+            count++;
+            for(j = i * 2; j < n; j = j + i)
+                composite[j] = 1;
+        }
+    }
+    return count;
+}
+
+int main(void) {
+    long round, count = 0;
+
+    for(round = 0; round < 20; round++)
+        count = sieve(500000);
+    printf("%d\n", (int) count);
+    return 0;
+}
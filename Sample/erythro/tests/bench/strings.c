@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+long words(char* text) {
+    char* p;
+    long count = 0;
+
+    for(p = text; *p != 0; p++)
+        if(*p == 32)
+            count++;
+    return count;
+}
+
+int main(void) {
+    char* text;
+    long round, total = 0;
+
+    text = "the quick brown fox jumps over the lazy dog while the compiler scans every character of this sentence looking for the spaces between its words and counting them one at a time until it finds the zero at the end";
+    for(round = 0; round < 200000; round++)
+        total = total + words(text);
+    printf("%d\n", (int) total);
+    return 0;
+}
@@ -0,0 +1,109 @@
+#!/bin/sh
+#
+# Writes a valid Erythro program of about the given size to stdout,
+#  for finding out how the compiler scales.
+#
+# The program is a run of units, each of which has:
+#  * a struct, and some globals,
+#  * a function, that calls the one before it, with
+#     * an expression nested as deeply as asked,
+#     * a block of as many statements as asked,
+#     * a string literal as long as asked.
+# And a main, which calls the last function.
+#
+# Usage: sh tests/generate.sh [-d depth] [-b statements] [-l length] [-g globals] size
+#   -d: How deeply to nest the expression in each function (8)
+#   -b: How many statements to put in each function (16)
+#   -l: How long to make the string in each function (64), up to the lexer's 512
+#   -g: How many globals to give each unit (4)
+#   size: In bytes, or with a K or M after it
+#
+
+Depth=8
+Statements=16
+Length=64
+Globals=4
+
+while [ $# -gt 1 ]; do
+    case $1 in
+        -d) Depth=$2 ;;
+        -b) Statements=$2 ;;
+        -l) Length=$2 ;;
+        -g) Globals=$2 ;;
+        *) break ;;
+    esac
+    shift 2
+done
+
+case $1 in
+    *K) Size=$(( ${1%K} * 1024 )) ;;
+    *M) Size=$(( ${1%M} * 1024 * 1024 )) ;;
+    [0-9]*) Size=$1 ;;
+    *) sed -n '2,/^$/s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+esac
+
+awk -v Size="$Size" -v Depth="$Depth" -v Statements="$Statements" -v Length="$Length" -v Globals="$Globals" '
+function Emit(Text) {
+    print Text
+    Written += length(Text) + 1
+}
+
+# (((b + a) * g) - ...), with as many brackets as Depth.
+# Nesting to the left needs only two registers, however deep it goes.
+function Nested(Unit, Depth,    Open, Text, i) {
+    for(i = 0; i < Depth; i++) {
+        Open = Open "("
+        Text = Text " " Operators[i % 3] " " (i % 2 ? "g" Unit "_" (i % Globals) : "a") ")"
+    }
+    return Open "b" Text
+}
+
+function Unit(i,    Text, j) {
+    Emit("struct s" i " {")
+    Emit("    int x,")
+    Emit("    long y,")
+    Emit("    char z")
+    Emit("};")
+    Emit("")
+
+    for(j = 0; j < Globals; j++)
+        Emit("long g" i "_" j ";")
+    Emit("char* t" i ";")
+    Emit("")
+
+    Emit("long :: f" i "(long a, long b) {")
+    Emit("    long c;")
+    Emit("    long d;")
+    Emit("    c = " Nested(i, Depth) ";")
+    Emit("    d = c;")
+
+    for(j = 0; j < Statements; j++)
+        Emit("    " (j % 2 ? "d" : "c") " = " (j % 2 ? "c" : "d") " " Operators[j % 3] " g" i "_" (j % Globals) ";")
+
+    Emit("    if(c > d) {")
+    Emit("        g" i "_0 = g" i "_0 + c;")
+    Emit("    }")
+    Emit("    t" i " = \"" String "\";")
+    if(i > 0)
+        Emit("    d = f" (i - 1) "(c, d);")
+    Emit("    return (c + d);")
+    Emit("}")
+    Emit("")
+}
+
+BEGIN {
+    Operators[0] = "+"
+    Operators[1] = "*"
+    Operators[2] = "-"
+
+    for(i = 0; i < Length; i++)
+        String = String substr("abcdefghijklmnopqrstuvwxyz ", i % 27 + 1, 1)
+
+    for(i = 0; Written < Size || i == 0; i++)
+        Unit(i)
+
+    Emit("int :: main() {")
+    Emit("    g0_0 = f" (i - 1) "(1, 2);")
+    Emit("    return (0);")
+    Emit("}")
+}'
@@ -0,0 +1,235 @@
+#!/bin/sh
+#
+# Runs every test in this directory, and checks it still does what it did.
+#
+# Each test is compiled with -S, timed, then built into a binary and run,
+#  with as many tests at once as there are processors. What the test wrote
+#  to stdout, and its exit status, must match tests/expected/<test>.out.
+#  A test that doesn't compile is expected to fail with the same error.
+#  The tests from earlier versions of the language are kept as they are.
+#  A test with a <test>.profile next to it is compiled with -fprofile-use.
+#  A test with a <test>.flags next to it is compiled with those flags too.
+#  A void main leaves no exit status, so it is recorded as "exit -".
+#  A test listed in tests/broken.txt, with why, is run but not checked,
+#  and is never given expected output, until the compiler is fixed.
+#
+# The time to compile, and the time the binary took to run, are the fastest
+#  of a few tries. They are compared against tests/baseline.txt, if there is
+#  one, and a test that got slower by more than $SLOWDOWN percent (20), and
+#  by more than $NOISE milliseconds (10), is flagged.
+#
+# Usage: sh tests/harness.sh [-j jobs] [-r tries] [-O] [--run] [--update] [--save-baseline]
+#   -j: How many tests to run at once
+#   -r: How many times to compile and run each test, keeping the fastest
+#   -O: Optimise the tests
+#   --run: Run in memory with erc --run, rather than building a binary.
+#           The run time is then everything after compiling. Only on Windows
+#           does the JIT call the C library the way the tests expect.
+#   --update: Write the expected output of every test from what it did
+#   --save-baseline: Keep these times as the baseline to compare against
+#
+# The compiler is $ERC, or erc on the PATH.
+# Exits with 1 if any test failed or got slower.
+#
+
+Tests=$(cd "$(dirname "$0")" && pwd)
+Root=$(dirname "$Tests")
+
+# Milliseconds since some point, or seconds if date can't do better.
+Now() {
+    Time=$(date +%s%N)
+    case $Time in
+        *N) echo $(( $(date +%s) * 1000 )) ;;
+        *) echo $(( Time / 1000000 )) ;;
+    esac
+}
+
+# Run a command, for no more than ten seconds where we can tell it so.
+Limited() {
+    if command -v timeout > /dev/null 2>&1; then
+        timeout 10 "$@"
+    else
+        "$@"
+    fi
+}
+
+# The error the compiler died with. Some of them go to stdout.
+Diagnostic() {
+    if [ -s "$Work/$Name.err" ]; then
+        tail -n 1 "$Work/$Name.err"
+    else
+        tail -n 1 "$Work/$Name.log"
+    fi
+}
+
+# Compile, build and run one test, into $Work/<test>.out and $Work/<test>.time
+RunOne() {
+    Name=$(basename "$1" .er)
+    Source=$Work/$Name.er
+    Out=$Work/$Name.out
+    cp "$1" "$Source"
+
+    # The profile is looked for next to the source.
+    TestFlags=$Flags
+    if [ -f "$1.profile" ]; then
+        cp "$1.profile" "$Source.profile"
+        TestFlags="$TestFlags -fprofile-use"
+    fi
+    [ -f "$1.flags" ] && TestFlags="$TestFlags $(cat "$1.flags")"
+
+    Compile=
+    Run=
+    Try=0
+    while [ $Try -lt "$Tries" ]; do
+        Try=$((Try + 1))
+
+        Start=$(Now)
+        if ! "$ERC" $TestFlags -S "$Source" > "$Work/$Name.log" 2> "$Work/$Name.err"; then
+            echo "error: $(Diagnostic)" > "$Out"
+            echo "$Name - -" > "$Work/$Name.time"
+            return
+        fi
+        Elapsed=$(( $(Now) - Start ))
+        [ -z "$Compile" ] || [ "$Elapsed" -lt "$Compile" ] && Compile=$Elapsed
+
+        # Tests like cat.er open files relative to the root.
+        if [ "$Mode" = run ]; then
+            Start=$(Now)
+            (cd "$Root" && Limited "$ERC" $TestFlags --run "$Source" < /dev/null > "$Work/$Name.stdout" 2> /dev/null)
+            Status=$?
+            Elapsed=$(( $(Now) - Start - Compile ))
+            [ $Elapsed -ge 0 ] || Elapsed=0
+
+            # What the compiler said comes first, as it did with -S.
+            tail -c +$(( $(wc -c < "$Work/$Name.log") + 1 )) "$Work/$Name.stdout" > "$Work/$Name.program"
+        else
+            # What the assembler and linker say differs between systems.
+            if ! "$ERC" $TestFlags -o "$Work/$Name.exe" "$Source" > /dev/null 2>&1; then
+                echo "error: unable to build" > "$Out"
+                echo "$Name $Compile -" > "$Work/$Name.time"
+                return
+            fi
+
+            Start=$(Now)
+            (cd "$Root" && Limited "$Work/$Name.exe" < /dev/null > "$Work/$Name.program" 2> /dev/null)
+            Status=$?
+            Elapsed=$(( $(Now) - Start ))
+        fi
+        [ -z "$Run" ] || [ "$Elapsed" -lt "$Run" ] && Run=$Elapsed
+    done
+
+    # Whatever was left in %rax is no exit status.
+    grep -q "^void *:: *main" "$Source" && Status=-
+
+    # Windows writes \r\n for a \n, so the same output can be expected everywhere.
+    { echo "exit $Status"; tr -d '\r' < "$Work/$Name.program"; } > "$Out"
+    echo "$Name $Compile $Run" > "$Work/$Name.time"
+}
+
+# The harness calls itself for each test, to run them side by side.
+if [ "$1" = "--one" ]; then
+    RunOne "$2"
+    exit 0
+fi
+
+Jobs=$(getconf _NPROCESSORS_ONLN 2> /dev/null || echo 1)
+Tries=3
+Flags=
+Mode=build
+Update=
+SaveBaseline=
+
+while [ $# -gt 0 ]; do
+    case $1 in
+        -j) Jobs=$2; shift ;;
+        -r) Tries=$2; shift ;;
+        -O) Flags=-O ;;
+        --run) Mode=run ;;
+        --update) Update=1 ;;
+        --save-baseline) SaveBaseline=1 ;;
+        *) sed -n '2,/^$/s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+    esac
+    shift
+done
+
+ERC=${ERC:-erc}
+Baseline=$Tests/baseline.txt
+Work=$(mktemp -d)
+trap 'rm -rf "$Work"' EXIT INT TERM
+export ERC Flags Mode Tries Work
+
+# Every test, which is any file that isn't part of the harness.
+for Test in "$Tests"/*; do
+    [ -f "$Test" ] || continue
+    case $Test in
+        *.sh|*.txt|*.profile|*.flags) continue ;;
+    esac
+    echo "$Test"
+done > "$Work/tests"
+
+xargs -n 1 -P "$Jobs" sh "$0" --one < "$Work/tests"
+
+Failed=0
+Slower=0
+New=0
+Broken=0
+printf "%-14s %12s %12s  %s\n" "test" "compile ms" "run ms" "result"
+
+while read -r Test; do
+    Name=$(basename "$Test" .er)
+    Expected=$Tests/expected/$Name.out
+    set -- $(cat "$Work/$Name.time")
+    Compile=$2
+    Run=$3
+
+    Reason=
+    [ -f "$Tests/broken.txt" ] && Reason=$(awk -v Name="$Name" '$1 == Name { $1 = ""; sub(/^ +/, ""); print }' "$Tests/broken.txt")
+
+    if [ -n "$Reason" ]; then
+        Result="broken: $Reason"
+        Broken=$((Broken + 1))
+    elif [ ! -f "$Expected" ]; then
+        Result=new
+        New=$((New + 1))
+    elif cmp -s "$Expected" "$Work/$Name.out"; then
+        Result=ok
+    else
+        Result=FAILED
+        [ -n "$Update" ] || Failed=$((Failed + 1))
+    fi
+
+    if [ -n "$Update" ] && [ -z "$Reason" ]; then
+        mkdir -p "$Tests/expected"
+        cp "$Work/$Name.out" "$Expected"
+    fi
+
+    # Look for a slowdown in either time.
+    if [ -f "$Baseline" ]; then
+        Before=$(awk -v Name="$Name" '$1 == Name { print $2, $3 }' "$Baseline")
+        Index=0
+        for Time in $Before; do
+            Index=$((Index + 1))
+            [ $Index -eq 1 ] && Current=$Compile || Current=$Run
+            [ "$Time" = - ] || [ "$Current" = - ] && continue
+
+            if [ $(( Current - Time )) -gt "${NOISE:-10}" ] && [ $(( Current * 100 )) -gt $(( Time * (100 + ${SLOWDOWN:-20}) )) ]; then
+                Result="$Result, slower ($([ $Index -eq 1 ] && echo compile || echo run) $Time -> $Current ms)"
+                Slower=$((Slower + 1))
+            fi
+        done
+    fi
+
+    printf "%-14s %12s %12s  %s\n" "$Name" "$Compile" "$Run" "$Result"
+
+    case $Result in FAILED*)
+        diff "$Expected" "$Work/$Name.out" | sed 's/^/    /' ;;
+    esac
+done < "$Work/tests"
+
+if [ -n "$SaveBaseline" ]; then
+    cat "$Work"/*.time > "$Baseline"
+    echo "Saved the baseline in $Baseline"
+fi
+
+echo "$(wc -l < "$Work/tests") tests: $Failed failed, $Slower slower, $New without expected output, $Broken known broken"
+[ $Failed -eq 0 ] && [ $Slower -eq 0 ]
@@ -0,0 +1,96 @@
+#!/bin/sh
+#
+# Measures how each phase of the compiler scales with the size of its input.
+#
+# Programs of each size are made by generate.sh, and compiled with -S and
+#  -ftime-report=json. For each phase, the growth from one size to the next
+#  is given as an exponent: 1 is linear, 2 is quadratic. A phase that grows
+#  with an exponent over $LIMIT (1.25) is flagged, once it takes long enough
+#  to measure, $NOISE milliseconds (20).
+#
+# Usage: sh tests/scaling.sh [-O] [-d depth] [-b statements] [-l length] [-g globals] [size ...]
+#   -O: Optimise the programs
+#   -d, -b, -l, -g: The shape of the programs, as for generate.sh
+#   size: The sizes to compile, from smallest to largest (1K 10K 100K 1M)
+#
+# The compiler is $ERC, or erc on the PATH.
+# Exits with 1 if any phase grew faster than the limit.
+#
+
+Tests=$(cd "$(dirname "$0")" && pwd)
+Phases="lex parse lookup mutate_type optimise generate schedule emit"
+Flags=
+Shape=
+
+while [ $# -gt 0 ]; do
+    case $1 in
+        -O) Flags=-O; shift ;;
+        -d|-b|-l|-g) Shape="$Shape $1 $2"; shift 2 ;;
+        -*) sed -n '2,/^$/s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+        *) break ;;
+    esac
+done
+
+[ $# -gt 0 ] || set -- 1K 10K 100K 1M
+
+ERC=${ERC:-erc}
+Work=$(mktemp -d)
+trap 'rm -rf "$Work"' EXIT INT TERM
+
+# The wall time of a phase, from the report, or 0 if it didn't run.
+Phase() {
+    Time=$(sed -n "s/.*\"$1\": {\"wall_ms\": \([0-9.]*\).*/\1/p" "$Work/report")
+    echo "${Time:-0}"
+}
+
+printf "%10s" "bytes"
+for Name in $Phases total; do
+    printf " %12s" "$Name"
+done
+printf " %10s %8s\n" "peak KB" "ns/byte"
+
+Flagged=0
+Previous=
+
+for Size in "$@"; do
+    sh "$Tests/generate.sh" $Shape "$Size" > "$Work/program.er"
+    Bytes=$(wc -c < "$Work/program.er")
+
+    if ! "$ERC" $Flags -S -ftime-report=json "$Work/program.er" > /dev/null 2> "$Work/report"; then
+        echo "$Size: the compiler failed: $(grep -v '^{' "$Work/report" | tail -n 1)"
+        exit 1
+    fi
+
+    Times=
+    for Name in $Phases total; do
+        Times="$Times $(Phase "$Name")"
+    done
+    Peak=$(sed -n 's/.*"total": {[^}]*"peak_rss_kb": \([0-9]*\).*/\1/p' "$Work/report")
+
+    # Print the times, then compare them with the size before.
+    Line=$(echo "$Bytes ${Peak:-0}$Times $Previous" | awk -v Phases="$Phases total" -v Limit="${LIMIT:-1.25}" -v Noise="${NOISE:-20}" '{
+        Count = split(Phases, Names, " ")
+        printf "%10d", $1
+        for(i = 1; i <= Count; i++)
+            printf " %12.3f", $(i + 2)
+        printf " %10d %8.1f\n", $2, $(Count + 2) * 1000000 / $1
+
+        # The previous size, and its times, follow.
+        if(NF == 2 * (Count + 2))
+            for(i = 1; i <= Count; i++) {
+                Before = $(Count + 4 + i)
+                Now = $(i + 2)
+                if(Now < Noise || Before <= 0)
+                    continue
+                Exponent = log(Now / Before) / log($1 / $(Count + 3))
+                if(Exponent > Limit)
+                    printf "    %s grew as size^%.2f, from %.3f to %.3f ms\n", Names[i], Exponent, Before, Now
+            }
+    }')
+    echo "$Line"
+
+    case $Line in *grew*) Flagged=1 ;; esac
+    Previous="$Bytes ${Peak:-0}$Times"
+done
+
+exit $Flagged